@@ -0,0 +1,169 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Sample program measuring how long application tasks are blocked by API
+ * calls while the LMIC task is busy joining, transmitting and receiving.
+ *******************************************************************************/
+
+#include "freertos/FreeRTOS.h"
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "nvs_flash.h"
+
+#include "ttn.h"
+
+// NOTE:
+// The LoRaWAN frequency and the radio chip must be configured by running 'idf.py menuconfig'.
+// Go to Components / The Things Network, select the appropriate values and save.
+
+// Copy the below hex strings from the TTN console (Applications > Your application > End devices
+// > Your device > Activation information)
+
+// AppEUI (sometimes called JoinEUI)
+const char *appEui = "????????????????";
+// DevEUI
+const char *devEui = "????????????????";
+// AppKey
+const char *appKey = "????????????????????????????????";
+
+// Pins and other resources
+#define TTN_SPI_HOST      SPI2_HOST
+#define TTN_SPI_DMA_CHAN  SPI_DMA_DISABLED
+#define TTN_PIN_SPI_SCLK  5
+#define TTN_PIN_SPI_MOSI  27
+#define TTN_PIN_SPI_MISO  19
+#define TTN_PIN_NSS       18
+#define TTN_PIN_RXTX      TTN_NOT_CONNECTED
+#define TTN_PIN_RST       14
+#define TTN_PIN_DIO0      26
+#define TTN_PIN_DIO1      35
+
+#define TX_INTERVAL 30
+static uint8_t msgData[] = "Hello, world";
+
+// Blocking time of the API calls made by the probe task
+typedef struct
+{
+    const char *name;
+    uint32_t calls;
+    int64_t total_us;
+    int64_t max_us;
+} call_stats_t;
+
+static call_stats_t stats[] = {
+    { "ttn_set_adr_enabled" },
+    { "ttn_get_mac_state" },
+    { "ttn_busy_duration" },
+    { "ttn_rx_tx_window" },
+};
+
+
+void record(call_stats_t *call, int64_t start)
+{
+    int64_t duration = esp_timer_get_time() - start;
+    call->calls++;
+    call->total_us += duration;
+    if (duration > call->max_us)
+        call->max_us = duration;
+}
+
+// Calls the API functions every tick, independent of what the LMIC task is doing
+void probeApi(void* pvParameter)
+{
+    while (1) {
+        int64_t start = esp_timer_get_time();
+        ttn_set_adr_enabled(true);
+        record(&stats[0], start);
+
+        start = esp_timer_get_time();
+        ttn_get_mac_state(NULL);
+        record(&stats[1], start);
+
+        start = esp_timer_get_time();
+        ttn_busy_duration();
+        record(&stats[2], start);
+
+        start = esp_timer_get_time();
+        ttn_rx_tx_window();
+        record(&stats[3], start);
+
+        vTaskDelay(1);
+    }
+}
+
+void printStats(void)
+{
+    for (int i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+    {
+        call_stats_t *call = &stats[i];
+        printf("%-20s %6u calls, avg %4u us, max %6u us\n", call->name, (unsigned)call->calls,
+                (unsigned)(call->calls != 0 ? call->total_us / call->calls : 0), (unsigned)call->max_us);
+    }
+}
+
+void sendMessages(void* pvParameter)
+{
+    while (1) {
+        printf("Sending message...\n");
+        ttn_response_code_t res = ttn_transmit_message(msgData, sizeof(msgData) - 1, 1, false);
+        printf(res == TTN_SUCCESSFUL_TRANSMISSION ? "Message sent.\n" : "Transmission failed.\n");
+        printStats();
+
+        vTaskDelay(TX_INTERVAL * pdMS_TO_TICKS(1000));
+    }
+}
+
+void app_main(void)
+{
+    esp_err_t err;
+    // Initialize the GPIO ISR handler service
+    err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+    ESP_ERROR_CHECK(err);
+
+    // Initialize the NVS (non-volatile storage) for saving and restoring the keys
+    err = nvs_flash_init();
+    ESP_ERROR_CHECK(err);
+
+    // Initialize SPI bus
+    spi_bus_config_t spi_bus_config = {
+        .miso_io_num = TTN_PIN_SPI_MISO,
+        .mosi_io_num = TTN_PIN_SPI_MOSI,
+        .sclk_io_num = TTN_PIN_SPI_SCLK,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1
+    };
+    err = spi_bus_initialize(TTN_SPI_HOST, &spi_bus_config, TTN_SPI_DMA_CHAN);
+    ESP_ERROR_CHECK(err);
+
+    // Initialize TTN
+    ttn_init();
+
+    // Configure the SX127x pins
+    ttn_configure_pins(TTN_SPI_HOST, TTN_PIN_NSS, TTN_PIN_RXTX, TTN_PIN_RST, TTN_PIN_DIO0, TTN_PIN_DIO1);
+
+    // The below line can be commented after the first run as the data is saved in NVS
+    ttn_provision(devEui, appEui, appKey);
+
+    // same priority as a typical application task
+    xTaskCreate(probeApi, "probe_api", 1024 * 4, (void* )0, 3, NULL);
+
+    printf("Joining...\n");
+    bool joined = ttn_join();
+    printStats();
+    if (joined)
+    {
+        printf("Joined.\n");
+        xTaskCreate(sendMessages, "send_messages", 1024 * 4, (void* )0, 3, NULL);
+    }
+    else
+    {
+        printf("Join failed. Goodbye\n");
+    }
+}
@@ -33,6 +33,8 @@ enum TTNResponseCode
 {
     /** @brief Transmission failed error */
     kTTNErrorTransmissionFailed = TTN_ERROR_TRANSMISSION_FAILED,
+    /** @brief Fragment does not fit into a frame at the current data rate */
+    kTTNErrorFragmentTooLarge = TTN_ERROR_FRAGMENT_TOO_LARGE,
     /** @brief Unexpected or internal error */
     kTTNErrorUnexpected = TTN_ERROR_UNEXPECTED,
     /** @brief Successful transmission of an uplink message */
@@ -64,6 +66,52 @@ enum TTNRxTxWindow
     kTTNRx2Window = TTN_WINDOW_RX2
 };
 
+/**
+ * @brief State of the LoRaWAN MAC layer
+ */
+enum TTNMacState
+{
+    /**
+     * @brief Idle; the device can go to deep sleep or can be powered off
+     */
+    kTTNMacIdle = TTN_MAC_IDLE,
+    /**
+     * @brief Transmission (or join request) submitted or in progress
+     */
+    kTTNMacTxPending = TTN_MAC_TX_PENDING,
+    /**
+     * @brief Waiting for or receiving in RX1 or RX2 window
+     */
+    kTTNMacRxWindow = TTN_MAC_RX_WINDOW,
+    /**
+     * @brief Transmission (or join request) pending, waiting for the duty cycle to allow it
+     */
+    kTTNMacDutyWait = TTN_MAC_DUTY_WAIT,
+    /**
+     * @brief Other MAC activity
+     */
+    kTTNMacBusy = TTN_MAC_BUSY
+};
+
+/**
+ * @brief LoRaWAN device class
+ */
+enum TTNDeviceClass
+{
+    /**
+     * @brief Class A: downlinks are only received in the RX1 and RX2 window after an uplink
+     */
+    kTTNClassA = TTN_CLASS_A,
+    /**
+     * @brief Class B: downlinks are also received in ping slots synchronized to the network beacon
+     */
+    kTTNClassB = TTN_CLASS_B,
+    /**
+     * @brief Class C: the radio continuously listens for downlinks when not transmitting
+     */
+    kTTNClassC = TTN_CLASS_C
+};
+
 /**
  * @brief Spreading Factor
  */
@@ -410,6 +458,123 @@ struct TTNRFSettings
  */
 typedef void (*TTNMessageCallback)(const uint8_t *payload, size_t length, ttn_port_t port);
 
+/**
+ * @brief Callback for recieved messages on a specific port
+ *
+ * @param payload   pointer to the received bytes
+ * @param length    number of received bytes
+ * @param port      port the message was received on
+ * @param userData  value passed to @ref TheThingsNetwork::onMessage(ttn_port_t, TTNPortMessageCallback, void*)
+ */
+typedef void (*TTNPortMessageCallback)(const uint8_t *payload, size_t length, ttn_port_t port, void *userData);
+
+/**
+ * @brief Downlink statistics (see @ref TheThingsNetwork::downlinkStats())
+ */
+typedef ttn_downlink_stats_t TTNDownlinkStats;
+
+/**
+ * @brief Timing of the uplink messages (see @ref TheThingsNetwork::uplinkTiming())
+ */
+typedef ttn_uplink_timing_t TTNUplinkTiming;
+
+/**
+ * @brief Handle for waiting for a background save (see @ref TheThingsNetwork::prepareForPowerOffAsync())
+ */
+typedef ttn_save_handle_t TTNSaveHandle;
+
+/**
+ * @brief Timeline of the startup phases (see @ref TheThingsNetwork::startupReport())
+ *
+ * The array `phases` is indexed by the values of @ref ttn_startup_phase_t.
+ */
+typedef ttn_startup_report_t TTNStartupReport;
+
+/**
+ * @brief Policy of the data rate advisor (see @ref TheThingsNetwork::setDrAdvisorPolicy())
+ */
+typedef ttn_dr_advisor_policy_t TTNDrAdvisorPolicy;
+
+/**
+ * @brief Link quality statistics for a data rate (see @ref TheThingsNetwork::drStats())
+ */
+typedef ttn_dr_stats_t TTNDrStats;
+
+/**
+ * @brief Multicast session (see @ref TheThingsNetwork::setMulticastSession())
+ */
+typedef ttn_multicast_session_t TTNMulticastSession;
+
+/**
+ * @brief Status of the fragmented data block transport session (see @ref TheThingsNetwork::fragStatus())
+ */
+typedef ttn_frag_status_t TTNFragStatus;
+
+/**
+ * @brief Callback for a completely received data block (see @ref TheThingsNetwork::startFragTransport())
+ */
+typedef ttn_frag_complete_cb TTNFragCompleteCallback;
+
+/**
+ * @brief Configuration of time-slotted uplinks (see @ref TheThingsNetwork::setSlottedTx())
+ */
+typedef ttn_slotted_tx_config_t TTNSlottedTxConfig;
+
+/**
+ * @brief GPS time (see @ref TheThingsNetwork::gpsTime())
+ */
+typedef ttn_gps_time_t TTNGpsTime;
+
+/**
+ * @brief Clock error calibration (see @ref TheThingsNetwork::clockCalibration())
+ */
+typedef ttn_clock_calibration_t TTNClockCalibration;
+
+/**
+ * @brief TX current at a TX power
+ */
+typedef ttn_tx_current_t TTNTxCurrent;
+
+/**
+ * @brief Supply currents of the radio states (see @ref TheThingsNetwork::setEnergyModel())
+ */
+typedef ttn_energy_model_t TTNEnergyModel;
+
+/**
+ * @brief Time spent in a radio state and the resulting charge
+ */
+typedef ttn_state_energy_t TTNStateEnergy;
+
+/**
+ * @brief Energy used by an uplink
+ */
+typedef ttn_uplink_energy_t TTNUplinkEnergy;
+
+/**
+ * @brief Energy used by the radio (see @ref TheThingsNetwork::energyReport())
+ */
+typedef ttn_energy_report_t TTNEnergyReport;
+
+/**
+ * @brief Link telemetry of an uplink (see @ref TheThingsNetwork::beginTelemetry())
+ */
+typedef ttn_telemetry_record_t TTNTelemetryRecord;
+
+/**
+ * @brief Iterator over the link telemetry records
+ */
+typedef ttn_telemetry_iterator_t TTNTelemetryIterator;
+
+/**
+ * @brief Statistics of the LMIC event logging (see @ref TheThingsNetwork::logStats())
+ */
+typedef ttn_log_stats_t TTNLogStats;
+
+/**
+ * @brief Segment of an uplink message payload (see @ref TheThingsNetwork::transmitSegments())
+ */
+typedef ttn_payload_segment_t TTNPayloadSegment;
+
 /**
  * @brief TTN device
  *
@@ -687,6 +852,32 @@ class TheThingsNetwork
         ttn_prepare_for_power_off();
     }
 
+    /**
+     * @brief Stops all activies and prepares for power off without waiting for the flash write.
+     *
+     * Same as @ref prepareForPowerOff() except that the communication state is written
+     * to NVS by a low-priority background task. Before cutting the power, call
+     * @ref waitForSave() with the returned handle.
+     *
+     * @return handle for waiting for the completion (0 if the state could not be captured)
+     */
+    TTNSaveHandle prepareForPowerOffAsync()
+    {
+        return ttn_prepare_for_power_off_async();
+    }
+
+    /**
+     * @brief Waits until the state saved by @ref prepareForPowerOffAsync() has been committed to NVS.
+     *
+     * @param handle  handle returned by @ref prepareForPowerOffAsync()
+     * @param ticksToWait  maximum time to wait (in FreeRTOS ticks)
+     * @return `true` if the state has been committed, `false` if the write failed or the timeout expired
+     */
+    bool waitForSave(TTNSaveHandle handle, TickType_t ticksToWait = portMAX_DELAY)
+    {
+        return ttn_wait_for_save(handle, ticksToWait);
+    }
+
     /**
      * @brief Waits until the TTN device is idle.
      * 
@@ -698,6 +889,35 @@ class TheThingsNetwork
         ttn_wait_for_idle();
     }
 
+    /**
+     * @brief Waits until the TTN device is idle or the timeout expires.
+     *
+     * The background task signals state changes. So the function blocks
+     * without polling and returns as soon as the device becomes idle.
+     *
+     * @param ticksToWait  maximum time to wait (in FreeRTOS ticks), or `portMAX_DELAY`
+     * @return `true` if the device is idle, `false` if the timeout expired
+     */
+    bool waitForIdle(TickType_t ticksToWait)
+    {
+        return ttn_wait_for_idle_timeout(ticksToWait);
+    }
+
+    /**
+     * @brief Gets the current state of the LoRaWAN MAC layer.
+     *
+     * The state is updated by the background task whenever it has finished
+     * processing and waits for the next event.
+     *
+     * @param dutyWaitEnd  if not `nullptr`, receives the FreeRTOS tick count when the wait
+     *   ends (only valid for @ref kTTNMacDutyWait)
+     * @return MAC state
+     */
+    TTNMacState macState(TickType_t *dutyWaitEnd = nullptr)
+    {
+        return static_cast<TTNMacState>(ttn_get_mac_state(dutyWaitEnd));
+    }
+
     /**
      * @brief Returns the minimum duration the TTN device is busy.
      * 
@@ -753,6 +973,63 @@ class TheThingsNetwork
         return static_cast<TTNResponseCode>(ttn_transmit_message(payload, length, port, confirm));
     }
 
+    /**
+     * @brief Transmits a message assembled from several buffers
+     *
+     * The segments are concatenated to form the message payload. They are copied directly into
+     * the radio frame when it is built, without an intermediate copy. The buffers must not be
+     * modified until the function returns.
+     *
+     * Otherwise, the function behaves like @ref transmitMessage().
+     *
+     * @param segments     array of payload segments
+     * @param numSegments  number of segments
+     * @param port         port (defaults to 1)
+     * @param confirm      flag indicating if a confirmation should be requested. Defaults to `false`
+     * @return @ref kTTNSuccessfulTransmission for successful transmission, @ref kTTNErrorTransmissionFailed for failed
+     * transmission, @ref kTTNErrorUnexpected for unexpected error
+     */
+    TTNResponseCode transmitSegments(const TTNPayloadSegment *segments, size_t numSegments, ttn_port_t port = 1,
+                                     bool confirm = false)
+    {
+        return static_cast<TTNResponseCode>(ttn_transmit_segments(segments, numSegments, port, confirm));
+    }
+
+    /**
+     * @brief Transmits a message that is larger than the maximum payload of the current data rate
+     *
+     * The message is split into fragments with a 4 byte header that are sent as unconfirmed
+     * uplinks, optionally followed by a parity fragment per group of fragments
+     * (see @ref ttn_transmit_fragmented() for the format). The function blocks until all
+     * fragments have been sent.
+     *
+     * @param payload      bytes to be transmitted
+     * @param length       number of bytes to be transmitted (up to 65,535)
+     * @param port         port
+     * @param parityGroup  number of fragments per parity fragment (2 to 15), or 0 for no parity fragments
+     * @return @ref kTTNSuccessfulTransmission if all fragments have been sent, @ref kTTNErrorFragmentTooLarge if
+     * a fragment does not fit into a frame at the current data rate, @ref kTTNErrorTransmissionFailed otherwise
+     */
+    TTNResponseCode transmitFragmented(const uint8_t *payload, size_t length, ttn_port_t port, int parityGroup = 0)
+    {
+        return static_cast<TTNResponseCode>(ttn_transmit_fragmented(payload, length, port, parityGroup));
+    }
+
+    /**
+     * @brief Gets the timing of the uplink messages sent so far
+     *
+     * Only uplinks that are transmitted right away (i.e. that do not wait for the duty cycle)
+     * are measured. See @ref ttn_get_uplink_timing() for details.
+     *
+     * @return uplink timing
+     */
+    TTNUplinkTiming uplinkTiming()
+    {
+        TTNUplinkTiming timing;
+        ttn_get_uplink_timing(&timing);
+        return timing;
+    }
+
     /**
      * @brief Sets the function to be called when a message is received
      *
@@ -761,9 +1038,10 @@ class TheThingsNetwork
      * parameters. The values are only valid during the duration of the
      * callback. So they must be immediately processed or copied.
      *
-     * Messages are received as a result of a call to @ref transmitMessage(). The callback is called
-     * in the task that called this function and it occurs before this function
-     * returns control to the caller.
+     * Messages are received as a result of a call to @ref transmitMessage(). They are copied into
+     * a pool of message buffers (see `CONFIG_TTN_DOWNLINK_POOL_SIZE`) and the callback is called
+     * from a separate dispatcher task, independently of whether the application is still in
+     * @ref transmitMessage() or not. If all buffers are in use, the message is dropped.
      *
      * @param callback  the callback function
      */
@@ -772,6 +1050,77 @@ class TheThingsNetwork
         ttn_on_message(callback);
     }
 
+    /**
+     * @brief Sets the function to be called when a message is received on the specified port
+     *
+     * Messages received on this port are passed to the specified function instead of the
+     * function set with @ref onMessage(TTNMessageCallback). The routing takes a single table lookup.
+     *
+     * Up to `CONFIG_TTN_MAX_PORT_HANDLERS` ports can have a callback at the same time.
+     *
+     * @param port      port number
+     * @param callback  the callback function, or `nullptr` to remove the callback for this port
+     * @param userData  value passed to the callback
+     * @return `true` if successful, `false` if the maximum number of port callbacks has been reached
+     */
+    bool onMessage(ttn_port_t port, TTNPortMessageCallback callback, void *userData = nullptr)
+    {
+        return ttn_on_port_message(port, callback, userData);
+    }
+
+    /**
+     * @brief Sets the callable object (e.g. lambda expression) to be called when a message is
+     * received on the specified port
+     *
+     * The object is called with the arguments `(const uint8_t *payload, size_t length, ttn_port_t port)`.
+     * It is not copied; only a reference is kept. So it must remain valid until it is replaced or removed.
+     * No memory is allocated.
+     *
+     * @param port     port number
+     * @param handler  callable object
+     * @return `true` if successful, `false` if the maximum number of port callbacks has been reached
+     */
+    template <typename Handler> bool onMessage(ttn_port_t port, Handler &handler)
+    {
+        return ttn_on_port_message(port, invokeHandler<Handler>, &handler);
+    }
+
+    /**
+     * @brief Gets the statistics of the downlink message delivery
+     *
+     * The statistics reveal if messages are dropped because the callback is too slow to keep
+     * up with the received messages.
+     *
+     * @return downlink statistics
+     */
+    TTNDownlinkStats downlinkStats()
+    {
+        TTNDownlinkStats stats;
+        ttn_get_downlink_stats(&stats);
+        return stats;
+    }
+
+    /**
+     * @brief Gets the timeline of the startup phases from boot to the first uplink.
+     *
+     * Requires `CONFIG_TTN_STARTUP_TRACE` to be enabled.
+     *
+     * @param report  structure receiving the timeline
+     * @return `true` if successful, `false` if startup tracing is disabled
+     */
+    bool startupReport(TTNStartupReport *report)
+    {
+        return ttn_get_startup_report(report);
+    }
+
+    /**
+     * @brief Logs the timeline of the startup phases.
+     */
+    void logStartupReport()
+    {
+        ttn_log_startup_report();
+    }
+
     /**
      * @brief Checks if DevEUI, AppEUI/JoinEUI and AppKey have been stored in non-volatile storage
      * or have been provided by a call to @ref join(const char*, const char*, const char*)
@@ -821,6 +1170,330 @@ class TheThingsNetwork
         ttn_set_adr_enabled(enabled);
     }
 
+    /**
+     * @brief Sets the LoRaWAN device class.
+     *
+     * The default is Class A. In Class C, the radio listens on the RX2 frequency and data rate
+     * whenever it is not transmitting and not in the RX1 window. Downlinks are delivered
+     * without waiting for the next uplink. Class C is suitable for mains-powered devices only.
+     *
+     * In Class B, the device synchronizes to the network beacon and opens ping slots at the
+     * periodicity set with setPingSlotPeriodicity(). Class B requires `CONFIG_TTN_CLASS_B`.
+     * If the beacon is lost, the device falls back to Class A.
+     *
+     * The device class is not saved; set it after each restart.
+     *
+     * @param device_class device class
+     */
+    void setDeviceClass(TTNDeviceClass device_class)
+    {
+        ttn_set_device_class(static_cast<ttn_device_class_t>(device_class));
+    }
+
+    /**
+     * @brief Sets the Class B ping slot periodicity.
+     *
+     * The device opens a ping slot every 0.96 × 2^periodicity seconds (0.96 s to 122.88 s).
+     * The default is 7. The periodicity takes effect with the next call of setDeviceClass().
+     *
+     * @param periodicity periodicity (0 to 7)
+     */
+    void setPingSlotPeriodicity(int periodicity)
+    {
+        ttn_set_ping_slot_periodicity(periodicity);
+    }
+
+    /**
+     * @brief Sets up a multicast session.
+     *
+     * Multicast downlinks are received in Class C and in the ping slots set up
+     * with setMulticastPingSlots() in Class B. They are delivered to the message
+     * callbacks like unicast downlinks.
+     *
+     * Multicast sessions are not saved; set them up after each restart.
+     *
+     * @param index session index (0 to `CONFIG_TTN_MULTICAST_SESSIONS` - 1)
+     * @param session session address, keys and frame counter range
+     * @return `true` if successful, `false` if the index is invalid
+     */
+    bool setMulticastSession(int index, const TTNMulticastSession *session)
+    {
+        return ttn_set_multicast_session(index, session);
+    }
+
+    /**
+     * @brief Opens Class B ping slots for a multicast session.
+     *
+     * @param index session index
+     * @param periodicity ping slot periodicity (0 to 7)
+     * @param frequency ping slot frequency (in Hz), or 0 for the default frequency of the region
+     * @param data_rate ping slot data rate
+     * @return `true` if successful, `false` otherwise
+     */
+    bool setMulticastPingSlots(int index, int periodicity, uint32_t frequency, TTNDataRate data_rate)
+    {
+        return ttn_set_multicast_ping_slots(index, periodicity, frequency, static_cast<ttn_data_rate_t>(data_rate));
+    }
+
+    /**
+     * @brief Removes a multicast session.
+     *
+     * @param index session index
+     */
+    void clearMulticastSession(int index)
+    {
+        ttn_clear_multicast_session(index);
+    }
+
+    /**
+     * @brief Gets the next expected frame counter of a multicast session.
+     *
+     * @param index session index
+     * @return frame counter, or 0 if the index is invalid
+     */
+    uint32_t multicastFcnt(int index)
+    {
+        return ttn_get_multicast_fcnt(index);
+    }
+
+    /**
+     * @brief Starts receiving data blocks with the fragmented data block transport (LoRaWAN TS004).
+     *
+     * The fragments are received on port 201 and written to the specified data partition.
+     * Once the data block is complete, it is found at the start of the partition and the
+     * callback is called.
+     *
+     * Requires `CONFIG_TTN_FRAG_TRANSPORT` to be enabled.
+     *
+     * @param partitionLabel label of the data partition
+     * @param callback function called when a data block has been completely received
+     * @param userData value passed to the callback
+     * @return `true` if successful, `false` otherwise
+     */
+    bool startFragTransport(const char *partitionLabel, TTNFragCompleteCallback callback, void *userData = nullptr)
+    {
+        return ttn_start_frag_transport(partitionLabel, callback, userData);
+    }
+
+    /**
+     * @brief Stops receiving data blocks and discards the current session.
+     */
+    void stopFragTransport()
+    {
+        ttn_stop_frag_transport();
+    }
+
+    /**
+     * @brief Gets the status of the fragmented data block transport session.
+     *
+     * @param status structure receiving the status
+     * @return `true` if a session is active, `false` otherwise
+     */
+    bool fragStatus(TTNFragStatus *status)
+    {
+        return ttn_get_frag_status(status);
+    }
+
+    /**
+     * @brief Sends uplinks in a time slot derived from the network time and the DevEUI.
+     *
+     * See @ref ttn_set_slotted_tx() for details. Requires `CONFIG_TTN_SLOTTED_TX` to be enabled.
+     *
+     * @param config slot configuration, or `nullptr` to send uplinks immediately again
+     * @return `true` if successful, `false` if the configuration is invalid or the feature is disabled
+     */
+    bool setSlottedTx(const TTNSlottedTxConfig *config)
+    {
+        return ttn_set_slotted_tx(config);
+    }
+
+    /**
+     * @brief Requests the network time.
+     *
+     * A DeviceTimeReq MAC command is sent with the next uplink. The answer synchronizes the
+     * GPS clock (see gpsTime()).
+     */
+    void requestTime()
+    {
+        ttn_request_time();
+    }
+
+    /**
+     * @brief Gets the current GPS time.
+     *
+     * @param gpsTime structure receiving the GPS time
+     * @return `true` if successful, `false` if no network time has been received yet
+     */
+    bool gpsTime(TTNGpsTime *gpsTime)
+    {
+        return ttn_get_gps_time(gpsTime);
+    }
+
+    /**
+     * @brief Gets the calibration of the clock error used for the RX windows.
+     *
+     * Requires `CONFIG_TTN_CLOCK_CALIBRATION` to be enabled.
+     *
+     * @param calibration structure receiving the calibration
+     * @return `true` if successful, `false` if the feature is disabled
+     */
+    bool clockCalibration(TTNClockCalibration *calibration)
+    {
+        return ttn_get_clock_calibration(calibration);
+    }
+
+    /**
+     * @brief Sets the supply currents used to calculate the energy of the radio.
+     *
+     * Requires `CONFIG_TTN_ENERGY_ACCOUNTING` to be enabled.
+     *
+     * @param model supply currents, or `nullptr` for the default model (SX1276 datasheet)
+     * @return `true` if successful, `false` if the model is invalid or the feature is disabled
+     */
+    bool setEnergyModel(const TTNEnergyModel *model)
+    {
+        return ttn_set_energy_model(model);
+    }
+
+    /**
+     * @brief Gets the time the radio has spent in each state and the resulting energy.
+     *
+     * Requires `CONFIG_TTN_ENERGY_ACCOUNTING` to be enabled.
+     *
+     * @param report structure receiving the report
+     * @return `true` if successful, `false` if the feature is disabled
+     */
+    bool energyReport(TTNEnergyReport *report)
+    {
+        return ttn_get_energy_report(report);
+    }
+
+    /**
+     * @brief Resets the totals of the energy report.
+     */
+    void resetEnergyReport()
+    {
+        ttn_reset_energy_report();
+    }
+
+    /**
+     * @brief Starts iterating over the link telemetry records.
+     *
+     * The iteration covers the records existing when it starts. Records overwritten
+     * during the iteration are skipped.
+     *
+     * Requires `CONFIG_TTN_TELEMETRY_RECORDS` to be greater than 0.
+     *
+     * @param iterator iterator to initialize
+     * @param fromId ID of the first record (0 for all records)
+     * @return `true` if successful, `false` if the feature is disabled
+     */
+    bool beginTelemetry(TTNTelemetryIterator *iterator, uint32_t fromId = 0)
+    {
+        return ttn_begin_telemetry(iterator, fromId);
+    }
+
+    /**
+     * @brief Gets the next link telemetry record (oldest first).
+     *
+     * @param iterator iterator
+     * @return the record (a copy in the iterator, valid until the next call), or `nullptr` if there are no more records
+     */
+    const TTNTelemetryRecord *nextTelemetry(TTNTelemetryIterator *iterator)
+    {
+        return ttn_next_telemetry(iterator);
+    }
+
+    /**
+     * @brief Ends iterating over the link telemetry records.
+     *
+     * @param iterator iterator
+     */
+    void endTelemetry(TTNTelemetryIterator *iterator)
+    {
+        ttn_end_telemetry(iterator);
+    }
+
+    /**
+     * @brief Writes the link telemetry records in a compact binary format (for upload).
+     *
+     * @param fromId ID of the first record (0 for all records)
+     * @param buf buffer receiving the records
+     * @param size size of the buffer (in bytes)
+     * @param endId receives the ID of the record following the last written one; can be `nullptr`
+     * @return the number of bytes written, or 0 if the feature is disabled
+     */
+    size_t dumpTelemetry(uint32_t fromId, uint8_t *buf, size_t size, uint32_t *endId = nullptr)
+    {
+        return ttn_dump_telemetry(fromId, buf, size, endId);
+    }
+
+    /**
+     * @brief Outputs the LMIC event log as formatted text via the ESP-IDF logging (default).
+     *
+     * Requires the macro `LMIC_ENABLE_event_logging` to be set to 1. Call it after configurePins().
+     *
+     * @return `true` if successful, `false` if event logging is disabled
+     */
+    bool logToConsole()
+    {
+        return ttn_log_to_console();
+    }
+
+    /**
+     * @brief Streams the LMIC event log as a compact binary trace to a UART.
+     *
+     * The UART driver must have been installed. The trace is decoded on the host with
+     * `tools/trace_decoder`.
+     *
+     * @param uartNum UART port
+     * @return `true` if successful, `false` if event logging is disabled
+     */
+    bool logToUart(uart_port_t uartNum)
+    {
+        return ttn_log_to_uart(uartNum);
+    }
+
+    /**
+     * @brief Streams the LMIC event log as a compact binary trace to a file.
+     *
+     * The file must remain open until the log has been switched to another output.
+     *
+     * @param file file opened for writing in binary mode
+     * @return `true` if successful, `false` if event logging is disabled
+     */
+    bool logToFile(FILE *file)
+    {
+        return ttn_log_to_file(file);
+    }
+
+    /**
+     * @brief Streams the LMIC event log as a compact binary trace to a flash partition.
+     *
+     * Once the partition is full, further records are dropped.
+     *
+     * @param label label of the data partition
+     * @return `true` if successful, `false` if the partition was not found or event logging is disabled
+     */
+    bool logToPartition(const char *label)
+    {
+        return ttn_log_to_partition(label);
+    }
+
+    /**
+     * @brief Gets the statistics of the LMIC event logging.
+     *
+     * Requires the macro `LMIC_ENABLE_event_logging` to be set to 1.
+     *
+     * @return statistics (all 0 if event logging is disabled)
+     */
+    TTNLogStats logStats()
+    {
+        TTNLogStats stats;
+        ttn_get_log_stats(&stats);
+        return stats;
+    }
+
     /**
      * @brief Sets the transmission data rate (i.e. the data rate for uplink messages).
      *
@@ -848,6 +1521,40 @@ class TheThingsNetwork
         ttn_set_max_tx_pow(tx_pow);
     }
 
+    /**
+     * @brief Sets the policy of the on-device data rate advisor.
+     *
+     * Requires `CONFIG_TTN_DR_ADVISOR` to be enabled.
+     *
+     * @param policy  policy
+     */
+    void setDrAdvisorPolicy(const TTNDrAdvisorPolicy &policy)
+    {
+        ttn_set_dr_advisor_policy(&policy);
+    }
+
+    /**
+     * @brief Gets the data rate recommended by the data rate advisor.
+     *
+     * @return recommended data rate, or @ref kTTNDRJoinDdefault if there is no recommendation yet
+     */
+    TTNDataRate recommendedDataRate()
+    {
+        return static_cast<TTNDataRate>(ttn_get_recommended_data_rate());
+    }
+
+    /**
+     * @brief Gets the link quality statistics of the specified data rate.
+     *
+     * @param data_rate  data rate
+     * @param stats  structure receiving the statistics
+     * @return `true` if successful, `false` if the data rate isn't tracked or the advisor is disabled
+     */
+    bool drStats(TTNDataRate data_rate, TTNDrStats *stats)
+    {
+        return ttn_get_dr_stats(static_cast<ttn_data_rate_t>(data_rate), stats);
+    }
+
     /**
      * @brief Gets current RX/TX window
      * @return window
@@ -901,6 +1608,13 @@ class TheThingsNetwork
     {
         return ttn_rssi();
     }
+
+  private:
+    template <typename Handler>
+    static void invokeHandler(const uint8_t *payload, size_t length, ttn_port_t port, void *userData)
+    {
+        (*static_cast<Handler *>(userData))(payload, length, port);
+    }
 };
 
 #endif
@@ -18,7 +18,9 @@
 #define TTN_C_H
 
 #include "driver/spi_master.h"
+#include "driver/uart.h"
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -41,6 +43,19 @@ extern "C"
      */
     typedef uint8_t ttn_port_t;
 
+    /**
+     * @brief Segment of an uplink message payload.
+     *
+     * See @ref ttn_transmit_segments().
+     */
+    typedef struct
+    {
+        /** @brief Start of segment */
+        const uint8_t *data;
+        /** @brief Length of segment (in bytes) */
+        uint8_t length;
+    } ttn_payload_segment_t;
+
     /**
      * @brief Response codes
      */
@@ -48,6 +63,8 @@ extern "C"
     {
         /** @brief Transmission failed error */
         TTN_ERROR_TRANSMISSION_FAILED = -1,
+        /** @brief Fragment does not fit into a frame at the current data rate */
+        TTN_ERROR_FRAGMENT_TOO_LARGE = -2,
         /** @brief Unexpected or internal error */
         TTN_ERROR_UNEXPECTED = -10,
         /** @brief Successful transmission of an uplink message */
@@ -79,6 +96,63 @@ extern "C"
         TTN_WINDOW_RX2 = 3
     } ttn_rx_tx_window_t;
 
+    /**
+     * @brief State of the LoRaWAN MAC layer
+     *
+     * See @ref ttn_get_mac_state().
+     */
+    typedef enum
+    {
+        /**
+         * @brief Idle; the device can go to deep sleep or can be powered off
+         */
+        TTN_MAC_IDLE = 0,
+        /**
+         * @brief Transmission (or join request) submitted or in progress
+         */
+        TTN_MAC_TX_PENDING = 1,
+        /**
+         * @brief Waiting for or receiving in RX1 or RX2 window
+         */
+        TTN_MAC_RX_WINDOW = 2,
+        /**
+         * @brief Transmission (or join request) pending, waiting for the duty cycle to allow it
+         */
+        TTN_MAC_DUTY_WAIT = 3,
+        /**
+         * @brief Settings changed by the application are being applied
+         */
+        TTN_MAC_BUSY = 4
+    } ttn_mac_state_t;
+
+    /**
+     * @brief LoRaWAN device class
+     *
+     * See @ref ttn_set_device_class().
+     */
+    typedef enum
+    {
+        /**
+         * @brief Class A: downlinks are only received in the RX1 and RX2 window after an uplink
+         */
+        TTN_CLASS_A = 0,
+        /**
+         * @brief Class B: downlinks are also received in ping slots synchronized to the network beacon
+         */
+        TTN_CLASS_B = 1,
+        /**
+         * @brief Class C: the radio continuously listens for downlinks when not transmitting
+         */
+        TTN_CLASS_C = 2
+    } ttn_device_class_t;
+
+    /**
+     * @brief Handle for waiting until the state saved in the background has been committed.
+     *
+     * See @ref ttn_prepare_for_power_off_async(). 0 indicates a failure.
+     */
+    typedef uint32_t ttn_save_handle_t;
+
     /**
      * @brief Spreading Factor
      */
@@ -425,6 +499,433 @@ extern "C"
      */
     typedef void (*ttn_message_cb)(const uint8_t *payload, size_t length, ttn_port_t port);
 
+    /**
+     * @brief Callback for received messages on a specific port
+     *
+     * @param payload    pointer to the received bytes
+     * @param length     number of received bytes
+     * @param port       port the message was received on
+     * @param user_data  value passed to @ref ttn_on_port_message()
+     */
+    typedef void (*ttn_port_message_cb)(const uint8_t *payload, size_t length, ttn_port_t port, void *user_data);
+
+    /**
+     * @brief Downlink statistics
+     *
+     * See @ref ttn_get_downlink_stats().
+     */
+    typedef struct
+    {
+        /** @brief Number of received downlink messages (including dropped ones) */
+        uint32_t received;
+        /** @brief Number of messages dropped because all message buffers were in use */
+        uint32_t dropped;
+        /** @brief Maximum number of message buffers that have been in use at the same time */
+        uint32_t pool_high_water;
+    } ttn_downlink_stats_t;
+
+    /**
+     * @brief Timing of the uplink messages
+     *
+     * See @ref ttn_get_uplink_timing().
+     */
+    typedef struct
+    {
+        /** @brief Number of uplinks that were transmitted immediately (the basis of the figures below) */
+        uint32_t uplinks;
+        /** @brief Average time (in µs) the submitting task spent encrypting the payload */
+        uint32_t encrypt_us;
+        /** @brief Average time (in µs) from the LMIC task taking the uplink to the start of the transmission */
+        uint32_t tx_start_us;
+        /** @brief Maximum time (in µs) from the LMIC task taking the uplink to the start of the transmission */
+        uint32_t max_tx_start_us;
+    } ttn_uplink_timing_t;
+
+    /**
+     * @brief Startup phase
+     *
+     * See @ref ttn_get_startup_report().
+     */
+    typedef enum
+    {
+        /** @brief @ref ttn_init() */
+        TTN_STARTUP_INIT,
+        /** @brief @ref ttn_configure_pins() */
+        TTN_STARTUP_CONFIGURE_PINS,
+        /** @brief Opening the NVS namespace */
+        TTN_STARTUP_NVS_OPEN,
+        /** @brief Restoring DevEUI, AppEUI/JoinEUI and AppKey from NVS */
+        TTN_STARTUP_KEY_RESTORE,
+        /** @brief Decoding DevEUI, AppEUI/JoinEUI and AppKey */
+        TTN_STARTUP_KEY_DECODE,
+        /** @brief Setting up the SPI device */
+        TTN_STARTUP_SPI_INIT,
+        /** @brief Initializing the HAL and resetting (or checking) the radio */
+        TTN_STARTUP_RADIO_INIT,
+        /** @brief Restoring the session from RTC memory or NVS */
+        TTN_STARTUP_SESSION_RESTORE,
+        /** @brief From starting the join procedure until the device has joined */
+        TTN_STARTUP_JOIN,
+        /** @brief Start of the first transmission (point in time) */
+        TTN_STARTUP_FIRST_TX,
+        /** @brief Number of phases */
+        TTN_STARTUP_NUM_PHASES
+    } ttn_startup_phase_t;
+
+    /**
+     * @brief Start and end time of a startup phase
+     *
+     * Times are in microseconds since boot. They are 0 if the phase has not (yet) started or ended.
+     */
+    typedef struct
+    {
+        /** @brief Time the phase started */
+        int64_t start;
+        /** @brief Time the phase ended */
+        int64_t end;
+    } ttn_startup_phase_timing_t;
+
+    /**
+     * @brief Timeline of the startup phases
+     *
+     * See @ref ttn_get_startup_report().
+     */
+    typedef struct
+    {
+        /** @brief Timing of the phases, indexed by @ref ttn_startup_phase_t */
+        ttn_startup_phase_timing_t phases[TTN_STARTUP_NUM_PHASES];
+    } ttn_startup_report_t;
+
+    /**
+     * @brief Operating mode of the data rate advisor
+     */
+    typedef enum
+    {
+        /** @brief Advisor is off */
+        TTN_DR_ADVISOR_OFF = 0,
+        /** @brief Link quality is tracked and a data rate is recommended (see @ref ttn_get_recommended_data_rate()) */
+        TTN_DR_ADVISOR_RECOMMEND = 1,
+        /** @brief Recommended data rate is also applied (only while ADR is disabled) */
+        TTN_DR_ADVISOR_APPLY = 2
+    } ttn_dr_advisor_mode_t;
+
+    /**
+     * @brief Policy of the data rate advisor
+     *
+     * See @ref ttn_set_dr_advisor_policy().
+     */
+    typedef struct
+    {
+        /** @brief Operating mode */
+        ttn_dr_advisor_mode_t mode;
+        /** @brief Maximum acceptable loss rate of confirmed uplinks (in percent) */
+        uint8_t max_loss_percent;
+        /** @brief Link margin (in dB) required at the current data rate to move to the next faster one */
+        uint8_t step_up_margin;
+        /** @brief Number of consecutive evaluations proposing the same data rate before it is recommended */
+        uint8_t hysteresis;
+        /** @brief Minimum number of uplinks with known outcome before the loss rate is evaluated */
+        uint8_t min_samples;
+        /** @brief Request a link check (gateway margin) every n-th uplink (0 to never request it) */
+        uint8_t link_check_interval;
+    } ttn_dr_advisor_policy_t;
+
+    /**
+     * @brief Link quality statistics for a data rate
+     *
+     * The statistics cover a sliding window of the most recent uplinks at this data rate.
+     * See @ref ttn_get_dr_stats().
+     */
+    typedef struct
+    {
+        /** @brief Number of uplinks in the window */
+        uint8_t uplinks;
+        /** @brief Number of uplinks answered by the network (ACK or downlink) */
+        uint8_t answered;
+        /** @brief Number of confirmed uplinks that have not been acknowledged */
+        uint8_t lost;
+        /** @brief Average link margin (in dB, -128 if unknown) */
+        int8_t avg_margin;
+        /** @brief Average SNR of downlinks (in dB, -128 if unknown) */
+        int8_t avg_snr;
+        /** @brief Average RSSI of downlinks (in dBm, -128 if unknown) */
+        int8_t avg_rssi;
+    } ttn_dr_stats_t;
+
+    /**
+     * @brief Multicast session
+     *
+     * The session keys and the frame counter range are usually distributed
+     * by the application server (e.g. with the LoRaWAN remote multicast setup package).
+     * See @ref ttn_set_multicast_session().
+     */
+    typedef struct
+    {
+        /** @brief Multicast address (McAddr) */
+        uint32_t address;
+        /** @brief Multicast network session key (McNwkSKey) */
+        uint8_t nwk_s_key[16];
+        /** @brief Multicast application session key (McAppSKey) */
+        uint8_t app_s_key[16];
+        /** @brief First valid frame counter */
+        uint32_t fcnt_min;
+        /** @brief Last valid frame counter */
+        uint32_t fcnt_max;
+    } ttn_multicast_session_t;
+
+    /**
+     * @brief Callback for a completely received data block
+     *
+     * See @ref ttn_start_frag_transport().
+     *
+     * @param size         size of the data block (in bytes), stored at the start of the partition
+     * @param descriptor   descriptor provided by the application server when the session was set up
+     * @param user_data    value passed to @ref ttn_start_frag_transport()
+     */
+    typedef void (*ttn_frag_complete_cb)(size_t size, uint32_t descriptor, void *user_data);
+
+    /**
+     * @brief Status of the fragmented data block transport session
+     *
+     * See @ref ttn_get_frag_status().
+     */
+    typedef struct
+    {
+        /** @brief Session has been set up by the application server */
+        bool active;
+        /** @brief Data block has been completely received */
+        bool complete;
+        /** @brief Data block cannot be reconstructed (too many lost fragments, out of memory or flash error) */
+        bool failed;
+        /** @brief Number of fragments of the data block */
+        uint16_t nb_frag;
+        /** @brief Fragment size (in bytes) */
+        uint8_t frag_size;
+        /** @brief Number of received fragments (uncoded and coded) */
+        uint16_t received;
+        /** @brief Number of fragments still needed to reconstruct the data block */
+        uint16_t missing;
+        /** @brief RAM used by the decoder (in bytes) */
+        uint32_t memory;
+    } ttn_frag_status_t;
+
+    /**
+     * @brief Configuration of time-slotted uplinks
+     *
+     * See @ref ttn_set_slotted_tx().
+     */
+    typedef struct
+    {
+        /** @brief Reporting period shared by all devices (in seconds, 1 to 3600) */
+        uint32_t period;
+        /** @brief Number of slots the period is divided into */
+        uint16_t num_slots;
+        /** @brief Maximum random delay added to the slot start (in ms, less than the slot length) */
+        uint16_t jitter;
+        /** @brief Interval between network time requests (in seconds, up to 86,400) */
+        uint32_t sync_interval;
+    } ttn_slotted_tx_config_t;
+
+    /**
+     * @brief GPS time
+     *
+     * See @ref ttn_get_gps_time().
+     */
+    typedef struct
+    {
+        /** @brief Seconds since the GPS epoch (1980-01-06 00:00:00 UTC, without leap seconds) */
+        uint32_t seconds;
+        /** @brief Fraction of the second (in µs) */
+        uint32_t microseconds;
+        /** @brief Estimated uncertainty (in ms) */
+        uint32_t uncertainty_ms;
+    } ttn_gps_time_t;
+
+    /**
+     * @brief Clock error calibration
+     *
+     * See @ref ttn_get_clock_calibration().
+     */
+    typedef struct
+    {
+        /** @brief `true` if the measured clock error is used for the RX windows */
+        bool calibrated;
+        /** @brief Number of downlinks measured */
+        uint16_t samples;
+        /** @brief Smoothed measured timing error (in ppm, positive if the local clock is fast) */
+        int32_t offset_ppm;
+        /** @brief Clock error used for the RX windows (in ppm) */
+        uint32_t clock_error_ppm;
+        /** @brief Reduction of the RX time per uplink without downlink (in µs) */
+        uint32_t rx_time_saved_us;
+    } ttn_clock_calibration_t;
+
+    /**
+     * @brief TX current at a TX power
+     */
+    typedef struct
+    {
+        /** @brief TX power (in dBm) */
+        int8_t power;
+        /** @brief Supply current (in µA) */
+        uint32_t current_ua;
+    } ttn_tx_current_t;
+
+    /**
+     * @brief Supply currents of the radio states
+     *
+     * See @ref ttn_set_energy_model().
+     */
+    typedef struct
+    {
+        /** @brief Supply voltage (in mV) */
+        uint16_t voltage_mv;
+        /** @brief Current in sleep mode (in nA) */
+        uint32_t sleep_na;
+        /** @brief Current in standby mode (in µA) */
+        uint32_t standby_ua;
+        /** @brief Current during frequency synthesis (in µA) */
+        uint32_t synth_ua;
+        /** @brief Current in RX mode (in µA) */
+        uint32_t rx_ua;
+        /**
+         * @brief Current in TX mode at different TX powers (in ascending order of the power).
+         *
+         * The current is interpolated linearly between the points. Unused points have a current of 0.
+         */
+        ttn_tx_current_t tx_current[4];
+    } ttn_energy_model_t;
+
+    /**
+     * @brief Time spent in a radio state and the resulting charge
+     */
+    typedef struct
+    {
+        /** @brief Time (in µs) */
+        uint64_t time_us;
+        /** @brief Charge (in µC) */
+        uint64_t charge_uc;
+    } ttn_state_energy_t;
+
+    /**
+     * @brief Energy used by an uplink (including the RX windows)
+     */
+    typedef struct
+    {
+        /** @brief TX power (in dBm) */
+        int8_t tx_power;
+        /** @brief Time in TX mode (in µs) */
+        uint32_t tx_us;
+        /** @brief Time in RX mode (in µs) */
+        uint32_t rx_us;
+        /** @brief Time in standby mode (in µs) */
+        uint32_t standby_us;
+        /** @brief Time of frequency synthesis (in µs) */
+        uint32_t synth_us;
+        /** @brief Charge (in µC) */
+        uint32_t charge_uc;
+        /** @brief Energy (in µJ) */
+        uint32_t energy_uj;
+    } ttn_uplink_energy_t;
+
+    /**
+     * @brief Energy used by the radio
+     *
+     * See @ref ttn_get_energy_report().
+     */
+    typedef struct
+    {
+        /** @brief Time covered by the report (in µs) */
+        uint64_t duration_us;
+        /** @brief Sleep mode */
+        ttn_state_energy_t sleep;
+        /** @brief Standby mode */
+        ttn_state_energy_t standby;
+        /** @brief Frequency synthesis */
+        ttn_state_energy_t synth;
+        /** @brief TX mode */
+        ttn_state_energy_t tx;
+        /** @brief RX mode */
+        ttn_state_energy_t rx;
+        /** @brief Total charge (in µC) */
+        uint64_t charge_uc;
+        /** @brief Total energy (in µJ) */
+        uint64_t energy_uj;
+        /** @brief Last uplink */
+        ttn_uplink_energy_t last_uplink;
+    } ttn_energy_report_t;
+
+    /**
+     * @brief Link telemetry of an uplink
+     *
+     * See @ref ttn_begin_telemetry().
+     */
+    typedef struct
+    {
+        /** @brief Record ID (increments with each record) */
+        uint32_t id;
+        /** @brief Start of the transmission (in s, local time continuing across deep sleep) */
+        uint32_t timestamp;
+        /** @brief Frame counter */
+        uint32_t fcnt;
+        /** @brief Frequency (in Hz) */
+        uint32_t frequency;
+        /** @brief Time from the submission to the start of the transmission (duty cycle, time slot) (in ms) */
+        uint32_t wait_ms;
+        /** @brief Delay of RX windows opened late (in µs) */
+        uint32_t rxlate_us;
+        /** @brief Delay of transmissions started late (in µs) */
+        uint32_t txlate_us;
+        /** @brief Airtime (in ms) */
+        uint16_t airtime_ms;
+        /** @brief RSSI of the downlink (in dBm) */
+        int16_t rssi;
+        /** @brief Channel */
+        uint8_t channel;
+        /** @brief Data rate */
+        uint8_t data_rate;
+        /** @brief TX power (in dBm) */
+        int8_t tx_power;
+        /** @brief SNR of the downlink (in 0.25 dB) */
+        int8_t snr;
+        /** @brief Window in which a downlink was received (0 none, 1 RX1, 2 RX2) */
+        uint8_t rx_window;
+        /** @brief Number of retransmissions */
+        uint8_t retries;
+        /** @brief `true` if it was a confirmed uplink */
+        bool confirmed;
+        /** @brief `true` if the confirmed uplink was acknowledged */
+        bool acked;
+    } ttn_telemetry_record_t;
+
+    /**
+     * @brief Iterator over the link telemetry records
+     */
+    typedef struct
+    {
+        uint32_t next_id;
+        uint32_t end_id;
+        /** @brief Copy of the record last returned by @ref ttn_next_telemetry() */
+        ttn_telemetry_record_t record;
+    } ttn_telemetry_iterator_t;
+
+    /**
+     * @brief Statistics of the LMIC event logging
+     *
+     * See @ref ttn_get_log_stats().
+     */
+    typedef struct
+    {
+        /** @brief Number of recorded events */
+        uint32_t events;
+        /** @brief Number of events overwritten before the logging task could output them */
+        uint32_t dropped;
+        /** @brief Average number of CPU cycles spent recording an event */
+        uint32_t cycles_per_event;
+        /** @brief Maximum number of CPU cycles spent recording an event */
+        uint32_t max_cycles;
+    } ttn_log_stats_t;
+
     /**
      * @brief Initializes The Things Network device instance.
      *
@@ -603,6 +1104,11 @@ extern "C"
      * If the device has access to the real time, set the system time (using `settimeofday()`)
      * before calling this function (and before @ref ttn_join()) and pass 0 for `off_duration`.
      * 
+     * If `CONFIG_TTN_COUNTER_LOG_INTERVAL` is set, the state is also saved while the device
+     * is running (frame counters every few uplinks) so communication can be resumed after
+     * an unexpected power loss without calling @ref ttn_prepare_for_power_off(). The
+     * uplink frame counter then skips the values that might have been used since the last save.
+     * 
      * Before this function is called, `nvs_flash_init()` must have been called once.
      *
      * @param off_duration duration the device was powered off (in minutes)
@@ -646,14 +1152,66 @@ extern "C"
      */
     void ttn_prepare_for_power_off(void);
 
+    /**
+     * @brief Stops all activies and prepares for power off without waiting for the flash write.
+     *
+     * Same as @ref ttn_prepare_for_power_off() except that the communication state is only
+     * copied to a staging buffer. It is written to NVS by a low-priority background task,
+     * so the caller doesn't block while the flash is erased and written.
+     *
+     * Before cutting the power, call @ref ttn_wait_for_save() with the returned handle.
+     *
+     * @return handle for waiting for the completion (0 if the state could not be captured)
+     */
+    ttn_save_handle_t ttn_prepare_for_power_off_async(void);
+
+    /**
+     * @brief Waits until the state saved by @ref ttn_prepare_for_power_off_async() has been committed to NVS.
+     *
+     * If the state has been saved several times in the meantime, the function waits for
+     * the most recent state to be committed.
+     *
+     * @param handle  handle returned by @ref ttn_prepare_for_power_off_async()
+     * @param ticks_to_wait  maximum time to wait (in FreeRTOS ticks), `portMAX_DELAY` to wait forever
+     * @return `true` if the state has been committed, `false` if the write failed or the timeout expired
+     */
+    bool ttn_wait_for_save(ttn_save_handle_t handle, TickType_t ticks_to_wait);
+
     /**
      * @brief Waits until the TTN device is idle.
      * 
      * If the TTN device is idle, the ESP32 can go into deep sleep mode
      * or be powered off without disrupting an on-going communication.
+     *
+     * Only transmissions, join requests and their RX windows keep the device busy.
+     * In Class B, the device is idle between them even though it tracks the beacon
+     * and listens in the ping slots; deep sleep ends the Class B synchronization.
      */
     void ttn_wait_for_idle(void);
 
+    /**
+     * @brief Waits until the TTN device is idle or the timeout expires.
+     *
+     * The background task signals state changes. So the function blocks
+     * without polling and returns as soon as the device becomes idle.
+     *
+     * @param ticks_to_wait  maximum time to wait (in FreeRTOS ticks), or `portMAX_DELAY`
+     * @return `true` if the device is idle, `false` if the timeout expired
+     */
+    bool ttn_wait_for_idle_timeout(TickType_t ticks_to_wait);
+
+    /**
+     * @brief Gets the current state of the LoRaWAN MAC layer.
+     *
+     * The state is updated by the background task whenever it has finished
+     * processing and waits for the next event.
+     *
+     * @param duty_wait_end  if not `NULL`, receives the FreeRTOS tick count when the wait
+     *   ends (only valid for @ref TTN_MAC_DUTY_WAIT)
+     * @return MAC state
+     */
+    ttn_mac_state_t ttn_get_mac_state(TickType_t *duty_wait_end);
+
     /**
      * @brief Returns the minimum duration the TTN device will be busy.
      * 
@@ -699,6 +1257,72 @@ extern "C"
      */
     ttn_response_code_t ttn_transmit_message(const uint8_t *payload, size_t length, ttn_port_t port, bool confirm);
 
+    /**
+     * @brief Transmits a message assembled from several buffers
+     *
+     * The segments are concatenated to form the message payload. They are copied directly into
+     * the radio frame when it is built, without an intermediate copy. The buffers must not be
+     * modified until the function returns.
+     *
+     * Otherwise, the function behaves like @ref ttn_transmit_message().
+     *
+     * @param segments      array of payload segments
+     * @param num_segments  number of segments
+     * @param port          port (use 1 as default)
+     * @param confirm       flag indicating if a confirmation should be requested (use `false` as default)
+     * @return @ref TTN_SUCCESSFUL_TRANSMISSION for successful transmission, @ref TTN_ERROR_TRANSMISSION_FAILED for
+     * failed transmission, @ref TTN_ERROR_UNEXPECTED for unexpected error
+     */
+    ttn_response_code_t ttn_transmit_segments(const ttn_payload_segment_t *segments, size_t num_segments,
+                                              ttn_port_t port, bool confirm);
+
+    /**
+     * @brief Transmits a message that is larger than the maximum payload of the current data rate
+     *
+     * The message is split into fragments that fit into a frame at the current data rate
+     * (at SF12, this can be less than 51 bytes). The fragments are sent as unconfirmed uplinks
+     * on the specified port, one after the other, each waiting for the duty cycle like
+     * @ref ttn_transmit_message(). The function blocks until all fragments have been sent.
+     *
+     * Optionally, a parity fragment is sent after each group of `parity_group` fragments. It
+     * contains the XOR of the group's fragments (padded with zeros to the fragment size), so the
+     * server can recover one lost fragment per group without a retransmission.
+     *
+     * Each fragment starts with a 4 byte header:
+     *
+     * - byte 0: message number (bits 7-4, incremented with each message) and parity group size (bits 3-0, 0 = no parity)
+     * - byte 1: fragment index (0 to N - 1 for the N data fragments, N + k for the parity fragment of group k)
+     * - byte 2-3: message length (little endian)
+     *
+     * All data fragments but the last one and all parity fragments have the same size.
+     * If the data rate drops while the message is sent (e.g. due to ADR) so that the next
+     * fragment no longer fits into a frame, the function stops and returns
+     * @ref TTN_ERROR_FRAGMENT_TOO_LARGE. The message can then be sent again with smaller fragments.
+     *
+     * @param payload       bytes to be transmitted
+     * @param length        number of bytes to be transmitted (up to 65,535)
+     * @param port          port
+     * @param parity_group  number of fragments per parity fragment (2 to 15), or 0 for no parity fragments
+     * @return @ref TTN_SUCCESSFUL_TRANSMISSION if all fragments have been sent, @ref TTN_ERROR_FRAGMENT_TOO_LARGE if
+     * a fragment does not fit into a frame at the current data rate, @ref TTN_ERROR_TRANSMISSION_FAILED if a
+     * fragment could not be sent or the message needs more than 256 fragments
+     */
+    ttn_response_code_t ttn_transmit_fragmented(const uint8_t *payload, size_t length, ttn_port_t port,
+                                                int parity_group);
+
+    /**
+     * @brief Gets the timing of the uplink messages sent so far
+     *
+     * Only uplinks that are transmitted right away (i.e. that do not wait for the duty cycle)
+     * are measured. For them, the time from the LMIC task taking the message to the start of the
+     * transmission is the LMIC task's processing time for the uplink (building and encrypting
+     * the frame). With `CONFIG_TTN_TX_PRE_ENCRYPTION`, the payload is encrypted by the task
+     * calling @ref ttn_transmit_message() instead.
+     *
+     * @param timing  structure receiving the timing
+     */
+    void ttn_get_uplink_timing(ttn_uplink_timing_t *timing);
+
     /**
      * @brief Sets the function to be called when a message is received
      *
@@ -707,14 +1331,61 @@ extern "C"
      * parameters. The values are only valid during the duration of the
      * callback. So they must be immediately processed or copied.
      *
-     * Messages are received as a result of @ref ttn_transmit_message(). The callback is called
-     * in the task that called this function and it occurs before this function
-     * returns control to the caller.
+     * Messages are received as a result of @ref ttn_transmit_message(). They are copied into
+     * a pool of message buffers (see `CONFIG_TTN_DOWNLINK_POOL_SIZE`) and the callback is called
+     * from a separate dispatcher task, independently of whether the application is still in
+     * @ref ttn_transmit_message() or not. If all buffers are in use, the message is dropped.
      *
      * @param callback  the callback function
      */
     void ttn_on_message(ttn_message_cb callback);
 
+    /**
+     * @brief Sets the function to be called when a message is received on the specified port
+     *
+     * Messages received on this port are passed to the specified function instead of the
+     * function set with @ref ttn_on_message(). The routing takes a single table lookup.
+     * The callback is called from the same dispatcher task and the same restrictions apply.
+     *
+     * Up to `CONFIG_TTN_MAX_PORT_HANDLERS` ports can have a callback at the same time.
+     *
+     * @param port       port number
+     * @param callback   the callback function, or `NULL` to remove the callback for this port
+     * @param user_data  value passed to the callback
+     * @return `true` if successful, `false` if the maximum number of port callbacks has been reached
+     */
+    bool ttn_on_port_message(ttn_port_t port, ttn_port_message_cb callback, void *user_data);
+
+    /**
+     * @brief Gets the statistics of the downlink message delivery
+     *
+     * The statistics reveal if messages are dropped because the callback is too slow to keep
+     * up with the received messages.
+     *
+     * @param stats  structure receiving the statistics
+     */
+    void ttn_get_downlink_stats(ttn_downlink_stats_t *stats);
+
+    /**
+     * @brief Gets the timeline of the startup phases from boot to the first uplink
+     *
+     * The timeline reveals where the time goes between waking up and sending the first message.
+     * Only the first occurrence of each phase is recorded.
+     *
+     * Requires `CONFIG_TTN_STARTUP_TRACE` to be enabled.
+     *
+     * @param report  structure receiving the timeline
+     * @return `true` if successful, `false` if startup tracing is disabled
+     */
+    bool ttn_get_startup_report(ttn_startup_report_t *report);
+
+    /**
+     * @brief Logs the timeline of the startup phases
+     *
+     * See @ref ttn_get_startup_report().
+     */
+    void ttn_log_startup_report(void);
+
     /**
      * @brief Checks if DevEUI, AppEUI/JoinEUI and AppKey have been stored in non-volatile storage
      * or have been provided by a call to @ref ttn_join_with_keys() or to @ref ttn_provision_transiently().
@@ -747,16 +1418,361 @@ extern "C"
      * ADR is enabled by default. It optimizes data rate, airtime and energy consumption
      * for devices with stable RF conditions. It should be turned off for mobile devices.
      *
+     * The setting is applied asynchronously by the LMIC task. The function returns without
+     * waiting for it, so @ref ttn_adr_enabled() might return the previous value for a short time.
+     *
      * @param enabled `true` to enable, `false` to disable
      */
     void ttn_set_adr_enabled(bool enabled);
 
+    /**
+     * @brief Sets the LoRaWAN device class.
+     *
+     * The default is Class A. In Class C, the radio listens on the RX2 frequency and data rate
+     * whenever it is not transmitting and not in the RX1 window. Downlinks are delivered
+     * without waiting for the next uplink. As the receiver is on almost all the time,
+     * Class C is suitable for mains-powered devices only.
+     *
+     * In Class B, the device synchronizes to the beacon broadcast by the gateways every 128 s
+     * and opens short receive windows (ping slots) at the periodicity set with
+     * @ref ttn_set_ping_slot_periodicity(). Downlinks are delivered with a bounded latency
+     * while the receiver is mostly off. Class B requires `CONFIG_TTN_CLASS_B`.
+     * The device sends an uplink requesting the network time and announcing the periodicity,
+     * and then listens for the next beacon only. If the beacon is not received within
+     * three beacon periods, or if the synchronization is lost later, the device falls back to Class A.
+     *
+     * The device must be registered as a Class B or Class C device on the network server.
+     * The device class is not saved; set it after each restart. Continuous reception
+     * starts as soon as the device has joined and the MAC is idle. Class B must be set
+     * after the device has joined.
+     *
+     * The device class is applied asynchronously by the LMIC task; the function returns
+     * without waiting for it.
+     *
+     * @param device_class device class
+     */
+    void ttn_set_device_class(ttn_device_class_t device_class);
+
+    /**
+     * @brief Sets the Class B ping slot periodicity.
+     *
+     * The device opens a ping slot every 0.96 × 2^periodicity seconds (0.96 s to 122.88 s).
+     * Smaller values reduce the downlink latency and increase the energy consumption.
+     * The default is 7 (one ping slot per beacon period).
+     *
+     * The periodicity takes effect with the next call of @ref ttn_set_device_class().
+     *
+     * @param periodicity periodicity (0 to 7)
+     */
+    void ttn_set_ping_slot_periodicity(int periodicity);
+
+    /**
+     * @brief Sets up a multicast session.
+     *
+     * Multicast downlinks are received while the device is in Class C (see @ref ttn_set_device_class())
+     * and in the ping slots set up with @ref ttn_set_multicast_ping_slots() while it is in Class B.
+     * They are delivered to the message callbacks like unicast downlinks; use a dedicated port
+     * to tell them apart. They do not affect the unicast session.
+     *
+     * The number of sessions is configured with `CONFIG_TTN_MULTICAST_SESSIONS`.
+     * Multicast sessions are not saved; set them up after each restart.
+     * Setting up a session again disables its ping slots.
+     *
+     * @param index session index (0 to `CONFIG_TTN_MULTICAST_SESSIONS` - 1)
+     * @param session session address, keys and frame counter range
+     * @return `true` if successful, `false` if the index is invalid
+     */
+    bool ttn_set_multicast_session(int index, const ttn_multicast_session_t *session);
+
+    /**
+     * @brief Opens Class B ping slots for a multicast session.
+     *
+     * The ping slots are opened in addition to the device's own ping slots
+     * while the device is in Class B. They start with the next beacon.
+     *
+     * @param index session index
+     * @param periodicity ping slot periodicity (0 to 7, see @ref ttn_set_ping_slot_periodicity())
+     * @param frequency ping slot frequency (in Hz), or 0 for the default frequency of the region
+     * @param data_rate ping slot data rate
+     * @return `true` if successful, `false` if the session isn't set up, the data rate is invalid or Class B is disabled
+     */
+    bool ttn_set_multicast_ping_slots(int index, int periodicity, uint32_t frequency, ttn_data_rate_t data_rate);
+
+    /**
+     * @brief Removes a multicast session.
+     *
+     * @param index session index
+     */
+    void ttn_clear_multicast_session(int index);
+
+    /**
+     * @brief Gets the next expected frame counter of a multicast session.
+     *
+     * @param index session index
+     * @return frame counter, or 0 if the index is invalid
+     */
+    uint32_t ttn_get_multicast_fcnt(int index);
+
+    /**
+     * @brief Starts receiving data blocks with the fragmented data block transport (LoRaWAN TS004).
+     *
+     * The application server sets up a session and sends the data block (e.g. a firmware update)
+     * as a series of fragments on port 201, usually to a multicast group (see @ref ttn_set_multicast_session()).
+     * Lost fragments are recovered from the coded (redundant) fragments sent after the data block.
+     *
+     * The fragments are written to the specified data partition. It must be large enough for
+     * the data block plus a scratch area of one fragment per lost fragment (up to
+     * `CONFIG_TTN_FRAG_MAX_LOST` fragments). The partition is erased when a session is set up.
+     * Once the data block is complete, it is found at the start of the partition and the callback
+     * is called from the dispatcher task.
+     *
+     * The answers to the application server are sent as unconfirmed uplinks on port 201
+     * from a separate task. If the application is transmitting at the same time, they are retried.
+     *
+     * Requires `CONFIG_TTN_FRAG_TRANSPORT` to be enabled.
+     *
+     * @param partition_label  label of the data partition
+     * @param callback   function called when a data block has been completely received
+     * @param user_data  value passed to the callback
+     * @return `true` if successful, `false` if the partition doesn't exist or port 201 can't be registered
+     */
+    bool ttn_start_frag_transport(const char *partition_label, ttn_frag_complete_cb callback, void *user_data);
+
+    /**
+     * @brief Stops receiving data blocks and discards the current session.
+     */
+    void ttn_stop_frag_transport(void);
+
+    /**
+     * @brief Gets the status of the fragmented data block transport session.
+     *
+     * @param status  structure receiving the status
+     * @return `true` if a session is active, `false` otherwise
+     */
+    bool ttn_get_frag_status(ttn_frag_status_t *status);
+
+    /**
+     * @brief Sends uplinks in a time slot derived from the network time and the DevEUI.
+     *
+     * The reporting period is aligned to the GPS epoch and divided into `num_slots` slots.
+     * The device uses the slot selected by a hash of its DevEUI, so a fleet of devices
+     * reporting with the same period spreads its uplinks instead of colliding.
+     * Each uplink starts precisely at the next slot start of the device (plus a random jitter).
+     * If the duty cycle doesn't allow it, it's moved to a later period.
+     *
+     * The network time is requested with a DeviceTimeReq piggybacked on an uplink whenever
+     * the GPS clock (see @ref ttn_get_gps_time()) is older than `sync_interval`. Until the
+     * first answer has been received, uplinks are sent immediately.
+     *
+     * @ref ttn_transmit_message() blocks until the uplink has been sent, i.e. up to one period.
+     * Joins are not affected.
+     *
+     * Requires `CONFIG_TTN_SLOTTED_TX` to be enabled.
+     *
+     * @param config  slot configuration, or `NULL` to send uplinks immediately again
+     * @return `true` if successful, `false` if the configuration is invalid or the feature is disabled
+     */
+    bool ttn_set_slotted_tx(const ttn_slotted_tx_config_t *config);
+
+    /**
+     * @brief Requests the network time.
+     *
+     * A DeviceTimeReq MAC command is sent with the next uplink. The answer synchronizes the
+     * GPS clock (see @ref ttn_get_gps_time()). The function doesn't trigger an uplink.
+     *
+     * Request the time regularly (e.g. every few hours) to keep the clock accurate.
+     * The drift of the local clock is estimated from answers that are at least 10 minutes apart.
+     */
+    void ttn_request_time(void);
+
+    /**
+     * @brief Gets the current GPS time.
+     *
+     * The GPS time is derived from the last network time answer, the time elapsed since
+     * then and the estimated drift of the local clock. Answers to requests from
+     * @ref ttn_request_time(), Class B and slotted uplinks are all used.
+     *
+     * The clock continues across deep sleep (see @ref ttn_prepare_for_deep_sleep()).
+     * Its accuracy during deep sleep depends on the RTC clock source. After power off,
+     * the time must be requested again.
+     *
+     * @param gps_time  structure receiving the GPS time
+     * @return `true` if successful, `false` if no network time has been received yet
+     */
+    bool ttn_get_gps_time(ttn_gps_time_t *gps_time);
+
+    /**
+     * @brief Gets the calibration of the clock error.
+     *
+     * The RX windows are opened early and kept open longer to allow for the error of the local
+     * clock. Instead of the maximum error (0.4%), the error measured from the timing of the
+     * received downlinks (RX1 and RX2) is used. This reduces the time the radio is in RX mode,
+     * in particular for the longer RX delays of TTN (5 s).
+     *
+     * Until two downlinks have been received, and after two confirmed uplinks in a row haven't
+     * been acknowledged, the maximum error is used. The calibration is kept across deep sleep.
+     *
+     * Requires `CONFIG_TTN_CLOCK_CALIBRATION` to be enabled.
+     *
+     * @param calibration  structure receiving the calibration
+     * @return `true` if successful, `false` if the feature is disabled
+     */
+    bool ttn_get_clock_calibration(ttn_clock_calibration_t *calibration);
+
+    /**
+     * @brief Sets the supply currents used to calculate the energy of the radio.
+     *
+     * The default model uses the figures of the SX1276 datasheet at 3.3 V (sleep 0.2 µA,
+     * standby 1.6 mA, synthesis 5.8 mA, RX 10.8 mA, TX 20 mA at 7 dBm to 120 mA at 20 dBm).
+     * For accurate results, measure the currents of the actual board.
+     *
+     * Requires `CONFIG_TTN_ENERGY_ACCOUNTING` to be enabled.
+     *
+     * @param model  supply currents, or `NULL` for the default model
+     * @return `true` if successful, `false` if the model is invalid or the feature is disabled
+     */
+    bool ttn_set_energy_model(const ttn_energy_model_t *model);
+
+    /**
+     * @brief Gets the time the radio has spent in each state and the resulting energy.
+     *
+     * The time is measured by the radio driver on each change of the operating mode.
+     * The charge and energy are calculated with the model set with @ref ttn_set_energy_model().
+     * The report covers the time since the first start or the last reset, including deep sleep
+     * (the radio is assumed to sleep). It also contains the energy of the last uplink, including
+     * its RX windows.
+     *
+     * Requires `CONFIG_TTN_ENERGY_ACCOUNTING` to be enabled.
+     *
+     * @param report  structure receiving the report
+     * @return `true` if successful, `false` if the feature is disabled
+     */
+    bool ttn_get_energy_report(ttn_energy_report_t *report);
+
+    /**
+     * @brief Resets the totals of the energy report.
+     */
+    void ttn_reset_energy_report(void);
+
+    /**
+     * @brief Starts iterating over the link telemetry records.
+     *
+     * A record is kept for each of the last `CONFIG_TTN_TELEMETRY_RECORDS` uplinks, including
+     * across deep sleep. The iteration covers the records existing when it starts. The LMIC
+     * task keeps adding records; records it overwrites during the iteration are skipped.
+     *
+     * Requires `CONFIG_TTN_TELEMETRY_RECORDS` to be greater than 0.
+     *
+     * @param iterator  iterator to initialize
+     * @param from_id   ID of the first record (older records are skipped; 0 for all records)
+     * @return `true` if successful, `false` if the feature is disabled
+     */
+    bool ttn_begin_telemetry(ttn_telemetry_iterator_t *iterator, uint32_t from_id);
+
+    /**
+     * @brief Gets the next link telemetry record (oldest first).
+     *
+     * @param iterator  iterator
+     * @return the record (a copy in the iterator, valid until the next call), or `NULL` if there are no more records
+     */
+    const ttn_telemetry_record_t *ttn_next_telemetry(ttn_telemetry_iterator_t *iterator);
+
+    /**
+     * @brief Ends iterating over the link telemetry records.
+     *
+     * @param iterator  iterator
+     */
+    void ttn_end_telemetry(ttn_telemetry_iterator_t *iterator);
+
+    /**
+     * @brief Writes the link telemetry records in a compact binary format (for upload).
+     *
+     * As many records as fit into the buffer are written (oldest first). Records are encoded
+     * as varints and deltas and typically take 15 to 20 bytes. See `ttn_telemetry.h` for the format.
+     *
+     * Requires `CONFIG_TTN_TELEMETRY_RECORDS` to be greater than 0.
+     *
+     * @param from_id  ID of the first record (0 for all records)
+     * @param buf      buffer receiving the records
+     * @param size     size of the buffer (in bytes)
+     * @param end_id   receives the ID of the record following the last written one (to continue with); can be `NULL`
+     * @return the number of bytes written, or 0 if the feature is disabled
+     */
+    size_t ttn_dump_telemetry(uint32_t from_id, uint8_t *buf, size_t size, uint32_t *end_id);
+
+    /**
+     * @brief Outputs the LMIC event log as formatted text via the ESP-IDF logging (default).
+     *
+     * Requires the macro `LMIC_ENABLE_event_logging` to be set to 1. Call it after
+     * @ref ttn_configure_pins().
+     *
+     * @return `true` if successful, `false` if event logging is disabled
+     */
+    bool ttn_log_to_console(void);
+
+    /**
+     * @brief Streams the LMIC event log as a compact binary trace to a UART.
+     *
+     * The UART driver must have been installed. The trace is decoded on the host with
+     * `tools/trace_decoder`, which reconstructs the event timeline and can export it in the
+     * Chrome/Perfetto trace format. See `ttn_logging.h` for the format.
+     *
+     * Requires the macro `LMIC_ENABLE_event_logging` to be set to 1. Call it after
+     * @ref ttn_configure_pins().
+     *
+     * @param uart_num  UART port
+     * @return `true` if successful, `false` if event logging is disabled
+     */
+    bool ttn_log_to_uart(uart_port_t uart_num);
+
+    /**
+     * @brief Streams the LMIC event log as a compact binary trace to a file.
+     *
+     * The file is flushed whenever the logging task is idle. It must remain open until
+     * the log has been switched to another output.
+     *
+     * See @ref ttn_log_to_uart().
+     *
+     * @param file  file opened for writing in binary mode
+     * @return `true` if successful, `false` if event logging is disabled
+     */
+    bool ttn_log_to_file(FILE *file);
+
+    /**
+     * @brief Streams the LMIC event log as a compact binary trace to a flash partition.
+     *
+     * The trace is written from the start of the partition, erasing the sectors as they are
+     * reached. Once the partition is full, further records are dropped.
+     *
+     * See @ref ttn_log_to_uart().
+     *
+     * @param label  label of the data partition
+     * @return `true` if successful, `false` if the partition was not found or event logging is disabled
+     */
+    bool ttn_log_to_partition(const char *label);
+
+    /**
+     * @brief Gets the statistics of the LMIC event logging.
+     *
+     * The cycles are measured in the tasks recording the events (mostly the LMIC task) and
+     * show the cost of the logging on the timing-critical paths.
+     *
+     * Requires the macro `LMIC_ENABLE_event_logging` to be set to 1.
+     *
+     * @param stats  structure receiving the statistics
+     * @return `true` if successful, `false` if event logging is disabled
+     */
+    bool ttn_get_log_stats(ttn_log_stats_t *stats);
+
     /**
      * @brief Sets the transmission data rate (i.e. the data rate for uplink messages).
      *
      * If ADR is enabled, it's is used as the initial data rate and later adjusted depending
      * on the RF conditions. If ADR is disabled, it is used for all uplink messages.
      *
+     * After the device has joined, the data rate is applied asynchronously by the LMIC task;
+     * the function returns without waiting for it.
+     *
      * @param data_rate data rate (use constants of enum @ref ttn_data_rate_t)
      */
     void ttn_set_data_rate(ttn_data_rate_t data_rate);
@@ -768,10 +1784,49 @@ extern "C"
      * If the antenna has a gain, it must be substracted from the specified value to
      * achieve the correct transmission power.
      *
+     * After the device has joined, the power is applied asynchronously by the LMIC task;
+     * the function returns without waiting for it.
+     *
      * @param tx_pow power, in dBm
      */
     void ttn_set_max_tx_pow(int tx_pow);
 
+    /**
+     * @brief Sets the policy of the on-device data rate advisor.
+     *
+     * The advisor tracks the link quality per data rate and recommends the fastest data rate
+     * with an acceptable loss rate. It's mainly intended for devices with ADR disabled
+     * (e.g. mobile devices). The default policy has the advisor turned off.
+     *
+     * Requires `CONFIG_TTN_DR_ADVISOR` to be enabled.
+     *
+     * @param policy  policy
+     */
+    void ttn_set_dr_advisor_policy(const ttn_dr_advisor_policy_t *policy);
+
+    /**
+     * @brief Gets the current policy of the data rate advisor.
+     *
+     * @param policy  structure receiving the policy
+     */
+    void ttn_get_dr_advisor_policy(ttn_dr_advisor_policy_t *policy);
+
+    /**
+     * @brief Gets the data rate recommended by the data rate advisor.
+     *
+     * @return recommended data rate, or @ref TTN_DR_JOIN_DEFAULT if there is no recommendation yet
+     */
+    ttn_data_rate_t ttn_get_recommended_data_rate(void);
+
+    /**
+     * @brief Gets the link quality statistics of the specified data rate.
+     *
+     * @param data_rate  data rate
+     * @param stats  structure receiving the statistics
+     * @return `true` if successful, `false` if the data rate isn't tracked or the advisor is disabled
+     */
+    bool ttn_get_dr_stats(ttn_data_rate_t data_rate, ttn_dr_stats_t *stats);
+
     /**
      * @brief Gets current RX/TX window
      * @return window
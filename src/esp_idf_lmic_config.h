@@ -65,6 +65,18 @@
 
 #define LMIC_ENABLE_onEvent 0
 
+#if !defined(CONFIG_TTN_CLASS_B)
 #define DISABLE_PING
 
 #define DISABLE_BEACONS
+#endif
+
+#if defined(CONFIG_TTN_MULTICAST_SESSIONS)
+#define LMIC_MAX_MC_SESSIONS CONFIG_TTN_MULTICAST_SESSIONS
+#endif
+
+#if defined(CONFIG_TTN_ZERO_COPY_TX)
+// uplink payloads are gathered from the application buffers;
+// the staging buffer only holds port 0 MAC answers
+#define LMIC_PENDTXDATA_SIZE 64
+#endif
@@ -12,6 +12,7 @@
 
 #include "hal_esp32.h"
 #include "../lmic/lmic.h"
+#include "../ttn_startup_trace.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
@@ -31,6 +32,14 @@
 #define NOTIFY_BIT_WAKEUP 4
 #define NOTIFY_BIT_STOP 8
 
+// hal_waitUntil() can busy-wait for the last part as the wake-up through
+// the esp_timer task has a jitter of up to a few 100 µs
+#if defined(CONFIG_TTN_PRECISE_WAIT_US)
+#define WAIT_SPIN_US CONFIG_TTN_PRECISE_WAIT_US
+#else
+#define WAIT_SPIN_US 0
+#endif
+
 
 #define TAG "ttn_hal"
 
@@ -74,12 +83,15 @@ static uint8_t dio_num;
 static spi_device_handle_t spi_handle;
 static spi_transaction_t spi_transaction;
 static SemaphoreHandle_t mutex;
+static SemaphoreHandle_t task_stopped;
 static esp_timer_handle_t timer;
 static int64_t time_offset;
 static int32_t initial_time_offset;
 static int64_t next_alarm;
 static volatile bool run_background_task;
 static volatile wait_kind_e current_wait_kind;
+static hal_esp32_command_handler_t command_handler;
+static hal_esp32_sleep_handler_t sleep_handler;
 
 
 // -----------------------------------------------------------------------------
@@ -128,16 +140,16 @@ void init_io(void)
     if (pin_rx_tx != LMIC_UNUSED_PIN)
         output_pin_config.pin_bit_mask |= BIT64(pin_rx_tx);
 
-    if (pin_rst != LMIC_UNUSED_PIN)
-        output_pin_config.pin_bit_mask |= BIT64(pin_rst);
-
     gpio_config(&output_pin_config);
 
     gpio_set_level(pin_nss, 1);
     if (pin_rx_tx != LMIC_UNUSED_PIN)
         gpio_set_level(pin_rx_tx, 0);
-    if (pin_rst != LMIC_UNUSED_PIN)
-        gpio_set_level(pin_rst, 0);
+
+    // Release RST instead of asserting it so a radio kept configured
+    // during deep sleep survives for a warm start (see radio_init_warm()).
+    // radio_init() drives the pin itself when a full reset is needed.
+    hal_pin_rst(2);
 
     // DIO pins with interrupt handlers
     gpio_config_t input_pin_config = {
@@ -211,6 +223,8 @@ uint8_t hal_getTxPowerPolicy(u1_t inputPolicy, s1_t requestedPower, u4_t frequen
 
 void init_spi(void)
 {
+    TTN_STARTUP_BEGIN(TTN_STARTUP_SPI_INIT);
+
     // init device
     spi_device_interface_config_t spi_config = {
         .mode = 0,
@@ -226,6 +240,7 @@ void init_spi(void)
     esp_err_t ret = spi_bus_add_device(spi_host, &spi_config, &spi_handle);
     ESP_ERROR_CHECK(ret);
 
+    TTN_STARTUP_END(TTN_STARTUP_SPI_INIT);
     ESP_LOGI(TAG, "SPI initialized");
 }
 
@@ -321,9 +336,10 @@ void init_timer(void)
     esp_err_t err = esp_timer_create(&timer_config, &timer);
     ESP_ERROR_CHECK(err);
 
+    // continue the time from before deep sleep with µs resolution
     struct timeval now;
     gettimeofday(&now, NULL);
-    time_offset += (int64_t)now.tv_sec * 1000000;
+    time_offset += (int64_t)now.tv_sec * 1000000 + now.tv_usec - esp_timer_get_time();
     initial_time_offset = 0;
 
     ESP_LOGI(TAG, "Timer initialized");
@@ -342,6 +358,11 @@ void hal_esp32_set_time(uint32_t time_val)
     time_offset = (int64_t)time_val * 1000000;
 }
 
+int64_t hal_esp32_get_time_us(void)
+{
+    return get_current_time();
+}
+
 void set_next_alarm(int64_t time)
 {
     next_alarm = time;
@@ -376,6 +397,10 @@ bool wait(wait_kind_e wait_kind)
     TickType_t ticks_to_wait = wait_kind == WAIT_KIND_CHECK_IO ? 0 : portMAX_DELAY;
     while (true)
     {
+        // the stop notification might have been consumed by an earlier wait
+        if (wait_kind == WAIT_KIND_WAIT_FOR_ANY_EVENT && !run_background_task)
+            return false;
+
         current_wait_kind = wait_kind;
         uint32_t bits = ulTaskNotifyTake(pdTRUE, ticks_to_wait);
         current_wait_kind = WAIT_KIND_NONE;
@@ -449,9 +474,19 @@ u4_t hal_waitUntil(u4_t time)
 {
     int64_t esp_now = get_current_time();
     int64_t esp_time = os_time_to_esp_time(esp_now, time);
-    set_next_alarm(esp_time);
-    arm_timer(esp_now);
-    wait(WAIT_KIND_WAIT_FOR_TIMER);
+    if (esp_time - esp_now > WAIT_SPIN_US)
+    {
+        set_next_alarm(esp_time - WAIT_SPIN_US);
+        arm_timer(esp_now);
+        wait(WAIT_KIND_WAIT_FOR_TIMER);
+    }
+
+    // precise timing for RX windows (in particular Class B beacons and ping slots)
+    if (WAIT_SPIN_US > 0)
+    {
+        while (get_current_time() < esp_time)
+            ;
+    }
 
     u4_t os_now = hal_ticks();
     u4_t diff = os_now - time;
@@ -488,7 +523,20 @@ void hal_sleep(void)
     if (wait(WAIT_KIND_CHECK_IO))
         return;
 
-    arm_timer(get_current_time());
+    int64_t esp_now = get_current_time();
+    if (sleep_handler != NULL)
+    {
+        TickType_t duration = 0;
+        if (next_alarm != 0)
+        {
+            duration = pdMS_TO_TICKS((next_alarm - esp_now + 999) / 1000);
+            if (duration == 0)
+                duration = 1;
+        }
+        sleep_handler(duration);
+    }
+
+    arm_timer(esp_now);
     wait(WAIT_KIND_WAIT_FOR_ANY_EVENT);
 }
 
@@ -510,8 +558,21 @@ void hal_enableIRQs(void)
 
 void hal_processPendingIRQs(void)
 {
-    // nothing to do as interrupt handlers post message to queue
-    // and don't access any shared data structures
+    // interrupt handlers post message to queue and don't access any
+    // shared data structures; but commands from application tasks
+    // are executed here, between LMIC jobs
+    if (command_handler != NULL)
+        command_handler();
+}
+
+void hal_esp32_set_command_handler(hal_esp32_command_handler_t handler)
+{
+    command_handler = handler;
+}
+
+void hal_esp32_set_sleep_handler(hal_esp32_sleep_handler_t handler)
+{
+    sleep_handler = handler;
 }
 
 
@@ -521,6 +582,7 @@ void hal_processPendingIRQs(void)
 void hal_esp32_init_critical_section(void)
 {
     mutex = xSemaphoreCreateRecursiveMutex();
+    task_stopped = xSemaphoreCreateBinary();
 }
 
 void hal_esp32_enter_critical_section(void)
@@ -539,6 +601,7 @@ void lmic_background_task(void* pvParameter)
 {
     while (run_background_task)
         os_runloop_once();
+    xSemaphoreGive(task_stopped);
     vTaskDelete(NULL);
 }
 
@@ -555,6 +618,7 @@ void hal_init_ex(const void *pContext)
 void hal_esp32_start_lmic_task(void)
 {
     run_background_task = true;
+    xSemaphoreTake(task_stopped, 0); // not taken if the task stopped itself
     xTaskCreate(lmic_background_task, "ttn_lmic", 1024 * 4, NULL, CONFIG_TTN_BG_TASK_PRIO, &lmic_task);
 
     // enable interrupts
@@ -564,15 +628,25 @@ void hal_esp32_start_lmic_task(void)
 
 void hal_esp32_stop_lmic_task(void)
 {
+    bool is_lmic_task = hal_esp32_is_lmic_task();
     run_background_task = false;
     gpio_isr_handler_remove(pin_dio0);
     gpio_isr_handler_remove(pin_dio1);
     disarm_timer();
     set_next_alarm(0);
     xTaskNotify(lmic_task, NOTIFY_BIT_STOP, eSetBits);
+
+    // wait until the LMIC task has completed its current job
+    if (!is_lmic_task)
+        xSemaphoreTake(task_stopped, portMAX_DELAY);
     lmic_task = xTaskGetCurrentTaskHandle();
 }
 
+bool hal_esp32_is_lmic_task(void)
+{
+    return xTaskGetCurrentTaskHandle() == lmic_task;
+}
+
 
 // -----------------------------------------------------------------------------
 // Fatal failure
@@ -24,6 +24,13 @@ extern "C" {
 
 void hal_esp32_configure_pins(spi_host_device_t spi_host, uint8_t nss, uint8_t rxtx, uint8_t rst, uint8_t dio0, uint8_t dio1);
 void hal_esp32_start_lmic_task(void);
+/**
+ * Stops the LMIC task.
+ *
+ * Unless called by the LMIC task itself, the function returns once the
+ * LMIC task has completed its current job and exited. It must not be
+ * called while holding the critical section.
+ */
 void hal_esp32_stop_lmic_task(void);
 
 void hal_esp32_wake_up(void);
@@ -33,6 +40,31 @@ void hal_esp32_leave_critical_section(void);
 
 void hal_esp32_set_rssi_cal(int8_t rssi_cal);
 
+typedef void (*hal_esp32_command_handler_t)(void);
+
+/**
+ * Sets the function processing commands from application tasks.
+ * 
+ * The function is called by the LMIC task before each
+ * run of its job loop (and after a wake up).
+ * 
+ * @param handler command handler
+ */
+void hal_esp32_set_command_handler(hal_esp32_command_handler_t handler);
+
+typedef void (*hal_esp32_sleep_handler_t)(TickType_t duration);
+
+/**
+ * Sets the function to be notified when the LMIC task goes to sleep.
+ * 
+ * The function is called by the LMIC task when it has no job due
+ * and is about to wait for the next event.
+ * 
+ * @param handler sleep handler; it receives the time until the
+ *   next scheduled job (in FreeRTOS ticks), or 0 if no job is scheduled
+ */
+void hal_esp32_set_sleep_handler(hal_esp32_sleep_handler_t handler);
+
 TickType_t hal_esp32_get_timer_duration(void);
 
 /**
@@ -55,6 +87,26 @@ uint32_t hal_esp32_get_time(void);
  */
 void hal_esp32_set_time(uint32_t time_val);
 
+/**
+ * Gets the time of the LMIC clock.
+ * 
+ * It's the time base of hal_ticks() without the 32 bit wrap-around.
+ * It continues across deep sleep.
+ * 
+ * @return time (in µs)
+ */
+int64_t hal_esp32_get_time_us(void);
+
+/**
+ * Checks if the caller is the task running LMIC.
+ * 
+ * It's the LMIC background task, or the task that configured
+ * the pins or stopped the background task.
+ * 
+ * @return `true` if it is the LMIC task
+ */
+bool hal_esp32_is_lmic_task(void);
+
 
 #ifdef __cplusplus
 }
@@ -200,6 +200,26 @@
 #error "LMIC_MAX_FRAME_LENGTH cannot be larger than 255"
 #endif
 
+// LMIC_PENDTXDATA_SIZE
+// Size of the uplink staging buffer LMIC.pendTxData. Applications that send
+// all payloads with LMIC_setTxDataSegments() can shrink it; it must still be
+// large enough for port 0 MAC answers. LMIC_setTxData2() (and the functions
+// based on it, e.g. the compliance uplinks) rejects larger payloads with
+// LMIC_ERROR_TX_TOO_LARGE; LMIC_setTxData() completes them with TXRX_LENERR.
+#if !defined(LMIC_PENDTXDATA_SIZE)
+# define LMIC_PENDTXDATA_SIZE MAX_LEN_PAYLOAD
+#endif
+
+// LMIC_MAX_MC_SESSIONS
+// Number of multicast sessions (see LMIC_setMulticastSession()). Multicast
+// frames are only received in Class B ping slots and in Class C continuous
+// reception. 0 disables multicast.
+#if !defined(LMIC_MAX_MC_SESSIONS)
+# define LMIC_MAX_MC_SESSIONS 0
+#elif LMIC_MAX_MC_SESSIONS > 8
+#error "LMIC_MAX_MC_SESSIONS cannot be larger than 8"
+#endif
+
 // LMIC_ENABLE_event_logging
 // LMIC debugging for certification tests requires this, because debug prints affect
 // timing too dramatically. But normal operation doesn't need this.
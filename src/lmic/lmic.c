@@ -44,6 +44,8 @@ static void reportEventAndUpdate(ev_t);
 static void engineUpdate(void);
 static bit_t processJoinAccept_badframe(void);
 static bit_t processJoinAccept_nojoinframe(void);
+static void startClassCRx(void);
+static void stopClassCRx(void);
 
 
 #if !defined(DISABLE_BEACONS)
@@ -205,6 +207,61 @@ static void aes_cipher (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xre
 }
 
 
+#if !defined(USE_ORIGINAL_AES)
+void lmic_aes_encrypt(u1_t *data, u1_t *key);
+#endif
+
+// ttn-esp32: compute the key stream for the FRMPayload of the next new uplink
+// ahead of time, in the task submitting the data. The session and the frame
+// counter are read without synchronization with the LMIC task; buildDataFrame()
+// verifies them before the key stream is used. lmic_aes_encrypt() only uses
+// its arguments (and the hardware AES unit has its own lock).
+void LMIC_prepareTxKeystream (lmic_tx_keystream_t *pKeystream, u1_t port, u1_t dlen) {
+    pKeystream->nStream = 0;
+#if !defined(USE_ORIGINAL_AES)
+    pKeystream->devaddr = LMIC.devaddr;
+    if( pKeystream->devaddr == 0 || dlen > MAX_LEN_PAYLOAD )
+        return;
+    // frame counter the next new uplink will be sent with
+    pKeystream->seqno = LMIC.seqnoUp;
+    os_copyMem(pKeystream->key, port==0 ? LMIC.nwkKey : LMIC.artKey, 16);
+
+    u1_t block[16];
+    for (uint i = 0; i < dlen; i += 16) {
+        os_clearMem(block, 16);
+        block[0] = 1; // mode=cipher / dir=up
+        os_wlsbf4(block+ 6, pKeystream->devaddr);
+        os_wlsbf4(block+10, pKeystream->seqno);
+        block[15] = 1 + i / 16; // block counter
+        lmic_aes_encrypt(block, pKeystream->key);
+        os_copyMem(pKeystream->stream+i, block, dlen-i < 16 ? dlen-i : 16);
+    }
+    os_clearMem(block, 16);
+    pKeystream->nStream = dlen;
+#else
+    LMIC_API_PARAMETER(port);
+    LMIC_API_PARAMETER(dlen);
+#endif
+}
+
+// ttn-esp32: encrypt the payload with the key stream of the pending data,
+// provided it was computed for the current session, key and frame counter
+static bit_t applyTxKeystream (xref2u1_t payload, u1_t dlen) {
+    const lmic_tx_keystream_t *pKeystream = LMIC.pendTxKeystream;
+    if( pKeystream == NULL || pKeystream->nStream < dlen ||
+        pKeystream->devaddr != LMIC.devaddr || pKeystream->seqno != LMIC.seqnoUp-1 )
+        return 0;
+    xref2cu1_t key = LMIC.pendTxPort==0 ? LMIC.nwkKey : LMIC.artKey;
+    for (u1_t i = 0; i < 16; ++i) {
+        if( pKeystream->key[i] != key[i] )
+            return 0;
+    }
+    for (u1_t i = 0; i < dlen; ++i)
+        payload[i] ^= pKeystream->stream[i];
+    return 1;
+}
+
+
 static void aes_sessKeys (u2_t devnonce, xref2cu1_t artnonce, xref2u1_t nwkkey, xref2u1_t artkey) {
     os_clearMem(nwkkey, 16);
     nwkkey[0] = 0x01;
@@ -250,7 +307,8 @@ ostime_t calcAirTime (rps_t rps, u1_t plen) {
             * (s4_t)OSTICKS_PER_SEC / /*kbit/s*/50000;
     }
     u1_t sfx = 4*(sf+(7-SF7));
-    u1_t q = sfx - (sf >= SF11 ? 8 : 0);
+    // ttn-esp32: low data rate optimization for symbols of 16 ms or more (as set by the radio)
+    u1_t q = sfx - (((sf >= SF11 && bw == BW125) || (sf == SF12 && bw == BW250)) ? 8 : 0);
     int tmp = 8*plen - sfx + 28 + (getNocrc(rps)?0:16) - (getIh(rps)?20:0);
     if( tmp > 0 ) {
         tmp = (tmp + q - 1) / q;
@@ -316,11 +374,16 @@ static ostime_t calcRxWindow (u1_t secs, dr_t dr) {
         rxoff = (LMIC.drift * (ostime_t)secs) >> BCN_INTV_exp;
         err = (LMIC.lastDriftDiff * (ostime_t)secs) >> BCN_INTV_exp;
     }
-    rxsyms_t rxsyms = LMICbandplan_MINRX_SYMS_LoRa_ClassB;
+    // ttn-esp32: until the drift has been measured, assume the max clock error
+    if( (LMIC.bcninfo.flags & BCN_NODRIFT) != 0 ) {
+        ostime_t maxDrift = ms2osticksCeil(BCN_MAX_DRIFT_ms);
+        err += ((maxDrift * (secs == 0 ? BCN_INTV_sec : secs)) >> BCN_INTV_exp) + maxDrift * LMIC.missedBcns;
+    }
     err += (ostime_t)LMIC.maxDriftDiff * LMIC.missedBcns;
     setRxsyms(LMICbandplan_MINRX_SYMS_LoRa_ClassB + (err / dr2hsym(dr)));
 
-    return (rxsyms-LMICbandplan_PAMBL_SYMS) * dr2hsym(dr) + rxoff;
+    // ttn-esp32: open the window earlier by the error, too (was only extended at the end)
+    return (LMIC.rxsyms-LMICbandplan_PAMBL_SYMS) * dr2hsym(dr) + rxoff;
 }
 
 
@@ -331,6 +394,7 @@ static void calcBcnRxWindowFromMillis (u1_t ms, bit_t ini) {
         LMIC.maxDriftDiff = 0;
         LMIC.missedBcns = 0;
         LMIC.bcninfo.flags |= BCN_NODRIFT|BCN_NODDIFF;
+        LMIC.bcnAcquireMs = ms; // ttn-esp32: window used until the first beacon is received
     }
     ostime_t hsym = dr2hsym(DR_BCN);
     LMIC.bcnRxsyms = LMICbandplan_MINRX_SYMS_LoRa_ClassB + ms2osticksCeil(ms) / hsym;
@@ -340,12 +404,18 @@ static void calcBcnRxWindowFromMillis (u1_t ms, bit_t ini) {
 
 
 #if !defined(DISABLE_PING)
+// ttn-esp32: seconds from the last beacon to a slot (rounded up) for the clock
+// drift; was estimated as 2+slot+intv, overestimating by up to 128 seconds
+static u1_t slotSecs (ostime_t slottime) {
+    return (u1_t)((osticks2ms(slottime - LMIC.bcninfo.txtime) + 999) / 1000);
+}
+
 // Setup scheduled RX window (ping/multicast slot)
-static void rxschedInit (xref2rxsched_t rxsched) {
+static void rxschedInit (xref2rxsched_t rxsched, devaddr_t addr) {
     os_clearMem(AESkey,16);
     os_clearMem(LMIC.frame+8,8);
     os_wlsbf4(LMIC.frame, LMIC.bcninfo.time);
-    os_wlsbf4(LMIC.frame+4, LMIC.devaddr);
+    os_wlsbf4(LMIC.frame+4, addr);
     os_aes(AES_ENC,LMIC.frame,16);
     u1_t intvExp = rxsched->intvExp;
     ostime_t off = os_rlsbf2(LMIC.frame) & (0x0FFF >> (7 - intvExp)); // random offset (slot units)
@@ -353,7 +423,7 @@ static void rxschedInit (xref2rxsched_t rxsched) {
                        BCN_RESERVE_osticks +
                        ms2osticks(BCN_SLOT_SPAN_ms * off)); // random offset osticks
     rxsched->slot   = 0;
-    rxsched->rxtime = rxsched->rxbase - calcRxWindow(/*secs BCN_RESERVE*/2+(1<<intvExp),rxsched->dr);
+    rxsched->rxtime = rxsched->rxbase - calcRxWindow(slotSecs(rxsched->rxbase),rxsched->dr);
     rxsched->rxsyms = LMIC.rxsyms;
 }
 
@@ -368,12 +438,48 @@ static bit_t rxschedNext (xref2rxsched_t rxsched, ostime_t cando) {
     u1_t intv = 1<<rxsched->intvExp;
     if( (rxsched->slot = (slot += (intv))) >= 128 )
         return 0;
-    rxsched->rxtime = rxsched->rxbase
-        + ((BCN_WINDOW_osticks * (ostime_t)slot) >> BCN_INTV_exp)
-        - calcRxWindow(/*secs BCN_RESERVE*/2+slot+intv,rxsched->dr);
+    ostime_t slottime = rxsched->rxbase + ((BCN_WINDOW_osticks * (ostime_t)slot) >> BCN_INTV_exp);
+    rxsched->rxtime = slottime - calcRxWindow(slotSecs(slottime),rxsched->dr);
     rxsched->rxsyms = LMIC.rxsyms;
     goto again;
 }
+
+// ttn-esp32: setup the ping slots of the device and of the Class B multicast sessions
+static void rxschedInitAll (void) {
+    rxschedInit(&LMIC.ping, LMIC.devaddr);
+#if LMIC_MAX_MC_SESSIONS > 0
+    for( u1_t idx = 0; idx < LMIC_MAX_MC_SESSIONS; idx++ ) {
+        if( (LMIC.client.mcClassB & (1 << idx)) == 0 )
+            continue;
+        xref2rxsched_t rxsched = &LMIC.mcPing[idx];
+        rxsched->intvExp = LMIC.client.mcSessions[idx].pingIntvExp;
+        rxsched->dr      = LMIC.client.mcSessions[idx].pingDr;
+        rxsched->freq    = LMIC.client.mcSessions[idx].pingFreq;
+        rxschedInit(rxsched, LMIC.client.mcAddr[idx]);
+    }
+#endif
+}
+
+// ttn-esp32: earliest ping slot of all schedules, NULL if none is left in this beacon period
+static xref2rxsched_t rxschedNextAll (ostime_t cando, devaddr_t *addr) {
+    xref2rxsched_t next = NULL;
+    if( rxschedNext(&LMIC.ping, cando) ) {
+        next = &LMIC.ping;
+        *addr = LMIC.devaddr;
+    }
+#if LMIC_MAX_MC_SESSIONS > 0
+    for( u1_t idx = 0; idx < LMIC_MAX_MC_SESSIONS; idx++ ) {
+        xref2rxsched_t rxsched = &LMIC.mcPing[idx];
+        if( (LMIC.client.mcClassB & (1 << idx)) == 0 || ! rxschedNext(rxsched, cando) )
+            continue;
+        if( next == NULL || rxsched->rxtime - next->rxtime < 0 ) {
+            next = rxsched;
+            *addr = LMIC.client.mcAddr[idx];
+        }
+    }
+#endif
+    return next;
+}
 #endif // !DISABLE_PING)
 
 
@@ -454,6 +560,41 @@ void LMIC_setPingable (u1_t intvExp) {
         LMIC_enableTracking(0);
 }
 
+// ttn-esp32: Switch to Class B. The periodicity is sent to the network server
+// and the network time is requested so the first beacon can be received
+// without scanning for up to 128s. Tracking starts after the uplink.
+void LMIC_startClassB (u1_t intvExp) {
+    LMIC.ping.intvExp = (intvExp & 0x7);
+    LMIC.opmode = (LMIC.opmode | OP_PINGABLE) & ~OP_PINGINI;
+    LMIC.txPingSlotInfoReq = 1;
+    if( LMIC.devaddr == 0 || (LMIC.opmode & OP_SHUTDOWN) != 0 )
+        return;
+    if( (LMIC.opmode & (OP_TRACK|OP_SCAN)) != 0 ) {
+        engineUpdate();
+        return;
+    }
+#if LMIC_ENABLE_DeviceTimeReq
+    if (LMIC.txDeviceTimeReqState == lmic_RequestTimeState_idle)
+        LMIC.txDeviceTimeReqState = lmic_RequestTimeState_tx;
+    LMIC.opmode |= OP_POLL;
+    engineUpdate();
+#else
+    startScan();
+#endif // LMIC_ENABLE_DeviceTimeReq
+}
+
+// ttn-esp32: Return to Class A.
+void LMIC_stopClassB (void) {
+    LMIC.txPingSlotInfoReq = 0;
+    if( (LMIC.opmode & (OP_SCAN|OP_TRACK)) != 0 && (LMIC.opmode & OP_TXRXPEND) == 0 ) {
+        // cancel pending beacon or ping slot reception
+        os_radio(RADIO_RST);
+        os_clearCallback(&LMIC.osjob);
+    }
+    LMIC_stopPingable();
+    LMIC_disableTracking();
+}
+
 #endif // !DISABLE_PING
 
 static void runEngineUpdate (xref2osjob_t osjob) {
@@ -633,10 +774,7 @@ static lmic_beacon_error_t decodeBeacon (void) {
     if(! LMICbandplan_isValidBeacon1(d))
         return LMIC_BEACON_ERROR_INVALID;   // first (common) part fails CRC check
     // First set of fields is ok
-    u4_t bcnnetid = os_rlsbf4(&d[OFF_BCN_NETID]) & 0xFFFFFF;
-    if( bcnnetid != LMIC.netid )
-        return LMIC_BEACON_ERROR_WRONG_NETWORK;  // not the beacon we're looking for
-
+    // ttn-esp32: LoRaWAN 1.0.3 beacons no longer carry the NetID
     LMIC.bcninfo.flags &= ~(BCN_PARTIAL|BCN_FULL);
     // Match - update bcninfo structure
     LMIC.bcninfo.snr    = LMIC.snr;
@@ -645,8 +783,8 @@ static lmic_beacon_error_t decodeBeacon (void) {
     LMIC.bcninfo.time   = os_rlsbf4(&d[OFF_BCN_TIME]);
     LMIC.bcninfo.flags |= BCN_PARTIAL;
 
-    // Check 2nd set
-    if( os_rlsbf2(&d[OFF_BCN_CRC2]) != os_crc16(d,OFF_BCN_CRC2) )
+    // Check 2nd set (ttn-esp32: CRC covers the gateway specific part only)
+    if( os_rlsbf2(&d[OFF_BCN_CRC2]) != os_crc16(&d[OFF_BCN_INFO], OFF_BCN_CRC2-OFF_BCN_INFO) )
         return LMIC_BEACON_ERROR_SUCCESS_PARTIAL;
     // Second set of fields is ok
     LMIC.bcninfo.lat    = (s4_t)os_rlsbf4(&d[OFF_BCN_LAT-1]) >> 8; // read as signed 24-bit
@@ -918,9 +1056,9 @@ scan_mac_cmds(
 
         switch( cmd ) {
         case MCMD_LinkCheckAns: {
-            // TODO(tmm@mcci.com) capture these, reliably..
-            //int gwmargin = opts[oidx+1];
-            //int ngws = opts[oidx+2];
+            // ttn-esp32: capture margin and gateway count
+            LMIC.gwMargin = opts[oidx+1];
+            LMIC.gwCount = opts[oidx+2];
             break;
         }
         // from 1.0.3 spec section 5.2:
@@ -1083,6 +1221,14 @@ scan_mac_cmds(
         }
 #endif // !DISABLE_MCMD_PingSlotChannelReq && !DISABLE_PING
 
+#if !defined(DISABLE_PING)
+        // ttn-esp32: the network server has accepted the ping slot periodicity
+        case MCMD_PingSlotInfoAns: {
+            LMIC.txPingSlotInfoReq = 0;
+            break;
+        }
+#endif // !DISABLE_PING
+
 #if defined(ENABLE_MCMD_BeaconTimingAns) && !defined(DISABLE_BEACONS)
         case MCMD_BeaconTimingAns: {
             // Ignore if tracking already enabled or bcninfoTries == 0
@@ -1438,6 +1584,7 @@ static void radioRx (void) {
 
 // start RX in window 2.
 static void setupRx2 (void) {
+    stopClassCRx(); // ttn-esp32
     initTxrxFlags(__func__, TXRX_DNW2);
     LMIC.rps = dndr2rps(LMIC.dn2Dr);
     LMIC.freq = LMIC.dn2Freq;
@@ -1525,12 +1672,16 @@ static void schedRx12 (ostime_t delay, osjobcb_t func, u1_t dr) {
     //
     // This also sets LMIC.rxsyms. This is NOT normally used for FSK; see LMICbandplan_txDoneFSK()
     LMIC.rxtime = LMIC.txend + LMICcore_adjustForDrift(delay, hsym, LMICbandplan_MINRX_SYMS_LoRa_ClassA);
+    // ttn-esp32: the window is nominally at txend + delay (for the clock error calibration)
+    LMIC.radio.rxwin_nominal = LMIC.txend + delay;
+    LMIC.radio.rxwin_delay = delay;
 
     LMIC_X_DEBUG_PRINTF("%"LMIC_PRId_ostime_t": sched Rx12 %"LMIC_PRId_ostime_t"\n", os_getTime(), LMIC.rxtime - os_getRadioRxRampup());
     os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - os_getRadioRxRampup(), func);
 }
 
 static void setupRx1 (osjobcb_t func) {
+    stopClassCRx(); // ttn-esp32: restores the RX1 parameters
     initTxrxFlags(__func__, TXRX_DNW1);
     // Turn LMIC.rps from TX over to RX
     LMIC.rps = setNocrc(LMIC.rps,1);
@@ -1544,7 +1695,7 @@ static void setupRx1 (osjobcb_t func) {
 static void txDone (ostime_t delay, osjobcb_t func) {
 #if !defined(DISABLE_PING)
     if( (LMIC.opmode & (OP_TRACK|OP_PINGABLE|OP_PINGINI)) == (OP_TRACK|OP_PINGABLE) ) {
-        rxschedInit(&LMIC.ping);    // note: reuses LMIC.frame buffer!
+        rxschedInitAll();    // note: reuses LMIC.frame buffer!
         LMIC.opmode |= OP_PINGINI;
     }
 #endif // !DISABLE_PING
@@ -1814,8 +1965,10 @@ static void setupRx2DnData (xref2osjob_t osjob) {
 static void processRx1DnData (xref2osjob_t osjob) {
     LMIC_API_PARAMETER(osjob);
 
-    if( LMIC.dataLen == 0 || !processDnData() )
+    if( LMIC.dataLen == 0 || !processDnData() ) {
         schedRx12(sec2osticks(LMIC.rxDelay +(int)DELAY_EXTDNW2), FUNC_ADDR(setupRx2DnData), LMIC.dn2Dr);
+        startClassCRx(); // ttn-esp32: listen until RX2 opens
+    }
 }
 
 
@@ -1830,6 +1983,7 @@ static void updataDone (xref2osjob_t osjob) {
     LMIC_API_PARAMETER(osjob);
 
     txDone(sec2osticks(LMIC.rxDelay), FUNC_ADDR(setupRx1DnData));
+    startClassCRx(); // ttn-esp32: listen until RX1 opens
 }
 
 // ========================================
@@ -1852,10 +2006,25 @@ static bit_t sendAdrAckReq(void) {
     }
 }
 
+// copy the segments of the pending uplink payload to their final place in the frame
+static void gatherTxSegments (xref2u1_t pDest) {
+    const lmic_tx_segment_t *pSegment = LMIC.pendTxSegments;
+    for (u1_t i = 0; i < LMIC.pendTxNumSegments; ++i, ++pSegment) {
+        os_copyMem(pDest, pSegment->pData, pSegment->nData);
+        pDest += pSegment->nData;
+    }
+}
+
 static bit_t buildDataFrame (void) {
     bit_t txdata = ((LMIC.opmode & (OP_TXDATA|OP_POLL)) != OP_POLL);
     u1_t dlen = txdata ? LMIC.pendTxLen : 0;
 
+    // ttn-esp32: pendTxLen might have been set for a shrunk pendTxData (see LMIC_PENDTXDATA_SIZE)
+    if (txdata && LMIC.pendTxSegments == NULL && dlen > sizeof(LMIC.pendTxData)) {
+        LMICOS_logEventUint32("payload too long for pendTxData", dlen);
+        return 0;
+    }
+
     // Piggyback MAC options
     // Prioritize by importance
     // highest importance are the ones in the pendMac buffer.
@@ -1909,6 +2078,20 @@ static bit_t buildDataFrame (void) {
         LMIC.txDeviceTimeReqState = lmic_RequestTimeState_rx;
     }
 #endif // LMIC_ENABLE_DeviceTimeReq
+    // ttn-esp32: link check request
+    if ( LMIC.txLinkCheckReq ) {
+        LMIC.frame[end+0] = MCMD_LinkCheckReq;
+        end += 1;
+        LMIC.txLinkCheckReq = 0;
+    }
+#if !defined(DISABLE_PING)
+    // ttn-esp32: repeated until PingSlotInfoAns is received
+    if ( LMIC.txPingSlotInfoReq ) {
+        LMIC.frame[end+0] = MCMD_PingSlotInfoReq;
+        LMIC.frame[end+1] = LMIC.ping.intvExp & 0x7;
+        end += 2;
+    }
+#endif // !DISABLE_PING
 #if !defined(DISABLE_BEACONS) && defined(ENABLE_MCMD_BeaconTimingAns)
     if ( LMIC.bcninfoTries > 0 ) {
         LMIC.frame[end+0] = MCMD_BeaconInfoReq;
@@ -1947,6 +2130,11 @@ static bit_t buildDataFrame (void) {
     LMIC.frame[OFF_DAT_FCT] = (LMIC.dnConf | LMIC.adrEnabled
                               | (sendAdrAckReq() ? FCT_ADRACKReq : 0)
                               | (end-OFF_DAT_OPTS));
+#if !defined(DISABLE_PING)
+    // ttn-esp32: tell the network server that ping slots are open
+    if( (LMIC.opmode & (OP_TRACK|OP_PINGABLE)) == (OP_TRACK|OP_PINGABLE) )
+        LMIC.frame[OFF_DAT_FCT] |= FCT_CLASSB;
+#endif // !DISABLE_PING
     os_wlsbf4(LMIC.frame+OFF_DAT_ADDR,  LMIC.devaddr);
 
     if( LMIC.txCnt == 0 && LMIC.upRepeatCount == 0 ) {
@@ -1978,10 +2166,16 @@ static bit_t buildDataFrame (void) {
             }
         }
         LMIC.frame[end] = LMIC.pendTxPort;
-        os_copyMem(LMIC.frame+end+1, LMIC.pendTxData, dlen);
-        aes_cipher(LMIC.pendTxPort==0 ? LMIC.nwkKey : LMIC.artKey,
-                   LMIC.devaddr, LMIC.seqnoUp-1,
-                   /*up*/0, LMIC.frame+end+1, dlen);
+        if (LMIC.pendTxSegments != NULL) {
+            gatherTxSegments(LMIC.frame+end+1);
+        } else {
+            os_copyMem(LMIC.frame+end+1, LMIC.pendTxData, dlen);
+        }
+        if (! applyTxKeystream(LMIC.frame+end+1, dlen)) {
+            aes_cipher(LMIC.pendTxPort==0 ? LMIC.nwkKey : LMIC.artKey,
+                       LMIC.devaddr, LMIC.seqnoUp-1,
+                       /*up*/0, LMIC.frame+end+1, dlen);
+        }
     }
     aes_appendMic(LMIC.nwkKey, LMIC.devaddr, LMIC.seqnoUp-1, /*up*/0, LMIC.frame, flen-4);
 
@@ -2032,6 +2226,38 @@ static void onBcnRx (xref2osjob_t osjob) {
 }
 
 
+// ttn-esp32: Predict the next beacon from the time reference of the last
+// DeviceTimeAns. Its error is dominated by the clock drift since the
+// answer (100 ppm assumed) plus the resolution of the answer. If the
+// beacon is not found within a few periods, EV_SCAN_TIMEOUT is reported.
+static bit_t acquireBeaconFromNetworkTime (void) {
+    lmic_time_reference_t ref;
+    if( ! LMIC_getNetworkTimeReference(&ref) )
+        return 0;
+    ostime_t now = os_getTime();
+    ostime_t age = now - ref.tLocal;
+    if( age < 0 || age > sec2osticks(BCN_ACQUIRE_MAX_AGE_sec) )
+        return 0;
+
+    u4_t ageSec = (u4_t)osticks2ms(age) / 1000;
+    lmic_gpstime_t bcnTime = ((ref.tNetwork + ageSec) | (BCN_INTV_sec - 1)) + 1;
+    ostime_t bcnStart = ref.tLocal + sec2osticks(bcnTime - ref.tNetwork);
+    if( bcnStart - now < ms2osticks(BCN_ACQUIRE_LEAD_ms) ) {
+        bcnTime += BCN_INTV_sec;
+        bcnStart += BCN_INTV_osticks;
+    }
+
+    // pretend we received the previous beacon
+    LMIC.bcninfo.time = bcnTime - BCN_INTV_sec;
+    LMIC.bcninfo.txtime = bcnStart - BCN_INTV_osticks;
+    LMIC.bcninfo.flags = 0;
+    LMIC.bcnChnl = (bcnTime >> BCN_INTV_exp) & 7;
+    calcBcnRxWindowFromMillis(BCN_ACQUIRE_BASE_ms + (ageSec + BCN_INTV_sec) / 10, 1);
+    LMIC.opmode |= OP_TRACK;
+    return 1;
+}
+
+
 // Enable receiver to listen to incoming beacons
 // netid defines when scan stops (any or specific beacon)
 // This mode ends with events: EV_SCAN_TIMEOUT/EV_SCAN_BEACON
@@ -2043,6 +2269,9 @@ static void startScan (void) {
         return;
     if( (LMIC.opmode & OP_SHUTDOWN) != 0 )
         return;
+    // ttn-esp32: if the network time is known, only listen around the next beacon
+    if( acquireBeaconFromNetworkTime() )
+        return;
     // Cancel onging TX/RX transaction
     LMIC.txCnt = LMIC.dnConf = LMIC.bcninfo.flags = 0;
     LMIC.opmode = (LMIC.opmode | OP_SCAN) & ~(OP_TXRXPEND);
@@ -2196,13 +2425,135 @@ void LMIC_unjoinAndRejoin(void) {
 //
 // ================================================================================
 
+// ================================================================================
+//
+// ttn-esp32: Multicast
+//
+// Frames addressed to an active multicast session are accepted in Class B
+// ping slots and in Class C continuous reception (not in RX1/RX2, where
+// they would be taken for the answer to the uplink). They must be
+// unconfirmed and without MAC commands, and they do not affect the unicast
+// session. The payload is delivered like a unicast downlink.
+//
+// ================================================================================
+
+#if LMIC_MAX_MC_SESSIONS > 0
+// Decode a frame of a multicast session. Returns 0 and leaves the frame
+// untouched if the address doesn't belong to a multicast session. Frames
+// of a multicast session that are invalid are discarded (LMIC.dataLen = 0).
+static bit_t decodeMulticastFrame (void) {
+    xref2u1_t d = LMIC.frame;
+    int dlen = LMIC.dataLen;
+    if( dlen < OFF_DAT_OPTS+4 )
+        return 0;
+
+    devaddr_t addr = os_rlsbf4(&d[OFF_DAT_ADDR]);
+    u1_t idx;
+    for( idx = 0; idx < LMIC_MAX_MC_SESSIONS; idx++ ) {
+        if( (LMIC.client.mcActive & (1 << idx)) != 0 && LMIC.client.mcAddr[idx] == addr )
+            break;
+    }
+    if( idx == LMIC_MAX_MC_SESSIONS )
+        return 0;
+
+    lmic_mc_session_t *mc = &LMIC.client.mcSessions[idx];
+    u1_t hdr  = d[0];
+    u1_t fct  = d[OFF_DAT_FCT];
+    int  poff = OFF_DAT_OPTS;
+    int  pend = dlen-4;  // MIC
+    if( (hdr & (HDR_FTYPE|HDR_MAJOR)) != (HDR_FTYPE_DADN|HDR_MAJOR_V1) ||
+        (fct & (FCT_ACK|FCT_OPTLEN)) != 0 ||
+        pend <= poff || d[poff] == 0 ) {
+        LMICOS_logEventUint32("decodeMulticastFrame: invalid frame", ((u4_t)idx << 16) | (hdr << 8) | fct);
+        goto norx;
+    }
+
+    u2_t seqnoDiff = (u2_t)(os_rlsbf2(&d[OFF_DAT_SEQNO]) - mc->seqnoDn);
+    u4_t seqno = mc->seqnoDn + seqnoDiff;
+    if( !aes_verifyMic(mc->nwkKey, addr, seqno, /*dn*/1, d, pend) ) {
+        LMICOS_logEventUint32("decodeMulticastFrame: bad MIC", ((u4_t)idx << 24) | (seqno & 0xFFFFFF));
+        goto norx;
+    }
+    if( seqnoDiff > LMICbandplan_MAX_FCNT_GAP || seqno > mc->seqnoDnMax ) {
+        LMICOS_logEventUint32("decodeMulticastFrame: frame counter out of range", ((u4_t)idx << 24) | (seqno & 0xFFFFFF));
+        goto norx;
+    }
+    mc->seqnoDn = seqno+1;
+
+    poff++; // port
+    aes_cipher(mc->artKey, addr, seqno, /*dn*/1, d+poff, pend-poff);
+    orTxrxFlags(__func__, TXRX_PORT);
+    LMIC.dataBeg = poff;
+    LMIC.dataLen = pend-poff;
+#if LMIC_DEBUG_LEVEL > 0
+    LMIC_DEBUG_PRINTF("%"LMIC_PRId_ostime_t": Received multicast downlink, session=%d, port=%d\n", os_getTime(), idx, d[poff-1]);
+#endif
+    return 1;
+
+  norx:
+    LMIC.dataLen = 0;
+    return 0;
+}
+
+bit_t LMIC_setMulticastSession (u1_t idx, devaddr_t addr, const u1_t *nwkKey, const u1_t *artKey, u4_t seqnoDn, u4_t seqnoDnMax) {
+    if( idx >= LMIC_MAX_MC_SESSIONS )
+        return 0;
+    lmic_mc_session_t *mc = &LMIC.client.mcSessions[idx];
+    LMIC.client.mcAddr[idx] = addr;
+    os_copyMem(mc->nwkKey, nwkKey, 16);
+    os_copyMem(mc->artKey, artKey, 16);
+    mc->seqnoDn = seqnoDn;
+    mc->seqnoDnMax = seqnoDnMax;
+    LMIC.client.mcActive |= (1 << idx);
+    LMIC.client.mcClassB &= ~(1 << idx);
+    return 1;
+}
+
+void LMIC_clearMulticastSession (u1_t idx) {
+    if( idx >= LMIC_MAX_MC_SESSIONS )
+        return;
+    LMIC.client.mcActive &= ~(1 << idx);
+    LMIC.client.mcClassB &= ~(1 << idx);
+    os_clearMem(&LMIC.client.mcSessions[idx], sizeof(LMIC.client.mcSessions[idx]));
+}
+
+u4_t LMIC_getMulticastSeqnoDn (u1_t idx) {
+    if( idx >= LMIC_MAX_MC_SESSIONS )
+        return 0;
+    return LMIC.client.mcSessions[idx].seqnoDn;
+}
+
+#if !defined(DISABLE_PING)
+// Open ping slots for the session (in addition to the device's own ping
+// slots while in Class B). They start with the next beacon.
+// A frequency of 0 selects the default ping slot frequency.
+bit_t LMIC_setMulticastPingSlots (u1_t idx, u1_t intvExp, u4_t freq, dr_t dr) {
+    if( idx >= LMIC_MAX_MC_SESSIONS || (LMIC.client.mcActive & (1 << idx)) == 0 || ! validDR(dr) )
+        return 0;
+    lmic_mc_session_t *mc = &LMIC.client.mcSessions[idx];
+    mc->pingIntvExp = intvExp & 0x7;
+    mc->pingFreq = freq != 0 ? freq : FREQ_PING;
+    mc->pingDr = dr;
+    LMIC.client.mcClassB |= (1 << idx);
+    // mark the schedule as exhausted until it is set up with the next beacon
+    LMIC.mcPing[idx].slot = 128;
+    LMIC.mcPing[idx].rxtime = os_getTime();
+    return 1;
+}
+#endif // !DISABLE_PING
+#else
+static inline bit_t decodeMulticastFrame (void) {
+    return 0;
+}
+#endif // LMIC_MAX_MC_SESSIONS > 0
+
 #if !defined(DISABLE_PING)
 static void processPingRx (xref2osjob_t osjob) {
     LMIC_API_PARAMETER(osjob);
 
     if( LMIC.dataLen != 0 ) {
         initTxrxFlags(__func__, TXRX_PING);
-        if( decodeFrame() ) {
+        if( decodeMulticastFrame() || decodeFrame() ) { // ttn-esp32: multicast
             reportEventNoUpdate(EV_RXCOMPLETE);
         }
     }
@@ -2211,6 +2562,89 @@ static void processPingRx (xref2osjob_t osjob) {
 }
 #endif // !DISABLE_PING
 
+// ================================================================================
+//
+// ttn-esp32: Class C
+//
+// While a Class C device is not transmitting and not in RX1, the radio sits in
+// continuous reception on the RX2 frequency and data rate. The radio parameters
+// in use before are saved and restored when the reception is stopped, as
+// continuous RX is also started between TX and RX1.
+//
+// ================================================================================
+
+static void processClassCRx (xref2osjob_t osjob);
+
+// decode a frame received in continuous RX (radio is asleep)
+static void decodeClassCFrame (void) {
+    LMIC.classCState = LMIC_CLASSC_IDLE;
+    LMIC.freq = LMIC.classCSavedFreq;
+    LMIC.rps = LMIC.classCSavedRps;
+    if( LMIC.dataLen != 0 ) {
+        initTxrxFlags(__func__, TXRX_DNW2);
+        if( decodeMulticastFrame() || decodeFrame() ) {
+            reportEventNoUpdate(EV_RXCOMPLETE);
+        }
+    }
+}
+
+static void startClassCRx (void) {
+    if( LMIC.client.devClass != LMIC_CLASS_C || LMIC.classCState != LMIC_CLASSC_IDLE )
+        return;
+    if( LMIC.devaddr == 0 || (LMIC.opmode & (OP_JOINING|OP_SHUTDOWN)) != 0 )
+        return;
+    // the radio driver has no continuous FSK reception
+    if( getSf(dndr2rps(LMIC.dn2Dr)) == FSK )
+        return;
+
+    LMIC.classCSavedFreq = LMIC.freq;
+    LMIC.classCSavedRps = LMIC.rps;
+    LMIC.freq = LMIC.dn2Freq;
+    LMIC.rps = dndr2rps(LMIC.dn2Dr);
+    LMIC.dataLen = 0;
+    LMIC.classCState = LMIC_CLASSC_RX;
+    LMIC.classCJob.func = FUNC_ADDR(processClassCRx);
+    os_radio(RADIO_RXON);
+}
+
+// stop continuous RX before the radio or LMIC.frame are used for something else
+static void stopClassCRx (void) {
+    if( LMIC.classCState == LMIC_CLASSC_RX ) {
+        os_radio(RADIO_RST);
+        LMIC.classCState = LMIC_CLASSC_IDLE;
+        LMIC.freq = LMIC.classCSavedFreq;
+        LMIC.rps = LMIC.classCSavedRps;
+    } else if( LMIC.classCState == LMIC_CLASSC_RXDONE ) {
+        // frame received but not yet processed: process it before LMIC.frame is reused
+        os_clearCallback(&LMIC.classCJob);
+        decodeClassCFrame();
+    }
+}
+
+// scheduled by the radio IRQ handler when a frame has been received in continuous RX
+static void processClassCRx (xref2osjob_t osjob) {
+    LMIC_API_PARAMETER(osjob);
+
+    if( LMIC.classCState != LMIC_CLASSC_RXDONE )
+        return;
+    decodeClassCFrame();
+    if( (LMIC.opmode & OP_TXRXPEND) != 0 ) {
+        // waiting for RX1/RX2: keep listening until the window opens
+        startClassCRx();
+    } else {
+        // sends a pending ACK or MAC answer, or re-arms continuous RX
+        engineUpdate();
+    }
+}
+
+void LMIC_setDeviceClass (u1_t devClass) {
+    LMIC.client.devClass = devClass;
+    if( devClass != LMIC_CLASS_C )
+        stopClassCRx();
+    if( LMIC.devaddr != 0 && (LMIC.opmode & OP_SHUTDOWN) == 0 )
+        engineUpdate();
+}
+
 // process downlink data at close of RX window.  Return zero if another RX window
 // should be scheduled, non-zero to prevent scheduling of RX2 (if relevant).
 // Confusingly, the caller actualyl does some of the calculation, so the answer from
@@ -2327,6 +2761,10 @@ static bit_t processDnData_norx(void) {
 // this Class-A uplink-and-receive cycle is complete.
 static bit_t processDnData_txcomplete(void) {
     LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND);
+    // the segments belong to the caller and are no longer needed
+    LMIC.pendTxSegments = NULL;
+    LMIC.pendTxNumSegments = 0;
+    LMIC.pendTxKeystream = NULL;
     // turn off all the repeat stuff.
     LMIC.txCnt = LMIC.upRepeatCount = 0;
 
@@ -2375,6 +2813,11 @@ static bit_t processDnData_txcomplete(void) {
             // call the user's notification routine.
             (*pNetworkTimeCb)(LMIC.client.pNetworkTimeUserData, flagSuccess);
         }
+#if !defined(DISABLE_PING)
+        // ttn-esp32: Class B waits for the network time to find the beacon
+        if( (LMIC.opmode & (OP_PINGABLE|OP_SCAN|OP_TRACK)) == OP_PINGABLE )
+            startScan();
+#endif // !DISABLE_PING
     }
 #endif // LMIC_ENABLE_DeviceTimeReq
 
@@ -2456,6 +2899,7 @@ static void processBeacon (xref2osjob_t osjob) {
             // We don't have a previous beacon to calc some drift - assume
             // an max error of 13ms = 128sec*100ppm which is roughly +/-100ppm
             calcBcnRxWindowFromMillis(13,0);
+            LMIC.missedBcns = 0; // ttn-esp32: misses while acquiring
             goto rev;
         }
         // We have a previous BEACON to calculate some drift
@@ -2479,6 +2923,19 @@ static void processBeacon (xref2osjob_t osjob) {
                          e_.info   = drift,
                          e_.info2  = /*occasion BEACON*/0));
         // formerly we'd assert on BCN_PARTIAL|BCN_FULL, but we can't get here if so
+    } else if( (flags & (BCN_PARTIAL|BCN_FULL)) == 0 ) {
+        // ttn-esp32: first beacon not yet received (predicted from network time)
+        LMIC.bcninfo.txtime += BCN_INTV_osticks;
+        LMIC.bcninfo.time   += BCN_INTV_sec;
+        if( ++LMIC.missedBcns > BCN_ACQUIRE_TRIES ) {
+            LMIC.opmode &= ~(OP_TRACK|OP_PINGABLE|OP_PINGINI);
+            reportEventAndUpdate(EV_SCAN_TIMEOUT);
+            return;
+        }
+        // the clock error grows with each period
+        calcBcnRxWindowFromMillis(LMIC.bcnAcquireMs + LMIC.missedBcns * BCN_MAX_DRIFT_ms, 0);
+        ev = EV_BEACON_MISSED;
+        goto rev;
     } else {
         ev = EV_BEACON_MISSED;
         LMIC.bcninfo.txtime += BCN_INTV_osticks - LMIC.drift;
@@ -2499,8 +2956,11 @@ static void processBeacon (xref2osjob_t osjob) {
   rev:
     LMICbandplan_advanceBeaconChannel();
 #if !defined(DISABLE_PING)
-    if( (LMIC.opmode & OP_PINGINI) != 0 )
-        rxschedInit(&LMIC.ping);  // note: reuses LMIC.frame buffer!
+    // ttn-esp32: start the ping slots with the first beacon, not with the next uplink
+    if( (LMIC.opmode & OP_PINGABLE) != 0 && (LMIC.bcninfo.flags & (BCN_PARTIAL|BCN_FULL)) != 0 ) {
+        rxschedInitAll();  // note: reuses LMIC.frame buffer!
+        LMIC.opmode |= OP_PINGINI;
+    }
 #endif // !DISABLE_PING
     reportEventAndUpdate(ev);
 }
@@ -2559,7 +3019,7 @@ static void engineUpdate_inner (void) {
         // We are tracking a beacon
         // formerly asserted ( now - (LMIC.bcnRxtime - os_getRadioRxRampup()) <= 0 );
         rxtime = LMIC.bcnRxtime - os_getRadioRxRampup();
-        if (now - rxtime < 0) {
+        if (now - rxtime > 0) { // ttn-esp32: was inverted, dropping out before every beacon
             // too late: drop out of Class B.
             LMIC.opmode &= ~(OP_TRACK|OP_PINGABLE|OP_PINGINI|OP_REJOIN);
             reportEventNoUpdate(EV_LOST_TSYNC);
@@ -2582,6 +3042,13 @@ static void engineUpdate_inner (void) {
         // Delayed TX or waiting for duty cycle?
         if( (LMIC.globalDutyRate != 0 || (LMIC.opmode & OP_RNDTX) != 0)  &&  (txbeg - LMIC.globalDutyAvail) < 0 )
             txbeg = LMIC.globalDutyAvail;
+        // ttn-esp32: uplink in a time slot; move to the next slot if the channel isn't available in time
+        if( LMIC.txSlotSet && !jacc ) {
+            while( txbeg - LMIC.txSlotTime > 0 && LMIC.txSlotPeriod > 0 )
+                LMIC.txSlotTime += LMIC.txSlotPeriod;
+            if( txbeg - LMIC.txSlotTime <= 0 )
+                txbeg = LMIC.txSlotTime;
+        }
 #if !defined(DISABLE_BEACONS)
         // If we're tracking a beacon...
         // then make sure TX-RX transaction is complete before beacon
@@ -2597,6 +3064,8 @@ static void engineUpdate_inner (void) {
         // Earliest possible time vs overhead to setup radio
         if( txbeg - (now + TX_RAMPUP) < 0 ) {
             // We could send right now!
+            // ttn-esp32: radio and LMIC.frame are needed for TX
+            stopClassCRx();
             txbeg = now;
             dr_t txdr = (dr_t)LMIC.datarate;
 #if !defined(DISABLE_JOIN)
@@ -2643,6 +3112,10 @@ static void engineUpdate_inner (void) {
                         orTxrxFlags(__func__, TXRX_NACK);
                     }
                     LMIC.opmode &= ~(OP_POLL|OP_RNDTX|OP_TXDATA|OP_TXRXPEND);
+                    LMIC.pendTxSegments = NULL;
+                    LMIC.pendTxNumSegments = 0;
+                    LMIC.pendTxKeystream = NULL;
+                    LMIC.txSlotSet = 0; // ttn-esp32
                     LMIC.dataBeg = LMIC.dataLen = 0;
                     reportEventNoUpdate(EV_TXCOMPLETE);
                     return;
@@ -2652,11 +3125,25 @@ static void engineUpdate_inner (void) {
             LMIC.rps    = setCr(updr2rps(txdr), (cr_t)LMIC.errcr);
             LMIC.dndr   = txdr;  // carry TX datarate (can be != LMIC.datarate) over to txDone/setupRx1
             LMIC.opmode = (LMIC.opmode & ~(OP_POLL|OP_RNDTX)) | OP_TXRXPEND | OP_NEXTCHNL;
+            // ttn-esp32: start exactly at the slot time (the radio waits for it after the setup)
+            bit_t txAt = 0;
+            if( LMIC.txSlotSet && !jacc ) {
+                LMIC.txSlotSet = 0;
+                if( LMIC.txSlotTime - now > 0 ) {
+                    txbeg = LMIC.txSlotTime;
+                    txAt = 1;
+                }
+            }
             LMICbandplan_updateTx(txbeg);
             // limit power to value asked in adr
             LMIC.radio_txpow = LMIC.txpow > LMIC.adrTxPow ? LMIC.adrTxPow : LMIC.txpow;
             reportEventNoUpdate(EV_TXSTART);
-            os_radio(RADIO_TX);
+            if( txAt ) {
+                LMIC.txend = txbeg;
+                os_radio(RADIO_TX_AT);
+            } else {
+                os_radio(RADIO_TX);
+            }
             return;
         }
         // Cannot yet TX
@@ -2667,8 +3154,10 @@ static void engineUpdate_inner (void) {
             txbeg += 1;  // TX delayed by one tick (insignificant amount of time)
     } else {
         // No TX pending - no scheduled RX
-        if( (LMIC.opmode & OP_TRACK) == 0 )
+        if( (LMIC.opmode & OP_TRACK) == 0 ) {
+            startClassCRx(); // ttn-esp32
             return;
+        }
     }
 
 #if !defined(DISABLE_BEACONS)
@@ -2677,13 +3166,16 @@ static void engineUpdate_inner (void) {
 #if !defined(DISABLE_PING)
     if( (LMIC.opmode & OP_PINGINI) != 0 ) {
         // One more RX slot in this beacon period?
-        if( rxschedNext(&LMIC.ping, now+os_getRadioRxRampup()) ) {
-            if( txbeg != 0  &&  (txbeg - LMIC.ping.rxtime) < 0 )
+        // ttn-esp32: including the ping slots of multicast sessions
+        devaddr_t pingAddr;
+        xref2rxsched_t rxsched = rxschedNextAll(now+os_getRadioRxRampup(), &pingAddr);
+        if( rxsched != NULL ) {
+            if( txbeg != 0  &&  (txbeg - rxsched->rxtime) < 0 )
                 goto txdelay;
-            LMIC.rxsyms  = LMIC.ping.rxsyms;
-            LMIC.rxtime  = LMIC.ping.rxtime;
-            LMIC.freq    = LMIC.ping.freq;
-            LMIC.rps     = dndr2rps(LMIC.ping.dr);
+            LMIC.rxsyms  = rxsched->rxsyms;
+            LMIC.rxtime  = rxsched->rxtime;
+            LMIC.freq    = LMICbandplan_getPingFreq(rxsched->freq, pingAddr); // ttn-esp32: hopping in US-like regions
+            LMIC.rps     = dndr2rps(rxsched->dr);
             LMIC.dataLen = 0;
             ostime_t rxtime_ping = LMIC.rxtime - os_getRadioRxRampup();
             // did we miss the time?
@@ -2716,6 +3208,7 @@ static void engineUpdate_inner (void) {
 #endif // !DISABLE_BEACONS
 
   txdelay:
+    startClassCRx(); // ttn-esp32: listen while waiting to TX
     EV(devCond, INFO, (e_.reason = EV::devCond_t::TX_DELAY,
                        e_.eui    = MAIN::CDEV->getEui(),
                        e_.info   = osticks2ms(txbeg-now),
@@ -2756,6 +3249,8 @@ void LMIC_setDrTxpow (dr_t dr, s1_t txpow) {
 
 void LMIC_shutdown (void) {
     os_clearCallback(&LMIC.osjob);
+    os_clearCallback(&LMIC.classCJob); // ttn-esp32
+    LMIC.classCState = LMIC_CLASSC_IDLE;
     os_radio(RADIO_RST);
     LMIC.opmode |= OP_SHUTDOWN;
 }
@@ -2769,15 +3264,24 @@ void LMIC_reset (void) {
                        e_.eui    = MAIN::CDEV->getEui(),
                        e_.info   = EV_RESET));
     os_radio(RADIO_RST);
+    LMIC_resetState();
+}
+
+// ttn-esp32: LMIC_reset() without the radio reset, e.g. for a warm start
+// where the radio has kept its configuration.
+void LMIC_resetState (void) {
     os_clearCallback(&LMIC.osjob);
+    os_clearCallback(&LMIC.classCJob); // ttn-esp32: job is cleared with LMIC below
 
     // save callback info, clear LMIC, restore.
     do {
         lmic_client_data_t  client = LMIC.client;
+        lmic_radio_data_t   radio = LMIC.radio; // ttn-esp32: radio state is not reset
 
         os_clearMem((xref2u1_t)&LMIC,SIZEOFEXPR(LMIC));
 
         LMIC.client = client;
+        LMIC.radio = radio;
     } while (0);
 
     // LMIC.devaddr      =  0;      // true from os_clearMem().
@@ -2830,6 +3334,10 @@ void LMIC_clrTxData (void) {
         return;
     }
     LMIC.pendTxLen = 0;
+    LMIC.pendTxSegments = NULL;
+    LMIC.pendTxNumSegments = 0;
+    LMIC.pendTxKeystream = NULL;
+    LMIC.txSlotSet = 0; // ttn-esp32
     opmode &= ~(OP_TXDATA | OP_POLL);
     if (! (opmode & OP_JOINING)) {
         // in this case, we are joining, and the TX data
@@ -2845,6 +3353,7 @@ void LMIC_clrTxData (void) {
     if( (LMIC.opmode & (OP_JOINING|OP_SCAN)) != 0 ) // do not interfere with JOINING
         return;
     os_clearCallback(&LMIC.osjob);
+    stopClassCRx(); // ttn-esp32
     os_radio(RADIO_RST);
     engineUpdate();
 }
@@ -2917,6 +3426,19 @@ void LMIC_setTxData_strict (void) {
 }
 
 
+// result of queueing TX data with LMIC_setTxData_strict()
+static lmic_tx_error_t getTxDataResult (void) {
+    if ( (LMIC.opmode & OP_TXDATA) == 0 ) {
+        if (LMIC.txrxFlags & TXRX_LENERR) {
+            return LMIC_ERROR_TX_NOT_FEASIBLE;
+        } else {
+            // data has already been completed with error for some reason
+            return LMIC_ERROR_TX_FAILED;
+        }
+    }
+    return LMIC_ERROR_SUCCESS;
+}
+
 // send a message, attempting to adjust TX data rate
 lmic_tx_error_t LMIC_setTxData2 (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed) {
     adjustDrForFrameIfNotBusy(dlen);
@@ -2937,15 +3459,52 @@ lmic_tx_error_t LMIC_setTxData2_strict (u1_t port, xref2u1_t data, u1_t dlen, u1
     LMIC.pendTxPort = port;
     LMIC.pendTxLen  = dlen;
     LMIC_setTxData_strict();
-    if ( (LMIC.opmode & OP_TXDATA) == 0 ) {
-        if (LMIC.txrxFlags & TXRX_LENERR) {
-            return LMIC_ERROR_TX_NOT_FEASIBLE;
-        } else {
-            // data has already been completed with error for some reason
-            return LMIC_ERROR_TX_FAILED;
-        }
+    return getTxDataResult();
+}
+
+// send a message whose payload is gathered from several caller-owned buffers.
+// The buffers and the segment array must remain valid until the TX completes
+// (EV_TXCOMPLETE, EV_TXCANCELED or the txMessageCb). Nothing is copied until
+// the frame is built; try to adjust data rate.
+lmic_tx_error_t LMIC_setTxDataSegments (u1_t port, const lmic_tx_segment_t *pSegments, u1_t nSegments, u1_t confirmed) {
+    uint dlen = 0;
+    for (u1_t i = 0; i < nSegments; ++i)
+        dlen += pSegments[i].nData;
+    if( dlen > MAX_LEN_PAYLOAD )
+        return LMIC_ERROR_TX_TOO_LARGE;
+
+    adjustDrForFrameIfNotBusy((u1_t) dlen);
+    if (isTxPathBusy()) {
+        // already have a message queued
+        return LMIC_ERROR_TX_BUSY;
     }
-    return LMIC_ERROR_SUCCESS;
+    LMIC.pendTxSegments = pSegments;
+    LMIC.pendTxNumSegments = nSegments;
+    LMIC.pendTxConf = confirmed;
+    LMIC.pendTxPort = port;
+    LMIC.pendTxLen  = (u1_t) dlen;
+    LMIC_setTxData_strict();
+    return getTxDataResult();
+}
+
+// ttn-esp32: use a key stream computed with LMIC_prepareTxKeystream() for the
+// data passed with the next LMIC_setTxData*() call. It must remain valid until
+// the TX completes. If the data is not accepted, clear it again with NULL.
+void LMIC_setTxKeystream (const lmic_tx_keystream_t *pKeystream) {
+    LMIC.pendTxKeystream = pKeystream;
+}
+
+// send a segmented message with callback; try to adjust data rate
+lmic_tx_error_t LMIC_sendSegmentsWithCallback (
+    u1_t port, const lmic_tx_segment_t *pSegments, u1_t nSegments, u1_t confirmed,
+    lmic_txmessage_cb_t *pCb, void *pUserData
+) {
+    lmic_tx_error_t const result = LMIC_setTxDataSegments(port, pSegments, nSegments, confirmed);
+    if (result == 0) {
+        LMIC.client.txMessageCb = pCb;
+        LMIC.client.txMessageUserData = pUserData;
+    }
+    return result;
 }
 
 // send a message with callback; try to adjust data rate
@@ -3072,6 +3631,20 @@ void LMIC_getSessionKeys (u4_t *netid, devaddr_t *devaddr, xref2u1_t nwkKey, xre
     memcpy(nwkKey, LMIC.nwkKey, sizeof(LMIC.nwkKey));
 }
 
+// ttn-esp32: request a LinkCheckAns (gateway margin and count) with the next uplink
+void LMIC_requestLinkCheck(void) {
+    LMIC.txLinkCheckReq = 1;
+}
+
+// ttn-esp32: start the next uplink exactly at the given time. If the duty cycle
+// or the channel availability doesn't allow it, it's moved by multiples of
+// period (or sent as soon as possible if period is 0). Joins are not affected.
+void LMIC_setTxSlot(ostime_t slotTime, ostime_t period) {
+    LMIC.txSlotTime = slotTime;
+    LMIC.txSlotPeriod = period;
+    LMIC.txSlotSet = 1;
+}
+
 // \brief post an asynchronous request for the network time.
 void LMIC_requestNetworkTime(lmic_request_network_time_cb_t *pCallbackfn, void *pUserData) {
 #if LMIC_ENABLE_DeviceTimeReq
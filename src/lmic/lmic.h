@@ -162,6 +162,13 @@ enum { MAX_RXSYMS         = 350 };   // Stop tracking beacon if sync error grows
                                      // And for 100ppm clocks and 2 hours of beacon misses,
                                      // this needs to accommodate 1.4 seconds of error at
                                      // 4.096 ms/sym or at least 342 symbols.
+// ttn-esp32: clock error per beacon period (100 ppm) until the drift has been measured
+enum { BCN_MAX_DRIFT_ms   = 13 };
+// ttn-esp32: beacon acquisition from the network time (see LMIC_startClassB())
+enum { BCN_ACQUIRE_MAX_AGE_sec = 600 }; // max age of the DeviceTimeAns to predict the beacon
+enum { BCN_ACQUIRE_BASE_ms = 20 };      // error of the time reference, without clock drift
+enum { BCN_ACQUIRE_LEAD_ms = 1000 };    // min time to the first predicted beacon
+enum { BCN_ACQUIRE_TRIES   = 2 };       // beacon periods to try after the first one
 
 enum { LINK_CHECK_CONT    =  0  ,    // continue with this after reported dead link
        LINK_CHECK_DEAD    =  32 ,    // after this UP frames and no response to ack from NWK assume link is dead (ADR_ACK_DELAY)
@@ -281,6 +288,10 @@ enum { TXRX_ACK    = 0x80,   // confirmed UP frame was acked
        TXRX_DNW2   = 0x02,   // received in 2dn DN slot
        TXRX_DNW1   = 0x01,   // received in 1st DN slot
 };
+// ttn-esp32: device classes (lmic_client_data_t.devClass)
+enum { LMIC_CLASS_A = 0, LMIC_CLASS_C = 2 };
+// ttn-esp32: state of Class C continuous reception (lmic_t.classCState)
+enum { LMIC_CLASSC_IDLE = 0, LMIC_CLASSC_RX, LMIC_CLASSC_RXDONE };
 
 // Event types for event callback
 enum _ev_t { EV_SCAN_TIMEOUT=1, EV_BEACON_FOUND,
@@ -348,7 +359,7 @@ enum {
 typedef s1_t lmic_beacon_error_t;
 
 static inline bit_t LMIC_BEACON_SUCCESSFUL(lmic_beacon_error_t e) {
-    return e < 0;
+    return e >= 0; // ttn-esp32: was inverted
 }
 
 // LMIC_CFG_max_clock_error_ppm
@@ -378,6 +389,29 @@ typedef void LMIC_ABI_STD lmic_rxmessage_cb_t(void *pUserData, uint8_t port, con
 typedef void LMIC_ABI_STD lmic_txmessage_cb_t(void *pUserData, int fSuccess);
 typedef void LMIC_ABI_STD lmic_event_cb_t(void *pUserData, ev_t e);
 
+// one piece of an uplink payload that is gathered directly into the frame
+// when it is built, see LMIC_setTxDataSegments().
+typedef struct lmic_tx_segment_s lmic_tx_segment_t;
+
+struct lmic_tx_segment_s {
+    const u1_t  *pData;     // start of segment
+    u1_t        nData;      // length of segment in bytes
+};
+
+// ttn-esp32: AES-CTR key stream for the FRMPayload of an uplink, computed
+// ahead of time by the task submitting the data (see LMIC_prepareTxKeystream()).
+// It is only applied if the session and the frame counter still match when the
+// frame is built. Otherwise, the payload is encrypted as usual.
+typedef struct lmic_tx_keystream_s lmic_tx_keystream_t;
+
+struct lmic_tx_keystream_s {
+    devaddr_t   devaddr;    // session the key stream was computed for
+    u4_t        seqno;      // frame counter the key stream was computed for
+    u1_t        key[16];    // key the key stream was computed with
+    u1_t        nStream;    // length of the key stream in bytes (0 if not computed)
+    u1_t        stream[MAX_LEN_PAYLOAD];
+};
+
 // network time request callback function
 // defined unconditionally, because APIs and types can't change based on config.
 // This is called when a time-request succeeds or when we get a downlink
@@ -431,6 +465,23 @@ Description:
 */
 
 //! abstract type for collection of client data that survives LMIC_reset().
+#if LMIC_MAX_MC_SESSIONS > 0
+// ttn-esp32: keys and frame counter of a multicast session
+typedef struct lmic_mc_session_s lmic_mc_session_t;
+
+struct lmic_mc_session_s {
+    u4_t        seqnoDn;      //!< next expected frame counter
+    u4_t        seqnoDnMax;   //!< last valid frame counter
+    u1_t        nwkKey[16];   //!< McNwkSKey
+    u1_t        artKey[16];   //!< McAppSKey
+#if !defined(DISABLE_PING)
+    u4_t        pingFreq;     //!< Class B ping slot frequency (0: default)
+    u1_t        pingIntvExp;  //!< Class B ping slot periodicity
+    u1_t        pingDr;       //!< Class B ping slot data rate
+#endif
+};
+#endif
+
 typedef struct lmic_client_data_s lmic_client_data_t;
 
 //! contents of lmic_client_data_t
@@ -452,7 +503,12 @@ struct lmic_client_data_s {
 #endif // LMIC_ENABLE_user_events
 
     /* next we have things that are (u)int32_t */
-    /* none at the moment */
+#if LMIC_MAX_MC_SESSIONS > 0
+    // ttn-esp32: multicast sessions survive LMIC_reset(); the addresses are
+    // kept apart from the keys so the address match scans a small table.
+    devaddr_t   mcAddr[LMIC_MAX_MC_SESSIONS];       //!< McAddr of each session
+    lmic_mc_session_t mcSessions[LMIC_MAX_MC_SESSIONS];
+#endif
 
     /* next we have things that are (u)int16_t */
 
@@ -460,6 +516,11 @@ struct lmic_client_data_s {
 
     /* finally, things that are (u)int8_t */
     u1_t        devStatusAns_battery;       //!< value to report in MCMD_DevStatusAns message.
+    u1_t        devClass;                   //!< ttn-esp32: LMIC_CLASS_A or LMIC_CLASS_C
+#if LMIC_MAX_MC_SESSIONS > 0
+    u1_t        mcActive;                   //!< ttn-esp32: bit map of active multicast sessions
+    u1_t        mcClassB;                   //!< ttn-esp32: bit map of multicast sessions with ping slots
+#endif
 };
 
 /*
@@ -475,6 +536,16 @@ Description:
 
 */
 
+// ttn-esp32: radio states for the energy accounting
+enum {
+    LMIC_RADIO_STATE_SLEEP = 0,
+    LMIC_RADIO_STATE_STANDBY,
+    LMIC_RADIO_STATE_SYNTH,     // frequency synthesis (FSTX, FSRX)
+    LMIC_RADIO_STATE_TX,
+    LMIC_RADIO_STATE_RX,        // continuous RX, single RX, CAD
+    LMIC_RADIO_STATE_COUNT
+};
+
 typedef struct lmic_radio_data_s lmic_radio_data_t;
 
 struct lmic_radio_data_s {
@@ -486,6 +557,21 @@ struct lmic_radio_data_s {
     ostime_t    txlate_ticks;
     // number of tx late launches.
     unsigned    txlate_count;
+    // ttn-esp32: timing of the last RX1/RX2 window for the clock error calibration.
+    // nominal start of the window (txend + RX delay) and the RX delay; the delay is
+    // cleared by the consumer of the sample.
+    ostime_t    rxwin_nominal;
+    ostime_t    rxwin_delay;
+    // ttn-esp32: start of the last received LoRa frame (RxDone time minus airtime)
+    ostime_t    rxframe_start;
+    // ttn-esp32: os ticks spent in each radio state, accumulated on each state change. Can overflow!
+    u4_t        state_ticks[LMIC_RADIO_STATE_COUNT];
+    // ttn-esp32: current radio state and time it was entered
+    u1_t        state;
+    ostime_t    state_since;
+    // ttn-esp32: incremented before and after the above state is updated (odd while updating),
+    // so other tasks can take a consistent copy
+    u4_t        state_seq;
 };
 
 /*
@@ -504,12 +590,28 @@ struct lmic_t {
     // the OS job object. pointer alignment.
     osjob_t     osjob;
 
+    // ttn-esp32: job processing frames received in Class C continuous RX
+    // (separate from osjob, which may be scheduled for the next uplink)
+    osjob_t     classCJob;
+
+    // pending uplink payload if it was passed as segments (instead of being
+    // copied to pendTxData). Owned by the caller, cleared when the TX completes.
+    const lmic_tx_segment_t *pendTxSegments;
+    u1_t        pendTxNumSegments;
+
+    // ttn-esp32: key stream computed ahead of time for the pending uplink
+    // payload (or NULL). Owned by the caller, cleared when the TX completes.
+    const lmic_tx_keystream_t *pendTxKeystream;
+
 #if !defined(DISABLE_BEACONS)
     bcninfo_t   bcninfo;      // Last received beacon info
 #endif
 
 #if !defined(DISABLE_PING)
     rxsched_t   ping;         // pingable setup
+#if LMIC_MAX_MC_SESSIONS > 0
+    rxsched_t   mcPing[LMIC_MAX_MC_SESSIONS]; // ttn-esp32: ping slots of multicast sessions
+#endif
 #endif
 
     // the radio driver portable context
@@ -527,12 +629,15 @@ struct lmic_t {
     u4_t        freq;
 
     ostime_t    globalDutyAvail; // time device can send again
+    ostime_t    txSlotTime;     // ttn-esp32: exact start of the next uplink (if txSlotSet)
+    ostime_t    txSlotPeriod;   // ttn-esp32: interval to the following slot if txSlotTime is missed
 
     u4_t        netid;        // current network id (~0 - none)
     devaddr_t   devaddr;
     u4_t        seqnoDn;      // device level down stream seqno
     u4_t        seqnoUp;
     u4_t        dn2Freq;
+    u4_t        classCSavedFreq; // ttn-esp32: LMIC.freq before Class C RX
 
 #if !defined(DISABLE_BEACONS)
     ostime_t    bcnRxtime;
@@ -565,6 +670,7 @@ struct lmic_t {
 
     /* (u)int16_t things */
     rps_t       rps;            // radio parameter selections: SF, BW, CodingRate, NoCrc, implicit hdr
+    rps_t       classCSavedRps; // ttn-esp32: LMIC.rps before Class C RX
     u2_t        opmode;         // engineUpdate() operating mode flags
     u2_t        devNonce;       // last generated nonce
 
@@ -608,8 +714,8 @@ struct lmic_t {
 
     u1_t        pendTxPort;
     u1_t        pendTxConf;   // confirmed data
-    u1_t        pendTxLen;    // count of bytes in pendTxData.
-    u1_t        pendTxData[MAX_LEN_PAYLOAD];
+    u1_t        pendTxLen;    // count of bytes in pendTxData (or pendTxSegments).
+    u1_t        pendTxData[LMIC_PENDTXDATA_SIZE];
 
     u1_t        pendMacLen;         // number of bytes of pending Mac response data
     bit_t       pendMacPiggyback;   // received on port 0 or piggyback?
@@ -626,6 +732,12 @@ struct lmic_t {
     u1_t        rxDelay;      // Rx delay after TX
 
     u1_t        margin;
+    u1_t        gwMargin;     // ttn-esp32: margin (dB) reported by the last LinkCheckAns
+    u1_t        gwCount;      // ttn-esp32: number of gateways reported by the last LinkCheckAns
+    bit_t       txLinkCheckReq; // ttn-esp32: send LinkCheckReq with next uplink
+    bit_t       txPingSlotInfoReq; // ttn-esp32: send PingSlotInfoReq until answered
+    bit_t       txSlotSet;      // ttn-esp32: start the next uplink at txSlotTime
+    u1_t        classCState;  // ttn-esp32: state of Class C continuous RX
     s1_t        devAnsMargin; // SNR value between -32 and 31 (inclusive) for the last successfully received DevStatusReq command
     u1_t        adrEnabled;
     u1_t        moreData;     // NWK has more data pending
@@ -656,6 +768,7 @@ struct lmic_t {
 #if !defined(DISABLE_BEACONS)
     u1_t        missedBcns;   // unable to track last N beacons
     u1_t        bcninfoTries; // how often to try (scan mode only)
+    u1_t        bcnAcquireMs; // ttn-esp32: RX window (ms) while acquiring the first beacon
 #endif
     // Public part of MAC state
     u1_t        txCnt;
@@ -705,6 +818,7 @@ void  LMIC_unjoinAndRejoin (void);
 void  LMIC_shutdown     (void);
 void  LMIC_init         (void);
 void  LMIC_reset        (void);
+void  LMIC_resetState   (void); // ttn-esp32
 void  LMIC_clrTxData    (void);
 void  LMIC_setTxData    (void);
 void  LMIC_setTxData_strict(void);
@@ -712,6 +826,10 @@ lmic_tx_error_t LMIC_setTxData2(u1_t port, xref2u1_t data, u1_t dlen, u1_t confi
 lmic_tx_error_t LMIC_setTxData2_strict(u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed);
 lmic_tx_error_t LMIC_sendWithCallback(u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed, lmic_txmessage_cb_t *pCb, void *pUserData);
 lmic_tx_error_t LMIC_sendWithCallback_strict(u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed, lmic_txmessage_cb_t *pCb, void *pUserData);
+lmic_tx_error_t LMIC_setTxDataSegments(u1_t port, const lmic_tx_segment_t *pSegments, u1_t nSegments, u1_t confirmed);
+lmic_tx_error_t LMIC_sendSegmentsWithCallback(u1_t port, const lmic_tx_segment_t *pSegments, u1_t nSegments, u1_t confirmed, lmic_txmessage_cb_t *pCb, void *pUserData);
+void  LMIC_prepareTxKeystream(lmic_tx_keystream_t *pKeystream, u1_t port, u1_t dlen); // ttn-esp32
+void  LMIC_setTxKeystream(const lmic_tx_keystream_t *pKeystream);                     // ttn-esp32
 void  LMIC_sendAlive    (void);
 
 #if !defined(DISABLE_BEACONS)
@@ -722,6 +840,8 @@ void  LMIC_disableTracking (void);
 #if !defined(DISABLE_PING)
 void  LMIC_stopPingable  (void);
 void  LMIC_setPingable   (u1_t intvExp);
+void  LMIC_startClassB   (u1_t intvExp); // ttn-esp32
+void  LMIC_stopClassB    (void);         // ttn-esp32
 #endif
 
 void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
@@ -733,6 +853,17 @@ u4_t LMIC_setSeqnoUp    (u4_t);
 void LMIC_getSessionKeys (u4_t *netid, devaddr_t *devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
 
 void LMIC_requestNetworkTime(lmic_request_network_time_cb_t *pCallbackfn, void *pUserData);
+void LMIC_requestLinkCheck(void);
+void LMIC_setTxSlot(ostime_t slotTime, ostime_t period); // ttn-esp32
+void LMIC_setDeviceClass(u1_t devClass);
+#if LMIC_MAX_MC_SESSIONS > 0
+bit_t LMIC_setMulticastSession(u1_t idx, devaddr_t addr, const u1_t *nwkKey, const u1_t *artKey, u4_t seqnoDn, u4_t seqnoDnMax);
+void LMIC_clearMulticastSession(u1_t idx);
+u4_t LMIC_getMulticastSeqnoDn(u1_t idx);
+#if !defined(DISABLE_PING)
+bit_t LMIC_setMulticastPingSlots(u1_t idx, u1_t intvExp, u4_t freq, dr_t dr);
+#endif
+#endif
 int LMIC_getNetworkTimeReference(lmic_time_reference_t *pReference);
 
 int LMIC_registerRxMessageCb(lmic_rxmessage_cb_t *pRxMessageCb, void *pUserData);
@@ -292,6 +292,16 @@ void LMICau915_setBcnRxParams(void) {
 }
 #endif // !DISABLE_BEACONS
 
+#if !defined(DISABLE_PING)
+// ttn-esp32: the default ping slot channel hops with the beacon period
+u4_t LMICau915_getPingFreq(u4_t freq, devaddr_t addr) {
+        if (freq != 0)
+                return freq;
+        u1_t chnl = (addr + (LMIC.bcninfo.time >> BCN_INTV_exp)) & 7;
+        return AU915_500kHz_DNFBASE + chnl * AU915_500kHz_DNFSTEP;
+}
+#endif // !DISABLE_PING
+
 // set the Rx1 dndr, rps.
 void LMICau915_setRx1Params(void) {
         u1_t const txdr = LMIC.dndr;
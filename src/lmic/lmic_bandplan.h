@@ -106,6 +106,10 @@
 # error "LMICbandplan_setBcnRxParams() not defined by bandplan"
 #endif
 
+#if !defined(LMICbandplan_getPingFreq)
+# error "LMICbandplan_getPingFreq() not defined by bandplan"
+#endif
+
 #if !defined(LMICbandplan_canMapChannels)
 # error "LMICbandplan_canMapChannels() not defined by bandplan"
 #endif
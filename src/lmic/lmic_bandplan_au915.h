@@ -57,6 +57,10 @@ void LMICau915_initJoinLoop(void);
 void LMICau915_setBcnRxParams(void);
 #define LMICbandplan_setBcnRxParams() LMICau915_setBcnRxParams()
 
+// ttn-esp32: ping slot frequency (hopping if freq is 0)
+u4_t LMICau915_getPingFreq(u4_t freq, devaddr_t addr);
+#define LMICbandplan_getPingFreq(freq, addr)    LMICau915_getPingFreq(freq, addr)
+
 u4_t LMICau915_convFreq(xref2cu1_t ptr);
 #define LMICbandplan_convFreq(ptr)      LMICau915_convFreq(ptr)
 
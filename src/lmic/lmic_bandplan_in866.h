@@ -48,7 +48,7 @@ ostime_t LMICin866_dr2hsym(uint8_t dr);
 
 static inline int
 LMICin866_isValidBeacon1(const uint8_t *d) {
-        return os_rlsbf2(&d[OFF_BCN_CRC1]) != os_crc16(d, OFF_BCN_CRC1);
+        return os_rlsbf2(&d[OFF_BCN_CRC1]) == os_crc16(d, OFF_BCN_CRC1); // ttn-esp32: was inverted
 }
 
 #undef LMICbandplan_isValidBeacon1
@@ -47,11 +47,10 @@ ostime_t LMICkr920_dr2hsym(uint8_t dr);
 #define dr2hsym(dr) LMICkr920_dr2hsym(dr)
 
 
-// TODO(tmm@mcci.com) this looks bogus compared to current 1.02 regional
-// spec. https://github.com/mcci-catena/arduino-lmic/issues/18
+// ttn-esp32: 16 bit CRC over RFU and time (LoRaWAN 1.0.3 / RP002)
 static inline int
 LMICkr920_isValidBeacon1(const uint8_t *d) {
-    return d[OFF_BCN_CRC1] != (u1_t)os_crc16(d, OFF_BCN_CRC1);
+    return os_rlsbf2(&d[OFF_BCN_CRC1]) == os_crc16(d, OFF_BCN_CRC1);
 }
 
 #undef LMICbandplan_isValidBeacon1
@@ -54,6 +54,10 @@ ostime_t LMICus915_dr2hsym(uint8_t dr);
 void LMICus915_setBcnRxParams(void);
 #define LMICbandplan_setBcnRxParams() LMICus915_setBcnRxParams()
 
+// ttn-esp32: ping slot frequency (hopping if freq is 0)
+u4_t LMICus915_getPingFreq(u4_t freq, devaddr_t addr);
+#define LMICbandplan_getPingFreq(freq, addr)    LMICus915_getPingFreq(freq, addr)
+
 u4_t LMICus915_convFreq(xref2cu1_t ptr);
 #define LMICbandplan_convFreq(ptr)      LMICus915_convFreq(ptr)
 
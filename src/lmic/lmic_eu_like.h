@@ -46,7 +46,7 @@
 // provide a default for LMICbandplan_isValidBeacon1()
 static inline int
 LMICeulike_isValidBeacon1(const uint8_t *d) {
-        return os_rlsbf2(&d[OFF_BCN_CRC1]) != os_crc16(d, OFF_BCN_CRC1);
+        return os_rlsbf2(&d[OFF_BCN_CRC1]) == os_crc16(d, OFF_BCN_CRC1); // ttn-esp32: was inverted
 }
 
 #define LMICbandplan_isValidBeacon1(pFrame) LMICeulike_isValidBeacon1(pFrame)
@@ -74,6 +74,9 @@ void LMICeulike_processJoinAcceptCFList(void);
 #define LMICbandplan_advanceBeaconChannel()     \
         do { /* nothing */ } while (0)
 
+// ttn-esp32: ping slots use a single channel
+#define LMICbandplan_getPingFreq(freq, addr)    (freq)
+
 #define LMICbandplan_resetDefaultChannels()     \
         do { /* nothing */ } while (0)
 
@@ -236,6 +236,16 @@ void LMICus915_setBcnRxParams(void) {
 }
 #endif // !DISABLE_BEACONS
 
+#if !defined(DISABLE_PING)
+// ttn-esp32: the default ping slot channel hops with the beacon period
+u4_t LMICus915_getPingFreq(u4_t freq, devaddr_t addr) {
+        if (freq != 0)
+                return freq;
+        u1_t chnl = (addr + (LMIC.bcninfo.time >> BCN_INTV_exp)) & 7;
+        return US915_500kHz_DNFBASE + chnl * US915_500kHz_DNFSTEP;
+}
+#endif // !DISABLE_PING
+
 // set the Rx1 dndr, rps.
 void LMICus915_setRx1Params(void) {
     u1_t const txdr = LMIC.dndr;
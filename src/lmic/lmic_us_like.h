@@ -49,7 +49,7 @@ void LMICuslike_initJoinLoop(void);
 // provide the isValidBeacon1 function -- int for bool.
 static inline int
 LMICuslike_isValidBeacon1(const uint8_t *d) {
-        return os_rlsbf2(&d[OFF_BCN_CRC1]) != os_crc16(d, OFF_BCN_CRC1);
+        return os_rlsbf2(&d[OFF_BCN_CRC1]) == os_crc16(d, OFF_BCN_CRC1); // ttn-esp32: was inverted
 }
 
 #define LMICbandplan_isValidBeacon1(pFrame) LMICuslike_isValidBeacon1(pFrame)
@@ -72,8 +72,9 @@ void LMICuslike_processJoinAcceptCFList(void);
 #define LMICbandplan_processJoinAcceptCFList    LMICuslike_processJoinAcceptCFList
 
 
+// ttn-esp32: the beacon channel is derived from the beacon time
 #define LMICbandplan_advanceBeaconChannel()     \
-        do { LMIC.bcnChnl = (LMIC.bcnChnl+1) & 7; } while (0)
+        do { LMIC.bcnChnl = ((LMIC.bcninfo.time >> BCN_INTV_exp) + 1) & 7; } while (0)
 
 // TODO(tmm@mcci.com): decide whether we want to do this on every
 // reset or just restore the last sub-band selected by the user.
@@ -143,14 +143,14 @@ enum { DR_DNW2 = EU868_DR_SF12 };
 enum { CHNL_BCN = 5 };
 enum { FREQ_BCN = EU868_F6 };
 enum { DR_BCN = EU868_DR_SF9 };
-enum { AIRTIME_BCN = 144384 };  // micros
+enum { AIRTIME_BCN = 154076 };  // micros (ttn-esp32: 10 symbol preamble, plus TBeaconDelay of 1.5 ms)
 enum { LMIC_REGION_EIRP = EU868_LMIC_REGION_EIRP };         // region uses EIRP
 
 enum {
-        // Beacon frame format EU SF9
-        OFF_BCN_NETID = 0,
-        OFF_BCN_TIME = 3,
-        OFF_BCN_CRC1 = 7,
+        // Beacon frame format EU SF9 (ttn-esp32: LoRaWAN 1.0.3 / RP002)
+        // RFU(2) | Time(4) | CRC(2) | GwSpecific(7) | CRC(2)
+        OFF_BCN_TIME = 2,
+        OFF_BCN_CRC1 = 6,
         OFF_BCN_INFO = 8,
         OFF_BCN_LAT = 9,
         OFF_BCN_LON = 12,
@@ -186,28 +186,27 @@ enum { DR_DFLTMIN = US915_DR_SF7 };  // DR5
 enum { DR_PAGE = DR_PAGE_US915 };
 
 //enum { CHNL_PING         = 0 }; // used only for default init of state (follows beacon - rotating)
-enum { FREQ_PING         = US915_500kHz_DNFBASE + 0*US915_500kHz_DNFSTEP };  // default ping freq
-enum { DR_PING           = US915_DR_SF10CR };       // default ping DR
+enum { FREQ_PING         = 0 };  // default ping freq (ttn-esp32: 0 = hopping, see LMICbandplan_getPingFreq())
+enum { DR_PING           = US915_DR_SF12CR };       // default ping DR: DR8
 //enum { CHNL_DNW2         = 0 };
 enum { FREQ_DNW2         = US915_500kHz_DNFBASE + 0*US915_500kHz_DNFSTEP };
 enum { DR_DNW2           = US915_DR_SF12CR };
 enum { CHNL_BCN          = 0 }; // used only for default init of state (rotating beacon scheme)
 enum { DR_BCN            = US915_DR_SF12CR };
-// TODO(tmm@mcci.com): check this, as beacon DR was SF10 in IBM code.
-enum { AIRTIME_BCN       = 72192 };  // micros
+enum { AIRTIME_BCN       = 306652 };  // micros (ttn-esp32: 10 symbol preamble, plus TBeaconDelay of 1.5 ms)
 enum { LMIC_REGION_EIRP = US915_LMIC_REGION_EIRP };         // region uses EIRP
 
 enum {
-    // Beacon frame format US SF10
-    OFF_BCN_NETID    = 0,
-    OFF_BCN_TIME     = 3,
-    OFF_BCN_CRC1     = 7,
-    OFF_BCN_INFO     = 9,
-    OFF_BCN_LAT      = 10,
-    OFF_BCN_LON      = 13,
-    OFF_BCN_RFU1     = 16,
-    OFF_BCN_CRC2     = 17,
-    LEN_BCN          = 19
+    // Beacon frame format US DR8 (ttn-esp32: LoRaWAN 1.0.3 / RP002)
+    // RFU(5) | Time(4) | CRC(2) | GwSpecific(7) | RFU(3) | CRC(2)
+    OFF_BCN_TIME     = 5,
+    OFF_BCN_CRC1     = 9,
+    OFF_BCN_INFO     = 11,
+    OFF_BCN_LAT      = 12,
+    OFF_BCN_LON      = 15,
+    OFF_BCN_RFU1     = 18,
+    OFF_BCN_CRC2     = 21,
+    LEN_BCN          = 23
 };
 
 # if LMIC_DR_LEGACY
@@ -240,27 +239,27 @@ enum { DR_DFLTMIN       = AU915_DR_SF7 };  // DR5
 enum { DR_PAGE          = DR_PAGE_AU915 };
 
 //enum { CHNL_PING        = 0 }; // used only for default init of state (follows beacon - rotating)
-enum { FREQ_PING        = AU915_500kHz_DNFBASE + 0*AU915_500kHz_DNFSTEP };  // default ping freq
-enum { DR_PING          = AU915_DR_SF10CR };       // default ping DR
+enum { FREQ_PING        = 0 };  // default ping freq (ttn-esp32: 0 = hopping, see LMICbandplan_getPingFreq())
+enum { DR_PING          = AU915_DR_SF12CR };       // default ping DR: DR8
 //enum { CHNL_DNW2        = 0 };
 enum { FREQ_DNW2        = AU915_500kHz_DNFBASE + 0*AU915_500kHz_DNFSTEP };
 enum { DR_DNW2          = AU915_DR_SF12CR };                  // DR8
 enum { CHNL_BCN         = 0 }; // used only for default init of state (rotating beacon scheme)
-enum { DR_BCN           = AU915_DR_SF10CR };
-enum { AIRTIME_BCN      = 72192 };  // micros ... TODO(tmm@mcci.com) check.
+enum { DR_BCN           = AU915_DR_SF12CR };                  // DR8
+enum { AIRTIME_BCN      = 306652 };  // micros (ttn-esp32: 10 symbol preamble, plus TBeaconDelay of 1.5 ms)
 enum { LMIC_REGION_EIRP = AU915_LMIC_REGION_EIRP };         // region uses EIRP
 
 enum {
-        // Beacon frame format AU DR10/SF10 500kHz
-        OFF_BCN_NETID = 0,
-        OFF_BCN_TIME = 3,
-        OFF_BCN_CRC1 = 7,
-        OFF_BCN_INFO = 9,
-        OFF_BCN_LAT = 10,
-        OFF_BCN_LON = 13,
-        OFF_BCN_RFU1 = 16,
-        OFF_BCN_CRC2 = 17,
-        LEN_BCN = 19
+        // Beacon frame format AU DR8 (ttn-esp32: LoRaWAN 1.0.3 / RP002)
+        // RFU(5) | Time(4) | CRC(2) | GwSpecific(7) | RFU(3) | CRC(2)
+        OFF_BCN_TIME = 5,
+        OFF_BCN_CRC1 = 9,
+        OFF_BCN_INFO = 11,
+        OFF_BCN_LAT = 12,
+        OFF_BCN_LON = 15,
+        OFF_BCN_RFU1 = 18,
+        OFF_BCN_CRC2 = 21,
+        LEN_BCN = 23
 };
 
 # if LMIC_DR_LEGACY
@@ -300,12 +299,12 @@ enum { DR_DNW2 = AS923_DR_SF10 };
 enum { CHNL_BCN = 5 };
 enum { FREQ_BCN = AS923_FBCN };
 enum { DR_BCN = AS923_DR_SF9 };
-enum { AIRTIME_BCN = 144384 };  // micros
+enum { AIRTIME_BCN = 154076 };  // micros (ttn-esp32: 10 symbol preamble, plus TBeaconDelay of 1.5 ms)
 enum { LMIC_REGION_EIRP = AS923_LMIC_REGION_EIRP };         // region uses EIRP
 
 enum {
         // Beacon frame format AS SF9
-        OFF_BCN_NETID = 0,
+        // RFU(2) | Time(4) | CRC(2) | GwSpecific(7) | CRC(2)
         OFF_BCN_TIME = 2,
         OFF_BCN_CRC1 = 6,
         OFF_BCN_INFO = 8,
@@ -347,12 +346,12 @@ enum { DR_DNW2 = KR920_DR_SF12 };
 enum { CHNL_BCN = 11 };
 enum { FREQ_BCN = KR920_FBCN };
 enum { DR_BCN = KR920_DR_SF9 };
-enum { AIRTIME_BCN = 144384 };  // micros
+enum { AIRTIME_BCN = 154076 };  // micros (ttn-esp32: 10 symbol preamble, plus TBeaconDelay of 1.5 ms)
 enum { LMIC_REGION_EIRP = KR920_LMIC_REGION_EIRP };         // region uses EIRP
 
 enum {
         // Beacon frame format KR SF9
-        OFF_BCN_NETID = 0,
+        // RFU(2) | Time(4) | CRC(2) | GwSpecific(7) | CRC(2)
         OFF_BCN_TIME = 2,
         OFF_BCN_CRC1 = 6,
         OFF_BCN_INFO = 8,
@@ -391,12 +390,12 @@ enum { DR_DNW2 = IN866_DR_SF10 };
 enum { CHNL_BCN = 5 };
 enum { FREQ_BCN = IN866_FB };
 enum { DR_BCN = IN866_DR_SF8 };
-enum { AIRTIME_BCN = 144384 };  // micros
+enum { AIRTIME_BCN = 88028 };  // micros (ttn-esp32: 10 symbol preamble, plus TBeaconDelay of 1.5 ms)
 enum { LMIC_REGION_EIRP = IN866_LMIC_REGION_EIRP };         // region uses EIRP
 
 enum {
-        // Beacon frame format IN SF9
-        OFF_BCN_NETID = 0,
+        // Beacon frame format IN SF8
+        // RFU(1) | Time(4) | CRC(2) | GwSpecific(7) | RFU(3) | CRC(2)
         OFF_BCN_TIME = 1,
         OFF_BCN_CRC1 = 5,
         OFF_BCN_INFO = 7,
@@ -47,6 +47,23 @@ int os_init_ex (const void *pintable) {
     return 1;
 }
 
+// ttn-esp32: initialize for a warm start where the radio has kept its
+// configuration (e.g. after deep sleep). Falls back to a full radio
+// initialization if the radio fails the check. Returns 2 for a warm start,
+// 1 for a cold start and 0 on failure.
+int os_init_warm_ex (const void *pintable) {
+    memset(&OS, 0x00, sizeof(OS));
+    hal_init_ex(pintable);
+    int result = 2;
+    if (! radio_init_warm()) {
+        if (! radio_init())
+            return 0;
+        result = 1;
+    }
+    LMIC_init();
+    return result;
+}
+
 void os_init() {
     if (os_init_ex((const void *)&lmic_pins))
         return;
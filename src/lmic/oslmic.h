@@ -112,6 +112,10 @@ void radio_irq_handler (u1_t dio);
 void radio_irq_handler_v2 (u1_t dio, ostime_t tref);
 void os_init (void);
 int os_init_ex (const void *pPinMap);
+int os_init_warm_ex (const void *pPinMap);
+int radio_init_warm (void);
+void radio_get_rand_state (u1_t *state);
+void radio_set_rand_state (const u1_t *state);
 void os_runloop (void);
 void os_runloop_once (void);
 u1_t radio_rssi (void);
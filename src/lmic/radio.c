@@ -405,8 +405,30 @@ static void requestModuleActive(bit_t state) {
         hal_waitUntil(os_getTime() + ticks);;
 }
 
+// ttn-esp32: radio state for each operating mode (energy accounting)
+static CONST_TABLE(u1_t, RADIO_STATE_FOR_OPMODE)[] = {
+    [OPMODE_SLEEP]     = LMIC_RADIO_STATE_SLEEP,
+    [OPMODE_STANDBY]   = LMIC_RADIO_STATE_STANDBY,
+    [OPMODE_FSTX]      = LMIC_RADIO_STATE_SYNTH,
+    [OPMODE_TX]        = LMIC_RADIO_STATE_TX,
+    [OPMODE_FSRX]      = LMIC_RADIO_STATE_SYNTH,
+    [OPMODE_RX]        = LMIC_RADIO_STATE_RX,
+    [OPMODE_RX_SINGLE] = LMIC_RADIO_STATE_RX,
+    [OPMODE_CAD]       = LMIC_RADIO_STATE_RX,
+};
+
+// ttn-esp32: add the time spent in the current radio state and enter the state of the mode
+static void accountState(u1_t mode, ostime_t now) {
+    __atomic_add_fetch(&LMIC.radio.state_seq, 1, __ATOMIC_ACQ_REL);
+    LMIC.radio.state_ticks[LMIC.radio.state] += (u4_t)(now - LMIC.radio.state_since);
+    LMIC.radio.state = TABLE_GET_U1(RADIO_STATE_FOR_OPMODE, mode & OPMODE_MASK);
+    LMIC.radio.state_since = now;
+    __atomic_add_fetch(&LMIC.radio.state_seq, 1, __ATOMIC_RELEASE);
+}
+
 static void writeOpmode(u1_t mode) {
     u1_t const maskedMode = mode & OPMODE_MASK;
+    accountState(mode, os_getTime()); // ttn-esp32
     if (maskedMode != OPMODE_SLEEP)
         requestModuleActive(1);
     writeReg(RegOpMode, mode);
@@ -1159,6 +1181,32 @@ int radio_init () {
     return 1;
 }
 
+// ttn-esp32: initialize the radio for a warm start, e.g. after deep sleep.
+// The radio is not reset and keeps its configuration. A single read of the
+// operation mode register checks that it is still in LoRa sleep mode as left
+// by the previous session; a radio that has been reset or power-cycled reads
+// back FSK standby. Returns 0 if the check fails and radio_init() is needed.
+// The random seed buffer must be restored with radio_set_rand_state().
+int radio_init_warm () {
+    requestModuleActive(1);
+
+    if ((readReg(RegOpMode) & (OPMODE_LORA | OPMODE_MASK)) != (OPMODE_LORA | OPMODE_SLEEP))
+        return 0;
+
+    return 1;
+}
+
+// ttn-esp32: save and restore the random seed buffer across a warm start
+void radio_get_rand_state (u1_t *state) {
+    os_copyMem(state, randbuf, sizeof(randbuf));
+}
+
+void radio_set_rand_state (const u1_t *state) {
+    os_copyMem(randbuf, state, sizeof(randbuf));
+    if (randbuf[0] == 0 || randbuf[0] > 16)
+        randbuf[0] = 16; // re-encrypt seed before next use
+}
+
 // return next random byte derived from seed buffer
 // (buf[0] holds index of next byte to be returned)
 u1_t radio_rand1 () {
@@ -1293,7 +1341,11 @@ void radio_irq_handler_v2 (u1_t dio, ostime_t now) {
 #if LMIC_DEBUG_LEVEL > 0
     ostime_t const entry = now;
 #endif
-    if( (readReg(RegOpMode) & OPMODE_LORA) != 0) { // LORA modem
+    // ttn-esp32: the radio changes to standby by itself after TX and single RX
+    u1_t const mode = readReg(RegOpMode);
+    accountState(mode, now);
+
+    if( (mode & OPMODE_LORA) != 0) { // LORA modem
         u1_t flags = readReg(LORARegIrqFlags);
         LMIC.saveIrqFlags = flags;
         LMICOS_logEventUint32("radio_irq_handler_v2: LoRa", flags);
@@ -1302,6 +1354,7 @@ void radio_irq_handler_v2 (u1_t dio, ostime_t now) {
             // save exact tx time
             LMIC.txend = now - us2osticks(43); // TXDONE FIXUP
         } else if( flags & IRQ_LORA_RXDONE_MASK ) {
+            ostime_t const rxdone = now; // ttn-esp32
             // save exact rx time
             if(getBw(LMIC.rps) == BW125) {
                 now -= TABLE_GET_U2(LORA_RXDONE_FIXUP, getSf(LMIC.rps));
@@ -1310,6 +1363,8 @@ void radio_irq_handler_v2 (u1_t dio, ostime_t now) {
             // read the PDU and inform the MAC that we received something
             LMIC.dataLen = (readReg(LORARegModemConfig1) & SX127X_MC1_IMPLICIT_HEADER_MODE_ON) ?
                 readReg(LORARegPayloadLength) : readReg(LORARegRxNbBytes);
+            // ttn-esp32: start of the preamble, for the clock error calibration
+            LMIC.radio.rxframe_start = rxdone - calcAirTime(LMIC.rps, LMIC.dataLen);
             // set FIFO read address pointer
             writeReg(LORARegFifoAddrPtr, readReg(LORARegFifoRxCurrentAddr));
             // now read the FIFO
@@ -1379,6 +1434,13 @@ void radio_irq_handler_v2 (u1_t dio, ostime_t now) {
     }
     // go from standby to sleep
     opmode(OPMODE_SLEEP);
+    // ttn-esp32: frames received in Class C continuous RX have their own job
+    // (LMIC.osjob may be scheduled for the next uplink); it re-arms the reception
+    if (LMIC.classCState == LMIC_CLASSC_RX) {
+        LMIC.classCState = LMIC_CLASSC_RXDONE;
+        os_setCallback(&LMIC.classCJob, LMIC.classCJob.func);
+        return;
+    }
     // run os job (use preset func ptr)
     os_setCallback(&LMIC.osjob, LMIC.osjob.func);
 #endif /* ! CFG_TxContinuousMode */
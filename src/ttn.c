@@ -13,18 +13,43 @@
 #include "ttn.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include "hal/hal_esp32.h"
 #include "lmic/lmic.h"
+#include "lmic/lmic_bandplan.h"
+#include "mbedtls/platform_util.h"
+#include "ttn_adr_cache.h"
+#include "ttn_clock.h"
+#include "ttn_clock_cal.h"
+#include "ttn_command.h"
+#include "ttn_dispatch.h"
+#include "ttn_dr_advisor.h"
+#include "ttn_energy.h"
 #include "ttn_logging.h"
 #include "ttn_provisioning.h"
 #include "ttn_nvs.h"
 #include "ttn_rtc.h"
+#include "ttn_slotted_tx.h"
+#include "ttn_startup_trace.h"
+#include "ttn_telemetry.h"
 
 #define TAG "ttn"
 
 #define DEFAULT_MAX_TX_POWER -1000
 
+#define MAC_IDLE_BIT 0x01
+
+#define FRAGMENT_HEADER_SIZE 4
+#define FRAGMENT_MAX_COUNT 256
+#define FRAGMENT_MAX_GROUP 15
+
+// ttn_payload_segment_t is passed to LMIC as is
+_Static_assert(sizeof(ttn_payload_segment_t) == sizeof(lmic_tx_segment_t), "segment layout mismatch");
+_Static_assert(__builtin_offsetof(ttn_payload_segment_t, length) == __builtin_offsetof(lmic_tx_segment_t, nData),
+               "segment layout mismatch");
+
 /**
  * @brief Reason the user code is waiting
  */
@@ -32,7 +57,9 @@ typedef enum
 {
     TTN_WAITING_NONE,
     TTN_WAITING_FOR_JOIN,
-    TTN_WAITING_FOR_TRANSMISSION
+    TTN_WAITING_FOR_TRANSMISSION,
+    // result has been posted, but not yet received by the waiting task
+    TTN_WAITING_RESULT_POSTED
 } ttn_waiting_reason_t;
 
 /**
@@ -43,7 +70,6 @@ typedef enum
     TTN_EVENT_NONE,
     TTN_EVNT_JOIN_COMPLETED,
     TTN_EVENT_JOIN_FAILED,
-    TTN_EVENT_MESSAGE_RECEIVED,
     TTN_EVENT_TRANSMISSION_COMPLETED,
     TTN_EVENT_TRANSMISSION_FAILED
 } ttn_event_t;
@@ -54,29 +80,88 @@ typedef enum
 typedef struct
 {
     ttn_event_t event;
-    uint8_t port;
-    const uint8_t *message;
-    size_t message_size;
 } ttn_lmic_event_t;
 
+/**
+ * @brief Arguments for restoring the session from NVS in the LMIC task
+ */
+typedef struct
+{
+    int off_duration;
+    bool restored;
+} nvs_restore_args_t;
+
+/**
+ * @brief Arguments and results of the multicast functions run in the LMIC task
+ */
+typedef struct
+{
+    int index;
+    const ttn_multicast_session_t *session;
+    int periodicity;
+    uint32_t frequency;
+    ttn_data_rate_t data_rate;
+    bool result;
+    uint32_t fcnt;
+} multicast_args_t;
+
 static bool is_started;
+// written by start() and stop(), read by any task
+static bool is_running;
 static bool has_joined;
 static QueueHandle_t lmic_event_queue;
-static ttn_message_cb message_callback;
 static ttn_waiting_reason_t waiting_reason;
 static ttn_rf_settings_t last_rf_settings[4];
 static ttn_rx_tx_window_t current_rx_tx_window;
 static int subband = 2;
 static ttn_data_rate_t join_data_rate = TTN_DR_JOIN_DEFAULT;
 static int max_tx_power = DEFAULT_MAX_TX_POWER;
-
-static void start(void);
+static int ping_slot_periodicity = 7;
+static EventGroupHandle_t mac_state_event_group;
+static volatile ttn_mac_state_t mac_state;
+static volatile TickType_t duty_wait_end;
+// posted, but not yet executed commands
+static uint32_t commands_in_flight;
+static uint8_t fragmented_message_number;
+// uplink timing (updated by the LMIC task and the transmitting tasks)
+static portMUX_TYPE timing_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool is_submitting;
+static int64_t submit_time;
+static uint32_t num_immediate_uplinks;
+static uint64_t total_tx_start_us;
+static uint32_t max_tx_start_us;
+static uint32_t num_encryptions;
+static uint64_t total_encrypt_us;
+
+static void start(bool warm_start);
 static void stop(void);
 static bool join_core(void);
+static ttn_response_code_t transmit(ttn_port_t port, const uint8_t *payload, size_t length,
+                                   const ttn_payload_segment_t *segments, size_t num_segments, bool confirm);
+static ttn_response_code_t transmit_fragment(ttn_port_t port, const uint8_t *header, const uint8_t *data, size_t length);
+static size_t max_payload_size(void);
 static void config_rf_params(void);
 static void event_callback(void *user_data, ev_t event);
 static void message_received_callback(void *user_data, uint8_t port, const uint8_t *message, size_t message_size);
 static void message_transmitted_callback(void *user_data, int success);
+static void post_transmission_result(bool success);
+static void post_result(ttn_event_t event);
+static void post_command(const ttn_command_t *command);
+static void run_in_lmic_task(void (*function)(void *arg), void *arg);
+static void process_commands(void);
+static void drain_commands(void);
+static void execute_command(const ttn_command_t *command);
+static void submit_transmission(const ttn_command_t *command);
+static void restore_from_rtc(void *arg);
+static void restore_from_nvs(void *arg);
+static void get_max_frame_len(void *arg);
+static void check_frame_feasible(void *arg);
+static void set_multicast_session(void *arg);
+static void set_multicast_ping_slots(void *arg);
+static void clear_multicast_session(void *arg);
+static void get_multicast_fcnt(void *arg);
+static void lmic_going_to_sleep(TickType_t duration);
+static void publish_mac_state(ttn_mac_state_t state);
 static void save_rf_settings(ttn_rf_settings_t *rf_settings);
 static void clear_rf_settings(ttn_rf_settings_t *rf_settings);
 
@@ -87,17 +172,28 @@ void ttn_init(void)
     ASSERT(0);
 #endif
 
-    message_callback = NULL;
+    TTN_STARTUP_BEGIN(TTN_STARTUP_INIT);
+    ttn_dispatch_set_callback(NULL);
+    ttn_command_init();
     hal_esp32_init_critical_section();
+    hal_esp32_set_command_handler(process_commands);
+    hal_esp32_set_sleep_handler(lmic_going_to_sleep);
+
+    mac_state_event_group = xEventGroupCreate();
+    ASSERT(mac_state_event_group != NULL);
+    publish_mac_state(TTN_MAC_IDLE);
+    TTN_STARTUP_END(TTN_STARTUP_INIT);
 }
 
 void ttn_configure_pins(spi_host_device_t spi_host, uint8_t nss, uint8_t rxtx, uint8_t rst, uint8_t dio0, uint8_t dio1)
 {
+    TTN_STARTUP_BEGIN(TTN_STARTUP_CONFIGURE_PINS);
     hal_esp32_configure_pins(spi_host, nss, rxtx, rst, dio0, dio1);
 
 #if LMIC_ENABLE_event_logging
     ttn_log_init();
 #endif
+    TTN_STARTUP_END(TTN_STARTUP_CONFIGURE_PINS);
 }
 
 void ttn_set_subband(int band)
@@ -105,7 +201,7 @@ void ttn_set_subband(int band)
     subband = band;
 }
 
-void start(void)
+void start(bool warm_start)
 {
     if (is_started)
         return;
@@ -113,28 +209,52 @@ void start(void)
     LMIC_registerEventCb(event_callback, NULL);
     LMIC_registerRxMessageCb(message_received_callback, NULL);
 
-    os_init_ex(NULL);
+    TTN_STARTUP_BEGIN(TTN_STARTUP_RADIO_INIT);
+    if (warm_start)
+    {
+        // The radio has kept its configuration and the session is about to be
+        // restored from RTC memory: skip radio reset and RSSI seeding.
+        warm_start = os_init_warm_ex(NULL) == 2;
+        if (!warm_start)
+            ESP_LOGW(TAG, "Radio has lost its state, falling back to full initialization");
+    }
+    else
+    {
+        os_init_ex(NULL);
+    }
+    TTN_STARTUP_END(TTN_STARTUP_RADIO_INIT);
+
     hal_esp32_enter_critical_section();
-    LMIC_reset();
-    LMIC_setClockError(MAX_CLOCK_ERROR * 4 / 100);
+    if (warm_start)
+        LMIC_resetState();
+    else
+        LMIC_reset();
+    ttn_clock_cal_apply();
     waiting_reason = TTN_WAITING_NONE;
     hal_esp32_leave_critical_section();
 
     lmic_event_queue = xQueueCreate(4, sizeof(ttn_lmic_event_t));
     ASSERT(lmic_event_queue != NULL);
+    ttn_dispatch_init();
     hal_esp32_start_lmic_task();
     is_started = true;
+    __atomic_store_n(&is_running, true, __ATOMIC_SEQ_CST);
 }
 
 void stop(void)
 {
     if (!is_started)
         return;
-    
+
+    // commands posted from now on are executed directly
+    __atomic_store_n(&is_running, false, __ATOMIC_SEQ_CST);
+    hal_esp32_stop_lmic_task();
+
     hal_esp32_enter_critical_section();
     LMIC_shutdown();
-    hal_esp32_stop_lmic_task();
+    drain_commands();
     waiting_reason = TTN_WAITING_NONE;
+    publish_mac_state(TTN_MAC_IDLE);
     hal_esp32_leave_critical_section();
 }
 
@@ -228,12 +348,20 @@ bool ttn_resume_after_deep_sleep(void)
         return false;
     }
 
-    start();
+    if (!ttn_rtc_is_valid())
+        return false;
+
+    start(true);
 
-    if (!ttn_rtc_restore())
+    TTN_STARTUP_BEGIN(TTN_STARTUP_SESSION_RESTORE);
+    bool restored = false;
+    run_in_lmic_task(restore_from_rtc, &restored);
+    if (!restored)
         return false;
+    TTN_STARTUP_END(TTN_STARTUP_SESSION_RESTORE);
 
     has_joined = true;
+    ESP_LOGI(TAG, "Resumed after deep sleep, ready %lld us after boot", (long long)esp_timer_get_time());
     return true;
 }
 
@@ -251,10 +379,14 @@ bool ttn_resume_after_power_off(int off_duration)
         return false;
     }
 
-    start();
+    start(false);
 
-    if (!ttn_nvs_restore(off_duration))
+    TTN_STARTUP_BEGIN(TTN_STARTUP_SESSION_RESTORE);
+    nvs_restore_args_t args = {.off_duration = off_duration};
+    run_in_lmic_task(restore_from_nvs, &args);
+    if (!args.restored)
         return false;
+    TTN_STARTUP_END(TTN_STARTUP_SESSION_RESTORE);
 
     has_joined = true;
     return true;
@@ -284,68 +416,237 @@ bool join_core(void)
         return false;
     }
 
-    start();
+    start(false);
+    if (!__atomic_load_n(&is_running, __ATOMIC_SEQ_CST))
+        return false; // stopped for deep sleep or power off
+
+    // claim the slot for waiting on the result; a transmission might be in progress
+    ttn_waiting_reason_t expected = TTN_WAITING_NONE;
+    if (!__atomic_compare_exchange_n(&waiting_reason, &expected, TTN_WAITING_FOR_JOIN, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_RELAXED))
+    {
+        ESP_LOGW(TAG, "Cannot join while a transmission is in progress");
+        return false;
+    }
 
     has_joined = true;
-    hal_esp32_enter_critical_section();
     xQueueReset(lmic_event_queue);
-    waiting_reason = TTN_WAITING_FOR_JOIN;
-
-    LMIC_startJoining();
-    config_rf_params();
 
-    hal_esp32_wake_up();
-    hal_esp32_leave_critical_section();
+    TTN_STARTUP_BEGIN(TTN_STARTUP_JOIN);
+    ttn_command_t command = {.type = TTN_CMD_JOIN};
+    post_command(&command);
 
     ttn_lmic_event_t event;
     xQueueReceive(lmic_event_queue, &event, portMAX_DELAY);
+    // release the slot only now so no other task can wait on the queue before
+    __atomic_store_n(&waiting_reason, TTN_WAITING_NONE, __ATOMIC_RELEASE);
     has_joined = event.event == TTN_EVNT_JOIN_COMPLETED;
     return has_joined;
 }
 
 ttn_response_code_t ttn_transmit_message(const uint8_t *payload, size_t length, ttn_port_t port, bool confirm)
 {
-    hal_esp32_enter_critical_section();
-    if (waiting_reason != TTN_WAITING_NONE || (LMIC.opmode & OP_TXRXPEND) != 0)
-    {
-        hal_esp32_leave_critical_section();
+#if defined(CONFIG_TTN_ZERO_COPY_TX)
+    if (length > MAX_LEN_PAYLOAD)
         return TTN_ERROR_TRANSMISSION_FAILED;
-    }
+    // the caller's buffer stays valid until the transmission has completed
+    ttn_payload_segment_t segment = {.data = payload, .length = length};
+    return transmit(port, NULL, 0, &segment, 1, confirm);
+#else
+    return transmit(port, payload, length, NULL, 0, confirm);
+#endif
+}
 
-    waiting_reason = TTN_WAITING_FOR_TRANSMISSION;
-    LMIC.client.txMessageCb = message_transmitted_callback;
-    LMIC.client.txMessageUserData = NULL;
-    LMIC_setTxData2(port, (xref2u1_t)payload, length, confirm);
-    hal_esp32_wake_up();
-    hal_esp32_leave_critical_section();
+ttn_response_code_t ttn_transmit_segments(const ttn_payload_segment_t *segments, size_t num_segments, ttn_port_t port,
+                                          bool confirm)
+{
+    if (num_segments > UINT8_MAX)
+        return TTN_ERROR_TRANSMISSION_FAILED;
+    return transmit(port, NULL, 0, segments, num_segments, confirm);
+}
 
-    while (true)
+ttn_response_code_t ttn_transmit_fragmented(const uint8_t *payload, size_t length, ttn_port_t port, int parity_group)
+{
+    if (length == 0 || length > UINT16_MAX || parity_group < 0 || parity_group == 1 ||
+        parity_group > FRAGMENT_MAX_GROUP)
+        return TTN_ERROR_TRANSMISSION_FAILED;
+
+    // fragment size fixed for the entire message
+    size_t max_payload = max_payload_size();
+    if (max_payload <= FRAGMENT_HEADER_SIZE)
+        return TTN_ERROR_FRAGMENT_TOO_LARGE;
+    size_t frag_size = max_payload - FRAGMENT_HEADER_SIZE;
+    size_t num_data = (length + frag_size - 1) / frag_size;
+    size_t num_parity = parity_group > 0 ? (num_data + parity_group - 1) / parity_group : 0;
+    if (num_data + num_parity > FRAGMENT_MAX_COUNT)
+        return TTN_ERROR_TRANSMISSION_FAILED;
+
+    uint8_t number = fragmented_message_number++ & 0x0f;
+    uint8_t header[FRAGMENT_HEADER_SIZE] = {(number << 4) | parity_group, 0, length & 0xff, length >> 8};
+    uint8_t parity[MAX_LEN_PAYLOAD];
+
+    for (size_t i = 0; i < num_data; i++)
     {
-        ttn_lmic_event_t result;
-        xQueueReceive(lmic_event_queue, &result, portMAX_DELAY);
+        const uint8_t *data = payload + i * frag_size;
+        size_t data_length = i + 1 < num_data ? frag_size : length - i * frag_size;
+
+        header[1] = i;
+        ttn_response_code_t res = transmit_fragment(port, header, data, data_length);
+        if (res != TTN_SUCCESSFUL_TRANSMISSION)
+            return res;
 
-        switch (result.event)
+        if (num_parity == 0)
+            continue;
+
+        // parity fragment: XOR of the group's data fragments, padded with zeros
+        size_t group_index = i % parity_group;
+        if (group_index == 0)
+            memset(parity, 0, frag_size);
+        for (size_t j = 0; j < data_length; j++)
+            parity[j] ^= data[j];
+
+        if (group_index + 1 == parity_group || i + 1 == num_data)
         {
-        case TTN_EVENT_MESSAGE_RECEIVED:
-            if (message_callback != NULL)
-                message_callback(result.message, result.message_size, result.port);
-            break;
+            header[1] = num_data + i / parity_group;
+            res = transmit_fragment(port, header, parity, frag_size);
+            if (res != TTN_SUCCESSFUL_TRANSMISSION)
+                return res;
+        }
+    }
+
+    return TTN_SUCCESSFUL_TRANSMISSION;
+}
+
+// Sends a fragment; checks first that it still fits as the data rate might have dropped since the previous one
+ttn_response_code_t transmit_fragment(ttn_port_t port, const uint8_t *header, const uint8_t *data, size_t length)
+{
+    ttn_payload_segment_t segments[2] = {
+        {.data = header, .length = FRAGMENT_HEADER_SIZE},
+        {.data = data, .length = length},
+    };
+
+    size_t frame_payload = FRAGMENT_HEADER_SIZE + length;
+    run_in_lmic_task(check_frame_feasible, &frame_payload);
+    if (frame_payload == 0)
+        return TTN_ERROR_FRAGMENT_TOO_LARGE;
+
+    return transmit(port, NULL, 0, segments, 2, false);
+}
 
-        case TTN_EVENT_TRANSMISSION_COMPLETED:
-            return TTN_SUCCESSFUL_TRANSMISSION;
+// Largest payload that fits into a frame at the current data rate without FOpts.
+// This is the limit LMIC_feasibleDataRateForFrame() checks before it switches to a faster data rate.
+size_t max_payload_size(void)
+{
+    int max_frame_len = 0;
+    run_in_lmic_task(get_max_frame_len, &max_frame_len);
+
+    int max_payload = max_frame_len - OFF_DAT_OPTS - 5;
+    if (max_payload <= 0)
+        return 0;
+    return max_payload < MAX_LEN_PAYLOAD ? max_payload : MAX_LEN_PAYLOAD;
+}
 
-        case TTN_EVENT_TRANSMISSION_FAILED:
-            return TTN_ERROR_TRANSMISSION_FAILED;
+ttn_response_code_t transmit(ttn_port_t port, const uint8_t *payload, size_t length,
+                             const ttn_payload_segment_t *segments, size_t num_segments, bool confirm)
+{
+    // claim the transmission slot; other tasks might try at the same time
+    ttn_waiting_reason_t expected = TTN_WAITING_NONE;
+    if (!__atomic_load_n(&is_running, __ATOMIC_SEQ_CST) ||
+        !__atomic_compare_exchange_n(&waiting_reason, &expected, TTN_WAITING_FOR_TRANSMISSION, false,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return TTN_ERROR_TRANSMISSION_FAILED;
 
-        default:
-            ASSERT(0);
+    ttn_command_t command = {.type = TTN_CMD_TRANSMIT,
+                             .transmit = {.payload = payload,
+                                          .length = length,
+                                          .segments = segments,
+                                          .num_segments = num_segments,
+                                          .port = port,
+                                          .confirm = confirm}};
+
+#if defined(CONFIG_TTN_TX_PRE_ENCRYPTION)
+    // Encrypt in this task so the LMIC task only has to build the header and the MIC.
+    // The key stream is used if it still matches the session and frame counter when the
+    // frame is built, and it stays valid until the transmission has completed.
+    lmic_tx_keystream_t keystream;
+    size_t total_length = length;
+    if (segments != NULL)
+    {
+        total_length = 0;
+        for (size_t i = 0; i < num_segments; i++)
+            total_length += segments[i].length;
+    }
+    if (total_length <= MAX_LEN_PAYLOAD)
+    {
+        int64_t start = esp_timer_get_time();
+        LMIC_prepareTxKeystream(&keystream, port, total_length);
+        if (keystream.nStream == total_length && total_length > 0)
+        {
+            command.transmit.keystream = &keystream;
+            int64_t duration = esp_timer_get_time() - start;
+            portENTER_CRITICAL(&timing_lock);
+            total_encrypt_us += duration;
+            num_encryptions++;
+            portEXIT_CRITICAL(&timing_lock);
         }
     }
+#endif
+
+    post_command(&command);
+
+    ttn_response_code_t res = TTN_ERROR_TRANSMISSION_FAILED;
+    ttn_lmic_event_t result;
+    xQueueReceive(lmic_event_queue, &result, portMAX_DELAY);
+    // release the slot only now so no other task can wait on the queue before
+    __atomic_store_n(&waiting_reason, TTN_WAITING_NONE, __ATOMIC_RELEASE);
+    switch (result.event)
+    {
+    case TTN_EVENT_TRANSMISSION_COMPLETED:
+        res = TTN_SUCCESSFUL_TRANSMISSION;
+        break;
+
+    case TTN_EVENT_TRANSMISSION_FAILED:
+        break;
+
+    default:
+        ASSERT(0);
+    }
+
+#if defined(CONFIG_TTN_TX_PRE_ENCRYPTION)
+    // contains a copy of the session key
+    mbedtls_platform_zeroize(&keystream, sizeof(keystream));
+#endif
+    return res;
+}
+
+void ttn_get_uplink_timing(ttn_uplink_timing_t *timing)
+{
+    portENTER_CRITICAL(&timing_lock);
+    uint32_t num_uplinks = num_immediate_uplinks;
+    uint32_t encryptions = num_encryptions;
+    uint64_t encrypt_us = total_encrypt_us;
+    uint64_t tx_start_us = total_tx_start_us;
+    timing->max_tx_start_us = max_tx_start_us;
+    portEXIT_CRITICAL(&timing_lock);
+
+    timing->uplinks = num_uplinks;
+    timing->encrypt_us = encryptions != 0 ? encrypt_us / encryptions : 0;
+    timing->tx_start_us = num_uplinks != 0 ? tx_start_us / num_uplinks : 0;
 }
 
 void ttn_on_message(ttn_message_cb callback)
 {
-    message_callback = callback;
+    ttn_dispatch_set_callback(callback);
+}
+
+bool ttn_on_port_message(ttn_port_t port, ttn_port_message_cb callback, void *user_data)
+{
+    return ttn_dispatch_set_port_callback(port, callback, user_data);
+}
+
+void ttn_get_downlink_stats(ttn_downlink_stats_t *stats)
+{
+    ttn_dispatch_get_stats(stats);
 }
 
 bool ttn_is_provisioned(void)
@@ -358,27 +659,49 @@ bool ttn_is_provisioned(void)
     return ttn_provisioning_have_keys();
 }
 
+// The state is saved after the LMIC task has stopped so it cannot change in the meantime.
+
 void ttn_prepare_for_deep_sleep(void)
 {
-    ttn_rtc_save();
     stop();
+    ttn_rtc_save();
 }
 
 void ttn_prepare_for_power_off(void)
 {
+    stop();
     ttn_nvs_save();
+}
+
+ttn_save_handle_t ttn_prepare_for_power_off_async(void)
+{
+    // snapshot now, commit in the background
     stop();
+    return ttn_nvs_save_async();
+}
+
+bool ttn_wait_for_save(ttn_save_handle_t handle, TickType_t ticks_to_wait)
+{
+    return ttn_nvs_wait_for_save(handle, ticks_to_wait);
 }
 
 void ttn_wait_for_idle(void)
 {
-    while (true)
-    {
-        TickType_t ticks_to_wait = ttn_busy_duration();
-        if (ticks_to_wait == 0)
-            return;
-        vTaskDelay(ticks_to_wait);
-    }
+    ttn_wait_for_idle_timeout(portMAX_DELAY);
+}
+
+bool ttn_wait_for_idle_timeout(TickType_t ticks_to_wait)
+{
+    EventBits_t bits = xEventGroupWaitBits(mac_state_event_group, MAC_IDLE_BIT, pdFALSE, pdTRUE, ticks_to_wait);
+    return (bits & MAC_IDLE_BIT) != 0;
+}
+
+ttn_mac_state_t ttn_get_mac_state(TickType_t *wait_end)
+{
+    ttn_mac_state_t state = mac_state;
+    if (wait_end != NULL)
+        *wait_end = duty_wait_end;
+    return state;
 }
 
 TickType_t ttn_busy_duration(void)
@@ -406,9 +729,79 @@ bool ttn_adr_enabled(void)
 
 void ttn_set_adr_enabled(bool enabled)
 {
-    hal_esp32_enter_critical_section();
-    LMIC_setAdrMode(enabled);
-    hal_esp32_leave_critical_section();
+    ttn_command_t command = {.type = TTN_CMD_SET_ADR_ENABLED, .adr_enabled = enabled};
+    post_command(&command);
+}
+
+void ttn_set_device_class(ttn_device_class_t device_class)
+{
+    ttn_command_t command = {.type = TTN_CMD_SET_DEVICE_CLASS, .device_class = device_class};
+    post_command(&command);
+}
+
+void ttn_set_ping_slot_periodicity(int periodicity)
+{
+    if (periodicity < 0 || periodicity > 7)
+    {
+        ESP_LOGW(TAG, "Invalid ping slot periodicity: %d", periodicity);
+        return;
+    }
+    ping_slot_periodicity = periodicity;
+}
+
+bool ttn_set_multicast_session(int index, const ttn_multicast_session_t *session)
+{
+#if LMIC_MAX_MC_SESSIONS > 0
+    if (index < 0 || index >= LMIC_MAX_MC_SESSIONS)
+        return false;
+
+    multicast_args_t args = {.index = index, .session = session};
+    run_in_lmic_task(set_multicast_session, &args);
+    return true;
+#else
+    ESP_LOGW(TAG, "Multicast is disabled (CONFIG_TTN_MULTICAST_SESSIONS)");
+    return false;
+#endif
+}
+
+bool ttn_set_multicast_ping_slots(int index, int periodicity, uint32_t frequency, ttn_data_rate_t data_rate)
+{
+#if LMIC_MAX_MC_SESSIONS > 0 && !defined(DISABLE_PING)
+    if (index < 0 || index >= LMIC_MAX_MC_SESSIONS || periodicity < 0 || periodicity > 7)
+        return false;
+
+    multicast_args_t args = {
+        .index = index, .periodicity = periodicity, .frequency = frequency, .data_rate = data_rate};
+    run_in_lmic_task(set_multicast_ping_slots, &args);
+    return args.result;
+#else
+    return false;
+#endif
+}
+
+void ttn_clear_multicast_session(int index)
+{
+#if LMIC_MAX_MC_SESSIONS > 0
+    multicast_args_t args = {.index = index};
+    run_in_lmic_task(clear_multicast_session, &args);
+#endif
+}
+
+uint32_t ttn_get_multicast_fcnt(int index)
+{
+#if LMIC_MAX_MC_SESSIONS > 0
+    multicast_args_t args = {.index = index};
+    run_in_lmic_task(get_multicast_fcnt, &args);
+    return args.fcnt;
+#else
+    return 0;
+#endif
+}
+
+void ttn_request_time(void)
+{
+    ttn_command_t command = {.type = TTN_CMD_REQUEST_TIME};
+    post_command(&command);
 }
 
 void ttn_set_data_rate(ttn_data_rate_t data_rate)
@@ -417,9 +810,8 @@ void ttn_set_data_rate(ttn_data_rate_t data_rate)
 
     if (has_joined)
     {
-        hal_esp32_enter_critical_section();
-        LMIC_setDrTxpow(data_rate, LMIC.adrTxPow);
-        hal_esp32_leave_critical_section();
+        ttn_command_t command = {.type = TTN_CMD_SET_DATA_RATE, .data_rate = data_rate};
+        post_command(&command);
     }
 }
 
@@ -429,9 +821,8 @@ void ttn_set_max_tx_pow(int tx_pow)
 
     if (has_joined)
     {
-        hal_esp32_enter_critical_section();
-        LMIC_setDrTxpow(LMIC.datarate, tx_pow);
-        hal_esp32_leave_critical_section();
+        ttn_command_t command = {.type = TTN_CMD_SET_MAX_TX_POW, .tx_pow = tx_pow};
+        post_command(&command);
     }
 }
 
@@ -479,13 +870,31 @@ void event_callback(void *user_data, ev_t event)
     switch (event)
     {
     case EV_TXSTART:
+        TTN_STARTUP_END(TTN_STARTUP_FIRST_TX);
         current_rx_tx_window = TTN_WINDOW_TX;
         save_rf_settings(&last_rf_settings[TTN_WINDOW_TX]);
         clear_rf_settings(&last_rf_settings[TTN_WINDOW_RX1]);
         clear_rf_settings(&last_rf_settings[TTN_WINDOW_RX2]);
+        ttn_dr_advisor_on_tx_start();
+        ttn_energy_on_tx_start();
+        ttn_telemetry_on_tx_start();
+        if (is_submitting)
+        {
+            // transmission started immediately (within submit_transmission())
+            uint32_t duration = esp_timer_get_time() - submit_time;
+            portENTER_CRITICAL(&timing_lock);
+            total_tx_start_us += duration;
+            if (duration > max_tx_start_us)
+                max_tx_start_us = duration;
+            num_immediate_uplinks++;
+            portEXIT_CRITICAL(&timing_lock);
+        }
         break;
 
     case EV_RXSTART:
+        // beacon and ping slot reception (Class B) is not part of a TX/RX cycle
+        if ((LMIC.opmode & OP_TXRXPEND) == 0)
+            break;
         if (current_rx_tx_window != TTN_WINDOW_RX1)
         {
             current_rx_tx_window = TTN_WINDOW_RX1;
@@ -498,6 +907,29 @@ void event_callback(void *user_data, ev_t event)
         }
         break;
 
+    case EV_JOINED:
+        TTN_STARTUP_END(TTN_STARTUP_JOIN);
+        ttn_adr_cache_on_joined();
+        ttn_clock_cal_on_tx_complete();
+        ttn_energy_on_tx_complete();
+        current_rx_tx_window = TTN_WINDOW_IDLE;
+        break;
+
+    case EV_JOIN_TXCOMPLETE:
+        ttn_energy_on_tx_complete();
+        current_rx_tx_window = TTN_WINDOW_IDLE;
+        break;
+
+    case EV_TXCOMPLETE:
+        ttn_adr_cache_on_tx_complete();
+        ttn_dr_advisor_on_tx_complete();
+        ttn_clock_on_tx_complete();
+        ttn_clock_cal_on_tx_complete();
+        ttn_energy_on_tx_complete();
+        ttn_telemetry_on_tx_complete();
+        current_rx_tx_window = TTN_WINDOW_IDLE;
+        break;
+
     default:
         current_rx_tx_window = TTN_WINDOW_IDLE;
         break;
@@ -523,30 +955,315 @@ void event_callback(void *user_data, ev_t event)
         }
     }
 
-    if (ttn_event == TTN_EVENT_NONE)
-        return;
-
-    ttn_lmic_event_t result = {.event = ttn_event};
-    waiting_reason = TTN_WAITING_NONE;
-    xQueueSend(lmic_event_queue, &result, pdMS_TO_TICKS(100));
+    if (ttn_event != TTN_EVENT_NONE)
+        post_result(ttn_event);
 }
 
 // Called by LMIC when a message has been received
 void message_received_callback(void *user_data, uint8_t port, const uint8_t *message, size_t message_size)
 {
-    ttn_lmic_event_t result = {
-        .event = TTN_EVENT_MESSAGE_RECEIVED, .port = port, .message = message, .message_size = message_size};
-    xQueueSend(lmic_event_queue, &result, pdMS_TO_TICKS(100));
+    // message points into LMIC.frame, which is overwritten by the next RX
+    ttn_dispatch_post(port, message, message_size);
 }
 
 // Called by LMIC when a message has been transmitted (or the transmission failed)
 void message_transmitted_callback(void *user_data, int success)
 {
-    waiting_reason = TTN_WAITING_NONE;
-    ttn_lmic_event_t result = {.event = success ? TTN_EVENT_TRANSMISSION_COMPLETED : TTN_EVENT_TRANSMISSION_FAILED};
+    ttn_nvs_log_uplink();
+    post_transmission_result(success);
+}
+
+void post_transmission_result(bool success)
+{
+    post_result(success ? TTN_EVENT_TRANSMISSION_COMPLETED : TTN_EVENT_TRANSMISSION_FAILED);
+}
+
+void post_result(ttn_event_t event)
+{
+    // the waiting task releases the slot once it has received the result
+    ttn_lmic_event_t result = {.event = event};
+    __atomic_store_n(&waiting_reason, TTN_WAITING_RESULT_POSTED, __ATOMIC_RELEASE);
     xQueueSend(lmic_event_queue, &result, pdMS_TO_TICKS(100));
 }
 
+// --- Commands
+
+// Called by application tasks to have a command executed by the LMIC task
+void post_command(const ttn_command_t *command)
+{
+    // no longer idle (before the LMIC task can see the command);
+    // stop() waits for the commands in flight
+    __atomic_add_fetch(&commands_in_flight, 1, __ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&is_running, __ATOMIC_SEQ_CST))
+    {
+        // no LMIC task: nothing to race with
+        __atomic_sub_fetch(&commands_in_flight, 1, __ATOMIC_SEQ_CST);
+        hal_esp32_enter_critical_section();
+        execute_command(command);
+        hal_esp32_leave_critical_section();
+        if (command->done != NULL)
+            xSemaphoreGive(command->done);
+        return;
+    }
+
+    bool is_tx = command->type == TTN_CMD_TRANSMIT || command->type == TTN_CMD_JOIN;
+    publish_mac_state(is_tx ? TTN_MAC_TX_PENDING : TTN_MAC_BUSY);
+
+    // the ring only fills up if the LMIC task is stalled; wait for it to catch up
+    while (!ttn_command_post(command))
+        vTaskDelay(1);
+    hal_esp32_wake_up();
+}
+
+// Called by application tasks to have a function executed by the LMIC task;
+// returns once it has been executed
+void run_in_lmic_task(void (*function)(void *arg), void *arg)
+{
+    if (__atomic_load_n(&is_running, __ATOMIC_SEQ_CST) && hal_esp32_is_lmic_task())
+    {
+        function(arg);
+        return;
+    }
+
+    StaticSemaphore_t done_buffer;
+    ttn_command_t command = {.type = TTN_CMD_CALL, .call = {.function = function, .arg = arg}};
+    command.done = xSemaphoreCreateBinaryStatic(&done_buffer);
+    post_command(&command);
+    xSemaphoreTake(command.done, portMAX_DELAY);
+    vSemaphoreDelete(command.done);
+}
+
+// Called by the LMIC task before running the next LMIC job
+void process_commands(void)
+{
+    ttn_command_t command;
+    while (ttn_command_take(&command))
+    {
+        execute_command(&command);
+        __atomic_sub_fetch(&commands_in_flight, 1, __ATOMIC_SEQ_CST);
+        if (command.done != NULL)
+            xSemaphoreGive(command.done);
+    }
+}
+
+// Called by stop() after the LMIC task has exited: takes over the commands that
+// were posted before is_running was cleared, so no task waits for them forever
+void drain_commands(void)
+{
+    while (__atomic_load_n(&commands_in_flight, __ATOMIC_SEQ_CST) != 0)
+    {
+        ttn_command_t command;
+        if (!ttn_command_take(&command))
+        {
+            vTaskDelay(1); // still being posted
+            continue;
+        }
+
+        if (command.type == TTN_CMD_TRANSMIT)
+            post_result(TTN_EVENT_TRANSMISSION_FAILED);
+        else if (command.type == TTN_CMD_JOIN)
+            post_result(TTN_EVENT_JOIN_FAILED);
+        else
+            execute_command(&command);
+        __atomic_sub_fetch(&commands_in_flight, 1, __ATOMIC_SEQ_CST);
+        if (command.done != NULL)
+            xSemaphoreGive(command.done);
+    }
+}
+
+void execute_command(const ttn_command_t *command)
+{
+    switch (command->type)
+    {
+    case TTN_CMD_SET_ADR_ENABLED:
+        LMIC_setAdrMode(command->adr_enabled);
+        break;
+
+    case TTN_CMD_SET_DATA_RATE:
+        LMIC_setDrTxpow(command->data_rate, LMIC.adrTxPow);
+        break;
+
+    case TTN_CMD_SET_MAX_TX_POW:
+        LMIC_setDrTxpow(LMIC.datarate, command->tx_pow);
+        break;
+
+    case TTN_CMD_SET_DEVICE_CLASS:
+#if !defined(DISABLE_PING)
+        if (command->device_class == TTN_CLASS_B)
+        {
+            LMIC_setDeviceClass(LMIC_CLASS_A);
+            LMIC_startClassB(ping_slot_periodicity);
+            break;
+        }
+        LMIC_stopClassB();
+#else
+        if (command->device_class == TTN_CLASS_B)
+        {
+            ESP_LOGW(TAG, "Class B is not enabled (CONFIG_TTN_CLASS_B)");
+            break;
+        }
+#endif
+        LMIC_setDeviceClass(command->device_class == TTN_CLASS_C ? LMIC_CLASS_C : LMIC_CLASS_A);
+        break;
+
+    case TTN_CMD_REQUEST_TIME:
+        // if a request is already pending (e.g. for Class B), its answer is used
+        LMIC_requestNetworkTime(NULL, NULL);
+        break;
+
+    case TTN_CMD_TRANSMIT:
+        submit_transmission(command);
+        break;
+
+    case TTN_CMD_JOIN:
+        LMIC_startJoining();
+        config_rf_params();
+        break;
+
+    case TTN_CMD_CALL:
+        command->call.function(command->call.arg);
+        break;
+    }
+}
+
+void submit_transmission(const ttn_command_t *command)
+{
+    submit_time = esp_timer_get_time();
+    lmic_tx_error_t res = LMIC_ERROR_TX_BUSY;
+    if ((LMIC.opmode & OP_TXRXPEND) == 0)
+    {
+        LMIC.client.txMessageCb = message_transmitted_callback;
+        LMIC.client.txMessageUserData = NULL;
+        ttn_slotted_tx_on_submit();
+        ttn_telemetry_on_submit();
+        LMIC_setTxKeystream(command->transmit.keystream);
+        // if the channel is available, the transmission starts within this call
+        is_submitting = true;
+        if (command->transmit.segments != NULL)
+            res = LMIC_setTxDataSegments(command->transmit.port,
+                                         (const lmic_tx_segment_t *)command->transmit.segments,
+                                         command->transmit.num_segments, command->transmit.confirm);
+        else
+            res = LMIC_setTxData2(command->transmit.port, (xref2u1_t)command->transmit.payload,
+                                  command->transmit.length, command->transmit.confirm);
+        is_submitting = false;
+    }
+
+    if (res == LMIC_ERROR_TX_BUSY || res == LMIC_ERROR_TX_TOO_LARGE)
+    {
+        // not queued; LMIC won't call message_transmitted_callback
+        LMIC.client.txMessageCb = NULL;
+        LMIC_setTxKeystream(NULL);
+        LMIC.txSlotSet = 0;
+        post_transmission_result(false);
+    }
+}
+
+// --- Functions run in the LMIC task (see run_in_lmic_task())
+
+void restore_from_rtc(void *arg)
+{
+    *(bool *)arg = ttn_rtc_restore();
+}
+
+void restore_from_nvs(void *arg)
+{
+    nvs_restore_args_t *args = arg;
+    args->restored = ttn_nvs_restore(args->off_duration);
+}
+
+void get_max_frame_len(void *arg)
+{
+    *(int *)arg = LMICbandplan_maxFrameLen(LMIC.datarate);
+}
+
+// Sets the payload size to 0 if no data rate LMIC would switch to fits the frame (without FOpts)
+void check_frame_feasible(void *arg)
+{
+    size_t *payload_size = arg;
+    dr_t dr = LMIC_feasibleDataRateForFrame(LMIC.datarate, *payload_size);
+    if (*payload_size + OFF_DAT_OPTS + 5 > LMICbandplan_maxFrameLen(dr))
+        *payload_size = 0;
+}
+
+void set_multicast_session(void *arg)
+{
+#if LMIC_MAX_MC_SESSIONS > 0
+    multicast_args_t *args = arg;
+    const ttn_multicast_session_t *session = args->session;
+    LMIC_setMulticastSession(args->index, session->address, session->nwk_s_key, session->app_s_key,
+                             session->fcnt_min, session->fcnt_max);
+#endif
+}
+
+void set_multicast_ping_slots(void *arg)
+{
+#if LMIC_MAX_MC_SESSIONS > 0 && !defined(DISABLE_PING)
+    multicast_args_t *args = arg;
+    args->result = LMIC_setMulticastPingSlots(args->index, args->periodicity, args->frequency, args->data_rate);
+#endif
+}
+
+void clear_multicast_session(void *arg)
+{
+#if LMIC_MAX_MC_SESSIONS > 0
+    multicast_args_t *args = arg;
+    LMIC_clearMulticastSession(args->index);
+#endif
+}
+
+void get_multicast_fcnt(void *arg)
+{
+#if LMIC_MAX_MC_SESSIONS > 0
+    multicast_args_t *args = arg;
+    args->fcnt = LMIC_getMulticastSeqnoDn(args->index);
+#endif
+}
+
+// --- MAC state
+
+// Called by the LMIC task when it has nothing to do until the next event
+void lmic_going_to_sleep(TickType_t duration)
+{
+    // synchronize with join_core()
+    hal_esp32_enter_critical_section();
+
+    ttn_mac_state_t state;
+    u2_t opmode = LMIC.opmode;
+    if ((opmode & OP_TXRXPEND) != 0)
+    {
+        // while transmitting, LMIC waits for the TX done interrupt without a timer
+        state = current_rx_tx_window == TTN_WINDOW_TX && duration == 0 ? TTN_MAC_TX_PENDING : TTN_MAC_RX_WINDOW;
+    }
+    else if ((opmode & (OP_JOINING | OP_TXDATA | OP_POLL)) != 0)
+    {
+        duty_wait_end = xTaskGetTickCount() + duration;
+        state = TTN_MAC_DUTY_WAIT;
+    }
+    else
+    {
+        // other timed jobs (beacon tracking, ping slots) run indefinitely and don't block deep sleep
+        state = TTN_MAC_IDLE;
+    }
+    publish_mac_state(state);
+
+    // a command might have been posted in the meantime
+    if (state == TTN_MAC_IDLE && __atomic_load_n(&commands_in_flight, __ATOMIC_ACQUIRE) != 0)
+        publish_mac_state(TTN_MAC_BUSY);
+
+    hal_esp32_leave_critical_section();
+}
+
+void publish_mac_state(ttn_mac_state_t state)
+{
+    mac_state = state;
+    if (state == TTN_MAC_IDLE)
+        xEventGroupSetBits(mac_state_event_group, MAC_IDLE_BIT);
+    else
+        xEventGroupClearBits(mac_state_event_group, MAC_IDLE_BIT);
+}
+
 // --- Helpers
 
 void save_rf_settings(ttn_rf_settings_t *rf_settings)
@@ -0,0 +1,182 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Cache of the ADR state for starting at the learned data rate after a join.
+ *******************************************************************************/
+
+#include "ttn_adr_cache.h"
+
+#if defined(CONFIG_TTN_ADR_CACHE)
+
+#include "esp_log.h"
+#include "lmic/lmic.h"
+#include "lmic/lmic_bandplan.h"
+#include "nvs_flash.h"
+#include "ttn_nvs.h"
+#include <string.h>
+
+#define TAG "ttn_adr"
+#define NVS_FLASH_PARTITION "ttn"
+#define NVS_FLASH_KEY_ADR_STATE "adr"
+
+/**
+ * @brief ADR state confirmed by a downlink
+ */
+typedef struct
+{
+    uint8_t region;
+    uint8_t datarate;
+    int8_t tx_pow;
+    uint8_t nb_trans;
+    int8_t margin; // SNR margin of the confirming downlink above the demodulation floor (in dB)
+    lmic_saved_adr_state_t channels;
+} adr_state_t;
+
+static void capture_state(adr_state_t *state);
+static void apply_state(const adr_state_t *state);
+static bool is_same_state(const adr_state_t *state1, const adr_state_t *state2);
+static int8_t downlink_margin(void);
+static bool load_state(adr_state_t *state);
+static void store_state(const adr_state_t *state);
+static void erase_state(void);
+
+static adr_state_t cached_state;
+static bool has_cached_state;
+static bool is_loaded;
+static adr_state_t fallback_state;
+static int probation_uplinks;
+
+void ttn_adr_cache_on_joined(void)
+{
+    probation_uplinks = 0;
+    // once loaded, the cached state is more recent than NVS (writes are staged)
+    if (!is_loaded)
+    {
+        has_cached_state = load_state(&cached_state);
+        is_loaded = true;
+    }
+    if (!has_cached_state || !LMIC.adrEnabled)
+        return;
+
+    if (cached_state.margin < CONFIG_TTN_ADR_CACHE_MIN_MARGIN)
+    {
+        ESP_LOGI(TAG, "Cached ADR state not used (margin %d dB)", cached_state.margin);
+        return;
+    }
+
+    capture_state(&fallback_state);
+    apply_state(&cached_state);
+
+    // Request an ADR acknowledgement with the next uplink to verify the link
+    LMIC.adrChanged = 1;
+    probation_uplinks = CONFIG_TTN_ADR_CACHE_PROBATION;
+    ESP_LOGI(TAG, "Starting with cached ADR state: DR%d, %d dBm", cached_state.datarate, cached_state.tx_pow);
+}
+
+void ttn_adr_cache_on_tx_complete(void)
+{
+    if (!LMIC.adrEnabled || LMIC.devaddr == 0)
+        return;
+
+    if ((LMIC.txrxFlags & (TXRX_DNW1 | TXRX_DNW2)) != 0)
+    {
+        // the network has answered: the link works with the current state
+        probation_uplinks = 0;
+
+        adr_state_t state;
+        capture_state(&state);
+        state.margin = downlink_margin();
+        if (!has_cached_state || !is_same_state(&state, &cached_state))
+        {
+            store_state(&state);
+            cached_state = state;
+            has_cached_state = true;
+        }
+        return;
+    }
+
+    if (probation_uplinks == 0)
+        return;
+
+    probation_uplinks--;
+    if (probation_uplinks > 0)
+        return;
+
+    ESP_LOGW(TAG, "No downlink with cached ADR state, falling back to DR%d", fallback_state.datarate);
+    apply_state(&fallback_state);
+    erase_state();
+    has_cached_state = false;
+}
+
+void capture_state(adr_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->region = CFG_region;
+    state->datarate = LMIC.datarate;
+    state->tx_pow = LMIC.adrTxPow;
+    state->nb_trans = LMIC.upRepeat;
+    LMICbandplan_saveAdrState(&state->channels);
+}
+
+void apply_state(const adr_state_t *state)
+{
+    LMICbandplan_restoreAdrState(&state->channels);
+    LMIC.upRepeat = state->nb_trans;
+    LMIC_setDrTxpow(state->datarate, state->tx_pow);
+}
+
+bool is_same_state(const adr_state_t *state1, const adr_state_t *state2)
+{
+    // margin is not compared; it fluctuates
+    return state1->datarate == state2->datarate && state1->tx_pow == state2->tx_pow &&
+           state1->nb_trans == state2->nb_trans &&
+           memcmp(&state1->channels, &state2->channels, sizeof(state1->channels)) == 0;
+}
+
+int8_t downlink_margin(void)
+{
+    // demodulation floor: -7.5 dB at SF7, 2.5 dB lower for each higher spreading factor
+    int sf = getSf(LMIC.rps);
+    if (sf == FSK)
+        return 127;
+    int floor_x4 = -30 - 10 * (sf - SF7);
+    int margin = (LMIC.snr - floor_x4) / 4;
+    return margin > 127 ? 127 : margin < -128 ? -128 : margin;
+}
+
+// --- Non-volatile storage
+
+bool load_state(adr_state_t *state)
+{
+    nvs_handle handle = 0;
+    esp_err_t res = nvs_open(NVS_FLASH_PARTITION, NVS_READONLY, &handle);
+    if (res != ESP_OK)
+        return false;
+
+    size_t len = sizeof(*state);
+    res = nvs_get_blob(handle, NVS_FLASH_KEY_ADR_STATE, state, &len);
+    nvs_close(handle);
+
+    // size and region detect incompatible firmware and configuration changes
+    return res == ESP_OK && len == sizeof(*state) && state->region == CFG_region;
+}
+
+// Called from the LMIC task: the NVS commit is done by the background writer
+
+void store_state(const adr_state_t *state)
+{
+    ttn_nvs_stage_blob(NVS_FLASH_KEY_ADR_STATE, state, sizeof(*state));
+}
+
+void erase_state(void)
+{
+    ttn_nvs_stage_blob(NVS_FLASH_KEY_ADR_STATE, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Cache of the ADR state for starting at the learned data rate after a join.
+ *******************************************************************************/
+
+#ifndef TTN_ADR_CACHE_H
+#define TTN_ADR_CACHE_H
+
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief ADR cache.
+     *
+     * When a downlink confirms that the link works at the current ADR state
+     * (data rate, TX power, channel mask, NbTrans), the state and its link
+     * margin are saved in NVS. After a join, the saved state is applied and an
+     * ADR acknowledgement is requested. If no downlink arrives within the
+     * probation period, the device returns to the state after the join and
+     * the cache is cleared.
+     *
+     * Both functions are called from the LMIC task. The state is written to
+     * NVS by the background writer task.
+     */
+
+#if defined(CONFIG_TTN_ADR_CACHE)
+
+    void ttn_adr_cache_on_joined(void);
+    void ttn_adr_cache_on_tx_complete(void);
+
+#else
+
+    static inline void ttn_adr_cache_on_joined(void)
+    {
+    }
+
+    static inline void ttn_adr_cache_on_tx_complete(void)
+    {
+    }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * GPS time derived from the network time (DeviceTimeAns).
+ *******************************************************************************/
+
+#include "ttn_clock.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "hal/hal_esp32.h"
+#include "lmic/lmic.h"
+#include "ttn.h"
+#include <string.h>
+
+#define TAG "ttn_clock"
+
+#define FLAG_SYNCED 0x01
+#define FLAG_DRIFT_VALID 0x02
+
+// minimum interval between the samples used for a drift estimate
+#define MIN_DRIFT_INTERVAL_US (600LL * 1000000)
+// larger rate errors are considered measurement errors
+#define MAX_DRIFT_PPB 500000
+// weight of a new drift estimate (1 / 2^n)
+#define DRIFT_SMOOTHING_SHIFT 2
+
+// accuracy of DeviceTimeAns (1/256 s resolution, gateway timestamp)
+#define BASE_UNCERTAINTY_US 5000
+// remaining rate error with and without drift estimate (in ppb)
+#define DRIFT_UNCERTAINTY_PPB 2000
+#define CRYSTAL_UNCERTAINTY_PPB 50000
+
+static void add_sample(int64_t local_us, int64_t gps_us);
+
+static portMUX_TYPE clock_lock = portMUX_INITIALIZER_UNLOCKED;
+static ttn_clock_state_t clock_state;
+// last DeviceTimeAns taken as a sample
+static lmic_time_reference_t last_reference;
+
+bool ttn_get_gps_time(ttn_gps_time_t *gps_time)
+{
+    memset(gps_time, 0, sizeof(*gps_time));
+
+    int64_t gps_us;
+    int64_t age_us;
+    if (!ttn_clock_get(hal_esp32_get_time_us(), &gps_us, &age_us))
+        return false;
+
+    portENTER_CRITICAL(&clock_lock);
+    bool drift_valid = (clock_state.flags & FLAG_DRIFT_VALID) != 0;
+    portEXIT_CRITICAL(&clock_lock);
+
+    int64_t uncertainty_ppb = drift_valid ? DRIFT_UNCERTAINTY_PPB : CRYSTAL_UNCERTAINTY_PPB;
+    int64_t uncertainty_us = BASE_UNCERTAINTY_US + age_us * uncertainty_ppb / 1000000000;
+
+    gps_time->seconds = gps_us / 1000000;
+    gps_time->microseconds = gps_us % 1000000;
+    gps_time->uncertainty_ms = uncertainty_us / 1000;
+    return true;
+}
+
+bool ttn_clock_get(int64_t local_us, int64_t *gps_us, int64_t *age_us)
+{
+    portENTER_CRITICAL(&clock_lock);
+    ttn_clock_state_t state = clock_state;
+    portEXIT_CRITICAL(&clock_lock);
+
+    if ((state.flags & FLAG_SYNCED) == 0)
+        return false;
+
+    int64_t elapsed = local_us - state.ref_local_us;
+    *gps_us = state.ref_gps_us + elapsed + elapsed * state.drift_ppb / 1000000000;
+    if (age_us != NULL)
+        *age_us = elapsed;
+    return true;
+}
+
+void ttn_clock_reset(void)
+{
+    portENTER_CRITICAL(&clock_lock);
+    clock_state.flags &= ~FLAG_SYNCED;
+    portEXIT_CRITICAL(&clock_lock);
+}
+
+void ttn_clock_save(ttn_clock_state_t *state)
+{
+    portENTER_CRITICAL(&clock_lock);
+    *state = clock_state;
+    portEXIT_CRITICAL(&clock_lock);
+}
+
+void ttn_clock_restore(const ttn_clock_state_t *state)
+{
+    portENTER_CRITICAL(&clock_lock);
+    clock_state = *state;
+    portEXIT_CRITICAL(&clock_lock);
+}
+
+// --- Called from LMIC task
+
+void ttn_clock_on_tx_complete(void)
+{
+    lmic_time_reference_t reference;
+    if (!LMIC_getNetworkTimeReference(&reference))
+        return;
+    if (reference.tLocal == last_reference.tLocal && reference.tNetwork == last_reference.tNetwork)
+        return;
+    last_reference = reference;
+
+    // extend the LMIC time (32 bit ticks of 16 µs) to the 64 bit local time
+    int64_t now_us = hal_esp32_get_time_us();
+    s4_t ticks_ago = (s4_t)((u4_t)(now_us >> 4) - (u4_t)reference.tLocal);
+    int64_t local_us = now_us - (int64_t)ticks_ago * US_PER_OSTICK;
+
+    add_sample(local_us, (int64_t)reference.tNetwork * 1000000);
+}
+
+void add_sample(int64_t local_us, int64_t gps_us)
+{
+    int64_t offset_us = 0;
+
+    portENTER_CRITICAL(&clock_lock);
+    ttn_clock_state_t state = clock_state;
+    portEXIT_CRITICAL(&clock_lock);
+
+    if ((state.flags & FLAG_SYNCED) == 0)
+    {
+        state.anchor_local_us = local_us;
+        state.anchor_gps_us = gps_us;
+    }
+    else
+    {
+        int64_t elapsed = local_us - state.ref_local_us;
+        offset_us = gps_us - (state.ref_gps_us + elapsed + elapsed * state.drift_ppb / 1000000000);
+
+        int64_t interval = local_us - state.anchor_local_us;
+        if (interval >= MIN_DRIFT_INTERVAL_US)
+        {
+            // error accumulated over the interval (in µs) per ms of the interval, i.e. in ppb
+            int64_t drift = (gps_us - state.anchor_gps_us - interval) * 1000000 / (interval / 1000);
+            if (drift > -MAX_DRIFT_PPB && drift < MAX_DRIFT_PPB)
+            {
+                if ((state.flags & FLAG_DRIFT_VALID) != 0)
+                    state.drift_ppb += (drift - state.drift_ppb) >> DRIFT_SMOOTHING_SHIFT;
+                else
+                    state.drift_ppb = drift;
+                state.flags |= FLAG_DRIFT_VALID;
+            }
+            state.anchor_local_us = local_us;
+            state.anchor_gps_us = gps_us;
+        }
+        else if (interval < 0)
+        {
+            // local time has been reset
+            state.anchor_local_us = local_us;
+            state.anchor_gps_us = gps_us;
+        }
+    }
+
+    state.ref_local_us = local_us;
+    state.ref_gps_us = gps_us;
+    state.flags |= FLAG_SYNCED;
+
+    portENTER_CRITICAL(&clock_lock);
+    clock_state = state;
+    portEXIT_CRITICAL(&clock_lock);
+
+    ESP_LOGI(TAG, "GPS time %lld s, offset %lld ms, drift %d ppb", (long long)(gps_us / 1000000),
+             (long long)(offset_us / 1000), (int)state.drift_ppb);
+}
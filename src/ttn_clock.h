@@ -0,0 +1,80 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * GPS time derived from the network time (DeviceTimeAns).
+ *******************************************************************************/
+
+#ifndef TTN_CLOCK_H
+#define TTN_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Disciplined GPS clock.
+     *
+     * The clock maps the local time (hal_esp32_get_time_us(), the time base of
+     * hal_ticks()) to GPS time. Each DeviceTimeAns provides a sample: the GPS
+     * time at the end of the uplink. The latest sample is the reference for the
+     * mapping (phase). The rate error of the local clock (drift) is estimated from
+     * samples that are at least 10 minutes apart and smoothed, so the GPS time
+     * stays accurate between the samples.
+     *
+     * The state is kept in RTC memory across deep sleep as the local time continues.
+     * It's discarded if the local time is reset after power off.
+     */
+
+    /**
+     * @brief Clock state saved across deep sleep
+     */
+    typedef struct
+    {
+        // latest sample
+        int64_t ref_local_us;
+        int64_t ref_gps_us;
+        // start of the interval for the next drift estimate
+        int64_t anchor_local_us;
+        int64_t anchor_gps_us;
+        // rate error of the local clock (in ppb, positive if it's slow)
+        int32_t drift_ppb;
+        uint8_t flags;
+    } ttn_clock_state_t;
+
+    /**
+     * @brief Gets the GPS time for the given local time.
+     * @param local_us local time (in µs)
+     * @param gps_us receives the GPS time (in µs since the GPS epoch)
+     * @param age_us receives the time since the last sample (in µs); can be `NULL`
+     * @return `true` if successful, `false` if the clock isn't synchronized
+     */
+    bool ttn_clock_get(int64_t local_us, int64_t *gps_us, int64_t *age_us);
+
+    /**
+     * @brief Discards the synchronization (keeps the drift estimate).
+     */
+    void ttn_clock_reset(void);
+
+    void ttn_clock_save(ttn_clock_state_t *state);
+    void ttn_clock_restore(const ttn_clock_state_t *state);
+
+    /**
+     * @brief Takes a new sample if a DeviceTimeAns has been received (called from the LMIC task).
+     */
+    void ttn_clock_on_tx_complete(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
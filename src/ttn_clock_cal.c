@@ -0,0 +1,188 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Calibration of the clock error used to position the RX windows.
+ *******************************************************************************/
+
+#include "ttn_clock_cal.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "hal/hal_esp32.h"
+#include "lmic/lmic.h"
+#include "sdkconfig.h"
+#include "ttn.h"
+#include <string.h>
+
+#define TAG "ttn_clock_cal"
+
+// maximum clock error supported by LMIC (used until calibrated)
+#define MAX_ERROR_PPM LMIC_kMaxClockError_ppm
+
+#if defined(CONFIG_TTN_CLOCK_CALIBRATION)
+
+// number of samples needed before the measured error is used
+#define MIN_SAMPLES 2
+// confirmed uplinks in a row without acknowledgement that reset the calibration
+#define MAX_MISSES 2
+// decay of the peak per sample (1 / 2^n)
+#define PEAK_DECAY_SHIFT 3
+// weight of a new sample in the smoothed error (1 / 2^n)
+#define OFFSET_SMOOTHING_SHIFT 2
+// margin added to the peak (in ppm), in addition to a quarter of the peak
+#define MARGIN_PPM 50
+
+static uint32_t clock_error_ppm(const ttn_clock_cal_state_t *state);
+
+static portMUX_TYPE cal_lock = portMUX_INITIALIZER_UNLOCKED;
+static ttn_clock_cal_state_t cal_state;
+
+bool ttn_get_clock_calibration(ttn_clock_calibration_t *calibration)
+{
+    memset(calibration, 0, sizeof(*calibration));
+
+    portENTER_CRITICAL(&cal_lock);
+    ttn_clock_cal_state_t state = cal_state;
+    portEXIT_CRITICAL(&cal_lock);
+
+    hal_esp32_enter_critical_section();
+    uint32_t rx_delay = LMIC.rxDelay;
+    hal_esp32_leave_critical_section();
+
+    uint32_t error_ppm = clock_error_ppm(&state);
+    calibration->calibrated = state.samples >= MIN_SAMPLES;
+    calibration->samples = state.samples;
+    calibration->offset_ppm = state.offset_ppm;
+    calibration->clock_error_ppm = error_ppm;
+    // RX1 and RX2 are each extended by twice the drift over their delay (in s)
+    calibration->rx_time_saved_us = 2 * (2 * rx_delay + 1) * (MAX_ERROR_PPM - error_ppm);
+    return true;
+}
+
+void ttn_clock_cal_apply(void)
+{
+    portENTER_CRITICAL(&cal_lock);
+    uint32_t error_ppm = clock_error_ppm(&cal_state);
+    portEXIT_CRITICAL(&cal_lock);
+
+    LMIC_setClockError((u2_t)((error_ppm * MAX_CLOCK_ERROR + 999999) / 1000000));
+}
+
+void ttn_clock_cal_save(ttn_clock_cal_state_t *state)
+{
+    portENTER_CRITICAL(&cal_lock);
+    *state = cal_state;
+    portEXIT_CRITICAL(&cal_lock);
+}
+
+void ttn_clock_cal_restore(const ttn_clock_cal_state_t *state)
+{
+    portENTER_CRITICAL(&cal_lock);
+    cal_state = *state;
+    if (cal_state.peak_ppm > MAX_ERROR_PPM)
+        memset(&cal_state, 0, sizeof(cal_state));
+    portEXIT_CRITICAL(&cal_lock);
+
+    ttn_clock_cal_apply();
+}
+
+uint32_t clock_error_ppm(const ttn_clock_cal_state_t *state)
+{
+    if (state->samples < MIN_SAMPLES)
+        return MAX_ERROR_PPM;
+
+    uint32_t error_ppm = state->peak_ppm + state->peak_ppm / 4 + MARGIN_PPM;
+    return error_ppm < MAX_ERROR_PPM ? error_ppm : MAX_ERROR_PPM;
+}
+
+// --- Called from LMIC task
+
+void ttn_clock_cal_on_tx_complete(void)
+{
+    ostime_t delay = LMIC.radio.rxwin_delay;
+    LMIC.radio.rxwin_delay = 0;
+
+    portENTER_CRITICAL(&cal_lock);
+    ttn_clock_cal_state_t state = cal_state;
+    portEXIT_CRITICAL(&cal_lock);
+
+    if ((LMIC.txrxFlags & (TXRX_DNW1 | TXRX_DNW2)) != 0 && delay > 0)
+    {
+        // a frame was received in RX1 or RX2 (the flags are cleared otherwise)
+        ostime_t error = LMIC.radio.rxframe_start - LMIC.radio.rxwin_nominal;
+        int32_t error_ppm = (int32_t)((int64_t)error * 1000000 / delay);
+        if (error_ppm <= -MAX_ERROR_PPM || error_ppm >= MAX_ERROR_PPM)
+        {
+            ESP_LOGW(TAG, "Discarding RX timing sample of %d ppm", (int)error_ppm);
+            return;
+        }
+
+        uint16_t abs_ppm = (uint16_t)(error_ppm < 0 ? -error_ppm : error_ppm);
+        state.peak_ppm -= state.peak_ppm >> PEAK_DECAY_SHIFT;
+        if (abs_ppm > state.peak_ppm)
+            state.peak_ppm = abs_ppm;
+        if (state.samples > 0)
+            state.offset_ppm += (error_ppm - state.offset_ppm) >> OFFSET_SMOOTHING_SHIFT;
+        else
+            state.offset_ppm = error_ppm;
+        if (state.samples < UINT16_MAX)
+            state.samples += 1;
+        state.misses = 0;
+
+        ESP_LOGI(TAG, "RX timing error %d us (%d ppm), clock error %u ppm", (int)osticks2us(error),
+                 (int)error_ppm, (unsigned)clock_error_ppm(&state));
+    }
+    else if ((LMIC.txrxFlags & TXRX_NACK) != 0)
+    {
+        state.misses += 1;
+        if (state.misses >= MAX_MISSES && state.samples >= MIN_SAMPLES)
+        {
+            ESP_LOGW(TAG, "Acknowledgements missing, reverting to a clock error of %d ppm", MAX_ERROR_PPM);
+            memset(&state, 0, sizeof(state));
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    portENTER_CRITICAL(&cal_lock);
+    cal_state = state;
+    portEXIT_CRITICAL(&cal_lock);
+
+    ttn_clock_cal_apply();
+}
+
+#else
+
+bool ttn_get_clock_calibration(ttn_clock_calibration_t *calibration)
+{
+    ESP_LOGW(TAG, "Clock calibration is disabled (CONFIG_TTN_CLOCK_CALIBRATION)");
+    memset(calibration, 0, sizeof(*calibration));
+    return false;
+}
+
+void ttn_clock_cal_apply(void)
+{
+    LMIC_setClockError(MAX_CLOCK_ERROR * 4 / 100);
+}
+
+void ttn_clock_cal_on_tx_complete(void)
+{
+}
+
+void ttn_clock_cal_save(ttn_clock_cal_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+}
+
+void ttn_clock_cal_restore(const ttn_clock_cal_state_t *state)
+{
+}
+
+#endif
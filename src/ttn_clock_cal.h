@@ -0,0 +1,72 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Calibration of the clock error used to position the RX windows.
+ *******************************************************************************/
+
+#ifndef TTN_CLOCK_CAL_H
+#define TTN_CLOCK_CAL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Clock error calibration.
+     *
+     * LMIC opens the RX windows earlier and keeps them open longer to allow for
+     * the clock error (see LMICcore_adjustForDrift()). Instead of assuming the
+     * maximum error LMIC supports (0.4%), the error is measured: the gateway
+     * sends a downlink exactly RX delay after the end of the uplink, so the
+     * difference between the start of the received frame (RxDone time minus
+     * airtime) and the nominal window start, divided by the RX delay, is the
+     * error of the local clock including the fixed timing offsets.
+     *
+     * The clock error passed to LMIC is the decaying peak of the measured errors
+     * plus a margin. Until two downlinks have been measured, and after two
+     * confirmed uplinks in a row haven't been acknowledged, the maximum error is used.
+     *
+     * The state is kept in RTC memory across deep sleep.
+     */
+
+    /**
+     * @brief Calibration state saved across deep sleep
+     */
+    typedef struct
+    {
+        uint16_t samples;
+        // decaying peak of the measured error (in ppm)
+        uint16_t peak_ppm;
+        // smoothed measured error (in ppm, positive if the local clock is fast)
+        int16_t offset_ppm;
+        // confirmed uplinks in a row without acknowledgement
+        uint8_t misses;
+    } ttn_clock_cal_state_t;
+
+    /**
+     * @brief Passes the current clock error to LMIC (called in the LMIC task or critical section).
+     */
+    void ttn_clock_cal_apply(void);
+
+    /**
+     * @brief Takes a sample if a downlink has been received in RX1 or RX2 (called from the LMIC task).
+     */
+    void ttn_clock_cal_on_tx_complete(void);
+
+    void ttn_clock_cal_save(ttn_clock_cal_state_t *state);
+    void ttn_clock_cal_restore(const ttn_clock_cal_state_t *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
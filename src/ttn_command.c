@@ -0,0 +1,91 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Lock-free command channel from application tasks to the LMIC task.
+ *******************************************************************************/
+
+#include "ttn_command.h"
+
+// Bounded multi-producer, single-consumer ring buffer. Application tasks
+// post commands without taking a lock (a compare-and-swap on the write
+// position claims a slot). The LMIC task takes them out before each run
+// of its job loop, so LMIC state is only modified by the LMIC task.
+
+// must be a power of 2
+#define RING_SIZE 8
+
+/**
+ * @brief Ring buffer cell
+ *
+ * The sequence number tells whether the cell is free for the producer
+ * claiming position `pos` (sequence == pos) or holds a command for the
+ * consumer at position `pos` (sequence == pos + 1).
+ */
+typedef struct
+{
+    uint32_t sequence;
+    ttn_command_t command;
+} ttn_command_cell_t;
+
+static ttn_command_cell_t cells[RING_SIZE];
+// next position to write (shared by producers)
+static uint32_t enqueue_pos;
+// next position to read (LMIC task only)
+static uint32_t dequeue_pos;
+
+void ttn_command_init(void)
+{
+    for (uint32_t i = 0; i < RING_SIZE; i++)
+        cells[i].sequence = i;
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+}
+
+bool ttn_command_post(const ttn_command_t *command)
+{
+    uint32_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    while (true)
+    {
+        ttn_command_cell_t *cell = &cells[pos & (RING_SIZE - 1)];
+        uint32_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(sequence - pos);
+        if (diff == 0)
+        {
+            // cell is free: try to claim it (updates pos on failure)
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->command = *command;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false; // ring is full
+        }
+        else
+        {
+            // another producer claimed the cell
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+bool ttn_command_take(ttn_command_t *command)
+{
+    ttn_command_cell_t *cell = &cells[dequeue_pos & (RING_SIZE - 1)];
+    uint32_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    if (sequence != dequeue_pos + 1)
+        return false; // empty (or producer still writing)
+
+    *command = cell->command;
+    __atomic_store_n(&cell->sequence, dequeue_pos + RING_SIZE, __ATOMIC_RELEASE);
+    dequeue_pos++;
+    return true;
+}
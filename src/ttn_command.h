@@ -0,0 +1,94 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Lock-free command channel from application tasks to the LMIC task.
+ *******************************************************************************/
+
+#ifndef TTN_COMMAND_H
+#define TTN_COMMAND_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "ttn.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Command type
+     */
+    typedef enum
+    {
+        TTN_CMD_SET_ADR_ENABLED,
+        TTN_CMD_SET_DATA_RATE,
+        TTN_CMD_SET_MAX_TX_POW,
+        TTN_CMD_SET_DEVICE_CLASS,
+        TTN_CMD_REQUEST_TIME,
+        TTN_CMD_TRANSMIT,
+        TTN_CMD_JOIN,
+        TTN_CMD_CALL
+    } ttn_command_type_t;
+
+    /**
+     * @brief Command sent from an application task to the LMIC task
+     */
+    typedef struct
+    {
+        ttn_command_type_t type;
+        // given once the command has been executed (or NULL if the caller doesn't wait)
+        SemaphoreHandle_t done;
+        union {
+            bool adr_enabled;
+            ttn_data_rate_t data_rate;
+            int tx_pow;
+            ttn_device_class_t device_class;
+            struct
+            {
+                // either payload/length or segments/num_segments is used
+                const uint8_t *payload;
+                size_t length;
+                const ttn_payload_segment_t *segments;
+                size_t num_segments;
+                ttn_port_t port;
+                bool confirm;
+                // encryption computed by the submitting task (or NULL)
+                const struct lmic_tx_keystream_s *keystream;
+            } transmit;
+            struct
+            {
+                void (*function)(void *arg);
+                void *arg;
+            } call;
+        };
+    } ttn_command_t;
+
+    /**
+     * @brief Initializes the command ring (empty).
+     */
+    void ttn_command_init(void);
+
+    /**
+     * @brief Posts a command to the LMIC task without taking a lock (any task).
+     * @return `true` if successful, `false` if the ring is full
+     */
+    bool ttn_command_post(const ttn_command_t *command);
+
+    /**
+     * @brief Takes the next command out of the ring (LMIC task only).
+     * @return `true` if a command has been taken, `false` if the ring is empty
+     */
+    bool ttn_command_take(ttn_command_t *command);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,180 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Delivery of downlink messages from a dedicated task.
+ *******************************************************************************/
+
+#include "ttn_dispatch.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "lmic/lmic.h"
+#include <string.h>
+
+#define TAG "ttn_dispatch"
+
+#define POOL_SIZE CONFIG_TTN_DOWNLINK_POOL_SIZE
+
+/**
+ * @brief Pooled buffer for a received message
+ */
+typedef struct
+{
+    ttn_port_t port;
+    uint8_t length;
+    uint8_t payload[MAX_LEN_PAYLOAD];
+} ttn_downlink_t;
+
+/**
+ * @brief Registered handler for a port
+ */
+typedef struct
+{
+    ttn_port_message_cb callback;
+    void *user_data;
+} ttn_port_handler_t;
+
+static void dispatch_task(void *param);
+
+static ttn_downlink_t pool[POOL_SIZE];
+// indexes of unused buffers
+static QueueHandle_t free_queue;
+// indexes of buffers waiting to be dispatched
+static QueueHandle_t pending_queue;
+static ttn_message_cb message_callback;
+
+// handler slot (plus 1) for each port; 0 if no handler is registered
+static uint8_t port_slots[256];
+static ttn_port_handler_t port_handlers[CONFIG_TTN_MAX_PORT_HANDLERS];
+static portMUX_TYPE handler_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// statistics (only written by LMIC task)
+static ttn_downlink_stats_t stats;
+
+void ttn_dispatch_init(void)
+{
+    if (free_queue != NULL)
+        return;
+
+    free_queue = xQueueCreate(POOL_SIZE, sizeof(uint8_t));
+    pending_queue = xQueueCreate(POOL_SIZE, sizeof(uint8_t));
+    ASSERT(free_queue != NULL && pending_queue != NULL);
+
+    for (uint8_t i = 0; i < POOL_SIZE; i++)
+        xQueueSend(free_queue, &i, 0);
+
+    xTaskCreate(dispatch_task, "ttn_dispatch", 1024 * 4, NULL, CONFIG_TTN_DISPATCH_TASK_PRIO, NULL);
+}
+
+void ttn_dispatch_set_callback(ttn_message_cb callback)
+{
+    message_callback = callback;
+}
+
+bool ttn_dispatch_set_port_callback(ttn_port_t port, ttn_port_message_cb callback, void *user_data)
+{
+    bool result = true;
+    portENTER_CRITICAL(&handler_lock);
+
+    int slot = port_slots[port] - 1;
+    if (callback == NULL)
+    {
+        // unregister
+        if (slot >= 0)
+        {
+            port_slots[port] = 0;
+            port_handlers[slot].callback = NULL;
+        }
+    }
+    else
+    {
+        if (slot < 0)
+        {
+            // find a free slot
+            for (slot = 0; slot < CONFIG_TTN_MAX_PORT_HANDLERS; slot++)
+            {
+                if (port_handlers[slot].callback == NULL)
+                    break;
+            }
+        }
+
+        if (slot < CONFIG_TTN_MAX_PORT_HANDLERS)
+        {
+            port_handlers[slot].callback = callback;
+            port_handlers[slot].user_data = user_data;
+            port_slots[port] = slot + 1;
+        }
+        else
+        {
+            result = false;
+        }
+    }
+
+    portEXIT_CRITICAL(&handler_lock);
+    return result;
+}
+
+// Called from LMIC task; must not block
+void ttn_dispatch_post(ttn_port_t port, const uint8_t *message, size_t length)
+{
+    stats.received++;
+
+    uint8_t index;
+    if (free_queue == NULL || xQueueReceive(free_queue, &index, 0) != pdTRUE)
+    {
+        stats.dropped++;
+        return;
+    }
+
+    uint32_t in_use = POOL_SIZE - uxQueueMessagesWaiting(free_queue);
+    if (in_use > stats.pool_high_water)
+        stats.pool_high_water = in_use;
+
+    ttn_downlink_t *downlink = &pool[index];
+    downlink->port = port;
+    downlink->length = length;
+    memcpy(downlink->payload, message, length);
+
+    // cannot fail: the queue has room for all buffers
+    xQueueSend(pending_queue, &index, 0);
+}
+
+void ttn_dispatch_get_stats(ttn_downlink_stats_t *s)
+{
+    *s = stats;
+}
+
+void dispatch_task(void *param)
+{
+    while (true)
+    {
+        uint8_t index;
+        xQueueReceive(pending_queue, &index, portMAX_DELAY);
+
+        ttn_downlink_t *downlink = &pool[index];
+
+        ttn_port_handler_t handler = {.callback = NULL};
+        portENTER_CRITICAL(&handler_lock);
+        int slot = port_slots[downlink->port] - 1;
+        if (slot >= 0)
+            handler = port_handlers[slot];
+        portEXIT_CRITICAL(&handler_lock);
+
+        ttn_message_cb callback = message_callback;
+        if (handler.callback != NULL)
+            handler.callback(downlink->payload, downlink->length, downlink->port, handler.user_data);
+        else if (callback != NULL)
+            callback(downlink->payload, downlink->length, downlink->port);
+        else
+            ESP_LOGW(TAG, "No handler for message on port %d", downlink->port);
+
+        xQueueSend(free_queue, &index, 0);
+    }
+}
@@ -0,0 +1,46 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Delivery of downlink messages from a dedicated task.
+ *******************************************************************************/
+
+#ifndef TTN_DISPATCH_H
+#define TTN_DISPATCH_H
+
+#include "ttn.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Downlink dispatcher.
+     *
+     * Received messages are copied from the LMIC frame buffer into a fixed pool
+     * of preallocated buffers and queued. A separate task hands them to the
+     * registered callback. The LMIC task never blocks; if all buffers are in
+     * use, the message is dropped and counted.
+     *
+     * Per-port callbacks are looked up with a single index into a 256-entry
+     * table of slot numbers. Messages on ports without a per-port callback
+     * go to the general callback.
+     */
+
+    void ttn_dispatch_init(void);
+    void ttn_dispatch_set_callback(ttn_message_cb callback);
+    bool ttn_dispatch_set_port_callback(ttn_port_t port, ttn_port_message_cb callback, void *user_data);
+    void ttn_dispatch_post(ttn_port_t port, const uint8_t *message, size_t length);
+    void ttn_dispatch_get_stats(ttn_downlink_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,291 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Device-side data rate advisor based on the measured link quality.
+ *******************************************************************************/
+
+#include "ttn_dr_advisor.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "ttn.h"
+#include <string.h>
+
+#define TAG "ttn_dr_advisor"
+
+#if defined(CONFIG_TTN_DR_ADVISOR)
+
+#include "lmic/lmic.h"
+#include "lmic/lmic_bandplan.h"
+
+// Uplink data rates are DR0 to DR7 in all supported regions
+#define NUM_DR 8
+#define WINDOW_SIZE 16
+#define UNKNOWN_VALUE -128
+
+typedef enum
+{
+    OUTCOME_UNKNOWN = 0, // unconfirmed uplink without downlink
+    OUTCOME_ANSWERED,
+    OUTCOME_LOST,
+} outcome_t;
+
+/**
+ * @brief Link quality measured for an uplink
+ */
+typedef struct
+{
+    uint8_t outcome;
+    int8_t margin;
+    int8_t snr;
+    int8_t rssi;
+} sample_t;
+
+/**
+ * @brief Sliding window of samples for a data rate
+ */
+typedef struct
+{
+    sample_t samples[WINDOW_SIZE];
+    uint8_t count;
+    uint8_t next;
+} dr_window_t;
+
+static void add_sample(int dr, const sample_t *sample);
+static void compute_stats(int dr, ttn_dr_stats_t *stats);
+static int propose_data_rate(int dr);
+static bool is_loss_too_high(const ttn_dr_stats_t *stats, int max_loss_percent);
+static int8_t clamp_int8(int value);
+
+static portMUX_TYPE advisor_lock = portMUX_INITIALIZER_UNLOCKED;
+static ttn_dr_advisor_policy_t policy = {
+    .mode = TTN_DR_ADVISOR_OFF,
+    .max_loss_percent = 10,
+    .step_up_margin = 10,
+    .hysteresis = 3,
+    .min_samples = 4,
+    .link_check_interval = 8,
+};
+static dr_window_t windows[NUM_DR];
+static int tx_dr = -1;
+static bool tx_confirmed;
+static int proposed_dr = -1;
+static int proposal_count;
+static int recommended_dr = -1;
+static int uplinks_since_link_check;
+
+void ttn_set_dr_advisor_policy(const ttn_dr_advisor_policy_t *new_policy)
+{
+    portENTER_CRITICAL(&advisor_lock);
+    policy = *new_policy;
+    portEXIT_CRITICAL(&advisor_lock);
+}
+
+void ttn_get_dr_advisor_policy(ttn_dr_advisor_policy_t *current_policy)
+{
+    portENTER_CRITICAL(&advisor_lock);
+    *current_policy = policy;
+    portEXIT_CRITICAL(&advisor_lock);
+}
+
+ttn_data_rate_t ttn_get_recommended_data_rate(void)
+{
+    int dr = recommended_dr;
+    return dr >= 0 ? (ttn_data_rate_t)dr : TTN_DR_JOIN_DEFAULT;
+}
+
+bool ttn_get_dr_stats(ttn_data_rate_t data_rate, ttn_dr_stats_t *stats)
+{
+    if (data_rate >= NUM_DR)
+        return false;
+
+    portENTER_CRITICAL(&advisor_lock);
+    compute_stats(data_rate, stats);
+    portEXIT_CRITICAL(&advisor_lock);
+    return true;
+}
+
+// --- Called from LMIC task
+
+void ttn_dr_advisor_on_tx_start(void)
+{
+    tx_dr = LMIC.datarate;
+    tx_confirmed = LMIC.pendTxConf;
+    LMIC.gwCount = 0; // detects LinkCheckAns for this uplink
+}
+
+void ttn_dr_advisor_on_tx_complete(void)
+{
+    ttn_dr_advisor_policy_t current_policy;
+    ttn_get_dr_advisor_policy(&current_policy);
+    if (current_policy.mode == TTN_DR_ADVISOR_OFF || tx_dr < 0 || tx_dr >= NUM_DR)
+        return;
+
+    sample_t sample = {.outcome = OUTCOME_UNKNOWN, .margin = UNKNOWN_VALUE, .snr = UNKNOWN_VALUE, .rssi = UNKNOWN_VALUE};
+    bool has_downlink = (LMIC.txrxFlags & (TXRX_DNW1 | TXRX_DNW2)) != 0;
+    if (has_downlink)
+    {
+        sample.outcome = OUTCOME_ANSWERED;
+        sample.snr = clamp_int8(LMIC.snr / 4);
+        sample.rssi = clamp_int8(LMIC.rssi - RSSI_OFF);
+        sample.margin = clamp_int8(LMIC.margin); // downlink margin as a proxy
+    }
+    if (tx_confirmed && (LMIC.txrxFlags & TXRX_NACK) != 0)
+        sample.outcome = OUTCOME_LOST;
+    if (LMIC.gwCount > 0 && LMIC.gwMargin != 255)
+        sample.margin = clamp_int8(LMIC.gwMargin); // uplink margin reported by network
+
+    portENTER_CRITICAL(&advisor_lock);
+    add_sample(tx_dr, &sample);
+    portEXIT_CRITICAL(&advisor_lock);
+
+    if (current_policy.link_check_interval > 0)
+    {
+        uplinks_since_link_check++;
+        if (uplinks_since_link_check >= current_policy.link_check_interval)
+        {
+            LMIC_requestLinkCheck();
+            uplinks_since_link_check = 0;
+        }
+    }
+
+    // hysteresis: the same proposal is needed several times in a row
+    int dr = propose_data_rate(tx_dr);
+    if (dr == proposed_dr)
+    {
+        proposal_count++;
+    }
+    else
+    {
+        proposed_dr = dr;
+        proposal_count = 1;
+    }
+
+    if (recommended_dr < 0)
+        recommended_dr = tx_dr;
+    if (proposal_count < current_policy.hysteresis || dr == recommended_dr)
+        return;
+
+    recommended_dr = dr;
+    ESP_LOGI(TAG, "Recommended data rate: DR%d", dr);
+
+    if (current_policy.mode == TTN_DR_ADVISOR_APPLY && !LMIC.adrEnabled && dr != LMIC.datarate)
+        LMIC_setDrTxpow(dr, KEEP_TXPOW);
+}
+
+void add_sample(int dr, const sample_t *sample)
+{
+    dr_window_t *window = &windows[dr];
+    window->samples[window->next] = *sample;
+    window->next = (window->next + 1) % WINDOW_SIZE;
+    if (window->count < WINDOW_SIZE)
+        window->count++;
+}
+
+void compute_stats(int dr, ttn_dr_stats_t *stats)
+{
+    const dr_window_t *window = &windows[dr];
+    int margin_sum = 0, margin_count = 0;
+    int snr_sum = 0, rssi_sum = 0, downlink_count = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->uplinks = window->count;
+    for (int i = 0; i < window->count; i++)
+    {
+        const sample_t *sample = &window->samples[i];
+        if (sample->outcome == OUTCOME_ANSWERED)
+            stats->answered++;
+        else if (sample->outcome == OUTCOME_LOST)
+            stats->lost++;
+
+        if (sample->margin != UNKNOWN_VALUE)
+        {
+            margin_sum += sample->margin;
+            margin_count++;
+        }
+        if (sample->snr != UNKNOWN_VALUE)
+        {
+            snr_sum += sample->snr;
+            rssi_sum += sample->rssi;
+            downlink_count++;
+        }
+    }
+
+    stats->avg_margin = margin_count > 0 ? margin_sum / margin_count : UNKNOWN_VALUE;
+    stats->avg_snr = downlink_count > 0 ? snr_sum / downlink_count : UNKNOWN_VALUE;
+    stats->avg_rssi = downlink_count > 0 ? rssi_sum / downlink_count : UNKNOWN_VALUE;
+}
+
+int propose_data_rate(int dr)
+{
+    ttn_dr_stats_t stats;
+    ttn_dr_stats_t faster_stats;
+    ttn_dr_advisor_policy_t current_policy;
+
+    portENTER_CRITICAL(&advisor_lock);
+    current_policy = policy;
+    compute_stats(dr, &stats);
+    if (dr + 1 < NUM_DR)
+        compute_stats(dr + 1, &faster_stats);
+    portEXIT_CRITICAL(&advisor_lock);
+
+    // too many losses: step down
+    if (stats.answered + stats.lost >= current_policy.min_samples && is_loss_too_high(&stats, current_policy.max_loss_percent))
+    {
+        if (dr > 0 && LMICbandplan_isDataRateFeasible(dr - 1))
+            return dr - 1;
+        return dr;
+    }
+
+    // enough margin: step up unless the faster data rate recently failed
+    if (stats.avg_margin != UNKNOWN_VALUE && stats.avg_margin >= current_policy.step_up_margin && dr + 1 < NUM_DR &&
+        LMICbandplan_isDataRateFeasible(dr + 1))
+    {
+        if (faster_stats.answered + faster_stats.lost >= current_policy.min_samples && is_loss_too_high(&faster_stats, current_policy.max_loss_percent))
+            return dr;
+        return dr + 1;
+    }
+
+    return dr;
+}
+
+bool is_loss_too_high(const ttn_dr_stats_t *stats, int max_loss_percent)
+{
+    int known = stats->answered + stats->lost;
+    return known > 0 && stats->lost * 100 > max_loss_percent * known;
+}
+
+int8_t clamp_int8(int value)
+{
+    return value > 127 ? 127 : value < -127 ? -127 : value;
+}
+
+#else
+
+void ttn_set_dr_advisor_policy(const ttn_dr_advisor_policy_t *policy)
+{
+    ESP_LOGW(TAG, "Data rate advisor is disabled (CONFIG_TTN_DR_ADVISOR)");
+}
+
+void ttn_get_dr_advisor_policy(ttn_dr_advisor_policy_t *policy)
+{
+    memset(policy, 0, sizeof(*policy));
+}
+
+ttn_data_rate_t ttn_get_recommended_data_rate(void)
+{
+    return TTN_DR_JOIN_DEFAULT;
+}
+
+bool ttn_get_dr_stats(ttn_data_rate_t data_rate, ttn_dr_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    return false;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Device-side data rate advisor based on the measured link quality.
+ *******************************************************************************/
+
+#ifndef TTN_DR_ADVISOR_H
+#define TTN_DR_ADVISOR_H
+
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Data rate advisor.
+     *
+     * For each data rate, a sliding window of the last uplinks records whether the
+     * network answered (ACK or downlink), whether a confirmed uplink was lost, and
+     * the measured link margin (from LinkCheckAns if available, otherwise from the
+     * downlink RSSI). After each uplink, the advisor proposes a faster data rate
+     * if the margin is sufficient or a slower one if the loss rate is too high.
+     * A proposal must persist for a number of evaluations (hysteresis) before it
+     * becomes the recommendation.
+     *
+     * Both functions are called from the LMIC task.
+     */
+
+#if defined(CONFIG_TTN_DR_ADVISOR)
+
+    void ttn_dr_advisor_on_tx_start(void);
+    void ttn_dr_advisor_on_tx_complete(void);
+
+#else
+
+    static inline void ttn_dr_advisor_on_tx_start(void)
+    {
+    }
+
+    static inline void ttn_dr_advisor_on_tx_complete(void)
+    {
+    }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
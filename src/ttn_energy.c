@@ -0,0 +1,275 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Energy accounting of the radio states.
+ *******************************************************************************/
+
+#include "ttn_energy.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "ttn.h"
+#include <string.h>
+
+#define TAG "ttn_energy"
+
+#if defined(CONFIG_TTN_ENERGY_ACCOUNTING)
+
+#include "hal/hal_esp32.h"
+#include "lmic/lmic.h"
+
+#define NUM_TX_POINTS ((int)(sizeof(((ttn_energy_model_t *)0)->tx_current) / sizeof(ttn_tx_current_t)))
+#define MAX_SNAPSHOT_ATTEMPTS 8
+
+typedef struct
+{
+    u4_t state_ticks[LMIC_RADIO_STATE_COUNT];
+    s1_t tx_power;
+} radio_snapshot_t;
+
+static void update_totals(void);
+static bool take_snapshot(radio_snapshot_t *snapshot);
+static void accumulate(const radio_snapshot_t *snapshot);
+static uint32_t tx_current(int tx_power);
+static uint64_t charge_uc(uint64_t time_us, uint32_t current_ua);
+
+// SX1276 datasheet figures (sleep, standby, FS, RX in band 1, TX with RFO and PA_BOOST)
+#define DEFAULT_MODEL                                                                                                  \
+    {                                                                                                                  \
+        .voltage_mv = 3300, .sleep_na = 200, .standby_ua = 1600, .synth_ua = 5800, .rx_ua = 10800,                     \
+        .tx_current = {{7, 20000}, {13, 29000}, {17, 87000}, {20, 120000}},                                            \
+    }
+
+static portMUX_TYPE energy_lock = portMUX_INITIALIZER_UNLOCKED;
+static const ttn_energy_model_t default_model = DEFAULT_MODEL;
+static ttn_energy_model_t model = DEFAULT_MODEL;
+static ttn_energy_state_t totals;
+// radio driver totals already accumulated (the driver starts from 0 as well)
+static u4_t last_ticks[LMIC_RADIO_STATE_COUNT];
+// totals at the start of the current uplink
+static ttn_energy_state_t uplink_start;
+static ttn_uplink_energy_t last_uplink;
+
+bool ttn_set_energy_model(const ttn_energy_model_t *new_model)
+{
+    if (new_model != NULL)
+    {
+        if (new_model->voltage_mv == 0 || new_model->tx_current[0].current_ua == 0)
+            return false;
+        for (int i = 1; i < NUM_TX_POINTS; i++)
+        {
+            if (new_model->tx_current[i].current_ua != 0 &&
+                new_model->tx_current[i].power <= new_model->tx_current[i - 1].power)
+                return false;
+        }
+    }
+
+    portENTER_CRITICAL(&energy_lock);
+    model = new_model != NULL ? *new_model : default_model;
+    portEXIT_CRITICAL(&energy_lock);
+    return true;
+}
+
+bool ttn_get_energy_report(ttn_energy_report_t *report)
+{
+    memset(report, 0, sizeof(*report));
+    update_totals();
+
+    int64_t now_us = hal_esp32_get_time_us();
+    portENTER_CRITICAL(&energy_lock);
+    ttn_energy_state_t state = totals;
+    ttn_energy_model_t current_model = model;
+    report->last_uplink = last_uplink;
+    portEXIT_CRITICAL(&energy_lock);
+
+    uint64_t active_us = state.standby_us + state.synth_us + state.tx_us + state.rx_us;
+    report->duration_us = now_us > state.start_us ? now_us - state.start_us : 0;
+    report->sleep.time_us = report->duration_us > active_us ? report->duration_us - active_us : 0;
+    report->sleep.charge_uc = report->sleep.time_us * current_model.sleep_na / 1000000000;
+    report->standby.time_us = state.standby_us;
+    report->standby.charge_uc = charge_uc(state.standby_us, current_model.standby_ua);
+    report->synth.time_us = state.synth_us;
+    report->synth.charge_uc = charge_uc(state.synth_us, current_model.synth_ua);
+    report->tx.time_us = state.tx_us;
+    report->tx.charge_uc = state.tx_charge_nc / 1000;
+    report->rx.time_us = state.rx_us;
+    report->rx.charge_uc = charge_uc(state.rx_us, current_model.rx_ua);
+
+    report->charge_uc = report->sleep.charge_uc + report->standby.charge_uc + report->synth.charge_uc +
+                        report->tx.charge_uc + report->rx.charge_uc;
+    report->energy_uj = report->charge_uc * current_model.voltage_mv / 1000;
+    return true;
+}
+
+void ttn_reset_energy_report(void)
+{
+    update_totals();
+
+    int64_t now_us = hal_esp32_get_time_us();
+    portENTER_CRITICAL(&energy_lock);
+    memset(&totals, 0, sizeof(totals));
+    totals.start_us = now_us;
+    uplink_start = totals;
+    memset(&last_uplink, 0, sizeof(last_uplink));
+    portEXIT_CRITICAL(&energy_lock);
+}
+
+void ttn_energy_save(ttn_energy_state_t *state)
+{
+    update_totals();
+
+    portENTER_CRITICAL(&energy_lock);
+    *state = totals;
+    portEXIT_CRITICAL(&energy_lock);
+}
+
+void ttn_energy_restore(const ttn_energy_state_t *state)
+{
+    portENTER_CRITICAL(&energy_lock);
+    totals = *state;
+    uplink_start = totals;
+    portEXIT_CRITICAL(&energy_lock);
+}
+
+// Snapshots are taken and accumulated under the lock so they are accumulated in order.
+void update_totals(void)
+{
+    radio_snapshot_t snapshot;
+    portENTER_CRITICAL(&energy_lock);
+    if (take_snapshot(&snapshot))
+        accumulate(&snapshot);
+    portEXIT_CRITICAL(&energy_lock);
+}
+
+// The current state is included up to now, so the totals can be taken at any time.
+// Fails if the LMIC task keeps updating the radio state (the next snapshot catches up).
+bool take_snapshot(radio_snapshot_t *snapshot)
+{
+    for (int attempt = 0; attempt < MAX_SNAPSHOT_ATTEMPTS; attempt++)
+    {
+        u4_t seq = __atomic_load_n(&LMIC.radio.state_seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) != 0)
+            continue;
+
+        memcpy(snapshot->state_ticks, LMIC.radio.state_ticks, sizeof(snapshot->state_ticks));
+        snapshot->state_ticks[LMIC.radio.state] += (u4_t)(os_getTime() - LMIC.radio.state_since);
+        snapshot->tx_power = LMIC.radio_txpow;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&LMIC.radio.state_seq, __ATOMIC_RELAXED) == seq)
+            return true;
+    }
+    return false;
+}
+
+// called with the lock held
+void accumulate(const radio_snapshot_t *snapshot)
+{
+    int64_t now_us = hal_esp32_get_time_us();
+
+    // the totals only increase; the unsigned difference is correct across an overflow
+    uint64_t delta_us[LMIC_RADIO_STATE_COUNT];
+    for (int i = 0; i < LMIC_RADIO_STATE_COUNT; i++)
+    {
+        delta_us[i] = (uint64_t)(u4_t)(snapshot->state_ticks[i] - last_ticks[i]) * US_PER_OSTICK;
+        last_ticks[i] = snapshot->state_ticks[i];
+    }
+
+    if (totals.start_us == 0)
+        totals.start_us = now_us;
+    totals.standby_us += delta_us[LMIC_RADIO_STATE_STANDBY];
+    totals.synth_us += delta_us[LMIC_RADIO_STATE_SYNTH];
+    totals.rx_us += delta_us[LMIC_RADIO_STATE_RX];
+    // the TX time since the last snapshot belongs to the current or last uplink
+    totals.tx_us += delta_us[LMIC_RADIO_STATE_TX];
+    totals.tx_charge_nc += delta_us[LMIC_RADIO_STATE_TX] * tx_current(snapshot->tx_power) / 1000;
+}
+
+// linear interpolation between the points of the model (called with the lock held)
+uint32_t tx_current(int tx_power)
+{
+    const ttn_tx_current_t *points = model.tx_current;
+    if (tx_power <= points[0].power)
+        return points[0].current_ua;
+
+    for (int i = 1; i < NUM_TX_POINTS && points[i].current_ua != 0; i++)
+    {
+        if (tx_power <= points[i].power)
+        {
+            int32_t range = points[i].power - points[i - 1].power;
+            int32_t step = (int32_t)points[i].current_ua - (int32_t)points[i - 1].current_ua;
+            return points[i - 1].current_ua + step * (tx_power - points[i - 1].power) / range;
+        }
+        if (i == NUM_TX_POINTS - 1 || points[i + 1].current_ua == 0)
+            return points[i].current_ua;
+    }
+    return points[0].current_ua;
+}
+
+uint64_t charge_uc(uint64_t time_us, uint32_t current_ua)
+{
+    return time_us * current_ua / 1000000;
+}
+
+// --- Called from LMIC task
+
+void ttn_energy_on_tx_start(void)
+{
+    update_totals();
+
+    portENTER_CRITICAL(&energy_lock);
+    uplink_start = totals;
+    portEXIT_CRITICAL(&energy_lock);
+}
+
+void ttn_energy_on_tx_complete(void)
+{
+    update_totals();
+
+    portENTER_CRITICAL(&energy_lock);
+    ttn_uplink_energy_t uplink = {
+        .tx_power = LMIC.radio_txpow,
+        .tx_us = (uint32_t)(totals.tx_us - uplink_start.tx_us),
+        .rx_us = (uint32_t)(totals.rx_us - uplink_start.rx_us),
+        .standby_us = (uint32_t)(totals.standby_us - uplink_start.standby_us),
+        .synth_us = (uint32_t)(totals.synth_us - uplink_start.synth_us),
+    };
+    uint64_t charge_nc = totals.tx_charge_nc - uplink_start.tx_charge_nc +
+                         ((uint64_t)uplink.rx_us * model.rx_ua + (uint64_t)uplink.standby_us * model.standby_ua +
+                          (uint64_t)uplink.synth_us * model.synth_ua) /
+                             1000;
+    uplink.charge_uc = (uint32_t)(charge_nc / 1000);
+    uplink.energy_uj = (uint32_t)(charge_nc * model.voltage_mv / 1000000);
+    last_uplink = uplink;
+    uplink_start = totals;
+    portEXIT_CRITICAL(&energy_lock);
+
+    ESP_LOGD(TAG, "Uplink at %d dBm: TX %u us, RX %u us, %u uJ", (int)uplink.tx_power, (unsigned)uplink.tx_us,
+             (unsigned)uplink.rx_us, (unsigned)uplink.energy_uj);
+}
+
+#else
+
+bool ttn_set_energy_model(const ttn_energy_model_t *model)
+{
+    ESP_LOGW(TAG, "Energy accounting is disabled (CONFIG_TTN_ENERGY_ACCOUNTING)");
+    return false;
+}
+
+bool ttn_get_energy_report(ttn_energy_report_t *report)
+{
+    ESP_LOGW(TAG, "Energy accounting is disabled (CONFIG_TTN_ENERGY_ACCOUNTING)");
+    memset(report, 0, sizeof(*report));
+    return false;
+}
+
+void ttn_reset_energy_report(void)
+{
+}
+
+#endif
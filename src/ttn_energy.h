@@ -0,0 +1,84 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Energy accounting of the radio states.
+ *******************************************************************************/
+
+#ifndef TTN_ENERGY_H
+#define TTN_ENERGY_H
+
+#include "sdkconfig.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Radio energy accounting.
+     *
+     * The radio driver accumulates the time spent in each state (sleep, standby,
+     * frequency synthesis, TX, RX) on each change of the operating mode, including
+     * the changes the radio makes by itself after TX and RX. The totals are taken
+     * from the driver at each uplink and when a report is requested and converted
+     * to charge with the current figures of the energy model. The TX current depends
+     * on the TX power, so the TX charge is accumulated per uplink with its TX power.
+     *
+     * The sleep time is the remainder of the elapsed time. The totals are kept in
+     * RTC memory across deep sleep; during deep sleep, the radio is assumed to sleep.
+     *
+     * The hooks are called from the LMIC task.
+     */
+
+    /**
+     * @brief Totals saved across deep sleep
+     */
+    typedef struct
+    {
+        int64_t start_us;
+        uint64_t standby_us;
+        uint64_t synth_us;
+        uint64_t tx_us;
+        uint64_t rx_us;
+        uint64_t tx_charge_nc;
+    } ttn_energy_state_t;
+
+#if defined(CONFIG_TTN_ENERGY_ACCOUNTING)
+
+    void ttn_energy_on_tx_start(void);
+    void ttn_energy_on_tx_complete(void);
+    void ttn_energy_save(ttn_energy_state_t *state);
+    void ttn_energy_restore(const ttn_energy_state_t *state);
+
+#else
+
+    static inline void ttn_energy_on_tx_start(void)
+    {
+    }
+
+    static inline void ttn_energy_on_tx_complete(void)
+    {
+    }
+
+    static inline void ttn_energy_save(ttn_energy_state_t *state)
+    {
+    }
+
+    static inline void ttn_energy_restore(const ttn_energy_state_t *state)
+    {
+    }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
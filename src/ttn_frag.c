@@ -0,0 +1,404 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Fragmented data block transport (LoRaWAN TS004).
+ *******************************************************************************/
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+#include "ttn.h"
+#include <string.h>
+
+#define TAG "ttn_frag"
+
+#if defined(CONFIG_TTN_FRAG_TRANSPORT)
+
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "ttn_frag_decoder.h"
+
+#define FRAG_PORT 201
+
+#define CMD_PACKAGE_VERSION 0x00
+#define CMD_FRAG_SESSION_STATUS 0x01
+#define CMD_FRAG_SESSION_SETUP 0x02
+#define CMD_FRAG_SESSION_DELETE 0x03
+#define CMD_DATA_FRAGMENT 0x08
+
+#define PACKAGE_IDENTIFIER 3
+#define PACKAGE_VERSION 1
+
+#define FLASH_SECTOR_SIZE 4096
+#define MAX_ANSWER_LENGTH 16
+#define ANSWER_RETRY_INTERVAL_MS 1000
+#define ANSWER_MAX_RETRIES 30
+
+/**
+ * @brief Answer waiting to be sent
+ */
+typedef struct
+{
+    uint32_t delay_ms;
+    uint8_t length;
+    uint8_t payload[MAX_ANSWER_LENGTH];
+} frag_answer_t;
+
+/**
+ * @brief State of the fragmentation session
+ */
+typedef struct
+{
+    bool active;
+    uint8_t index;
+    uint8_t padding;
+    uint8_t block_ack_delay;
+    uint32_t descriptor;
+    ttn_frag_decoder_t decoder;
+} frag_session_t;
+
+static void handle_message(const uint8_t *payload, size_t length, ttn_port_t port, void *user_data);
+static size_t handle_status_req(const uint8_t *req, uint8_t *answer, uint32_t *delay_ms);
+static size_t handle_setup_req(const uint8_t *req, uint8_t *answer);
+static size_t handle_delete_req(const uint8_t *req, uint8_t *answer);
+static bool handle_data_fragment(const uint8_t *req, size_t length);
+static void delete_session(void);
+static void answer_task(void *param);
+static bool store_read(void *context, uint32_t offset, void *buf, size_t length);
+static bool store_write(void *context, uint32_t offset, const void *buf, size_t length);
+
+static SemaphoreHandle_t session_mutex;
+static QueueHandle_t answer_queue;
+static const esp_partition_t *partition;
+static ttn_frag_complete_cb complete_callback;
+static void *complete_user_data;
+static frag_session_t session;
+
+bool ttn_start_frag_transport(const char *partition_label, ttn_frag_complete_cb callback, void *user_data)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (part == NULL)
+    {
+        ESP_LOGE(TAG, "Partition '%s' not found", partition_label);
+        return false;
+    }
+
+    if (session_mutex == NULL)
+    {
+        session_mutex = xSemaphoreCreateMutex();
+        answer_queue = xQueueCreate(4, sizeof(frag_answer_t));
+        if (session_mutex == NULL || answer_queue == NULL)
+            return false;
+        xTaskCreate(answer_task, "ttn_frag", 1024 * 3, NULL, CONFIG_TTN_DISPATCH_TASK_PRIO, NULL);
+    }
+
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    delete_session();
+    partition = part;
+    complete_callback = callback;
+    complete_user_data = user_data;
+    xSemaphoreGive(session_mutex);
+
+    return ttn_on_port_message(FRAG_PORT, handle_message, NULL);
+}
+
+void ttn_stop_frag_transport(void)
+{
+    if (session_mutex == NULL)
+        return;
+
+    ttn_on_port_message(FRAG_PORT, NULL, NULL);
+
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    delete_session();
+    partition = NULL;
+    complete_callback = NULL;
+    xSemaphoreGive(session_mutex);
+}
+
+bool ttn_get_frag_status(ttn_frag_status_t *status)
+{
+    memset(status, 0, sizeof(*status));
+    if (session_mutex == NULL)
+        return false;
+
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    bool active = session.active;
+    if (active)
+    {
+        const ttn_frag_decoder_t *decoder = &session.decoder;
+        status->active = true;
+        status->complete = decoder->result == TTN_FRAG_DECODER_COMPLETE;
+        status->failed = decoder->result != TTN_FRAG_DECODER_COMPLETE && decoder->result != TTN_FRAG_DECODER_ONGOING;
+        status->nb_frag = decoder->nb_frag;
+        status->frag_size = decoder->frag_size;
+        status->received = decoder->nb_received;
+        status->missing = ttn_frag_decoder_missing(decoder);
+        status->memory = ttn_frag_decoder_memory(decoder);
+    }
+    xSemaphoreGive(session_mutex);
+
+    return active;
+}
+
+// Called from the dispatcher task
+void handle_message(const uint8_t *payload, size_t length, ttn_port_t port, void *user_data)
+{
+    frag_answer_t answer = {0};
+    bool completed = false;
+    size_t pos = 0;
+
+    xSemaphoreTake(session_mutex, portMAX_DELAY);
+    if (partition == NULL)
+    {
+        // stopped while the message was being dispatched
+        xSemaphoreGive(session_mutex);
+        return;
+    }
+
+    while (pos < length)
+    {
+        uint8_t cmd = payload[pos++];
+        size_t remaining = length - pos;
+        uint8_t *ans = answer.payload + answer.length;
+        size_t ans_len = 0;
+
+        if (cmd == CMD_DATA_FRAGMENT)
+        {
+            completed = handle_data_fragment(payload + pos, remaining);
+            break;
+        }
+
+        if (MAX_ANSWER_LENGTH - answer.length < 5)
+            break;
+
+        if (cmd == CMD_PACKAGE_VERSION)
+        {
+            ans[0] = CMD_PACKAGE_VERSION;
+            ans[1] = PACKAGE_IDENTIFIER;
+            ans[2] = PACKAGE_VERSION;
+            ans_len = 3;
+        }
+        else if (cmd == CMD_FRAG_SESSION_STATUS && remaining >= 1)
+        {
+            ans_len = handle_status_req(payload + pos, ans, &answer.delay_ms);
+            pos += 1;
+        }
+        else if (cmd == CMD_FRAG_SESSION_SETUP && remaining >= 10)
+        {
+            ans_len = handle_setup_req(payload + pos, ans);
+            pos += 10;
+        }
+        else if (cmd == CMD_FRAG_SESSION_DELETE && remaining >= 1)
+        {
+            ans_len = handle_delete_req(payload + pos, ans);
+            pos += 1;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Unknown or truncated command 0x%02x", cmd);
+            break;
+        }
+
+        answer.length += ans_len;
+    }
+
+    size_t size = session.decoder.nb_frag * session.decoder.frag_size - session.padding;
+    uint32_t descriptor = session.descriptor;
+    ttn_frag_complete_cb callback = complete_callback;
+    void *callback_user_data = complete_user_data;
+
+    xSemaphoreGive(session_mutex);
+
+    if (answer.length > 0 && xQueueSend(answer_queue, &answer, 0) != pdTRUE)
+        ESP_LOGW(TAG, "Answer dropped");
+
+    if (completed && callback != NULL)
+        callback(size, descriptor, callback_user_data);
+}
+
+size_t handle_status_req(const uint8_t *req, uint8_t *answer, uint32_t *delay_ms)
+{
+    bool all_participants = (req[0] & 0x01) != 0;
+    uint8_t index = (req[0] >> 1) & 0x03;
+    if (!session.active || session.index != index)
+        return 0;
+
+    const ttn_frag_decoder_t *decoder = &session.decoder;
+    uint16_t missing = ttn_frag_decoder_missing(decoder);
+    if (!all_participants && missing == 0)
+        return 0;
+
+    uint16_t received = (index << 14) | (decoder->nb_received & 0x3fff);
+    bool no_memory = decoder->result == TTN_FRAG_DECODER_TOO_MANY_LOST || decoder->result == TTN_FRAG_DECODER_NO_MEMORY;
+    answer[0] = CMD_FRAG_SESSION_STATUS;
+    answer[1] = received & 0xff;
+    answer[2] = received >> 8;
+    answer[3] = missing > 255 ? 255 : missing;
+    answer[4] = no_memory ? 0x01 : 0x00;
+
+    // spread the answers of all devices over 2^(BlockAckDelay + 4) seconds
+    uint32_t window_ms = (1000u << (session.block_ack_delay + 4));
+    uint32_t delay = esp_random() % window_ms;
+    if (delay > *delay_ms)
+        *delay_ms = delay;
+
+    return 5;
+}
+
+size_t handle_setup_req(const uint8_t *req, uint8_t *answer)
+{
+    uint8_t index = (req[0] >> 4) & 0x03;
+    uint16_t nb_frag = req[1] | (req[2] << 8);
+    uint8_t frag_size = req[3];
+    uint8_t control = req[4];
+    uint8_t algo = (control >> 3) & 0x07;
+    uint8_t status = index << 6;
+
+    if (algo != 0 || nb_frag == 0 || frag_size == 0)
+        status |= 0x01; // encoding unsupported
+    if (session.active && session.index != index)
+        status |= 0x04; // only one session at a time
+
+    uint32_t max_lost = nb_frag < CONFIG_TTN_FRAG_MAX_LOST ? nb_frag : CONFIG_TTN_FRAG_MAX_LOST;
+    uint32_t store_size = ((uint32_t)nb_frag + max_lost) * frag_size;
+    if (store_size > partition->size)
+        status |= 0x02; // not enough memory
+
+    if ((status & 0x0f) == 0)
+    {
+        delete_session();
+
+        uint32_t erase_size = (store_size + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+        ttn_frag_store_t store = {.read = store_read, .write = store_write, .context = (void *)partition};
+        if (esp_partition_erase_range(partition, 0, erase_size) != ESP_OK ||
+            !ttn_frag_decoder_init(&session.decoder, nb_frag, frag_size, max_lost, &store))
+        {
+            status |= 0x02;
+        }
+        else
+        {
+            session.active = true;
+            session.index = index;
+            session.padding = req[5];
+            session.block_ack_delay = control & 0x07;
+            session.descriptor = req[6] | (req[7] << 8) | (req[8] << 16) | ((uint32_t)req[9] << 24);
+            ESP_LOGI(TAG, "Session %d: %d fragments of %d bytes", index, nb_frag, frag_size);
+        }
+    }
+
+    answer[0] = CMD_FRAG_SESSION_SETUP;
+    answer[1] = status;
+    return 2;
+}
+
+size_t handle_delete_req(const uint8_t *req, uint8_t *answer)
+{
+    uint8_t index = req[0] & 0x03;
+    uint8_t status = index;
+    if (session.active && session.index == index)
+        delete_session();
+    else
+        status |= 0x04; // session does not exist
+
+    answer[0] = CMD_FRAG_SESSION_DELETE;
+    answer[1] = status;
+    return 2;
+}
+
+// Returns `true` if the fragment completes the data block
+bool handle_data_fragment(const uint8_t *req, size_t length)
+{
+    if (length < 2)
+        return false;
+
+    uint16_t header = req[0] | (req[1] << 8);
+    uint8_t index = header >> 14;
+    uint16_t n = header & 0x3fff;
+    ttn_frag_decoder_t *decoder = &session.decoder;
+    if (!session.active || session.index != index || length - 2 < decoder->frag_size)
+        return false;
+
+    ttn_frag_decoder_result_t previous = decoder->result;
+    ttn_frag_decoder_result_t result = ttn_frag_decoder_process(decoder, n, req + 2);
+    if (result == previous)
+        return false;
+
+    if (result == TTN_FRAG_DECODER_COMPLETE)
+    {
+        ESP_LOGI(TAG, "Session %d complete (%d fragments received)", index, decoder->nb_received);
+        return true;
+    }
+
+    ESP_LOGE(TAG, "Session %d failed (%d)", index, result);
+    return false;
+}
+
+void delete_session(void)
+{
+    if (session.active)
+        ttn_frag_decoder_free(&session.decoder);
+    memset(&session, 0, sizeof(session));
+}
+
+// Sends the answers as uplinks; retries while another transmission is in progress
+void answer_task(void *param)
+{
+    frag_answer_t answer;
+    while (true)
+    {
+        xQueueReceive(answer_queue, &answer, portMAX_DELAY);
+        if (answer.delay_ms > 0)
+            vTaskDelay(pdMS_TO_TICKS(answer.delay_ms));
+
+        int retries = 0;
+        while (ttn_transmit_message(answer.payload, answer.length, FRAG_PORT, false) != TTN_SUCCESSFUL_TRANSMISSION)
+        {
+            if (++retries > ANSWER_MAX_RETRIES)
+            {
+                ESP_LOGW(TAG, "Answer not sent");
+                break;
+            }
+            vTaskDelay(pdMS_TO_TICKS(ANSWER_RETRY_INTERVAL_MS));
+        }
+    }
+}
+
+bool store_read(void *context, uint32_t offset, void *buf, size_t length)
+{
+    return esp_partition_read((const esp_partition_t *)context, offset, buf, length) == ESP_OK;
+}
+
+bool store_write(void *context, uint32_t offset, const void *buf, size_t length)
+{
+    return esp_partition_write((const esp_partition_t *)context, offset, buf, length) == ESP_OK;
+}
+
+#else
+
+bool ttn_start_frag_transport(const char *partition_label, ttn_frag_complete_cb callback, void *user_data)
+{
+    ESP_LOGW(TAG, "Fragmented data block transport is disabled (CONFIG_TTN_FRAG_TRANSPORT)");
+    return false;
+}
+
+void ttn_stop_frag_transport(void)
+{
+}
+
+bool ttn_get_frag_status(ttn_frag_status_t *status)
+{
+    memset(status, 0, sizeof(*status));
+    return false;
+}
+
+#endif
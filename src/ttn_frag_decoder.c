@@ -0,0 +1,342 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Reassembly of fragmented data blocks with forward error correction.
+ *******************************************************************************/
+
+#include "ttn_frag_decoder.h"
+#include <stdlib.h>
+#include <string.h>
+
+static bool freeze_missing(ttn_frag_decoder_t *decoder);
+static ttn_frag_decoder_result_t add_coded(ttn_frag_decoder_t *decoder, uint16_t n, const uint8_t *data);
+static ttn_frag_decoder_result_t add_equation(ttn_frag_decoder_t *decoder);
+static ttn_frag_decoder_result_t solve(ttn_frag_decoder_t *decoder);
+static int find_missing(const ttn_frag_decoder_t *decoder, uint16_t index);
+static void parity_matrix_line(uint8_t *line, uint16_t n, uint16_t m);
+static uint32_t prbs23(uint32_t x);
+static size_t row_offset(uint16_t p, uint16_t nb_bytes);
+static void xor_bytes(uint8_t *dst, const uint8_t *src, size_t length);
+
+static inline bool get_bit(const uint8_t *bits, uint32_t i)
+{
+    return (bits[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline void set_bit(uint8_t *bits, uint32_t i)
+{
+    bits[i >> 3] |= 1 << (i & 7);
+}
+
+static inline size_t bitmap_size(uint32_t nb_bits)
+{
+    return (nb_bits + 7) / 8;
+}
+
+bool ttn_frag_decoder_init(ttn_frag_decoder_t *decoder, uint16_t nb_frag, uint8_t frag_size, uint16_t max_lost,
+                           const ttn_frag_store_t *store)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    if (nb_frag == 0 || frag_size == 0)
+        return false;
+
+    decoder->store = *store;
+    decoder->nb_frag = nb_frag;
+    decoder->frag_size = frag_size;
+    decoder->max_lost = max_lost;
+    decoder->result = TTN_FRAG_DECODER_ONGOING;
+
+    decoder->received = calloc(bitmap_size(nb_frag), 1);
+    decoder->line = malloc(bitmap_size(nb_frag));
+    decoder->data = malloc(frag_size);
+    decoder->tmp = malloc(frag_size);
+    if (decoder->received == NULL || decoder->line == NULL || decoder->data == NULL || decoder->tmp == NULL)
+    {
+        ttn_frag_decoder_free(decoder);
+        return false;
+    }
+
+    return true;
+}
+
+void ttn_frag_decoder_free(ttn_frag_decoder_t *decoder)
+{
+    free(decoder->received);
+    free(decoder->line);
+    free(decoder->missing);
+    free(decoder->matrix);
+    free(decoder->row);
+    free(decoder->data);
+    free(decoder->tmp);
+    decoder->received = NULL;
+    decoder->line = NULL;
+    decoder->missing = NULL;
+    decoder->matrix = NULL;
+    decoder->row = NULL;
+    decoder->data = NULL;
+    decoder->tmp = NULL;
+}
+
+ttn_frag_decoder_result_t ttn_frag_decoder_process(ttn_frag_decoder_t *decoder, uint16_t index, const uint8_t *data)
+{
+    if (decoder->result != TTN_FRAG_DECODER_ONGOING || index == 0)
+        return decoder->result;
+
+    decoder->nb_received++;
+    uint16_t i = index - 1;
+    uint32_t frag_size = decoder->frag_size;
+
+    if (i < decoder->nb_frag)
+    {
+        if (decoder->missing == NULL)
+        {
+            // before the first coded fragment: write to the data block
+            if (get_bit(decoder->received, i))
+                return decoder->result;
+
+            if (!decoder->store.write(decoder->store.context, i * frag_size, data, frag_size))
+                return decoder->result = TTN_FRAG_DECODER_STORE_ERROR;
+
+            set_bit(decoder->received, i);
+            decoder->nb_uncoded++;
+            if (decoder->nb_uncoded == decoder->nb_frag)
+                decoder->result = TTN_FRAG_DECODER_COMPLETE;
+            return decoder->result;
+        }
+
+        // late uncoded fragment: equation with a single unknown
+        int j = find_missing(decoder, i);
+        if (j < 0)
+            return decoder->result;
+
+        memset(decoder->row, 0, bitmap_size(decoder->nb_missing));
+        set_bit(decoder->row, j);
+        memcpy(decoder->data, data, frag_size);
+        return add_equation(decoder);
+    }
+
+    if (decoder->missing == NULL && !freeze_missing(decoder))
+        return decoder->result;
+
+    return add_coded(decoder, i - decoder->nb_frag + 1, data);
+}
+
+uint16_t ttn_frag_decoder_missing(const ttn_frag_decoder_t *decoder)
+{
+    if (decoder->result == TTN_FRAG_DECODER_COMPLETE)
+        return 0;
+    if (decoder->missing == NULL)
+        return decoder->nb_frag - decoder->nb_uncoded;
+    return decoder->nb_missing - decoder->rank;
+}
+
+size_t ttn_frag_decoder_memory(const ttn_frag_decoder_t *decoder)
+{
+    size_t size = 2 * bitmap_size(decoder->nb_frag) + 2 * decoder->frag_size;
+    if (decoder->missing != NULL)
+    {
+        uint16_t nb_bytes = bitmap_size(decoder->nb_missing);
+        size += decoder->nb_missing * sizeof(uint16_t) + row_offset(decoder->nb_missing, nb_bytes) + nb_bytes;
+    }
+    return size;
+}
+
+// The fragments not received when the first coded fragment arrives become the unknowns
+bool freeze_missing(ttn_frag_decoder_t *decoder)
+{
+    uint16_t nb_missing = decoder->nb_frag - decoder->nb_uncoded;
+    if (nb_missing > decoder->max_lost)
+    {
+        decoder->result = TTN_FRAG_DECODER_TOO_MANY_LOST;
+        return false;
+    }
+
+    uint16_t nb_bytes = bitmap_size(nb_missing);
+    decoder->missing = malloc(nb_missing * sizeof(uint16_t));
+    decoder->matrix = calloc(row_offset(nb_missing, nb_bytes), 1);
+    decoder->row = malloc(nb_bytes);
+    if (decoder->missing == NULL || decoder->matrix == NULL || decoder->row == NULL)
+    {
+        decoder->result = TTN_FRAG_DECODER_NO_MEMORY;
+        return false;
+    }
+
+    decoder->nb_missing = 0;
+    for (uint16_t i = 0; i < decoder->nb_frag; i++)
+    {
+        if (!get_bit(decoder->received, i))
+            decoder->missing[decoder->nb_missing++] = i;
+    }
+
+    return true;
+}
+
+// Reduces a coded fragment to an equation over the missing fragments
+ttn_frag_decoder_result_t add_coded(ttn_frag_decoder_t *decoder, uint16_t n, const uint8_t *data)
+{
+    uint32_t frag_size = decoder->frag_size;
+    memcpy(decoder->data, data, frag_size);
+    memset(decoder->row, 0, bitmap_size(decoder->nb_missing));
+    parity_matrix_line(decoder->line, n, decoder->nb_frag);
+
+    for (uint16_t i = 0; i < decoder->nb_frag; i++)
+    {
+        if (!get_bit(decoder->line, i))
+            continue;
+
+        if (get_bit(decoder->received, i))
+        {
+            if (!decoder->store.read(decoder->store.context, i * frag_size, decoder->tmp, frag_size))
+                return decoder->result = TTN_FRAG_DECODER_STORE_ERROR;
+            xor_bytes(decoder->data, decoder->tmp, frag_size);
+        }
+        else
+        {
+            set_bit(decoder->row, find_missing(decoder, i));
+        }
+    }
+
+    return add_equation(decoder);
+}
+
+// Eliminates the equation in `row` / `data` against the stored equations.
+// Row p of the matrix has its lowest coefficient in column p and starts at byte p / 8.
+ttn_frag_decoder_result_t add_equation(ttn_frag_decoder_t *decoder)
+{
+    uint16_t nb_missing = decoder->nb_missing;
+    uint16_t nb_bytes = bitmap_size(nb_missing);
+    uint32_t frag_size = decoder->frag_size;
+    uint32_t scratch = (uint32_t)decoder->nb_frag * frag_size;
+    uint16_t byte_index = 0;
+
+    while (true)
+    {
+        while (byte_index < nb_bytes && decoder->row[byte_index] == 0)
+            byte_index++;
+        if (byte_index == nb_bytes)
+            return decoder->result; // linearly dependent
+
+        uint8_t b = decoder->row[byte_index];
+        uint16_t p = byte_index * 8;
+        while ((b & 1) == 0)
+        {
+            b >>= 1;
+            p++;
+        }
+
+        uint8_t *stored = decoder->matrix + row_offset(p, nb_bytes);
+        if (!get_bit(stored, p & 7))
+        {
+            // new pivot
+            if (!decoder->store.write(decoder->store.context, scratch + p * frag_size, decoder->data, frag_size))
+                return decoder->result = TTN_FRAG_DECODER_STORE_ERROR;
+            memcpy(stored, decoder->row + byte_index, nb_bytes - byte_index);
+            decoder->rank++;
+            break;
+        }
+
+        xor_bytes(decoder->row + byte_index, stored, nb_bytes - byte_index);
+        if (!decoder->store.read(decoder->store.context, scratch + p * frag_size, decoder->tmp, frag_size))
+            return decoder->result = TTN_FRAG_DECODER_STORE_ERROR;
+        xor_bytes(decoder->data, decoder->tmp, frag_size);
+    }
+
+    if (decoder->rank == nb_missing)
+        return solve(decoder);
+    return decoder->result;
+}
+
+// Back substitution: writes the missing fragments, starting with the last one
+ttn_frag_decoder_result_t solve(ttn_frag_decoder_t *decoder)
+{
+    uint16_t nb_missing = decoder->nb_missing;
+    uint16_t nb_bytes = bitmap_size(nb_missing);
+    uint32_t frag_size = decoder->frag_size;
+    uint32_t scratch = (uint32_t)decoder->nb_frag * frag_size;
+    void *context = decoder->store.context;
+
+    for (int p = nb_missing - 1; p >= 0; p--)
+    {
+        if (!decoder->store.read(context, scratch + p * frag_size, decoder->data, frag_size))
+            return decoder->result = TTN_FRAG_DECODER_STORE_ERROR;
+
+        const uint8_t *stored = decoder->matrix + row_offset(p, nb_bytes);
+        uint16_t first = p & ~7;
+        for (uint16_t j = p + 1; j < nb_missing; j++)
+        {
+            if (!get_bit(stored, j - first))
+                continue;
+            if (!decoder->store.read(context, decoder->missing[j] * frag_size, decoder->tmp, frag_size))
+                return decoder->result = TTN_FRAG_DECODER_STORE_ERROR;
+            xor_bytes(decoder->data, decoder->tmp, frag_size);
+        }
+
+        if (!decoder->store.write(context, decoder->missing[p] * frag_size, decoder->data, frag_size))
+            return decoder->result = TTN_FRAG_DECODER_STORE_ERROR;
+    }
+
+    return decoder->result = TTN_FRAG_DECODER_COMPLETE;
+}
+
+int find_missing(const ttn_frag_decoder_t *decoder, uint16_t index)
+{
+    int lo = 0;
+    int hi = decoder->nb_missing - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (decoder->missing[mid] == index)
+            return mid;
+        if (decoder->missing[mid] < index)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+// Line n (1-based) of the parity check matrix for m fragments (TS004, section 3)
+void parity_matrix_line(uint8_t *line, uint16_t n, uint16_t m)
+{
+    memset(line, 0, bitmap_size(m));
+
+    uint32_t m_temp = (m & (m - 1)) == 0 ? 1 : 0;
+    uint32_t x = 1 + 1001 * (uint32_t)n;
+    for (uint16_t nb_coeff = 0; nb_coeff < m / 2; nb_coeff++)
+    {
+        uint32_t r = 1 << 16;
+        while (r >= m)
+        {
+            x = prbs23(x);
+            r = x % (m + m_temp);
+        }
+        set_bit(line, r);
+    }
+}
+
+uint32_t prbs23(uint32_t x)
+{
+    uint32_t b0 = x & 1;
+    uint32_t b1 = (x & 0x20) >> 5;
+    return (x >> 1) + ((b0 ^ b1) << 22);
+}
+
+// Offset of row p in the triangular matrix. Row p covers columns 8 * (p / 8) to nb_bytes * 8 - 1.
+size_t row_offset(uint16_t p, uint16_t nb_bytes)
+{
+    size_t q = p >> 3;
+    size_t r = p & 7;
+    return 8 * (q * nb_bytes - q * (q - 1) / 2) + r * (nb_bytes - q);
+}
+
+void xor_bytes(uint8_t *dst, const uint8_t *src, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        dst[i] ^= src[i];
+}
@@ -0,0 +1,153 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Reassembly of fragmented data blocks with forward error correction.
+ *******************************************************************************/
+
+#ifndef TTN_FRAG_DECODER_H
+#define TTN_FRAG_DECODER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Fragment decoder.
+     *
+     * Implements the decoding of LoRaWAN Fragmented Data Block Transport
+     * (TS004) sessions. A data block of M fragments of S bytes is sent as
+     * M uncoded fragments (index 1 to M) followed by coded fragments (index
+     * M + 1 and higher). A coded fragment is the XOR of about half of the
+     * uncoded fragments, selected by a pseudo-random parity matrix line.
+     *
+     * Uncoded fragments are written directly to their position in the store
+     * and tracked in a bitmap. When the first coded fragment arrives, the
+     * fragments missing at that time (L of them) become the unknowns of a
+     * system of XOR equations. Each coded fragment (and each late uncoded
+     * fragment) is reduced to an equation over the missing fragments and
+     * eliminated against the equations received so far. Only the coefficients
+     * are kept in RAM, as an upper triangular bit matrix of L * (L + 1) / 2
+     * bits; the right-hand sides are written to a scratch area of the store
+     * following the data block. Once L independent equations have been
+     * received, the missing fragments are recovered by back substitution and
+     * written to the data block.
+     *
+     * Every byte of the store is written once, so a flash partition can be
+     * used as the store if it has been erased beforehand.
+     *
+     * The decoder does not depend on ESP-IDF and can be used on a host.
+     */
+
+    /**
+     * @brief Reads from the fragment store.
+     * @return `true` if successful
+     */
+    typedef bool (*ttn_frag_store_read_fn)(void *context, uint32_t offset, void *buf, size_t length);
+
+    /**
+     * @brief Writes to the fragment store.
+     * @return `true` if successful
+     */
+    typedef bool (*ttn_frag_store_write_fn)(void *context, uint32_t offset, const void *buf, size_t length);
+
+    /**
+     * @brief Storage for the data block and the scratch area
+     *
+     * The data block occupies the range 0 to M * S - 1. The scratch area
+     * follows it and needs up to `max_lost` * S bytes.
+     */
+    typedef struct
+    {
+        ttn_frag_store_read_fn read;
+        ttn_frag_store_write_fn write;
+        void *context;
+    } ttn_frag_store_t;
+
+    typedef enum
+    {
+        TTN_FRAG_DECODER_ONGOING = 0,
+        TTN_FRAG_DECODER_COMPLETE,
+        TTN_FRAG_DECODER_TOO_MANY_LOST,
+        TTN_FRAG_DECODER_STORE_ERROR,
+        TTN_FRAG_DECODER_NO_MEMORY
+    } ttn_frag_decoder_result_t;
+
+    typedef struct
+    {
+        ttn_frag_store_t store;
+        uint16_t nb_frag;
+        uint8_t frag_size;
+        uint16_t max_lost;
+        ttn_frag_decoder_result_t result;
+
+        // number of received fragments (coded and uncoded)
+        uint16_t nb_received;
+        // number of uncoded fragments written to the store
+        uint16_t nb_uncoded;
+
+        // bitmap of uncoded fragments written to the store
+        uint8_t *received;
+        // parity matrix line (nb_frag bits)
+        uint8_t *line;
+
+        // fragment indexes of the missing fragments (0-based, ascending)
+        uint16_t *missing;
+        uint16_t nb_missing;
+        // number of independent equations
+        uint16_t rank;
+        // upper triangular coefficient matrix (row p holds columns p to nb_missing - 1)
+        uint8_t *matrix;
+        // equation being reduced (nb_missing bits)
+        uint8_t *row;
+
+        // right-hand side of the equation being reduced and a buffer for stored values
+        uint8_t *data;
+        uint8_t *tmp;
+    } ttn_frag_decoder_t;
+
+    /**
+     * @brief Initializes the decoder for a new data block.
+     * @return `true` if successful, `false` if out of memory or the parameters are invalid
+     */
+    bool ttn_frag_decoder_init(ttn_frag_decoder_t *decoder, uint16_t nb_frag, uint8_t frag_size, uint16_t max_lost,
+                               const ttn_frag_store_t *store);
+
+    /**
+     * @brief Releases the memory of the decoder.
+     */
+    void ttn_frag_decoder_free(ttn_frag_decoder_t *decoder);
+
+    /**
+     * @brief Processes a fragment.
+     * @param index fragment index (1-based; uncoded fragments are 1 to M, coded ones M + 1 and higher)
+     * @param data fragment data (S bytes)
+     * @return decoder state after processing the fragment
+     */
+    ttn_frag_decoder_result_t ttn_frag_decoder_process(ttn_frag_decoder_t *decoder, uint16_t index, const uint8_t *data);
+
+    /**
+     * @brief Gets the number of fragments still needed to reconstruct the data block.
+     */
+    uint16_t ttn_frag_decoder_missing(const ttn_frag_decoder_t *decoder);
+
+    /**
+     * @brief Gets the number of bytes of RAM allocated by the decoder.
+     */
+    size_t ttn_frag_decoder_memory(const ttn_frag_decoder_t *decoder);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,27 +10,78 @@
  * Circular buffer for detailed logging without affecting LMIC timing.
  *******************************************************************************/
 
-#if LMIC_ENABLE_event_logging
-
 #include "ttn_logging.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "ttn.h"
+#include <string.h>
+
+#define TAG "lmic"
+
+#if LMIC_ENABLE_event_logging
+
+#include "esp_partition.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "hal/hal_esp32.h"
 #include "lmic/lmic.h"
-#include <string.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include "esp_cpu.h"
+#define get_cycle_count() esp_cpu_get_cycle_count()
+#else
+#include "hal/cpu_hal.h"
+#define get_cycle_count() cpu_hal_get_cycle_count()
+#endif
 
-#define NUM_RINGBUF_MSG 50
-#define TAG "lmic"
+// number of records per producer (must be a power of 2)
+#define BUFFER_SIZE 32
+// interval at which the logging task checks for new records
+#define POLL_INTERVAL_MS 10
+// maximum size of an encoded record
+#define MAX_RECORD_SIZE 80
+// number of strings whose ID is remembered in a binary trace
+#define MAX_STRINGS 96
+#define FLASH_SECTOR_SIZE 4096
+#define TRACE_VERSION 1
+
+// producers: the LMIC task, and all other tasks (serialized)
+#define PRODUCER_LMIC 0
+#define PRODUCER_OTHER 1
+#define NUM_PRODUCERS 2
+
+// record kinds (LMIC events use their ev_t value)
+#define KIND_STRING 0x00
+#define KIND_MESSAGE 0xf0
+#define KIND_MESSAGE_DATUM 0xf1
+#define KIND_FATAL 0xf2
+
+// record fields (bit order is encoding order)
+#define FIELD_DATUM 0x0001
+#define FIELD_FREQ 0x0002
+#define FIELD_TXEND 0x0004
+#define FIELD_GLOBAL_DUTY_AVAIL 0x0008
+#define FIELD_OPMODE 0x0010
+#define FIELD_FCNT_UP 0x0020
+#define FIELD_FCNT_DN 0x0040
+#define FIELD_RXSYMS 0x0080
+#define FIELD_RPS 0x0100
+#define FIELD_TX_CHNL 0x0200
+#define FIELD_DATARATE 0x0400
+#define FIELD_TXRX_FLAGS 0x0800
+#define FIELD_SAVE_IRQ_FLAGS 0x1000
 
 /**
- * @brief Message structure used in ring buffer
+ * @brief Log message
  *
- * The structure is sent from the LMIC task to the logging task.
+ * The LMIC task records it in a trace buffer and the logging task outputs it.
+ * Only the fields in `fields` are output (set by the logging task).
  */
 typedef struct
 {
     const char *message;
     uint32_t datum;
+    uint32_t fields;
     ev_t event;
     ostime_t time;
     ostime_t txend;
@@ -47,9 +98,79 @@ typedef struct
     u1_t saveIrqFlags;
 } TTNLogMessage;
 
+/**
+ * @brief Trace buffer slot
+ *
+ * The sequence number tells whether the slot holds the record at position
+ * `pos` (sequence == 2 * pos + 2) or whether the producer is writing the
+ * record at position `pos` (sequence == 2 * pos + 1).
+ */
+typedef struct
+{
+    uint32_t sequence;
+    TTNLogMessage log;
+} TTNTraceSlot;
+
+/**
+ * @brief Single-producer single-consumer trace buffer
+ *
+ * The producer never waits: if the buffer is full, it overwrites the oldest
+ * record. The consumer skips the records that have been overwritten, including
+ * the ones overwritten while it was copying them, and counts them as dropped.
+ */
+typedef struct
+{
+    TTNTraceSlot slots[BUFFER_SIZE];
+    // number of records written (producer)
+    uint32_t head;
+    // next record to read (consumer)
+    uint32_t tail;
+    // records overwritten before being read (consumer)
+    uint32_t dropped;
+    // cost of recording (producer)
+    uint32_t events;
+    uint32_t maxCycles;
+    uint64_t cycles;
+} TTNTraceBuffer;
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    size_t pos;
+} TTNTraceWriter;
+
+typedef enum
+{
+    SINK_CONSOLE,
+    SINK_UART,
+    SINK_FILE,
+    SINK_PARTITION,
+} TTNLogSink;
+
 static void loggingTask(void *param);
 static void logFatal(const char *const file, const uint16_t line);
 
+static bool takeRecord(TTNLogMessage *log);
+static bool readRecord(TTNTraceBuffer *buffer, TTNLogMessage *log);
+static void outputRecord(TTNLogMessage *log);
+static void outputDropped(void);
+static uint32_t totalDropped(void);
+
+static uint32_t eventFields(int event);
+static void encodeRecord(TTNTraceWriter *w, const TTNLogMessage *log, uint32_t ref, ostime_t previousTime);
+static void putByte(TTNTraceWriter *w, uint8_t value);
+static void putVarint(TTNTraceWriter *w, uint32_t value);
+static uint32_t zigzag(int32_t value);
+
+static bool beginSinkChange(void);
+static void endSinkChange(TTNLogSink newSink);
+static void writeTrace(const TTNLogMessage *log);
+static uint32_t stringId(const char *str);
+static void writeSink(const void *data, size_t len);
+static void writePartition(const void *data, size_t len);
+static void flushSink(void);
+
 static void printMessage(TTNLogMessage *log);
 static void printFatalError(TTNLogMessage *log);
 static void printEvent(TTNLogMessage *log);
@@ -67,49 +188,101 @@ static const char *const BW_NAMES[] = {"BW125", "BW250", "BW500", "BWrfu"};
 static const char *const CR_NAMES[] = {"CR 4/5", "CR 4/6", "CR 4/7", "CR 4/8"};
 static const char *const CRC_NAMES[] = {"NoCrc", "Crc"};
 
-static RingbufHandle_t ringBuffer;
+static const char *const DROPPED_MESSAGE = "Log records dropped";
+
+static bool isInitialized;
+static TTNTraceBuffer buffers[NUM_PRODUCERS];
+// serializes the tasks other than the LMIC task
+static portMUX_TYPE otherProducerLock = portMUX_INITIALIZER_UNLOCKED;
+
+// logging task state
+static TTNLogMessage pending[NUM_PRODUCERS];
+static bool hasPending[NUM_PRODUCERS];
+static ostime_t outputTime;
+static uint32_t reportedDropped;
+
+// sink (protected by sinkMutex)
+static SemaphoreHandle_t sinkMutex;
+static TTNLogSink sink = SINK_CONSOLE;
+static uart_port_t sinkUart;
+static FILE *sinkFile;
+static const esp_partition_t *sinkPartition;
+static size_t partitionPos;
+static size_t partitionErased;
+static bool isPartitionFull;
+static bool isSinkDirty;
+
+// binary trace state (protected by sinkMutex)
+static ostime_t traceTime;
+static const char *traceStrings[MAX_STRINGS];
+static uint32_t numTraceStrings;
 
 // Initialize logging
 void ttn_log_init(void)
 {
-    ringBuffer = xRingbufferCreate(NUM_RINGBUF_MSG * sizeof(TTNLogMessage), RINGBUF_TYPE_NOSPLIT);
-    if (ringBuffer == NULL)
+    if (isInitialized)
+        return;
+
+    sinkMutex = xSemaphoreCreateMutex();
+    if (sinkMutex == NULL)
     {
-        ESP_LOGE(TAG, "Failed to create ring buffer");
+        ESP_LOGE(TAG, "Failed to create mutex");
         ASSERT(0);
     }
 
-    xTaskCreate(loggingTask, "ttn_log", 1024 * 4, ringBuffer, 4, NULL);
+    xTaskCreate(loggingTask, "ttn_log", 1024 * 4, NULL, 4, NULL);
     hal_set_failure_handler(logFatal);
+    __atomic_store_n(&isInitialized, true, __ATOMIC_RELEASE);
 }
 
 // Record a logging event for later output
 void ttn_log_event(int event, const char *message, uint32_t datum)
 {
-    if (ringBuffer == NULL)
+    if (!__atomic_load_n(&isInitialized, __ATOMIC_ACQUIRE))
         return;
 
-    // capture state
-    TTNLogMessage log = {
-        .message = message,
-        .datum = datum,
-        .time = os_getTime(),
-        .txend = LMIC.txend,
-        .globalDutyAvail = LMIC.globalDutyAvail,
-        .event = (ev_t)event,
-        .freq = LMIC.freq,
-        .opmode = LMIC.opmode,
-        .fcntDn = (u2_t)LMIC.seqnoDn,
-        .fcntUp = (u2_t)LMIC.seqnoUp,
-        .rxsyms = LMIC.rxsyms,
-        .rps = LMIC.rps,
-        .txChnl = LMIC.txChnl,
-        .datarate = LMIC.datarate,
-        .txrxFlags = LMIC.txrxFlags,
-        .saveIrqFlags = LMIC.saveIrqFlags,
-    };
+    uint32_t start = get_cycle_count();
+
+    bool isLmicTask = hal_esp32_is_lmic_task();
+    if (!isLmicTask)
+        portENTER_CRITICAL(&otherProducerLock);
+    TTNTraceBuffer *buffer = &buffers[isLmicTask ? PRODUCER_LMIC : PRODUCER_OTHER];
+
+    uint32_t pos = buffer->head;
+    TTNTraceSlot *slot = &buffer->slots[pos & (BUFFER_SIZE - 1)];
+    __atomic_store_n(&slot->sequence, 2 * pos + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-    xRingbufferSend(ringBuffer, &log, sizeof(log), 0);
+    // capture state
+    TTNLogMessage *log = &slot->log;
+    log->message = message;
+    log->datum = datum;
+    log->time = os_getTime();
+    log->txend = LMIC.txend;
+    log->globalDutyAvail = LMIC.globalDutyAvail;
+    log->event = (ev_t)event;
+    log->freq = LMIC.freq;
+    log->opmode = LMIC.opmode;
+    log->fcntDn = (u2_t)LMIC.seqnoDn;
+    log->fcntUp = (u2_t)LMIC.seqnoUp;
+    log->rxsyms = LMIC.rxsyms;
+    log->rps = LMIC.rps;
+    log->txChnl = LMIC.txChnl;
+    log->datarate = LMIC.datarate;
+    log->txrxFlags = LMIC.txrxFlags;
+    log->saveIrqFlags = LMIC.saveIrqFlags;
+
+    __atomic_store_n(&slot->sequence, 2 * pos + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&buffer->head, pos + 1, __ATOMIC_RELEASE);
+
+    uint32_t cycles = get_cycle_count() - start;
+    buffer->cycles += cycles;
+    if (cycles > buffer->maxCycles)
+        buffer->maxCycles = cycles;
+    __atomic_store_n(&buffer->events, buffer->events + 1, __ATOMIC_RELEASE);
+
+    if (!isLmicTask)
+        portEXIT_CRITICAL(&otherProducerLock);
 }
 
 // record a fatal event (failed assert) for later output
@@ -132,27 +305,428 @@ void LMICOS_logEventUint32(const char *pMessage, uint32_t datum)
     ttn_log_event(-2, pMessage, datum);
 }
 
+bool ttn_get_log_stats(ttn_log_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    uint64_t cycles = 0;
+    for (int i = 0; i < NUM_PRODUCERS; i++)
+    {
+        // the producer might update the values while they are read
+        TTNTraceBuffer *buffer = &buffers[i];
+        uint32_t events, maxCycles;
+        uint64_t bufferCycles;
+        do
+        {
+            events = __atomic_load_n(&buffer->events, __ATOMIC_ACQUIRE);
+            bufferCycles = buffer->cycles;
+            maxCycles = buffer->maxCycles;
+        } while (__atomic_load_n(&buffer->events, __ATOMIC_ACQUIRE) != events);
+
+        stats->events += events;
+        cycles += bufferCycles;
+        if (maxCycles > stats->max_cycles)
+            stats->max_cycles = maxCycles;
+    }
+
+    stats->dropped = totalDropped();
+    stats->cycles_per_event = stats->events != 0 ? (uint32_t)(cycles / stats->events) : 0;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Trace buffers (logging task)
+
+// Take the oldest record of all producers
+bool takeRecord(TTNLogMessage *log)
+{
+    int oldest = -1;
+    for (int i = 0; i < NUM_PRODUCERS; i++)
+    {
+        if (!hasPending[i])
+            hasPending[i] = readRecord(&buffers[i], &pending[i]);
+        if (hasPending[i] && (oldest < 0 || (int32_t)(pending[i].time - pending[oldest].time) < 0))
+            oldest = i;
+    }
+
+    if (oldest < 0)
+        return false;
+
+    *log = pending[oldest];
+    hasPending[oldest] = false;
+    return true;
+}
+
+bool readRecord(TTNTraceBuffer *buffer, TTNLogMessage *log)
+{
+    while (true)
+    {
+        uint32_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        if (buffer->tail == head)
+            return false;
+
+        // skip the records that have been overwritten
+        if (head - buffer->tail > BUFFER_SIZE)
+        {
+            __atomic_store_n(&buffer->dropped, buffer->dropped + (head - buffer->tail - BUFFER_SIZE), __ATOMIC_RELAXED);
+            buffer->tail = head - BUFFER_SIZE;
+        }
+
+        TTNTraceSlot *slot = &buffer->slots[buffer->tail & (BUFFER_SIZE - 1)];
+        uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        *log = slot->log;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        bool isValid = sequence == 2 * buffer->tail + 2 &&
+                       __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+        buffer->tail++;
+        if (isValid)
+            return true;
+
+        // overwritten while being copied
+        __atomic_store_n(&buffer->dropped, buffer->dropped + 1, __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t totalDropped(void)
+{
+    uint32_t dropped = 0;
+    for (int i = 0; i < NUM_PRODUCERS; i++)
+        dropped += __atomic_load_n(&buffers[i].dropped, __ATOMIC_RELAXED);
+    return dropped;
+}
+
+// ---------------------------------------------------------------------------
+// Trace records
+
+// Fields output for an event (the ones needed to format it)
+uint32_t eventFields(int event)
+{
+    switch (event)
+    {
+    case -1:
+        return FIELD_OPMODE;
+    case -2:
+        return FIELD_DATUM | FIELD_OPMODE;
+    case -3:
+        return FIELD_DATUM | FIELD_FREQ | FIELD_TXEND | FIELD_GLOBAL_DUTY_AVAIL | FIELD_OPMODE | FIELD_RPS |
+               FIELD_TX_CHNL | FIELD_TXRX_FLAGS | FIELD_SAVE_IRQ_FLAGS;
+    case EV_JOINED:
+        return FIELD_TX_CHNL;
+    case EV_JOIN_FAILED:
+        return FIELD_FREQ | FIELD_OPMODE | FIELD_RPS;
+    case EV_TXCOMPLETE:
+        return FIELD_TXEND | FIELD_FCNT_UP | FIELD_FCNT_DN | FIELD_RPS | FIELD_TX_CHNL | FIELD_TXRX_FLAGS;
+    case EV_TXSTART:
+        return FIELD_FREQ | FIELD_TXEND | FIELD_OPMODE | FIELD_RPS | FIELD_TX_CHNL | FIELD_DATARATE;
+    case EV_RXSTART:
+        return FIELD_FREQ | FIELD_TXEND | FIELD_RXSYMS | FIELD_RPS;
+    case EV_JOIN_TXCOMPLETE:
+        return FIELD_TXEND | FIELD_SAVE_IRQ_FLAGS;
+    default:
+        return FIELD_OPMODE;
+    }
+}
+
+void encodeRecord(TTNTraceWriter *w, const TTNLogMessage *log, uint32_t ref, ostime_t previousTime)
+{
+    int event = (int)log->event;
+    uint8_t kind = event == -1 ? KIND_MESSAGE : event == -2 ? KIND_MESSAGE_DATUM : event == -3 ? KIND_FATAL : event;
+    uint32_t fields = log->fields;
+
+    putByte(w, kind);
+    putVarint(w, zigzag(log->time - previousTime));
+    putVarint(w, ref);
+    putVarint(w, fields);
+    if ((fields & FIELD_DATUM) != 0)
+        putVarint(w, log->datum);
+    if ((fields & FIELD_FREQ) != 0)
+        putVarint(w, log->freq);
+    if ((fields & FIELD_TXEND) != 0)
+        putVarint(w, zigzag(log->txend - log->time));
+    if ((fields & FIELD_GLOBAL_DUTY_AVAIL) != 0)
+        putVarint(w, zigzag(log->globalDutyAvail - log->time));
+    if ((fields & FIELD_OPMODE) != 0)
+        putVarint(w, log->opmode);
+    if ((fields & FIELD_FCNT_UP) != 0)
+        putVarint(w, log->fcntUp);
+    if ((fields & FIELD_FCNT_DN) != 0)
+        putVarint(w, log->fcntDn);
+    if ((fields & FIELD_RXSYMS) != 0)
+        putVarint(w, log->rxsyms);
+    if ((fields & FIELD_RPS) != 0)
+        putVarint(w, log->rps);
+    if ((fields & FIELD_TX_CHNL) != 0)
+        putVarint(w, log->txChnl);
+    if ((fields & FIELD_DATARATE) != 0)
+        putVarint(w, log->datarate);
+    if ((fields & FIELD_TXRX_FLAGS) != 0)
+        putVarint(w, log->txrxFlags);
+    if ((fields & FIELD_SAVE_IRQ_FLAGS) != 0)
+        putVarint(w, log->saveIrqFlags);
+}
+
+void putByte(TTNTraceWriter *w, uint8_t value)
+{
+    if (w->pos < w->size)
+        w->buf[w->pos++] = value;
+}
+
+void putVarint(TTNTraceWriter *w, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        putByte(w, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    putByte(w, (uint8_t)value);
+}
+
+uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// ---------------------------------------------------------------------------
+// Sinks
+
+bool ttn_log_to_console(void)
+{
+    if (!beginSinkChange())
+        return false;
+    endSinkChange(SINK_CONSOLE);
+    return true;
+}
+
+bool ttn_log_to_uart(uart_port_t uart_num)
+{
+    if (!beginSinkChange())
+        return false;
+    sinkUart = uart_num;
+    endSinkChange(SINK_UART);
+    return true;
+}
+
+bool ttn_log_to_file(FILE *file)
+{
+    if (!beginSinkChange())
+        return false;
+    sinkFile = file;
+    endSinkChange(SINK_FILE);
+    return true;
+}
+
+bool ttn_log_to_partition(const char *label)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (partition == NULL)
+    {
+        ESP_LOGE(TAG, "Partition %s not found", label);
+        return false;
+    }
+
+    if (!beginSinkChange())
+        return false;
+    sinkPartition = partition;
+    partitionPos = 0;
+    partitionErased = 0;
+    isPartitionFull = false;
+    endSinkChange(SINK_PARTITION);
+    return true;
+}
+
+// Wait until the current record has been written and flush the current sink
+bool beginSinkChange(void)
+{
+    if (sinkMutex == NULL)
+    {
+        ESP_LOGE(TAG, "Logging not initialized (call ttn_configure_pins() first)");
+        return false;
+    }
+
+    xSemaphoreTake(sinkMutex, portMAX_DELAY);
+    flushSink();
+    return true;
+}
+
+// Switch to the new sink and start a new binary trace
+void endSinkChange(TTNLogSink newSink)
+{
+    sink = newSink;
+    if (sink != SINK_CONSOLE)
+    {
+        traceTime = 0;
+        numTraceStrings = 0;
+
+        uint8_t buf[8] = {'T', 'T', 'N', 'T'};
+        TTNTraceWriter w = {.buf = buf, .size = sizeof(buf), .pos = 4};
+        putByte(&w, TRACE_VERSION);
+        putVarint(&w, US_PER_OSTICK);
+        writeSink(buf, w.pos);
+    }
+    xSemaphoreGive(sinkMutex);
+}
+
+// Write a record to the binary trace (called with sinkMutex held)
+void writeTrace(const TTNLogMessage *log)
+{
+    uint32_t id = stringId(log->message);
+
+    uint8_t buf[MAX_RECORD_SIZE];
+    TTNTraceWriter w = {.buf = buf, .size = sizeof(buf)};
+    encodeRecord(&w, log, id, traceTime);
+    traceTime = log->time;
+    writeSink(buf, w.pos);
+}
+
+// Get the ID of a string, and define it in the trace if it is new
+uint32_t stringId(const char *str)
+{
+    for (uint32_t i = 0; i < numTraceStrings && i < MAX_STRINGS; i++)
+    {
+        if (traceStrings[i] == str)
+            return i;
+    }
+
+    // once the table is full, strings are defined again for each use
+    uint32_t id = numTraceStrings;
+    if (numTraceStrings < MAX_STRINGS)
+    {
+        traceStrings[numTraceStrings] = str;
+        numTraceStrings++;
+    }
+
+    if (str == NULL)
+        str = "";
+    size_t len = strlen(str);
+    uint8_t buf[12];
+    TTNTraceWriter w = {.buf = buf, .size = sizeof(buf)};
+    putByte(&w, KIND_STRING);
+    putVarint(&w, id);
+    putVarint(&w, len);
+    writeSink(buf, w.pos);
+    writeSink(str, len);
+    return id;
+}
+
+void writeSink(const void *data, size_t len)
+{
+    switch (sink)
+    {
+    case SINK_UART:
+        uart_write_bytes(sinkUart, (const char *)data, len);
+        break;
+
+    case SINK_FILE:
+        fwrite(data, 1, len, sinkFile);
+        break;
+
+    case SINK_PARTITION:
+        writePartition(data, len);
+        break;
+
+    default:
+        return;
+    }
+    isSinkDirty = true;
+}
+
+// Append to the partition, erasing the sectors as they are reached; stops when full
+void writePartition(const void *data, size_t len)
+{
+    if (isPartitionFull)
+        return;
+
+    if (partitionPos + len > sinkPartition->size)
+    {
+        ESP_LOGW(TAG, "Trace partition %s is full", sinkPartition->label);
+        isPartitionFull = true;
+        return;
+    }
+
+    while (partitionErased < partitionPos + len)
+    {
+        if (esp_partition_erase_range(sinkPartition, partitionErased, FLASH_SECTOR_SIZE) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to erase trace partition %s", sinkPartition->label);
+            isPartitionFull = true;
+            return;
+        }
+        partitionErased += FLASH_SECTOR_SIZE;
+    }
+
+    esp_partition_write(sinkPartition, partitionPos, data, len);
+    partitionPos += len;
+}
+
+void flushSink(void)
+{
+    if (!isSinkDirty)
+        return;
+
+    if (sink == SINK_FILE)
+        fflush(sinkFile);
+    isSinkDirty = false;
+}
+
 // ---------------------------------------------------------------------------
 // Log output
 
 // Tasks that receiveds the recorded messages, formats and outputs them.
 void loggingTask(void *param)
 {
-    RingbufHandle_t ringBuffer = (RingbufHandle_t)param;
-
     while (true)
     {
-        size_t size;
-        TTNLogMessage *log = (TTNLogMessage *)xRingbufferReceive(ringBuffer, &size, portMAX_DELAY);
-        if (log == NULL)
+        TTNLogMessage log;
+        if (!takeRecord(&log))
+        {
+            // flush the sink while idle
+            xSemaphoreTake(sinkMutex, portMAX_DELAY);
+            flushSink();
+            xSemaphoreGive(sinkMutex);
+
+            vTaskDelay(pdMS_TO_TICKS(POLL_INTERVAL_MS));
             continue;
+        }
 
-        printMessage(log);
+        log.fields = eventFields((int)log.event);
 
-        vRingbufferReturnItem(ringBuffer, log);
+        xSemaphoreTake(sinkMutex, portMAX_DELAY);
+        if (totalDropped() != reportedDropped)
+            outputDropped();
+        outputRecord(&log);
+        xSemaphoreGive(sinkMutex);
     }
 }
 
+// Output a record to the current sink (called with sinkMutex held)
+void outputRecord(TTNLogMessage *log)
+{
+    outputTime = log->time;
+    if (sink == SINK_CONSOLE)
+        printMessage(log);
+    else
+        writeTrace(log);
+}
+
+// Output the number of records dropped since the last report (called with sinkMutex held)
+void outputDropped(void)
+{
+    uint32_t dropped = totalDropped();
+    TTNLogMessage log = {
+        .message = DROPPED_MESSAGE,
+        .datum = dropped - reportedDropped,
+        .fields = FIELD_DATUM,
+        .event = (ev_t)-2,
+        .time = outputTime,
+    };
+    reportedDropped = dropped;
+
+    if (sink == SINK_CONSOLE)
+        ESP_LOGW(TAG, "%u log records dropped", log.datum);
+    else
+        writeTrace(&log);
+}
+
 // Format and output a log message
 void printMessage(TTNLogMessage *log)
 {
@@ -310,4 +884,37 @@ void bin2hex(const uint8_t *bin, unsigned len, char *buf, char sep)
     buf[tgt] = 0;
 }
 
+#else
+
+bool ttn_log_to_console(void)
+{
+    ESP_LOGW(TAG, "Event logging is disabled (LMIC_ENABLE_event_logging)");
+    return false;
+}
+
+bool ttn_log_to_uart(uart_port_t uart_num)
+{
+    ESP_LOGW(TAG, "Event logging is disabled (LMIC_ENABLE_event_logging)");
+    return false;
+}
+
+bool ttn_log_to_file(FILE *file)
+{
+    ESP_LOGW(TAG, "Event logging is disabled (LMIC_ENABLE_event_logging)");
+    return false;
+}
+
+bool ttn_log_to_partition(const char *label)
+{
+    ESP_LOGW(TAG, "Event logging is disabled (LMIC_ENABLE_event_logging)");
+    return false;
+}
+
+bool ttn_get_log_stats(ttn_log_stats_t *stats)
+{
+    ESP_LOGW(TAG, "Event logging is disabled (LMIC_ENABLE_event_logging)");
+    memset(stats, 0, sizeof(*stats));
+    return false;
+}
+
 #endif
@@ -15,8 +15,7 @@
 
 #if LMIC_ENABLE_event_logging
 
-#include <freertos/FreeRTOS.h>
-#include <freertos/ringbuf.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -29,13 +28,47 @@ extern "C"
      * Logs internal information from LMIC in an asynchrnous fashion in order
      * not to distrub the sensitive LORA timing.
      *
-     * A ring buffer and a separate logging task is ued. The LMIC core records
-     * relevant values from the current LORA settings and writes them to a ring
-     * buffer. The logging tasks receives the message and the values, formats
-     * them and outputs them via the regular ESP-IDF logging mechanism.
+     * Trace buffers and a separate logging task are used. The LMIC core records
+     * relevant values from the current LORA settings in a fixed-size record and
+     * writes it to a trace buffer. The logging tasks polls the buffers and
+     * either formats the records and outputs them via the regular ESP-IDF
+     * logging mechanism or streams them as a compact binary trace to a UART, a
+     * file or a flash partition (see ttn_log_to_uart() etc.). The binary trace
+     * is decoded on the host with `tools/trace_decoder`.
+     *
+     * Each producer has its own lock-free single-producer single-consumer
+     * buffer: the LMIC task, and all other tasks (e.g. application tasks calling
+     * LMIC functions), which are serialized by a spinlock. A producer never
+     * waits; if its buffer is full, the oldest record is overwritten and
+     * counted as dropped (see ttn_get_log_stats()).
      *
      * In order to activate the detailed logging, set the macro
      * `LMIC_ENABLE_event_logging` to 1.
+     *
+     * Binary trace format (unsigned varints, signed values zigzag encoded):
+     *
+     *   header: "TTNT" | version (byte, 1) | µs per tick (varint)
+     *
+     *   string: 0x00 | string ID | length | characters
+     *
+     *   record: kind (byte) | time delta (signed, ticks) | string ID |
+     *           field mask | fields*
+     *
+     *   kind: 0x01 - 0x3f LMIC event (ev_t), 0xf0 message,
+     *         0xf1 message with value, 0xf2 fatal error, 0xff end of trace
+     *         (erased flash)
+     *
+     *   fields (in the order of the mask bits): 0 value, 1 frequency (Hz),
+     *         2 txend (signed, relative to the record), 3 global duty cycle
+     *         availability (signed, relative to the record), 4 opmode,
+     *         5 FCntUp, 6 FCntDn, 7 rxsyms, 8 rps, 9 TX channel, 10 data rate,
+     *         11 txrxFlags, 12 saveIrqFlags
+     *
+     * The time delta of the first record after a header is relative to 0,
+     * i.e. the LMIC time. A string is defined before its first use; the
+     * string ID of an LMIC event refers to the event name. Dropped records
+     * are reported as a message with the number of records as value. A new
+     * header starts a new trace, e.g. after a restart.
      */
 
     void ttn_log_init(void);
@@ -10,25 +10,139 @@
  * Functions for storing and retrieving TTN communication state from NVS.
  *******************************************************************************/
 
+#include "ttn_nvs.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "hal/hal_esp32.h"
 #include "lmic/lmic.h"
 #include "nvs_flash.h"
-#include "ttn_rtc.h"
+#include "ttn_clock.h"
+#include "ttn_session.h"
+#include "ttn_startup_trace.h"
+#include <stdio.h>
 #include <string.h>
 
-#define LMIC_OFFSET(field) __builtin_offsetof(struct lmic_t, field)
-#define LMIC_DIST(field1, field2) (LMIC_OFFSET(field2) - LMIC_OFFSET(field1))
-
 #define TAG "ttn_nvs"
 #define NVS_FLASH_PARTITION "ttn"
-#define NVS_FLASH_KEY_CHUNK_1 "chunk1"
-#define NVS_FLASH_KEY_CHUNK_2 "chunk2"
-#define NVS_FLASH_KEY_CHUNK_3 "chunk3"
+#define NVS_FLASH_KEY_SESSION "session"
 #define NVS_FLASH_KEY_TIME "time"
+#define NVS_FLASH_KEY_COUNTER_LOG "fclog%d"
+
+#define COUNTER_LOG_INTERVAL CONFIG_TTN_COUNTER_LOG_INTERVAL
+#define COUNTER_LOG_SLOTS 4
+
+#define STAGED_BLOB_SLOTS 2
+#define STAGED_BLOB_MAX_SIZE 128
+
+/**
+ * @brief Frame counter record of the write-ahead log
+ *
+ * Records are written round-robin into COUNTER_LOG_SLOTS keys.
+ */
+typedef struct
+{
+    uint32_t record_no;
+    uint32_t devaddr;
+    uint32_t seqno_up;
+    uint32_t seqno_dn;
+} counter_record_t;
+
+/**
+ * @brief Persistable state captured for writing to NVS
+ */
+typedef struct
+{
+    uint8_t session[TTN_SESSION_MAX_SIZE];
+    size_t session_len;
+    uint32_t time;
+    uint32_t devaddr;
+    uint32_t seqno_up;
+} snapshot_t;
+
+/**
+ * @brief Blob staged for writing (or erasing) by the writer task
+ */
+typedef struct
+{
+    const char *key; // NULL if slot is unused
+    bool erase;
+    size_t length;
+    uint8_t data[STAGED_BLOB_MAX_SIZE];
+} staged_blob_t;
+
+#define WRITER_IDLE_BIT 0x01
+
+static esp_err_t save_session(void);
+static bool take_snapshot(snapshot_t *snapshot);
+static esp_err_t commit_snapshot(const snapshot_t *snapshot);
+static void init_writer(void);
+static void writer_task(void *param);
+static bool take_staged_blob(staged_blob_t *blob);
+static esp_err_t commit_blob(const staged_blob_t *blob);
+#if COUNTER_LOG_INTERVAL > 0
+static void stage_counter_record(void);
+static esp_err_t commit_counter_record(const counter_record_t *record);
+static void replay_counter_log(nvs_handle handle);
+#endif
+
+// keys of the previous raw format
+static const char *const legacy_keys[] = {"chunk1", "chunk2", "chunk3"};
+
+// Background writer: the latest snapshot and counter record are staged and committed by a low-priority task
+static TaskHandle_t writer_task_handle;
+static SemaphoreHandle_t staging_mutex;
+static EventGroupHandle_t writer_event_group;
+static snapshot_t staging;
+static bool is_staged;
+static uint32_t staged_no;
+static volatile uint32_t committed_no;
+static volatile esp_err_t committed_result;
+static snapshot_t writer_buffer;
+#if COUNTER_LOG_INTERVAL > 0
+static counter_record_t staged_record;
+static bool is_record_staged;
+#endif
+static staged_blob_t staged_blobs[STAGED_BLOB_SLOTS];
+static staged_blob_t writer_blob;
+
+#if COUNTER_LOG_INTERVAL > 0
+// Log state: updated by the LMIC task and by the writer task after a commit
+static portMUX_TYPE log_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool log_valid;
+static uint32_t log_devaddr;
+static uint32_t log_seqno_up;
+static uint32_t log_record_no;
+static uint32_t log_records_since_save;
+#endif
 
 void ttn_nvs_save()
+{
+    ESP_ERROR_CHECK(save_session());
+}
+
+esp_err_t save_session(void)
+{
+    snapshot_t snapshot;
+    if (!take_snapshot(&snapshot))
+        return ESP_ERR_INVALID_SIZE;
+
+    return commit_snapshot(&snapshot);
+}
+
+bool take_snapshot(snapshot_t *snapshot)
+{
+    snapshot->session_len = ttn_session_encode(snapshot->session, sizeof(snapshot->session));
+    snapshot->time = hal_esp32_get_time();
+    snapshot->devaddr = LMIC.devaddr;
+    snapshot->seqno_up = LMIC.seqnoUp;
+    return snapshot->session_len != 0;
+}
+
+esp_err_t commit_snapshot(const snapshot_t *snapshot)
 {
     nvs_handle handle = 0;
     esp_err_t res = nvs_open(NVS_FLASH_PARTITION, NVS_READWRITE, &handle);
@@ -37,40 +151,236 @@ void ttn_nvs_save()
     if (res != ESP_OK)
         goto done;
 
-    // Save LMIC struct except client, osjob, pendTxData and frame
-    size_t len1 = LMIC_DIST(radio, pendTxData);
-    res = nvs_set_blob(handle, NVS_FLASH_KEY_CHUNK_1, &LMIC.radio, len1);
+    res = nvs_set_blob(handle, NVS_FLASH_KEY_SESSION, snapshot->session, snapshot->session_len);
     if (res != ESP_OK)
         goto done;
 
-    size_t len2 = LMIC_DIST(pendTxData, frame) - MAX_LEN_PAYLOAD;
-    res = nvs_set_blob(handle, NVS_FLASH_KEY_CHUNK_2, (u1_t *)&LMIC.pendTxData + MAX_LEN_PAYLOAD, len2);
+    res = nvs_set_u32(handle, NVS_FLASH_KEY_TIME, snapshot->time);
     if (res != ESP_OK)
         goto done;
 
-    size_t len3 = sizeof(struct lmic_t) - LMIC_OFFSET(frame) - MAX_LEN_FRAME;
-    res = nvs_set_blob(handle, NVS_FLASH_KEY_CHUNK_3, (u1_t *)&LMIC.frame + MAX_LEN_FRAME, len3);
+    for (int i = 0; i < sizeof(legacy_keys) / sizeof(legacy_keys[0]); i++)
+        nvs_erase_key(handle, legacy_keys[i]); // ignore ESP_ERR_NVS_NOT_FOUND
+
+    res = nvs_commit(handle);
     if (res != ESP_OK)
         goto done;
 
-    res = nvs_set_u32(handle, NVS_FLASH_KEY_TIME, hal_esp32_get_time());
+#if COUNTER_LOG_INTERVAL > 0
+    // the session supersedes all log records
+    portENTER_CRITICAL(&log_lock);
+    log_valid = true;
+    log_devaddr = snapshot->devaddr;
+    log_seqno_up = snapshot->seqno_up;
+    log_records_since_save = 0;
+    portEXIT_CRITICAL(&log_lock);
+#endif
+
+done:
+    nvs_close(handle);
+    return res;
+}
+
+// --- Background writer
+
+uint32_t ttn_nvs_save_async(void)
+{
+    if (writer_task_handle == NULL)
+        init_writer();
+
+    xSemaphoreTake(staging_mutex, portMAX_DELAY);
+    if (!take_snapshot(&staging))
+    {
+        xSemaphoreGive(staging_mutex);
+        return 0;
+    }
+    is_staged = true;
+    staged_no++;
+    if (staged_no == 0)
+        staged_no = 1; // 0 is reserved for failure
+    uint32_t snapshot_no = staged_no;
+    xEventGroupClearBits(writer_event_group, WRITER_IDLE_BIT);
+    xSemaphoreGive(staging_mutex);
+
+    xTaskNotifyGive(writer_task_handle);
+    return snapshot_no;
+}
+
+bool ttn_nvs_wait_for_save(uint32_t snapshot_no, TickType_t ticks_to_wait)
+{
+    if (snapshot_no == 0 || writer_event_group == NULL)
+        return false;
+
+    EventBits_t bits = xEventGroupWaitBits(writer_event_group, WRITER_IDLE_BIT, pdFALSE, pdTRUE, ticks_to_wait);
+    if ((bits & WRITER_IDLE_BIT) == 0)
+        return false; // timeout
+
+    // the last commit contains this snapshot or a newer one
+    return (int32_t)(committed_no - snapshot_no) >= 0 && committed_result == ESP_OK;
+}
+
+void init_writer(void)
+{
+    staging_mutex = xSemaphoreCreateMutex();
+    ASSERT(staging_mutex != NULL);
+    writer_event_group = xEventGroupCreate();
+    ASSERT(writer_event_group != NULL);
+    xEventGroupSetBits(writer_event_group, WRITER_IDLE_BIT);
+    xTaskCreate(writer_task, "ttn_nvs", 1024 * 3, NULL, CONFIG_TTN_NVS_TASK_PRIO, &writer_task_handle);
+}
+
+void writer_task(void *param)
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (true)
+        {
+            xSemaphoreTake(staging_mutex, portMAX_DELAY);
+#if COUNTER_LOG_INTERVAL > 0
+            bool has_record = is_record_staged;
+            counter_record_t record = staged_record;
+            is_record_staged = false;
+#else
+            bool has_record = false;
+#endif
+            bool has_blob = take_staged_blob(&writer_blob);
+            bool has_snapshot = is_staged;
+            if (!has_record && !has_blob && !has_snapshot)
+            {
+                xEventGroupSetBits(writer_event_group, WRITER_IDLE_BIT);
+                xSemaphoreGive(staging_mutex);
+                break;
+            }
+            if (has_snapshot)
+                memcpy(&writer_buffer, &staging, sizeof(writer_buffer));
+            uint32_t snapshot_no = staged_no;
+            is_staged = false;
+            xSemaphoreGive(staging_mutex);
+
+#if COUNTER_LOG_INTERVAL > 0
+            if (has_record)
+            {
+                esp_err_t res = commit_counter_record(&record);
+                if (res != ESP_OK)
+                    ESP_LOGW(TAG, "Writing frame counter record failed: %d", res);
+            }
+#endif
+
+            if (has_blob)
+            {
+                esp_err_t res = commit_blob(&writer_blob);
+                if (res != ESP_OK)
+                    ESP_LOGW(TAG, "Writing '%s' failed: %d", writer_blob.key, res);
+            }
+
+            if (has_snapshot)
+            {
+                esp_err_t res = commit_snapshot(&writer_buffer);
+                if (res != ESP_OK)
+                    ESP_LOGW(TAG, "Saving session failed: %d", res);
+                committed_result = res;
+                committed_no = snapshot_no;
+            }
+        }
+    }
+}
+
+void ttn_nvs_stage_blob(const char *key, const void *data, size_t length)
+{
+    ASSERT(length <= STAGED_BLOB_MAX_SIZE);
+
+    if (writer_task_handle == NULL)
+        init_writer();
+
+    xSemaphoreTake(staging_mutex, portMAX_DELAY);
+
+    // a staged blob with the same key is replaced
+    staged_blob_t *blob = NULL;
+    for (int i = 0; i < STAGED_BLOB_SLOTS && blob == NULL; i++)
+    {
+        if (staged_blobs[i].key != NULL && strcmp(staged_blobs[i].key, key) == 0)
+            blob = &staged_blobs[i];
+    }
+    for (int i = 0; i < STAGED_BLOB_SLOTS && blob == NULL; i++)
+    {
+        if (staged_blobs[i].key == NULL)
+            blob = &staged_blobs[i];
+    }
+
+    if (blob != NULL)
+    {
+        blob->key = key;
+        blob->erase = data == NULL;
+        blob->length = data != NULL ? length : 0;
+        if (data != NULL)
+            memcpy(blob->data, data, length);
+        xEventGroupClearBits(writer_event_group, WRITER_IDLE_BIT);
+    }
+    xSemaphoreGive(staging_mutex);
+
+    if (blob == NULL)
+    {
+        ESP_LOGW(TAG, "Too many staged writes, '%s' dropped", key);
+        return;
+    }
+
+    xTaskNotifyGive(writer_task_handle);
+}
+
+// Called by the writer task with the staging mutex held
+bool take_staged_blob(staged_blob_t *blob)
+{
+    for (int i = 0; i < STAGED_BLOB_SLOTS; i++)
+    {
+        if (staged_blobs[i].key != NULL)
+        {
+            memcpy(blob, &staged_blobs[i], sizeof(*blob));
+            staged_blobs[i].key = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t commit_blob(const staged_blob_t *blob)
+{
+    nvs_handle handle = 0;
+    esp_err_t res = nvs_open(NVS_FLASH_PARTITION, NVS_READWRITE, &handle);
     if (res != ESP_OK)
         goto done;
 
-    res = nvs_commit(handle);
+    if (blob->erase)
+    {
+        res = nvs_erase_key(handle, blob->key);
+        if (res == ESP_ERR_NVS_NOT_FOUND)
+            res = ESP_OK;
+    }
+    else
+    {
+        res = nvs_set_blob(handle, blob->key, blob->data, blob->length);
+    }
     if (res != ESP_OK)
         goto done;
 
+    res = nvs_commit(handle);
+
 done:
     nvs_close(handle);
-
-    ESP_ERROR_CHECK(res);
+    return res;
 }
 
 bool ttn_nvs_restore(int off_duration)
 {
+    uint8_t session[TTN_SESSION_MAX_SIZE];
+    size_t session_len = sizeof(session);
+    bool result = false;
+
     nvs_handle handle = 0;
+    TTN_STARTUP_BEGIN(TTN_STARTUP_NVS_OPEN);
     esp_err_t res = nvs_open(NVS_FLASH_PARTITION, NVS_READWRITE, &handle);
+    TTN_STARTUP_END(TTN_STARTUP_NVS_OPEN);
     if (res == ESP_ERR_NVS_NOT_INITIALIZED)
         ESP_LOGW(TAG, "NVS storage is not initialized. Call 'nvs_flash_init()' first.");
     if (res != ESP_OK)
@@ -81,25 +391,11 @@ bool ttn_nvs_restore(int off_duration)
     if (res != ESP_OK)
         goto done;
 
-    size_t len1 = LMIC_DIST(radio, pendTxData);
-    res = nvs_get_blob(handle, NVS_FLASH_KEY_CHUNK_1, &LMIC.radio, &len1);
-    if (res != ESP_OK)
-        goto done;
-
-    memset(LMIC.pendTxData, 0, MAX_LEN_PAYLOAD);
-
-    size_t len2 = LMIC_DIST(pendTxData, frame) - MAX_LEN_PAYLOAD;
-    res = nvs_get_blob(handle, NVS_FLASH_KEY_CHUNK_2, (u1_t *)&LMIC.pendTxData + MAX_LEN_PAYLOAD, &len2);
-    if (res != ESP_OK)
-        goto done;
-
-    memset(LMIC.frame, 0, MAX_LEN_FRAME);
-
-    size_t len3 = sizeof(struct lmic_t) - LMIC_OFFSET(frame) - MAX_LEN_FRAME;
-    res = nvs_get_blob(handle, NVS_FLASH_KEY_CHUNK_3, (u1_t *)&LMIC.frame + MAX_LEN_FRAME, &len3);
+    res = nvs_get_blob(handle, NVS_FLASH_KEY_SESSION, session, &session_len);
     if (res != ESP_OK)
         goto done;
 
+#if COUNTER_LOG_INTERVAL == 0
     // invalidate data
     res = nvs_erase_key(handle, NVS_FLASH_KEY_TIME);
     if (res != ESP_OK)
@@ -108,15 +404,154 @@ bool ttn_nvs_restore(int off_duration)
     res = nvs_commit(handle);
     if (res != ESP_OK)
         goto done;
+#endif
 
+    // advance the clock by the time the device was off
     if (off_duration != 0)
+    {
         hal_esp32_set_time(time_val + off_duration * 60);
+        // the GPS clock refers to the previous time
+        ttn_clock_reset();
+    }
+
+    result = ttn_session_decode(session, session_len);
+
+#if COUNTER_LOG_INTERVAL > 0
+    // The session stays valid as the counters in the log only ever increase.
+    if (result)
+        replay_counter_log(handle);
+#endif
 
 done:
     nvs_close(handle);
+    return result;
+}
+
+// --- Frame counter write-ahead log
+
+void ttn_nvs_log_uplink(void)
+{
+#if COUNTER_LOG_INTERVAL > 0
+    if (LMIC.devaddr == 0)
+        return; // not joined
+
+    portENTER_CRITICAL(&log_lock);
+    bool needs_save = !log_valid || LMIC.devaddr != log_devaddr
+        || log_records_since_save >= CONFIG_TTN_COUNTER_LOG_SAVE_INTERVAL;
+    bool needs_record = !needs_save && LMIC.seqnoUp - log_seqno_up >= COUNTER_LOG_INTERVAL;
+    portEXIT_CRITICAL(&log_lock);
+
+    if (needs_save)
+    {
+        // new session or log has grown: write full state in the background
+        ttn_nvs_save_async();
+    }
+    else if (needs_record)
+    {
+        stage_counter_record();
+    }
+#endif
+}
 
+#if COUNTER_LOG_INTERVAL > 0
+
+// Called by the LMIC task (or during restore); the record is written by the writer task
+void stage_counter_record(void)
+{
+    if (writer_task_handle == NULL)
+        init_writer();
+
+    portENTER_CRITICAL(&log_lock);
+    log_record_no++;
+    counter_record_t record = {
+        .record_no = log_record_no,
+        .devaddr = LMIC.devaddr,
+        .seqno_up = LMIC.seqnoUp,
+        .seqno_dn = LMIC.seqnoDn,
+    };
+    log_seqno_up = record.seqno_up;
+    log_records_since_save++;
+    portEXIT_CRITICAL(&log_lock);
+
+    // a newer record supersedes a staged one that has not been written yet
+    xSemaphoreTake(staging_mutex, portMAX_DELAY);
+    staged_record = record;
+    is_record_staged = true;
+    xEventGroupClearBits(writer_event_group, WRITER_IDLE_BIT);
+    xSemaphoreGive(staging_mutex);
+
+    xTaskNotifyGive(writer_task_handle);
+}
+
+esp_err_t commit_counter_record(const counter_record_t *record)
+{
+    char key[16];
+    snprintf(key, sizeof(key), NVS_FLASH_KEY_COUNTER_LOG, record->record_no % COUNTER_LOG_SLOTS);
+
+    nvs_handle handle = 0;
+    esp_err_t res = nvs_open(NVS_FLASH_PARTITION, NVS_READWRITE, &handle);
+    if (res != ESP_OK)
+        goto done;
+
+    res = nvs_set_blob(handle, key, record, sizeof(*record));
+    if (res != ESP_OK)
+        goto done;
+
+    res = nvs_commit(handle);
+
+done:
+    nvs_close(handle);
     if (res != ESP_OK)
-        memset(&LMIC.radio, 0, sizeof(LMIC) - LMIC_OFFSET(radio));
+    {
+        // the log has a gap: have the next uplink save the full session
+        portENTER_CRITICAL(&log_lock);
+        log_valid = false;
+        portEXIT_CRITICAL(&log_lock);
+    }
+    return res;
+}
 
-    return res == ESP_OK;
+void replay_counter_log(nvs_handle handle)
+{
+    uint32_t seqno_up = LMIC.seqnoUp;
+    uint32_t seqno_dn = LMIC.seqnoDn;
+    uint32_t record_no = 0;
+
+    for (int i = 0; i < COUNTER_LOG_SLOTS; i++)
+    {
+        char key[16];
+        snprintf(key, sizeof(key), NVS_FLASH_KEY_COUNTER_LOG, i);
+        counter_record_t record;
+        size_t len = sizeof(record);
+        if (nvs_get_blob(handle, key, &record, &len) != ESP_OK || len != sizeof(record))
+            continue;
+
+        if (record.record_no > record_no)
+            record_no = record.record_no;
+
+        if (record.devaddr != LMIC.devaddr)
+            continue; // from a previous session
+
+        if ((int32_t)(record.seqno_up - seqno_up) > 0)
+            seqno_up = record.seqno_up;
+        if ((int32_t)(record.seqno_dn - seqno_dn) > 0)
+            seqno_dn = record.seqno_dn;
+    }
+
+    // Up to COUNTER_LOG_INTERVAL - 1 uplinks since the last record might have been lost.
+    // Skip them so no frame counter is ever reused.
+    LMIC.seqnoUp = seqno_up + COUNTER_LOG_INTERVAL;
+    LMIC.seqnoDn = seqno_dn;
+    ESP_LOGI(TAG, "Frame counter restored from log: %u", (unsigned)LMIC.seqnoUp);
+
+    // Record the new counter right away so a further restore skips ahead again.
+    portENTER_CRITICAL(&log_lock);
+    log_valid = true;
+    log_devaddr = LMIC.devaddr;
+    log_record_no = record_no;
+    log_records_since_save = 0;
+    portEXIT_CRITICAL(&log_lock);
+    stage_counter_record();
 }
+
+#endif
@@ -13,7 +13,10 @@
 #ifndef TTN_NVS_H
 #define TTN_NVS_H
 
+#include "freertos/FreeRTOS.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -22,6 +25,19 @@ extern "C"
 
     void ttn_nvs_save();
     bool ttn_nvs_restore(int off_duration);
+    void ttn_nvs_log_uplink(void);
+    uint32_t ttn_nvs_save_async(void);
+    bool ttn_nvs_wait_for_save(uint32_t snapshot_no, TickType_t ticks_to_wait);
+
+    /**
+     * @brief Stages a blob to be written to NVS by the background writer.
+     *
+     * The data is copied. A blob staged earlier with the same key and not yet
+     * written is replaced. `key` must remain valid (e.g. a string literal).
+     *
+     * @param data  data to write, or `NULL` to erase the key
+     */
+    void ttn_nvs_stage_blob(const char *key, const void *data, size_t length);
 
 #ifdef __cplusplus
 }
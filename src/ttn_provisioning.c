@@ -22,6 +22,7 @@
 #include "hal/hal_esp32.h"
 #include "lmic/lmic.h"
 #include "nvs_flash.h"
+#include "ttn_startup_trace.h"
 
 #if defined(TTN_HAS_AT_COMMANDS)
 #define UART_NUM CONFIG_TTN_PROVISION_UART_NUM
@@ -376,6 +377,8 @@ bool decode(bool incl_dev_eui, const char *dev_eui, const char *app_eui, const c
     uint8_t buf_app_eui[8];
     uint8_t buf_app_key[16];
 
+    TTN_STARTUP_BEGIN(TTN_STARTUP_KEY_DECODE);
+
     if (incl_dev_eui && (strlen(dev_eui) != 16 || !hex_str_to_bin(dev_eui, buf_dev_eui, 8)))
     {
         ESP_LOGW(TAG, "Invalid DevEUI: %s", dev_eui);
@@ -407,6 +410,7 @@ bool decode(bool incl_dev_eui, const char *dev_eui, const char *app_eui, const c
     have_keys =
         !is_all_zeros(global_dev_eui, sizeof(global_dev_eui)) && !is_all_zeros(global_app_key, sizeof(global_app_key));
 
+    TTN_STARTUP_END(TTN_STARTUP_KEY_DECODE);
     return true;
 }
 
@@ -453,10 +457,17 @@ bool ttn_provisioning_restore_keys(bool silent)
     uint8_t buf_app_eui[8];
     uint8_t buf_app_key[16];
 
+    TTN_STARTUP_BEGIN(TTN_STARTUP_KEY_RESTORE);
+
     nvs_handle handle = 0;
+    TTN_STARTUP_BEGIN(TTN_STARTUP_NVS_OPEN);
     esp_err_t res = nvs_open(NVS_FLASH_PARTITION, NVS_READONLY, &handle);
+    TTN_STARTUP_END(TTN_STARTUP_NVS_OPEN);
     if (res == ESP_ERR_NVS_NOT_FOUND)
+    {
+        TTN_STARTUP_END(TTN_STARTUP_KEY_RESTORE);
         return false; // partition does not exist yet
+    }
     if (res == ESP_ERR_NVS_NOT_INITIALIZED)
     {
         ESP_LOGW(TAG, "NVS storage is not initialized. Call 'nvs_flash_init()' first.");
@@ -493,6 +504,7 @@ bool ttn_provisioning_restore_keys(bool silent)
 
 done:
     nvs_close(handle);
+    TTN_STARTUP_END(TTN_STARTUP_KEY_RESTORE);
     return true;
 }
 
@@ -13,46 +13,53 @@
 #include "ttn_rtc.h"
 #include "esp_system.h"
 #include "lmic/lmic.h"
-#include <string.h>
-
-#define LMIC_OFFSET(field) __builtin_offsetof(struct lmic_t, field)
-#define LMIC_DIST(field1, field2) (LMIC_OFFSET(field2) - LMIC_OFFSET(field1))
-#define TTN_RTC_MEM_SIZE (sizeof(struct lmic_t) - LMIC_OFFSET(radio) - MAX_LEN_PAYLOAD - MAX_LEN_FRAME)
+#include "ttn_clock.h"
+#include "ttn_clock_cal.h"
+#include "ttn_energy.h"
+#include "ttn_session.h"
 
 #define TTN_RTC_FLAG_VALUE 0xf30b84ce
 
-RTC_DATA_ATTR uint8_t ttn_rtc_mem_buf[TTN_RTC_MEM_SIZE];
+RTC_DATA_ATTR uint8_t ttn_rtc_mem_buf[TTN_SESSION_MAX_SIZE];
+RTC_DATA_ATTR uint16_t ttn_rtc_mem_len;
 RTC_DATA_ATTR uint32_t ttn_rtc_flag;
+RTC_DATA_ATTR uint8_t ttn_rtc_rand_state[16];
+RTC_DATA_ATTR ttn_clock_state_t ttn_rtc_clock_state;
+RTC_DATA_ATTR ttn_clock_cal_state_t ttn_rtc_clock_cal_state;
+RTC_DATA_ATTR ttn_energy_state_t ttn_rtc_energy_state;
 
 void ttn_rtc_save()
 {
-    // Copy LMIC struct except client, osjob, pendTxData and frame
-    size_t len1 = LMIC_DIST(radio, pendTxData);
-    memcpy(ttn_rtc_mem_buf, &LMIC.radio, len1);
-    size_t len2 = LMIC_DIST(pendTxData, frame) - MAX_LEN_PAYLOAD;
-    memcpy(ttn_rtc_mem_buf + len1, (u1_t *)&LMIC.pendTxData + MAX_LEN_PAYLOAD, len2);
-    size_t len3 = sizeof(struct lmic_t) - LMIC_OFFSET(frame) - MAX_LEN_FRAME;
-    memcpy(ttn_rtc_mem_buf + len1 + len2, (u1_t *)&LMIC.frame + MAX_LEN_FRAME, len3);
+    ttn_rtc_mem_len = ttn_session_encode(ttn_rtc_mem_buf, sizeof(ttn_rtc_mem_buf));
+    if (ttn_rtc_mem_len == 0)
+        return;
+
+    // Random seed buffer is needed as the radio isn't reinitialized on a warm start
+    radio_get_rand_state(ttn_rtc_rand_state);
+
+    // the local time continues during deep sleep, so the GPS clock stays valid
+    ttn_clock_save(&ttn_rtc_clock_state);
+    ttn_clock_cal_save(&ttn_rtc_clock_cal_state);
+    ttn_energy_save(&ttn_rtc_energy_state);
 
     ttn_rtc_flag = TTN_RTC_FLAG_VALUE;
 }
 
+bool ttn_rtc_is_valid()
+{
+    return ttn_rtc_flag == TTN_RTC_FLAG_VALUE;
+}
+
 bool ttn_rtc_restore()
 {
     if (ttn_rtc_flag != TTN_RTC_FLAG_VALUE)
         return false;
 
-    // Restore data
-    size_t len1 = LMIC_DIST(radio, pendTxData);
-    memcpy(&LMIC.radio, ttn_rtc_mem_buf, len1);
-    memset(LMIC.pendTxData, 0, MAX_LEN_PAYLOAD);
-    size_t len2 = LMIC_DIST(pendTxData, frame) - MAX_LEN_PAYLOAD;
-    memcpy((u1_t *)&LMIC.pendTxData + MAX_LEN_PAYLOAD, ttn_rtc_mem_buf + len1, len2);
-    memset(LMIC.frame, 0, MAX_LEN_FRAME);
-    size_t len3 = sizeof(struct lmic_t) - LMIC_OFFSET(frame) - MAX_LEN_FRAME;
-    memcpy((u1_t *)&LMIC.frame + MAX_LEN_FRAME, ttn_rtc_mem_buf + len1 + len2, len3);
-
     ttn_rtc_flag = 0xffffffff; // invalidate RTC data
 
-    return true;
+    radio_set_rand_state(ttn_rtc_rand_state);
+    ttn_clock_restore(&ttn_rtc_clock_state);
+    ttn_clock_cal_restore(&ttn_rtc_clock_cal_state);
+    ttn_energy_restore(&ttn_rtc_energy_state);
+    return ttn_session_decode(ttn_rtc_mem_buf, ttn_rtc_mem_len);
 }
@@ -22,6 +22,7 @@ extern "C"
 
     void ttn_rtc_save();
     bool ttn_rtc_restore();
+    bool ttn_rtc_is_valid();
 
 #ifdef __cplusplus
 }
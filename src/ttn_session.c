@@ -0,0 +1,611 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Compact serialization of the LoRaWAN session state.
+ *******************************************************************************/
+
+#include "ttn_session.h"
+#include "esp_log.h"
+#include "lmic/lmic.h"
+#include <string.h>
+
+#define TAG "ttn_session"
+
+#define FORMAT_VERSION 1
+
+#define WIRE_VARINT 0
+#define WIRE_BYTES 2
+
+// largest number of values in a packed field
+#define MAX_PACKED_VALUES 64
+
+// opmode flags that describe the session (all others are transient)
+#define PERSISTENT_OPMODE (OP_POLL | OP_NEXTCHNL | OP_LINKDEAD)
+
+// Field tags. Never reuse or renumber a tag; add new ones instead.
+enum
+{
+    TAG_REGION = 1,
+    TAG_TIME_REF = 2,
+    TAG_NETID = 3,
+    TAG_DEVADDR = 4,
+    TAG_NWK_KEY = 5,
+    TAG_ART_KEY = 6,
+    TAG_SEQNO_UP = 7,
+    TAG_SEQNO_DN = 8,
+    TAG_DEV_NONCE = 9,
+    TAG_OPMODE = 10,
+    TAG_DATARATE = 11,
+    TAG_ADR_TX_POW = 12,
+    TAG_TX_POW = 13,
+    TAG_ADR_ENABLED = 14,
+    TAG_ADR_ACK_REQ = 15,
+    TAG_ADR_CHANGED = 16,
+    TAG_RX1_DR_OFFSET = 17,
+    TAG_RX_DELAY = 18,
+    TAG_DN2_DR = 19,
+    TAG_DN2_FREQ = 20,
+    TAG_GLOBAL_DUTY_RATE = 21,
+    TAG_GLOBAL_DUTY_AVAIL = 22,
+    TAG_UP_REPEAT = 23,
+    TAG_TX_CHNL = 24,
+    TAG_INIT_BANDPLAN = 25,
+    TAG_DN_CONF = 26,
+    TAG_LAST_DN_CONF = 27,
+    TAG_PEND_MAC = 28,
+    TAG_DN2_ANS = 29,
+    TAG_DL_CHANNEL_ANS = 30,
+    TAG_RX_TIMING_SETUP_ANS = 31,
+    TAG_TX_PARAM = 32,
+    TAG_REJOIN_CNT = 33,
+    TAG_DEV_ANS_MARGIN = 34,
+
+    // EU-like regions
+    TAG_BANDS = 40,
+    TAG_CHANNEL_FREQ = 41,
+    TAG_CHANNEL_DL_FREQ = 42,
+    TAG_CHANNEL_DR_MAP = 43,
+    TAG_CHANNEL_MAP = 44,
+    TAG_CHANNEL_SHUFFLE_MAP = 45,
+
+    // US-like regions
+    TAG_CHANNEL_MAP_US = 50,
+    TAG_CHANNEL_SHUFFLE_MAP_US = 51,
+    TAG_ACTIVE_CHANNELS_125KHZ = 52,
+    TAG_ACTIVE_CHANNELS_500KHZ = 53,
+    TAG_TX_CHNL_125KHZ = 54,
+};
+
+// Fields that must be present for a usable session
+#define REQUIRED_FIELDS ((1u << TAG_DEVADDR) | (1u << TAG_NWK_KEY) | (1u << TAG_ART_KEY) | (1u << TAG_SEQNO_UP))
+
+#if CFG_LMIC_EU_like
+_Static_assert(MAX_CHANNELS <= MAX_PACKED_VALUES && 4 * MAX_BANDS <= MAX_PACKED_VALUES, "MAX_PACKED_VALUES too small");
+#endif
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    size_t pos;
+    bool overflow;
+} writer_t;
+
+typedef struct
+{
+    const uint8_t *buf;
+    size_t length;
+    size_t pos;
+    bool error;
+} reader_t;
+
+static uint32_t zigzag(int32_t value);
+static int32_t unzigzag(uint32_t value);
+static size_t varint_size(uint32_t value);
+static void put_byte(writer_t *w, uint8_t value);
+static void put_varint(writer_t *w, uint32_t value);
+static void put_uint(writer_t *w, int tag, uint32_t value);
+static void put_sint(writer_t *w, int tag, int32_t value);
+static void put_bytes(writer_t *w, int tag, const uint8_t *data, size_t length);
+static void put_packed(writer_t *w, int tag, const uint32_t *values, size_t count);
+static uint32_t get_varint(reader_t *r);
+static size_t get_packed(reader_t *r, uint32_t *values, size_t max_count);
+static void decode_field(reader_t *field, int tag, uint32_t value, ostime_t now, ostime_t elapsed);
+static ostime_t restore_time(int32_t saved, ostime_t now, ostime_t elapsed);
+
+// --- Encoding
+
+size_t ttn_session_encode(uint8_t *buf, size_t size)
+{
+    writer_t w = {.buf = buf, .size = size};
+    ostime_t time_ref = os_getTime();
+    uint32_t values[MAX_PACKED_VALUES];
+
+    put_varint(&w, FORMAT_VERSION);
+
+    put_uint(&w, TAG_REGION, CFG_region);
+    put_uint(&w, TAG_TIME_REF, (uint32_t)time_ref);
+    put_uint(&w, TAG_NETID, LMIC.netid);
+    put_uint(&w, TAG_DEVADDR, LMIC.devaddr);
+    put_bytes(&w, TAG_NWK_KEY, LMIC.nwkKey, sizeof(LMIC.nwkKey));
+    put_bytes(&w, TAG_ART_KEY, LMIC.artKey, sizeof(LMIC.artKey));
+    put_uint(&w, TAG_SEQNO_UP, LMIC.seqnoUp);
+    put_uint(&w, TAG_SEQNO_DN, LMIC.seqnoDn);
+    put_uint(&w, TAG_DEV_NONCE, LMIC.devNonce);
+    put_uint(&w, TAG_OPMODE, LMIC.opmode & PERSISTENT_OPMODE);
+
+    put_uint(&w, TAG_DATARATE, LMIC.datarate);
+    put_sint(&w, TAG_ADR_TX_POW, LMIC.adrTxPow);
+    put_sint(&w, TAG_TX_POW, LMIC.txpow);
+    put_uint(&w, TAG_ADR_ENABLED, LMIC.adrEnabled);
+    put_sint(&w, TAG_ADR_ACK_REQ, LMIC.adrAckReq);
+    put_uint(&w, TAG_ADR_CHANGED, LMIC.adrChanged);
+    put_uint(&w, TAG_RX1_DR_OFFSET, LMIC.rx1DrOffset);
+    put_uint(&w, TAG_RX_DELAY, LMIC.rxDelay);
+    put_uint(&w, TAG_DN2_DR, LMIC.dn2Dr);
+    put_uint(&w, TAG_DN2_FREQ, LMIC.dn2Freq);
+    put_uint(&w, TAG_GLOBAL_DUTY_RATE, LMIC.globalDutyRate);
+    put_sint(&w, TAG_GLOBAL_DUTY_AVAIL, LMIC.globalDutyAvail - time_ref);
+    put_uint(&w, TAG_UP_REPEAT, LMIC.upRepeat);
+    put_uint(&w, TAG_TX_CHNL, LMIC.txChnl);
+    put_uint(&w, TAG_INIT_BANDPLAN, LMIC.initBandplanAfterReset);
+    put_uint(&w, TAG_REJOIN_CNT, LMIC.rejoinCnt);
+    put_sint(&w, TAG_DEV_ANS_MARGIN, LMIC.devAnsMargin);
+
+    // pending MAC answers and acknowledgements
+    put_uint(&w, TAG_DN_CONF, LMIC.dnConf);
+    put_uint(&w, TAG_LAST_DN_CONF, LMIC.lastDnConf);
+    if (LMIC.pendMacLen > 0)
+    {
+        uint8_t pend_mac[1 + sizeof(LMIC.pendMacData)];
+        pend_mac[0] = LMIC.pendMacPiggyback;
+        memcpy(pend_mac + 1, LMIC.pendMacData, LMIC.pendMacLen);
+        put_bytes(&w, TAG_PEND_MAC, pend_mac, 1 + LMIC.pendMacLen);
+    }
+#if !defined(DISABLE_MCMD_RXParamSetupReq)
+    put_uint(&w, TAG_DN2_ANS, LMIC.dn2Ans);
+#endif
+#if !defined(DISABLE_MCMD_DlChannelReq)
+    put_uint(&w, TAG_DL_CHANNEL_ANS, LMIC.macDlChannelAns);
+#endif
+#if !defined(DISABLE_MCMD_RXTimingSetupReq)
+    put_uint(&w, TAG_RX_TIMING_SETUP_ANS, LMIC.macRxTimingSetupAns);
+#endif
+#if LMIC_ENABLE_TxParamSetupReq
+    put_uint(&w, TAG_TX_PARAM, LMIC.txParam);
+#endif
+
+    // channel plan and band availability
+#if CFG_LMIC_EU_like
+    for (int i = 0; i < MAX_BANDS; i++)
+    {
+        values[4 * i + 0] = LMIC.bands[i].txcap;
+        values[4 * i + 1] = zigzag(LMIC.bands[i].txpow);
+        values[4 * i + 2] = LMIC.bands[i].lastchnl;
+        values[4 * i + 3] = zigzag(LMIC.bands[i].avail - time_ref);
+    }
+    put_packed(&w, TAG_BANDS, values, 4 * MAX_BANDS);
+
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        values[i] = LMIC.channelFreq[i];
+    put_packed(&w, TAG_CHANNEL_FREQ, values, MAX_CHANNELS);
+#if !defined(DISABLE_MCMD_DlChannelReq)
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        values[i] = LMIC.channelDlFreq[i];
+    put_packed(&w, TAG_CHANNEL_DL_FREQ, values, MAX_CHANNELS);
+#endif
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        values[i] = LMIC.channelDrMap[i];
+    put_packed(&w, TAG_CHANNEL_DR_MAP, values, MAX_CHANNELS);
+    put_uint(&w, TAG_CHANNEL_MAP, LMIC.channelMap);
+    put_uint(&w, TAG_CHANNEL_SHUFFLE_MAP, LMIC.channelShuffleMap);
+#elif CFG_LMIC_US_like
+    const size_t num_words = sizeof(LMIC.channelMap) / sizeof(LMIC.channelMap[0]);
+    for (int i = 0; i < num_words; i++)
+        values[i] = LMIC.channelMap[i];
+    put_packed(&w, TAG_CHANNEL_MAP_US, values, num_words);
+    for (int i = 0; i < num_words; i++)
+        values[i] = LMIC.channelShuffleMap[i];
+    put_packed(&w, TAG_CHANNEL_SHUFFLE_MAP_US, values, num_words);
+    put_uint(&w, TAG_ACTIVE_CHANNELS_125KHZ, LMIC.activeChannels125khz);
+    put_uint(&w, TAG_ACTIVE_CHANNELS_500KHZ, LMIC.activeChannels500khz);
+    put_uint(&w, TAG_TX_CHNL_125KHZ, LMIC.txChnl_125kHz);
+#endif
+
+    if (w.overflow || w.pos + 2 > w.size)
+    {
+        ESP_LOGE(TAG, "Session state exceeds %d bytes", (int)size);
+        return 0;
+    }
+
+    os_wlsbf2(buf + w.pos, os_crc16(buf, w.pos));
+    return w.pos + 2;
+}
+
+uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+int32_t unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+size_t varint_size(uint32_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+void put_byte(writer_t *w, uint8_t value)
+{
+    if (w->pos >= w->size)
+    {
+        w->overflow = true;
+        return;
+    }
+    w->buf[w->pos++] = value;
+}
+
+void put_varint(writer_t *w, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        put_byte(w, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    put_byte(w, (uint8_t)value);
+}
+
+void put_uint(writer_t *w, int tag, uint32_t value)
+{
+    put_varint(w, (tag << 3) | WIRE_VARINT);
+    put_varint(w, value);
+}
+
+void put_sint(writer_t *w, int tag, int32_t value)
+{
+    put_uint(w, tag, zigzag(value));
+}
+
+void put_bytes(writer_t *w, int tag, const uint8_t *data, size_t length)
+{
+    put_varint(w, (tag << 3) | WIRE_BYTES);
+    put_varint(w, length);
+    for (size_t i = 0; i < length; i++)
+        put_byte(w, data[i]);
+}
+
+void put_packed(writer_t *w, int tag, const uint32_t *values, size_t count)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++)
+        length += varint_size(values[i]);
+
+    put_varint(w, (tag << 3) | WIRE_BYTES);
+    put_varint(w, length);
+    for (size_t i = 0; i < count; i++)
+        put_varint(w, values[i]);
+}
+
+// --- Decoding
+
+bool ttn_session_decode(const uint8_t *buf, size_t length)
+{
+    if (length < 3 || os_rlsbf2(buf + length - 2) != os_crc16(buf, length - 2))
+    {
+        ESP_LOGW(TAG, "Session state is corrupted");
+        return false;
+    }
+
+    reader_t r = {.buf = buf, .length = length - 2};
+    uint32_t version = get_varint(&r);
+    if (version != FORMAT_VERSION)
+    {
+        ESP_LOGW(TAG, "Unsupported session format version %u", (unsigned)version);
+        return false;
+    }
+
+    // the region and the time reference are needed before any field is applied
+    bool has_time_ref = false;
+    ostime_t time_ref = 0;
+    uint32_t region = ~0u;
+    reader_t scan = r;
+    while (scan.pos < scan.length && !scan.error)
+    {
+        uint32_t key = get_varint(&scan);
+        uint32_t value = get_varint(&scan);
+        if ((key & 7) == WIRE_BYTES)
+            scan.pos += value;
+        else if (key >> 3 == TAG_TIME_REF)
+        {
+            time_ref = (ostime_t)value;
+            has_time_ref = true;
+        }
+        else if (key >> 3 == TAG_REGION)
+            region = value;
+    }
+    if (region != CFG_region)
+    {
+        ESP_LOGW(TAG, "Session state is for a different region");
+        return false;
+    }
+
+    // The LMIC time continues across deep sleep and is advanced by the off
+    // duration after a power-off (see hal_esp32_set_time()), so the time since
+    // the save counts towards the duty cycle. If the clock has gone back (or
+    // the record has no time reference), the time in between counts as zero.
+    ostime_t now = os_getTime();
+    ostime_t elapsed = has_time_ref ? now - time_ref : 0;
+    if (elapsed < 0)
+        elapsed = 0;
+
+    // apply fields on top of the defaults prepared by the caller
+
+    uint32_t fields_seen = 0;
+    while (r.pos < r.length && !r.error)
+    {
+        uint32_t key = get_varint(&r);
+        int tag = key >> 3;
+        int wire_type = key & 7;
+        uint32_t value = get_varint(&r);
+
+        reader_t field = {.buf = r.buf + r.pos, .length = 0};
+        if (wire_type == WIRE_BYTES)
+        {
+            if (value > r.length - r.pos)
+            {
+                r.error = true;
+                break;
+            }
+            field.length = value;
+            r.pos += value;
+        }
+        else if (wire_type != WIRE_VARINT)
+        {
+            r.error = true;
+            break;
+        }
+
+        if (tag < 32)
+            fields_seen |= 1u << tag;
+        decode_field(&field, tag, value, now, elapsed);
+    }
+
+    if (r.error || (fields_seen & REQUIRED_FIELDS) != REQUIRED_FIELDS)
+    {
+        ESP_LOGW(TAG, "Session state is incomplete");
+        LMIC_resetState();
+        return false;
+    }
+
+    return true;
+}
+
+void decode_field(reader_t *field, int tag, uint32_t value, ostime_t now, ostime_t elapsed)
+{
+    uint32_t values[MAX_PACKED_VALUES];
+    size_t count;
+
+    switch (tag)
+    {
+    case TAG_NETID:
+        LMIC.netid = value;
+        break;
+    case TAG_DEVADDR:
+        LMIC.devaddr = value;
+        break;
+    case TAG_NWK_KEY:
+        if (field->length == sizeof(LMIC.nwkKey))
+            memcpy(LMIC.nwkKey, field->buf, sizeof(LMIC.nwkKey));
+        break;
+    case TAG_ART_KEY:
+        if (field->length == sizeof(LMIC.artKey))
+            memcpy(LMIC.artKey, field->buf, sizeof(LMIC.artKey));
+        break;
+    case TAG_SEQNO_UP:
+        LMIC.seqnoUp = value;
+        break;
+    case TAG_SEQNO_DN:
+        LMIC.seqnoDn = value;
+        break;
+    case TAG_DEV_NONCE:
+        LMIC.devNonce = value;
+        break;
+    case TAG_OPMODE:
+        LMIC.opmode |= value & PERSISTENT_OPMODE;
+        break;
+    case TAG_DATARATE:
+        LMIC.datarate = value;
+        break;
+    case TAG_ADR_TX_POW:
+        LMIC.adrTxPow = unzigzag(value);
+        break;
+    case TAG_TX_POW:
+        LMIC.txpow = unzigzag(value);
+        break;
+    case TAG_ADR_ENABLED:
+        LMIC.adrEnabled = value;
+        break;
+    case TAG_ADR_ACK_REQ:
+        LMIC.adrAckReq = unzigzag(value);
+        break;
+    case TAG_ADR_CHANGED:
+        LMIC.adrChanged = value;
+        break;
+    case TAG_RX1_DR_OFFSET:
+        LMIC.rx1DrOffset = value;
+        break;
+    case TAG_RX_DELAY:
+        LMIC.rxDelay = value;
+        break;
+    case TAG_DN2_DR:
+        LMIC.dn2Dr = value;
+        break;
+    case TAG_DN2_FREQ:
+        LMIC.dn2Freq = value;
+        break;
+    case TAG_GLOBAL_DUTY_RATE:
+        LMIC.globalDutyRate = value;
+        break;
+    case TAG_GLOBAL_DUTY_AVAIL:
+        LMIC.globalDutyAvail = restore_time(unzigzag(value), now, elapsed);
+        break;
+    case TAG_UP_REPEAT:
+        LMIC.upRepeat = value;
+        break;
+    case TAG_TX_CHNL:
+        LMIC.txChnl = value;
+        break;
+    case TAG_INIT_BANDPLAN:
+        LMIC.initBandplanAfterReset = value;
+        break;
+    case TAG_REJOIN_CNT:
+        LMIC.rejoinCnt = value;
+        break;
+    case TAG_DEV_ANS_MARGIN:
+        LMIC.devAnsMargin = unzigzag(value);
+        break;
+    case TAG_DN_CONF:
+        LMIC.dnConf = value;
+        break;
+    case TAG_LAST_DN_CONF:
+        LMIC.lastDnConf = value;
+        break;
+    case TAG_PEND_MAC:
+        if (field->length >= 1 && field->length <= 1 + sizeof(LMIC.pendMacData))
+        {
+            LMIC.pendMacPiggyback = field->buf[0];
+            LMIC.pendMacLen = field->length - 1;
+            memcpy(LMIC.pendMacData, field->buf + 1, LMIC.pendMacLen);
+        }
+        break;
+#if !defined(DISABLE_MCMD_RXParamSetupReq)
+    case TAG_DN2_ANS:
+        LMIC.dn2Ans = value;
+        break;
+#endif
+#if !defined(DISABLE_MCMD_DlChannelReq)
+    case TAG_DL_CHANNEL_ANS:
+        LMIC.macDlChannelAns = value;
+        break;
+#endif
+#if !defined(DISABLE_MCMD_RXTimingSetupReq)
+    case TAG_RX_TIMING_SETUP_ANS:
+        LMIC.macRxTimingSetupAns = value;
+        break;
+#endif
+#if LMIC_ENABLE_TxParamSetupReq
+    case TAG_TX_PARAM:
+        LMIC.txParam = value;
+        break;
+#endif
+
+#if CFG_LMIC_EU_like
+    case TAG_BANDS:
+        count = get_packed(field, values, 4 * MAX_BANDS) / 4;
+        for (int i = 0; i < count; i++)
+        {
+            LMIC.bands[i].txcap = values[4 * i + 0];
+            LMIC.bands[i].txpow = unzigzag(values[4 * i + 1]);
+            LMIC.bands[i].lastchnl = values[4 * i + 2];
+            LMIC.bands[i].avail = restore_time(unzigzag(values[4 * i + 3]), now, elapsed);
+        }
+        break;
+    case TAG_CHANNEL_FREQ:
+        count = get_packed(field, values, MAX_CHANNELS);
+        for (int i = 0; i < count; i++)
+            LMIC.channelFreq[i] = values[i];
+        break;
+#if !defined(DISABLE_MCMD_DlChannelReq)
+    case TAG_CHANNEL_DL_FREQ:
+        count = get_packed(field, values, MAX_CHANNELS);
+        for (int i = 0; i < count; i++)
+            LMIC.channelDlFreq[i] = values[i];
+        break;
+#endif
+    case TAG_CHANNEL_DR_MAP:
+        count = get_packed(field, values, MAX_CHANNELS);
+        for (int i = 0; i < count; i++)
+            LMIC.channelDrMap[i] = values[i];
+        break;
+    case TAG_CHANNEL_MAP:
+        LMIC.channelMap = value;
+        break;
+    case TAG_CHANNEL_SHUFFLE_MAP:
+        LMIC.channelShuffleMap = value;
+        break;
+#elif CFG_LMIC_US_like
+    case TAG_CHANNEL_MAP_US:
+        count = get_packed(field, values, sizeof(LMIC.channelMap) / sizeof(LMIC.channelMap[0]));
+        for (int i = 0; i < count; i++)
+            LMIC.channelMap[i] = values[i];
+        break;
+    case TAG_CHANNEL_SHUFFLE_MAP_US:
+        count = get_packed(field, values, sizeof(LMIC.channelShuffleMap) / sizeof(LMIC.channelShuffleMap[0]));
+        for (int i = 0; i < count; i++)
+            LMIC.channelShuffleMap[i] = values[i];
+        break;
+    case TAG_ACTIVE_CHANNELS_125KHZ:
+        LMIC.activeChannels125khz = value;
+        break;
+    case TAG_ACTIVE_CHANNELS_500KHZ:
+        LMIC.activeChannels500khz = value;
+        break;
+    case TAG_TX_CHNL_125KHZ:
+        LMIC.txChnl_125kHz = value;
+        break;
+#endif
+
+    default:
+        break; // unknown or not applicable: skip
+    }
+}
+
+// Converts a time relative to the save into LMIC time. Times in the past are
+// set to now as they might otherwise wrap around into the future.
+ostime_t restore_time(int32_t saved, ostime_t now, ostime_t elapsed)
+{
+    return saved > elapsed ? now + (saved - elapsed) : now;
+}
+
+uint32_t get_varint(reader_t *r)
+{
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (r->pos >= r->length)
+            break;
+        uint8_t b = r->buf[r->pos++];
+        value |= (uint32_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return value;
+    }
+    r->error = true;
+    return 0;
+}
+
+size_t get_packed(reader_t *r, uint32_t *values, size_t max_count)
+{
+    size_t count = 0;
+    while (r->pos < r->length && count < max_count)
+    {
+        uint32_t value = get_varint(r);
+        if (r->error)
+            break;
+        values[count++] = value;
+    }
+    return count;
+}
@@ -0,0 +1,71 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Compact serialization of the LoRaWAN session state.
+ *******************************************************************************/
+
+#ifndef TTN_SESSION_H
+#define TTN_SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Session serialization.
+     *
+     * Only the fields needed to resume the session are serialized (session keys,
+     * device address, frame counters, channel plan, ADR state, band availability).
+     * The format is a format version followed by tagged fields and a CRC-16:
+     *
+     *   version | (key value)* | crc16
+     *
+     * Keys, lengths and integers are varints (7 bits per byte, LSB group first).
+     * The key is the field tag shifted left by 3, combined with the wire type
+     * (0 = varint, 2 = length-delimited). Signed values are zigzag encoded.
+     * Times are stored relative to a reference time (LMIC time of the save) saved
+     * in the same record. The LMIC time continues during deep sleep and is
+     * advanced by the off duration when restoring from NVS, so the time in
+     * between counts towards the duty cycle. If the clock has gone back since
+     * the save, or for records without a reference time, the time in between
+     * counts as zero.
+     *
+     * Unknown tags are skipped, so fields can be added without changing the
+     * version. The version only changes if the meaning of an existing field changes.
+     */
+
+/** Maximum size of a serialized session (worst case of EU-like regions; typically about 220 bytes) */
+#define TTN_SESSION_MAX_SIZE 448
+
+    /**
+     * @brief Serializes the LMIC session state.
+     * @return number of bytes written, or 0 if the buffer is too small
+     */
+    size_t ttn_session_encode(uint8_t *buf, size_t size);
+
+    /**
+     * @brief Restores the session state.
+     *
+     * The fields are applied on top of the current LMIC state, which must have
+     * been reset by the caller (see LMIC_resetState()).
+     *
+     * @return `true` if successful, `false` if the data is invalid (LMIC is left in reset state)
+     */
+    bool ttn_session_decode(const uint8_t *buf, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,121 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Time-slotted uplinks derived from the network time.
+ *******************************************************************************/
+
+#include "ttn_slotted_tx.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "ttn.h"
+#include <string.h>
+
+#define TAG "ttn_slotted_tx"
+
+#if defined(CONFIG_TTN_SLOTTED_TX)
+
+#include "esp_system.h"
+#include "hal/hal_esp32.h"
+#include "lmic/lmic.h"
+#include "ttn_clock.h"
+
+#define MAX_PERIOD 3600
+#define MAX_SYNC_INTERVAL 86400
+// minimum time from queuing the uplink to the slot start
+#define MIN_LEAD_MS 50
+
+static uint32_t slot_for_dev_eui(uint16_t num_slots);
+
+static portMUX_TYPE slotted_tx_lock = portMUX_INITIALIZER_UNLOCKED;
+static ttn_slotted_tx_config_t config;
+static bool is_enabled;
+
+bool ttn_set_slotted_tx(const ttn_slotted_tx_config_t *new_config)
+{
+    if (new_config != NULL)
+    {
+        if (new_config->period == 0 || new_config->period > MAX_PERIOD || new_config->num_slots == 0 ||
+            new_config->num_slots > new_config->period * 1000 ||
+            new_config->jitter >= new_config->period * 1000 / new_config->num_slots ||
+            new_config->sync_interval == 0 || new_config->sync_interval > MAX_SYNC_INTERVAL)
+            return false;
+    }
+
+    portENTER_CRITICAL(&slotted_tx_lock);
+    is_enabled = new_config != NULL;
+    if (is_enabled)
+        config = *new_config;
+    portEXIT_CRITICAL(&slotted_tx_lock);
+    return true;
+}
+
+// --- Called from LMIC task
+
+void ttn_slotted_tx_on_submit(void)
+{
+    ttn_slotted_tx_config_t current_config;
+    portENTER_CRITICAL(&slotted_tx_lock);
+    bool enabled = is_enabled;
+    current_config = config;
+    portEXIT_CRITICAL(&slotted_tx_lock);
+
+    LMIC.txSlotSet = 0;
+    if (!enabled)
+        return;
+
+    ostime_t now = os_getTime();
+    int64_t gps_time_us;
+    int64_t age_us;
+    bool is_synced = ttn_clock_get(hal_esp32_get_time_us(), &gps_time_us, &age_us);
+
+    // piggyback a DeviceTimeReq on this uplink if the GPS clock isn't synchronized or the last answer is old
+    if (!is_synced || age_us > (int64_t)current_config.sync_interval * 1000000)
+        LMIC_requestNetworkTime(NULL, NULL);
+    if (!is_synced)
+        return;
+
+    uint64_t gps_time_ms = gps_time_us / 1000;
+    uint32_t period_ms = current_config.period * 1000;
+    uint32_t slot_length_ms = period_ms / current_config.num_slots;
+    uint32_t offset_ms = slot_for_dev_eui(current_config.num_slots) * slot_length_ms;
+    if (current_config.jitter > 0)
+        offset_ms += esp_random() % (current_config.jitter + 1);
+
+    // next slot start at least MIN_LEAD_MS in the future
+    uint64_t slot_time_ms = gps_time_ms - gps_time_ms % period_ms + offset_ms;
+    while (slot_time_ms < gps_time_ms + MIN_LEAD_MS)
+        slot_time_ms += period_ms;
+
+    LMIC_setTxSlot(now + ms2osticks(slot_time_ms - gps_time_ms), ms2osticks(period_ms));
+}
+
+// FNV-1a hash of the DevEUI
+uint32_t slot_for_dev_eui(uint16_t num_slots)
+{
+    uint8_t dev_eui[8];
+    os_getDevEui(dev_eui);
+
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 8; i++)
+    {
+        hash ^= dev_eui[i];
+        hash *= 16777619u;
+    }
+    return hash % num_slots;
+}
+
+#else
+
+bool ttn_set_slotted_tx(const ttn_slotted_tx_config_t *config)
+{
+    ESP_LOGW(TAG, "Slotted uplinks are disabled (CONFIG_TTN_SLOTTED_TX)");
+    return false;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Time-slotted uplinks derived from the network time.
+ *******************************************************************************/
+
+#ifndef TTN_SLOTTED_TX_H
+#define TTN_SLOTTED_TX_H
+
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Time-slotted uplinks.
+     *
+     * The reporting period is aligned to the GPS epoch and divided into slots.
+     * Each device uses the slot selected by a hash of its DevEUI, so devices
+     * with the same period spread their uplinks instead of colliding.
+     *
+     * The GPS time is derived from the last DeviceTimeAns and the local clock.
+     * A DeviceTimeReq is piggybacked on an uplink whenever the time reference
+     * is older than the sync interval. Without a time reference, uplinks are
+     * sent immediately.
+     *
+     * The hook is called from the LMIC task before an uplink is queued.
+     */
+
+#if defined(CONFIG_TTN_SLOTTED_TX)
+
+    void ttn_slotted_tx_on_submit(void);
+
+#else
+
+    static inline void ttn_slotted_tx_on_submit(void)
+    {
+    }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Timeline of the startup phases from boot to the first uplink.
+ *******************************************************************************/
+
+#include "ttn_startup_trace.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <string.h>
+
+#define TAG "ttn_startup"
+
+#if defined(CONFIG_TTN_STARTUP_TRACE)
+
+static const char *const phase_names[] = {
+    "init", "configure pins", "NVS open", "key restore", "key decode", "SPI init",
+    "radio init", "session restore", "join", "first TX",
+};
+
+_Static_assert(sizeof(phase_names) / sizeof(phase_names[0]) == TTN_STARTUP_NUM_PHASES, "phase names incomplete");
+
+static ttn_startup_report_t report;
+
+void ttn_startup_trace_begin(ttn_startup_phase_t phase)
+{
+    if (report.phases[phase].start == 0)
+        report.phases[phase].start = esp_timer_get_time();
+}
+
+void ttn_startup_trace_end(ttn_startup_phase_t phase)
+{
+    ttn_startup_phase_timing_t *timing = &report.phases[phase];
+    if (timing->end != 0)
+        return;
+
+    int64_t now = esp_timer_get_time();
+    if (timing->start == 0)
+        timing->start = now; // point in time without duration
+    timing->end = now;
+}
+
+bool ttn_get_startup_report(ttn_startup_report_t *startup_report)
+{
+    memcpy(startup_report, &report, sizeof(report));
+    return true;
+}
+
+void ttn_log_startup_report(void)
+{
+    for (int i = 0; i < TTN_STARTUP_NUM_PHASES; i++)
+    {
+        const ttn_startup_phase_timing_t *timing = &report.phases[i];
+        if (timing->start == 0)
+            continue;
+
+        if (timing->end == 0)
+            ESP_LOGI(TAG, "%-16s at %8lld us, not completed", phase_names[i], (long long)timing->start);
+        else
+            ESP_LOGI(TAG, "%-16s at %8lld us, took %lld us", phase_names[i], (long long)timing->start,
+                     (long long)(timing->end - timing->start));
+    }
+}
+
+#else
+
+bool ttn_get_startup_report(ttn_startup_report_t *startup_report)
+{
+    memset(startup_report, 0, sizeof(*startup_report));
+    return false;
+}
+
+void ttn_log_startup_report(void)
+{
+    ESP_LOGW(TAG, "Startup tracing is disabled (CONFIG_TTN_STARTUP_TRACE)");
+}
+
+#endif
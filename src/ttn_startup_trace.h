@@ -0,0 +1,51 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Timeline of the startup phases from boot to the first uplink.
+ *******************************************************************************/
+
+#ifndef TTN_STARTUP_TRACE_H
+#define TTN_STARTUP_TRACE_H
+
+#include "sdkconfig.h"
+#include "ttn.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Startup tracer.
+     *
+     * Records the time (since boot) at which each startup phase begins and ends.
+     * Only the first occurrence of each phase is recorded. Without
+     * CONFIG_TTN_STARTUP_TRACE, the macros compile to nothing.
+     */
+
+#if defined(CONFIG_TTN_STARTUP_TRACE)
+
+    void ttn_startup_trace_begin(ttn_startup_phase_t phase);
+    void ttn_startup_trace_end(ttn_startup_phase_t phase);
+
+#define TTN_STARTUP_BEGIN(phase) ttn_startup_trace_begin(phase)
+#define TTN_STARTUP_END(phase) ttn_startup_trace_end(phase)
+
+#else
+
+#define TTN_STARTUP_BEGIN(phase) ((void)0)
+#define TTN_STARTUP_END(phase) ((void)0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,286 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Ring buffer of per-uplink link telemetry.
+ *******************************************************************************/
+
+#include "ttn_telemetry.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "ttn.h"
+#include <string.h>
+
+#define TAG "ttn_telemetry"
+
+#if CONFIG_TTN_TELEMETRY_RECORDS > 0
+
+#include "hal/hal_esp32.h"
+#include "lmic/lmic.h"
+
+#define NUM_RECORDS CONFIG_TTN_TELEMETRY_RECORDS
+#define FORMAT_VERSION 1
+// maximum size of an encoded record
+#define MAX_RECORD_SIZE 48
+
+// the size is given in the Kconfig help (RTC slow memory is limited)
+_Static_assert(sizeof(ttn_telemetry_record_t) == 40, "update the record size in the Kconfig help");
+
+#define FLAG_CONFIRMED 0x04
+#define FLAG_ACKED 0x08
+#define MAX_RETRIES 15
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    size_t pos;
+} writer_t;
+
+static uint32_t oldest_id(void);
+static void encode_record(writer_t *w, const ttn_telemetry_record_t *record, const ttn_telemetry_record_t *previous);
+static uint32_t zigzag(int32_t value);
+static void put_byte(writer_t *w, uint8_t value);
+static void put_varint(writer_t *w, uint32_t value);
+
+// kept across deep sleep
+static RTC_DATA_ATTR ttn_telemetry_record_t records[NUM_RECORDS];
+static RTC_DATA_ATTR uint32_t next_id;
+
+// incremented before and after a record is written (odd while writing)
+static uint32_t write_seq;
+
+// uplink in progress
+static ttn_telemetry_record_t current;
+static bool is_submitted;
+static bool is_transmitting;
+static int64_t submit_time_us;
+static ostime_t rxlate_start;
+static ostime_t txlate_start;
+
+bool ttn_begin_telemetry(ttn_telemetry_iterator_t *iterator, uint32_t from_id)
+{
+    uint32_t first_id = oldest_id();
+    iterator->next_id = from_id > first_id ? from_id : first_id;
+    iterator->end_id = __atomic_load_n(&next_id, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+// The record is copied; the copy is retried if the LMIC task has written a record in the meantime.
+const ttn_telemetry_record_t *ttn_next_telemetry(ttn_telemetry_iterator_t *iterator)
+{
+    while (iterator->next_id < iterator->end_id)
+    {
+        uint32_t seq = __atomic_load_n(&write_seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) != 0)
+        {
+            vTaskDelay(1); // the LMIC task is writing a record
+            continue;
+        }
+
+        // records overwritten since the start of the iteration are skipped
+        uint32_t first_id = oldest_id();
+        if (iterator->next_id < first_id)
+            iterator->next_id = first_id;
+
+        memcpy(&iterator->record, &records[iterator->next_id % NUM_RECORDS], sizeof(iterator->record));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&write_seq, __ATOMIC_RELAXED) == seq)
+        {
+            iterator->next_id++;
+            return &iterator->record;
+        }
+    }
+    return NULL;
+}
+
+void ttn_end_telemetry(ttn_telemetry_iterator_t *iterator)
+{
+}
+
+size_t ttn_dump_telemetry(uint32_t from_id, uint8_t *buf, size_t size, uint32_t *end_id)
+{
+    writer_t w = {.buf = buf, .size = size};
+    ttn_telemetry_iterator_t iterator;
+    const ttn_telemetry_record_t *record;
+    ttn_telemetry_record_t previous;
+    bool has_previous = false;
+
+    put_byte(&w, FORMAT_VERSION);
+
+    ttn_begin_telemetry(&iterator, from_id);
+    // only complete records are written
+    while (w.pos + MAX_RECORD_SIZE <= w.size && (record = ttn_next_telemetry(&iterator)) != NULL)
+    {
+        encode_record(&w, record, has_previous ? &previous : NULL);
+        previous = *record;
+        has_previous = true;
+    }
+    if (end_id != NULL)
+        *end_id = iterator.next_id;
+    ttn_end_telemetry(&iterator);
+
+    return w.pos <= w.size ? w.pos : 0;
+}
+
+uint32_t oldest_id(void)
+{
+    uint32_t end_id = __atomic_load_n(&next_id, __ATOMIC_ACQUIRE);
+    return end_id > NUM_RECORDS ? end_id - NUM_RECORDS : 0;
+}
+
+void encode_record(writer_t *w, const ttn_telemetry_record_t *record, const ttn_telemetry_record_t *previous)
+{
+    put_varint(w, record->id - (previous != NULL ? previous->id : 0));
+    put_varint(w, zigzag((int32_t)(record->timestamp - (previous != NULL ? previous->timestamp : 0))));
+    put_varint(w, record->fcnt);
+    put_varint(w, record->frequency / 100);
+    put_byte(w, record->channel);
+    put_byte(w, record->data_rate);
+    put_varint(w, zigzag(record->tx_power));
+    put_varint(w, record->airtime_ms);
+    put_varint(w, record->wait_ms);
+
+    uint8_t flags = record->rx_window & 0x03;
+    if (record->confirmed)
+        flags |= FLAG_CONFIRMED;
+    if (record->acked)
+        flags |= FLAG_ACKED;
+    flags |= (record->retries < MAX_RETRIES ? record->retries : MAX_RETRIES) << 4;
+    put_byte(w, flags);
+    if (record->rx_window != 0)
+    {
+        put_varint(w, zigzag(record->rssi));
+        put_varint(w, zigzag(record->snr));
+    }
+
+    put_varint(w, record->rxlate_us);
+    put_varint(w, record->txlate_us);
+}
+
+uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+void put_byte(writer_t *w, uint8_t value)
+{
+    if (w->pos < w->size)
+        w->buf[w->pos] = value;
+    w->pos++;
+}
+
+void put_varint(writer_t *w, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        put_byte(w, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    put_byte(w, (uint8_t)value);
+}
+
+// --- Called from LMIC task
+
+void ttn_telemetry_on_submit(void)
+{
+    submit_time_us = hal_esp32_get_time_us();
+    is_submitted = true;
+}
+
+void ttn_telemetry_on_tx_start(void)
+{
+    if ((LMIC.opmode & OP_JOINING) != 0)
+        return;
+
+    int64_t now_us = hal_esp32_get_time_us();
+    if (!is_transmitting)
+    {
+        // uplinks sent by LMIC itself (e.g. MAC answers) haven't been submitted
+        memset(&current, 0, sizeof(current));
+        current.timestamp = (uint32_t)(now_us / 1000000);
+        if (is_submitted)
+            current.wait_ms = (uint32_t)((now_us - submit_time_us) / 1000);
+        is_submitted = false;
+        is_transmitting = true;
+        rxlate_start = LMIC.radio.rxlate_ticks;
+        txlate_start = LMIC.radio.txlate_ticks;
+    }
+    else
+    {
+        current.retries++;
+    }
+
+    // the last transmission is recorded
+    current.fcnt = LMIC.seqnoUp - 1;
+    current.frequency = LMIC.freq;
+    current.channel = LMIC.txChnl;
+    current.data_rate = LMIC.datarate;
+    current.tx_power = LMIC.radio_txpow;
+    current.airtime_ms = (uint16_t)osticks2ms(calcAirTime(LMIC.rps, LMIC.dataLen));
+    current.confirmed = LMIC.pendTxConf != 0;
+}
+
+void ttn_telemetry_on_tx_complete(void)
+{
+    if (!is_transmitting)
+        return;
+    is_transmitting = false;
+
+    if ((LMIC.txrxFlags & TXRX_DNW1) != 0)
+        current.rx_window = 1;
+    else if ((LMIC.txrxFlags & TXRX_DNW2) != 0)
+        current.rx_window = 2;
+    if (current.rx_window != 0)
+    {
+        current.rssi = LMIC.rssi - RSSI_OFF;
+        current.snr = LMIC.snr;
+    }
+    current.acked = (LMIC.txrxFlags & TXRX_ACK) != 0;
+    current.rxlate_us = osticks2us(LMIC.radio.rxlate_ticks - rxlate_start);
+    current.txlate_us = osticks2us(LMIC.radio.txlate_ticks - txlate_start);
+
+    // never waits for readers; they retry if a record has been written while copying
+    current.id = next_id;
+    __atomic_add_fetch(&write_seq, 1, __ATOMIC_ACQ_REL);
+    records[current.id % NUM_RECORDS] = current;
+    __atomic_store_n(&next_id, current.id + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&write_seq, 1, __ATOMIC_RELEASE);
+}
+
+#else
+
+bool ttn_begin_telemetry(ttn_telemetry_iterator_t *iterator, uint32_t from_id)
+{
+    ESP_LOGW(TAG, "Telemetry is disabled (CONFIG_TTN_TELEMETRY_RECORDS)");
+    iterator->next_id = 0;
+    iterator->end_id = 0;
+    return false;
+}
+
+const ttn_telemetry_record_t *ttn_next_telemetry(ttn_telemetry_iterator_t *iterator)
+{
+    return NULL;
+}
+
+void ttn_end_telemetry(ttn_telemetry_iterator_t *iterator)
+{
+}
+
+size_t ttn_dump_telemetry(uint32_t from_id, uint8_t *buf, size_t size, uint32_t *end_id)
+{
+    ESP_LOGW(TAG, "Telemetry is disabled (CONFIG_TTN_TELEMETRY_RECORDS)");
+    if (end_id != NULL)
+        *end_id = from_id;
+    return 0;
+}
+
+#endif
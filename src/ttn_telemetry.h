@@ -0,0 +1,87 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Ring buffer of per-uplink link telemetry.
+ *******************************************************************************/
+
+#ifndef TTN_TELEMETRY_H
+#define TTN_TELEMETRY_H
+
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Link telemetry.
+     *
+     * A record is written for each uplink (not for join requests) when it is
+     * complete, i.e. after the RX windows. It combines the data of the submission
+     * (to measure the wait for the duty cycle and the time slot), of the last
+     * transmission (channel, data rate, TX power, airtime; earlier ones count as
+     * retries) and of the RX windows (window, RSSI, SNR, acknowledgement).
+     * rxlate and txlate are the delays of the RX windows and the transmissions
+     * caused by a late LMIC task.
+     *
+     * The records are kept in a ring buffer in RTC memory, so they are kept across
+     * deep sleep. Each record has an ID that increments with each record. The
+     * oldest records are overwritten.
+     *
+     * Binary dump format (little endian varints as in the session format, signed
+     * values zigzag encoded):
+     *
+     *   version (1) | record*
+     *
+     *   record: id delta | timestamp delta (signed) | fcnt | frequency / 100 |
+     *           channel (byte) | data rate (byte) | tx power (signed) |
+     *           airtime (ms) | wait (ms) | flags (byte) | [rssi (signed) | snr (signed)] |
+     *           rxlate (µs) | txlate (µs)
+     *
+     *   flags: bits 0-1 RX window (0 none, 1 RX1, 2 RX2), bit 2 confirmed,
+     *          bit 3 acknowledged, bits 4-7 retries (up to 15)
+     *
+     * The deltas of the first record of a dump are relative to 0. RSSI and SNR are
+     * only present if a downlink was received.
+     *
+     * The LMIC task writes the records without waiting for readers. Readers copy
+     * each record and retry if a record was written in the meantime (sequence
+     * counter).
+     *
+     * The hooks are called from the LMIC task.
+     */
+
+#if CONFIG_TTN_TELEMETRY_RECORDS > 0
+
+    void ttn_telemetry_on_submit(void);
+    void ttn_telemetry_on_tx_start(void);
+    void ttn_telemetry_on_tx_complete(void);
+
+#else
+
+    static inline void ttn_telemetry_on_submit(void)
+    {
+    }
+
+    static inline void ttn_telemetry_on_tx_start(void)
+    {
+    }
+
+    static inline void ttn_telemetry_on_tx_complete(void)
+    {
+    }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,505 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Host test of the Class B timing: beacon layout and CRC, beacon airtime,
+ * beacon window prediction and tracking, ping slot offsets and windows, and
+ * the precise wait of the HAL.
+ *
+ * The expected values are computed independently from the LoRaWAN
+ * specification. LMIC is included as source so the static functions can be
+ * called directly; the radio is simulated by setting the received frame and
+ * its timestamp.
+ *******************************************************************************/
+
+#include "../../src/lmic/lmic.c"
+#include "host_idf.h"
+#include "mbedtls/aes.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(CFG_eu868)
+#define REGION_NAME "EU868"
+#define BEACON_SF 9
+#define BEACON_BW 125000
+#define BEACON_RFU1_LEN 2
+#define BEACON_RFU2_LEN 0
+#define BEACON_FREQ(time) 869525000
+#define PING_SF 9
+#define PING_BW 125000
+#define PING_FREQ(time, addr) 869525000
+#elif defined(CFG_us915)
+#define REGION_NAME "US915"
+#define BEACON_SF 12
+#define BEACON_BW 500000
+#define BEACON_RFU1_LEN 5
+#define BEACON_RFU2_LEN 3
+#define BEACON_FREQ(time) (923300000 + (((time) >> 7) & 7) * 600000)
+#define PING_SF 12
+#define PING_BW 500000
+#define PING_FREQ(time, addr) (923300000 + (((addr) + ((time) >> 7)) & 7) * 600000)
+#else
+#error "Region not supported by the Class B host test"
+#endif
+
+#define BEACON_LEN (BEACON_RFU1_LEN + 4 + 2 + 7 + BEACON_RFU2_LEN + 2)
+#define BEACON_PREAMBLE_SYMS 10
+#define PING_PREAMBLE_SYMS 8
+#define BEACON_DELAY_US 1500
+// preamble symbols the radio needs to detect a frame
+#define DETECT_SYMS 5
+
+#define US_PER_TICK 16.0
+
+static int checks;
+static int failures;
+
+#define CHECK(cond, ...)                                           \
+    do                                                             \
+    {                                                              \
+        checks++;                                                  \
+        if (!(cond))                                               \
+        {                                                          \
+            failures++;                                            \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);            \
+            printf(__VA_ARGS__);                                   \
+            printf("\n");                                          \
+        }                                                          \
+    } while (0)
+
+
+// -----------------------------------------------------------------------------
+// Reference implementations (LoRaWAN specification)
+
+static double symbol_us(int sf, int bw)
+{
+    return (double)(1 << sf) * 1e6 / bw;
+}
+
+// LoRa airtime (Semtech AN1200.13), CR 4/5, no low data rate optimization
+static double lora_airtime_us(int sf, int bw, int preamble_syms, int len, bool implicit_header, bool crc)
+{
+    double tsym = symbol_us(sf, bw);
+    int bits = 8 * len - 4 * sf + 28 + (crc ? 16 : 0) - (implicit_header ? 20 : 0);
+    int syms = 8;
+    if (bits > 0)
+        syms += (bits + 4 * sf - 1) / (4 * sf) * 5;
+    return (preamble_syms + 4.25) * tsym + syms * tsym;
+}
+
+// CRC-16/XMODEM (polynomial 0x1021, initial value 0), as used by the beacon
+static uint16_t crc16(const uint8_t *data, int len)
+{
+    uint16_t crc = 0;
+    for (int i = 0; i < len; i++)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) != 0 ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+// Beacon frame: RFU | Time | CRC | GwSpecific (InfoDesc, Lat, Lng) | RFU | CRC
+static void build_beacon(uint8_t *frame, uint32_t time, uint8_t info, int32_t lat, int32_t lon)
+{
+    memset(frame, 0, BEACON_LEN);
+    uint8_t *p = frame + BEACON_RFU1_LEN;
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(time >> (8 * i));
+    uint16_t crc = crc16(frame, BEACON_RFU1_LEN + 4);
+    p[4] = (uint8_t)crc;
+    p[5] = (uint8_t)(crc >> 8);
+
+    uint8_t *gw = p + 6;
+    gw[0] = info;
+    for (int i = 0; i < 3; i++)
+    {
+        gw[1 + i] = (uint8_t)(lat >> (8 * i));
+        gw[4 + i] = (uint8_t)(lon >> (8 * i));
+    }
+    crc = crc16(gw, 7 + BEACON_RFU2_LEN);
+    gw[7 + BEACON_RFU2_LEN] = (uint8_t)crc;
+    gw[8 + BEACON_RFU2_LEN] = (uint8_t)(crc >> 8);
+}
+
+// Ping offset: Rand = aes128_encrypt(16 x 0x00, BeaconTime | DevAddr | pad16)
+static uint32_t ping_offset(uint32_t beacon_time, uint32_t devaddr, int period)
+{
+    uint8_t key[16] = { 0 };
+    uint8_t block[16] = { 0 };
+    for (int i = 0; i < 4; i++)
+    {
+        block[i] = (uint8_t)(beacon_time >> (8 * i));
+        block[4 + i] = (uint8_t)(devaddr >> (8 * i));
+    }
+    mbedtls_aes_context ctx;
+    mbedtls_aes_init(&ctx);
+    mbedtls_aes_setkey_enc(&ctx, key, 128);
+    mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, block, block);
+    mbedtls_aes_free(&ctx);
+    return (block[0] + 256u * block[1]) % (uint32_t)period;
+}
+
+// Checks if a single RX window opened at `open` for `rxsyms` symbols detects
+// a preamble of `preamble_syms` symbols starting at `preamble` (ticks). The
+// radio must be listening for DETECT_SYMS symbols of the preamble.
+static bool window_covers(ostime_t open, rxsyms_t rxsyms, double sym_ticks, int preamble_syms, double preamble)
+{
+    double latest_open = preamble + (preamble_syms - DETECT_SYMS) * sym_ticks;
+    double earliest_close = preamble + DETECT_SYMS * sym_ticks;
+    // 1 tick for rounding to ticks
+    return open <= latest_open + 1 && open + rxsyms * sym_ticks >= earliest_close - 1;
+}
+
+
+// -----------------------------------------------------------------------------
+// Simulated time: the device clock runs `rho` too fast. True time is in µs since
+// the GPS epoch, local time is in LMIC ticks.
+
+typedef struct {
+    double rho;
+    double true_ref;
+    double local_ref;
+} clock_model_t;
+
+static double local_ticks(const clock_model_t *clock, double true_us)
+{
+    return clock->local_ref + (true_us - clock->true_ref) * (1 + clock->rho) / US_PER_TICK;
+}
+
+static void set_local_time(ostime_t ticks)
+{
+    host_set_time((int64_t)(u4_t)ticks * 16);
+}
+
+
+// -----------------------------------------------------------------------------
+// Tests
+
+static void test_crypto_and_crc(void)
+{
+    static const uint8_t key[16] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+    };
+    static const uint8_t expected[16] = {
+        0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+    };
+    uint8_t block[16];
+    for (int i = 0; i < 16; i++)
+        block[i] = (uint8_t)(i * 0x11);
+    memcpy(AESkey, key, 16);
+    os_aes(AES_ENC, block, 16);
+    CHECK(memcmp(block, expected, 16) == 0, "AES-128 test vector (FIPS-197)");
+
+    const uint8_t *check = (const uint8_t *)"123456789";
+    CHECK(crc16(check, 9) == 0x31c3, "reference CRC check value");
+    CHECK(os_crc16((xref2cu1_t)check, 9) == 0x31c3, "os_crc16 check value: 0x%04x", os_crc16((xref2cu1_t)check, 9));
+}
+
+static void test_beacon_airtime(void)
+{
+    double airtime = lora_airtime_us(BEACON_SF, BEACON_BW, BEACON_PREAMBLE_SYMS, BEACON_LEN, true, false) + BEACON_DELAY_US;
+    CHECK(fabs(airtime - AIRTIME_BCN) < 0.5, "AIRTIME_BCN %d µs, expected %.1f µs", AIRTIME_BCN, airtime);
+
+    // same as the LMIC airtime of the frame (8 symbol preamble) plus 2 symbols and the delay
+    rps_t rps = setIh(setNocrc(dndr2rps((dr_t)DR_BCN), 1), LEN_BCN);
+    double lmic_airtime = calcAirTime(rps, LEN_BCN) * US_PER_TICK + 2 * symbol_us(BEACON_SF, BEACON_BW) + BEACON_DELAY_US;
+    CHECK(fabs(lmic_airtime - AIRTIME_BCN) <= US_PER_TICK, "calcAirTime() of beacon: %.0f µs", lmic_airtime);
+    CHECK(dr2hsym(DR_BCN) == us2osticksRound(symbol_us(BEACON_SF, BEACON_BW) / 2), "half symbol time of beacon");
+    CHECK(dr2hsym(DR_PING) == us2osticksRound(symbol_us(PING_SF, PING_BW) / 2), "half symbol time of ping slot");
+}
+
+static void test_beacon_layout(void)
+{
+    CHECK(LEN_BCN == BEACON_LEN, "LEN_BCN %d, expected %d", LEN_BCN, BEACON_LEN);
+    CHECK(OFF_BCN_TIME == BEACON_RFU1_LEN, "OFF_BCN_TIME");
+    CHECK(OFF_BCN_CRC1 == BEACON_RFU1_LEN + 4, "OFF_BCN_CRC1");
+    CHECK(OFF_BCN_INFO == BEACON_RFU1_LEN + 6, "OFF_BCN_INFO");
+    CHECK(OFF_BCN_LAT == OFF_BCN_INFO + 1 && OFF_BCN_LON == OFF_BCN_INFO + 4, "OFF_BCN_LAT/LON");
+    CHECK(OFF_BCN_CRC2 == OFF_BCN_INFO + 7 + BEACON_RFU2_LEN, "OFF_BCN_CRC2");
+
+    static const struct {
+        uint32_t time;
+        uint8_t info;
+        int32_t lat;
+        int32_t lon;
+    } cases[] = {
+        { 1334000000u & ~127u, 0, 0x3a5f21, 0x06b2f0 },
+        { 0xffffff80u, 2, -0x3a5f21, -0x7fffff },
+        { 128, 1, -1, 0x7fffff },
+    };
+
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        LMIC_reset();
+        build_beacon(LMIC.frame, cases[i].time, cases[i].info, cases[i].lat, cases[i].lon);
+        LMIC.dataLen = LEN_BCN;
+        LMIC.rxtime = 0x12345678;
+        lmic_beacon_error_t result = decodeBeacon();
+        CHECK(result == LMIC_BEACON_ERROR_SUCCESS_FULL, "beacon %d: result %d", i, result);
+        CHECK(LMIC.bcninfo.time == cases[i].time, "beacon %d: time %u", i, LMIC.bcninfo.time);
+        CHECK(LMIC.bcninfo.txtime == 0x12345678 - AIRTIME_BCN_osticks, "beacon %d: txtime", i);
+        CHECK(LMIC.bcninfo.info == cases[i].info, "beacon %d: info", i);
+        CHECK(LMIC.bcninfo.lat == cases[i].lat && LMIC.bcninfo.lon == cases[i].lon,
+                "beacon %d: lat/lon %d/%d", i, LMIC.bcninfo.lat, LMIC.bcninfo.lon);
+        CHECK((LMIC.bcninfo.flags & (BCN_PARTIAL | BCN_FULL)) == (BCN_PARTIAL | BCN_FULL), "beacon %d: flags", i);
+    }
+
+    // corrupted gateway specific part: time is valid
+    LMIC_reset();
+    build_beacon(LMIC.frame, 0x4f7d5a00, 0, 100, 200);
+    LMIC.frame[OFF_BCN_LON] ^= 0x01;
+    LMIC.dataLen = LEN_BCN;
+    CHECK(decodeBeacon() == LMIC_BEACON_ERROR_SUCCESS_PARTIAL, "corrupted gateway part");
+    CHECK(LMIC.bcninfo.time == 0x4f7d5a00 && (LMIC.bcninfo.flags & BCN_FULL) == 0, "time of partial beacon");
+
+    // corrupted time and RFU
+    for (int offset = 0; offset < OFF_BCN_INFO; offset++)
+    {
+        LMIC_reset();
+        build_beacon(LMIC.frame, 0x4f7d5a00, 0, 100, 200);
+        LMIC.frame[offset] ^= 0x80;
+        LMIC.dataLen = LEN_BCN;
+        CHECK(decodeBeacon() == LMIC_BEACON_ERROR_INVALID, "corrupted byte %d", offset);
+        CHECK((LMIC.bcninfo.flags & (BCN_PARTIAL | BCN_FULL)) == 0, "flags of invalid beacon");
+    }
+
+    // wrong length
+    LMIC_reset();
+    build_beacon(LMIC.frame, 0x4f7d5a00, 0, 100, 200);
+    LMIC.dataLen = LEN_BCN - 1;
+    CHECK(decodeBeacon() == LMIC_BEACON_ERROR_INVALID, "short beacon");
+}
+
+static void test_wait_until(void)
+{
+    for (int run = 0; run < 2000; run++)
+    {
+        uint32_t jitter = run % 4 == 0 ? 0 : (uint32_t)(rand() % 480);
+        host_set_wakeup_jitter(jitter);
+        host_set_time(1000000 + (rand() % 1000000));
+
+        ostime_t now = hal_ticks();
+        ostime_t delay = run % 3 == 0 ? rand() % 100 : rand() % ms2osticks(3000);
+        ostime_t target = now + delay;
+        uint32_t wakeups = host_get_wakeups();
+        u4_t late = hal_waitUntil(target);
+        ostime_t end = hal_ticks();
+
+        CHECK(end - target >= 0 && end - target <= 1, "wait for %d ticks with %u µs jitter: %d ticks late",
+                delay, jitter, end - target);
+        CHECK(late <= 1, "reported lateness %u", late);
+        if (delay > us2osticks(600))
+            CHECK(host_get_wakeups() == wakeups + 1, "timer used for long wait");
+    }
+
+    // time in the past
+    host_set_wakeup_jitter(0);
+    host_set_time(5000000);
+    ostime_t now = hal_ticks();
+    u4_t late = hal_waitUntil(now - 100);
+    CHECK(late >= 100 && late <= 101, "target in the past: %u", late);
+    CHECK(hal_ticks() - now <= 1, "no wait for target in the past");
+}
+
+// Checks the RX window of the tracking state for the given
+// drift, drift error and missed beacons
+static void test_rx_window_math(void)
+{
+    static const s2_t drifts[] = { 0, 250, -800 };
+    static const s2_t diffs[] = { 0, 5, 60, 300, 900 };
+    double sym_ticks = symbol_us(BEACON_SF, BEACON_BW) / US_PER_TICK;
+
+    for (int d = 0; d < (int)(sizeof(drifts) / sizeof(drifts[0])); d++)
+    {
+        for (int e = 0; e < (int)(sizeof(diffs) / sizeof(diffs[0])); e++)
+        {
+            for (u1_t missed = 0; missed < 4; missed++)
+            {
+                for (int secs = 0; secs <= 128; secs += 14)
+                {
+                    LMIC_reset();
+                    LMIC.drift = drifts[d];
+                    LMIC.lastDriftDiff = diffs[e];
+                    LMIC.maxDriftDiff = diffs[e];
+                    LMIC.missedBcns = missed;
+
+                    // next beacon or a ping slot `secs` into the beacon period
+                    double span = secs == 0 ? 128 : secs;
+                    ostime_t nominal = 1000000;
+                    ostime_t open = nominal - calcRxWindow((u1_t)secs, DR_BCN);
+                    double center = nominal - drifts[d] * span / 128;
+                    double error = diffs[e] * span / 128 + (double)diffs[e] * missed;
+
+                    for (int side = -1; side <= 1; side++)
+                    {
+                        double preamble = center + side * error;
+                        CHECK(window_covers(open, LMIC.rxsyms, sym_ticks, PING_PREAMBLE_SYMS, preamble),
+                                "drift %d, error %d, missed %u, %d s: preamble at %+.0f ticks, window %+d ticks for %u symbols",
+                                drifts[d], diffs[e], missed, secs, preamble - nominal, open - nominal, LMIC.rxsyms);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Predicts the first beacon from a DeviceTimeAns received `age_sec` ago,
+// the time reference having an error of `ref_error_ms`.
+static bool acquire_beacon(clock_model_t *clock, double rho, int age_sec, double ref_error_ms)
+{
+    LMIC_reset();
+    LMIC.devaddr = 0x26011f3a;
+
+    double answer_time = 1334000000.0e6 + (rand() % 1000000000) + rand() % 1000000;
+    clock->rho = rho;
+    clock->true_ref = answer_time;
+    clock->local_ref = 0x10000000;
+
+    // DeviceTimeAns: the GPS time at the end of the uplink (1/256 s resolution)
+    double answer_sec = floor(answer_time / 1e6);
+    int frac = (int)floor((answer_time / 1e6 - answer_sec) * 256);
+    LMIC.netDeviceTime = (lmic_gpstime_t)answer_sec;
+    LMIC.netDeviceTimeFrac = frac;
+    LMIC.localDeviceTime = (ostime_t)llround(local_ticks(clock, answer_time + ref_error_ms * 1000.0));
+
+    set_local_time((ostime_t)llround(local_ticks(clock, answer_time + age_sec * 1e6)));
+    ostime_t now = os_getTime();
+    bool predicted = acquireBeaconFromNetworkTime();
+    CHECK(predicted, "beacon predicted from network time, %d s", age_sec);
+    if (!predicted)
+        return false;
+
+    uint32_t next = LMIC.bcninfo.time + BCN_INTV_sec;
+    double next_true = next * 1e6;
+    double lead_ms = (local_ticks(clock, next_true) - now) * US_PER_TICK / 1000;
+    CHECK(next % BCN_INTV_sec == 0, "beacon time %u", next);
+    CHECK(lead_ms > BCN_ACQUIRE_LEAD_ms - 200 && lead_ms < BCN_INTV_ms + BCN_ACQUIRE_LEAD_ms + 200, "first beacon in %.0f ms", lead_ms);
+    CHECK((LMIC.opmode & OP_TRACK) != 0, "tracking");
+    return true;
+}
+
+// Tracks beacons (`pattern`: 1 received, 0 missed) and checks each beacon
+// and ping slot window against the simulated clock
+static void track_beacons(clock_model_t *clock, const char *pattern, const char *scenario)
+{
+    double bcn_sym = symbol_us(BEACON_SF, BEACON_BW) / US_PER_TICK;
+    double ping_sym = symbol_us(PING_SF, PING_BW) / US_PER_TICK;
+
+    for (int n = 0; pattern[n] != 0; n++)
+    {
+        uint32_t time = LMIC.bcninfo.time + BCN_INTV_sec;
+        double beacon_start = local_ticks(clock, time * 1e6);
+        double preamble = local_ticks(clock, time * 1e6 + BEACON_DELAY_US);
+        CHECK(window_covers(LMIC.bcnRxtime, LMIC.bcnRxsyms, bcn_sym, BEACON_PREAMBLE_SYMS, preamble),
+                "%s, beacon %d: preamble at %+.0f ticks, window %+.0f ticks for %u symbols",
+                scenario, n, preamble - beacon_start, LMIC.bcnRxtime - beacon_start, LMIC.bcnRxsyms);
+
+        LMICbandplan_setBcnRxParams();
+        CHECK(LMIC.freq == (u4_t)BEACON_FREQ(time), "%s, beacon %d: frequency %u", scenario, n, LMIC.freq);
+
+        if (pattern[n] == '1')
+        {
+            build_beacon(LMIC.frame, time, 0, 0x123456, -0x123456);
+            LMIC.dataLen = LEN_BCN;
+            // end of frame, with up to 100 µs interrupt latency
+            LMIC.rxtime = (ostime_t)llround(local_ticks(clock, time * 1e6 + AIRTIME_BCN) + rand() % 7);
+            set_local_time(LMIC.rxtime + 10);
+        }
+        else
+        {
+            // RX timeout
+            LMIC.dataLen = 0;
+            set_local_time(LMIC.bcnRxtime + (ostime_t)(LMIC.bcnRxsyms * bcn_sym) + 10);
+        }
+        processBeacon(NULL);
+        CHECK((LMIC.opmode & OP_TRACK) != 0, "%s, beacon %d: tracking", scenario, n);
+        CHECK(LMIC.bcninfo.time == time, "%s, beacon %d: time", scenario, n);
+
+        if ((LMIC.bcninfo.flags & (BCN_PARTIAL | BCN_FULL)) == 0)
+            continue;
+
+        // ping slots of this beacon period
+        int intv_exp = n % 8;
+        int period = 1 << (5 + intv_exp);
+        uint32_t offset = ping_offset(time, LMIC.devaddr, period);
+        rxsched_t ping = { 0 };
+        ping.dr = DR_PING;
+        ping.intvExp = (u1_t)intv_exp;
+        rxschedInit(&ping, LMIC.devaddr);
+
+        double period_end = local_ticks(clock, (time + BCN_INTV_sec) * 1e6 - BCN_GUARD_us);
+        int slots = 0;
+        do
+        {
+            double slot_start = local_ticks(clock, time * 1e6 + BCN_RESERVE_us + (offset + slots * period) * (double)BCN_SLOT_SPAN_us);
+            CHECK(window_covers(ping.rxtime, ping.rxsyms, ping_sym, PING_PREAMBLE_SYMS, slot_start),
+                    "%s, beacon %d, ping period %d, slot %d: window %+.0f ticks for %u symbols",
+                    scenario, n, period, slots, ping.rxtime - slot_start, ping.rxsyms);
+            CHECK(slot_start < period_end, "%s, slot %d before guard", scenario, slots);
+            slots++;
+        } while (rxschedNext(&ping, ping.rxtime + 1));
+        CHECK(slots == 4096 / period, "%s, beacon %d: %d ping slots, expected %d", scenario, n, slots, 4096 / period);
+
+        u4_t freq = LMICbandplan_getPingFreq(LMIC.ping.freq, LMIC.devaddr);
+        CHECK(freq == (u4_t)PING_FREQ(time, LMIC.devaddr), "%s, beacon %d: ping frequency %u", scenario, n, freq);
+    }
+}
+
+static void test_beacon_tracking(void)
+{
+    static const double drifts_ppm[] = { -100, -30, 0, 45, 100 };
+    // the reference is the start of the GPS second, up to 1 s before the answer
+    static const int ages[] = { 1, 10, 100, 300, BCN_ACQUIRE_MAX_AGE_sec - 2 };
+    static const double ref_errors_ms[] = { -BCN_ACQUIRE_BASE_ms, 0, BCN_ACQUIRE_BASE_ms };
+    static const char *patterns[] = {
+        "1111111111",
+        "0111101",
+        "00110001",
+        "1001100011110000001",
+    };
+    char scenario[100];
+
+    for (int d = 0; d < (int)(sizeof(drifts_ppm) / sizeof(drifts_ppm[0])); d++)
+    {
+        for (int a = 0; a < (int)(sizeof(ages) / sizeof(ages[0])); a++)
+        {
+            for (int e = 0; e < (int)(sizeof(ref_errors_ms) / sizeof(ref_errors_ms[0])); e++)
+            {
+                for (int p = 0; p < (int)(sizeof(patterns) / sizeof(patterns[0])); p++)
+                {
+                    snprintf(scenario, sizeof(scenario), "%+.0f ppm, %d s, %+.0f ms, %s",
+                            drifts_ppm[d], ages[a], ref_errors_ms[e], patterns[p]);
+                    clock_model_t clock;
+                    if (acquire_beacon(&clock, drifts_ppm[d] * 1e-6, ages[a], ref_errors_ms[e]))
+                        track_beacons(&clock, patterns[p], scenario);
+                }
+            }
+        }
+    }
+}
+
+int main(void)
+{
+    srand(1);
+    printf("Class B host test (%s)\n", REGION_NAME);
+
+    test_crypto_and_crc();
+    test_beacon_airtime();
+    test_beacon_layout();
+    test_wait_until();
+    test_rx_window_math();
+    test_beacon_tracking();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef int gpio_num_t;
+typedef int esp_err_t;
+
+enum { GPIO_MODE_INPUT, GPIO_MODE_OUTPUT };
+enum { GPIO_INTR_DISABLE, GPIO_INTR_POSEDGE };
+
+typedef struct {
+    uint64_t pin_bit_mask;
+    int mode;
+    int pull_up_en;
+    int pull_down_en;
+    int intr_type;
+} gpio_config_t;
+
+esp_err_t gpio_config(const gpio_config_t *config);
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level);
+esp_err_t gpio_set_direction(gpio_num_t pin, int mode);
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, void (*handler)(void *), void *arg);
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin);
@@ -0,0 +1,10 @@
+#pragma once
+#include <stdio.h>
+
+#define ESP_OK 0
+#define ESP_ERROR_CHECK(x) (void)(x)
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) do { } while (0)
+#define ESP_LOGI(tag, fmt, ...) do { } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { } while (0)
+#define ESP_LOGV(tag, fmt, ...) do { } while (0)
@@ -0,0 +1,321 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulated ESP-IDF environment for running LMIC and the HAL on the host:
+ * single task, simulated time with an esp_timer that wakes up the task late
+ * by a random jitter, and AES-128 for the mbedtls interface.
+ *******************************************************************************/
+
+#include "host_idf.h"
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "esp_timer.h"
+#include "mbedtls/aes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NOTIFY_BIT_TIMER 2
+
+static int64_t sim_time;
+static int64_t timer_expiry = -1;
+static uint32_t wakeup_jitter;
+static uint32_t wakeups;
+static uint32_t notify_bits;
+
+
+void host_set_time(int64_t time_us)
+{
+    sim_time = time_us;
+    timer_expiry = -1;
+}
+
+void host_set_wakeup_jitter(uint32_t jitter_us)
+{
+    wakeup_jitter = jitter_us;
+}
+
+uint32_t host_get_wakeups(void)
+{
+    return wakeups;
+}
+
+
+// -----------------------------------------------------------------------------
+// esp_timer
+
+int64_t esp_timer_get_time(void)
+{
+    return sim_time++;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    *handle = NULL;
+    return 0;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    timer_expiry = sim_time + (int64_t)timeout_us;
+    return 0;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    timer_expiry = -1;
+    return 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// FreeRTOS (single task)
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return (TaskHandle_t)&sim_time;
+}
+
+BaseType_t xTaskCreate(void (*task)(void *), const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle)
+{
+    fprintf(stderr, "host: tasks are not supported\n");
+    abort();
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    sim_time += (int64_t)ticks * 1000;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    notify_bits |= value;
+    return pdPASS;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action, BaseType_t *woken)
+{
+    notify_bits |= value;
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    if (notify_bits == 0 && timer_expiry >= 0 && (ticks != 0 || timer_expiry <= sim_time))
+    {
+        // the esp_timer task wakes up the waiting task a bit late
+        if (timer_expiry > sim_time)
+            sim_time = timer_expiry;
+        if (wakeup_jitter > 0)
+            sim_time += rand() % (wakeup_jitter + 1);
+        timer_expiry = -1;
+        wakeups++;
+        notify_bits |= NOTIFY_BIT_TIMER;
+    }
+
+    if (notify_bits == 0 && ticks != 0)
+    {
+        fprintf(stderr, "host: task would wait forever\n");
+        abort();
+    }
+
+    uint32_t bits = notify_bits;
+    notify_bits = 0;
+    return bits;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+    return (SemaphoreHandle_t)&sim_time;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks)
+{
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex)
+{
+    return pdTRUE;
+}
+
+// binary semaphore (a single task cannot wait for another task)
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return calloc(1, sizeof(int));
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+    int *count = semaphore;
+    if (*count == 0)
+        return pdFALSE;
+    *count = 0;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    *(int *)semaphore = 1;
+    return pdTRUE;
+}
+
+
+// -----------------------------------------------------------------------------
+// GPIO and SPI (no radio attached)
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+    return 0;
+}
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+    return 0;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t pin, int mode)
+{
+    return 0;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, void (*handler)(void *), void *arg)
+{
+    return 0;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin)
+{
+    return 0;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *config, spi_device_handle_t *handle)
+{
+    *handle = NULL;
+    return 0;
+}
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t *trans)
+{
+    return 0;
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *trans)
+{
+    return 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// AES-128 (FIPS-197), encryption only
+
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static uint8_t xtime(uint8_t x)
+{
+    return (uint8_t)((x << 1) ^ ((x & 0x80) != 0 ? 0x1b : 0x00));
+}
+
+void mbedtls_aes_init(mbedtls_aes_context *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_aes_free(mbedtls_aes_context *ctx)
+{
+}
+
+int mbedtls_aes_setkey_enc(mbedtls_aes_context *ctx, const unsigned char *key, unsigned int keybits)
+{
+    if (keybits != 128)
+        return -1;
+
+    uint8_t *w = ctx->round_keys;
+    memcpy(w, key, 16);
+    uint8_t rcon = 1;
+    for (int i = 16; i < 176; i += 4)
+    {
+        uint8_t t[4] = { w[i - 4], w[i - 3], w[i - 2], w[i - 1] };
+        if (i % 16 == 0)
+        {
+            uint8_t t0 = t[0];
+            t[0] = sbox[t[1]] ^ rcon;
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[t0];
+            rcon = xtime(rcon);
+        }
+        for (int j = 0; j < 4; j++)
+            w[i + j] = w[i - 16 + j] ^ t[j];
+    }
+    return 0;
+}
+
+int mbedtls_aes_crypt_ecb(mbedtls_aes_context *ctx, int mode, const unsigned char input[16], unsigned char output[16])
+{
+    if (mode != MBEDTLS_AES_ENCRYPT)
+        return -1;
+
+    uint8_t s[16];
+    for (int i = 0; i < 16; i++)
+        s[i] = input[i] ^ ctx->round_keys[i];
+
+    for (int round = 1; round <= 10; round++)
+    {
+        // SubBytes and ShiftRows (state is column-major)
+        uint8_t t[16];
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 4; r++)
+                t[4 * c + r] = sbox[s[4 * ((c + r) % 4) + r]];
+
+        // MixColumns (except in the last round)
+        if (round < 10)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                uint8_t *col = &t[4 * c];
+                uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                uint8_t c0 = col[0];
+                col[0] ^= all ^ xtime(col[0] ^ col[1]);
+                col[1] ^= all ^ xtime(col[1] ^ col[2]);
+                col[2] ^= all ^ xtime(col[2] ^ col[3]);
+                col[3] ^= all ^ xtime(col[3] ^ c0);
+            }
+        }
+
+        for (int i = 0; i < 16; i++)
+            s[i] = t[i] ^ ctx->round_keys[16 * round + i];
+    }
+
+    memcpy(output, s, 16);
+    return 0;
+}
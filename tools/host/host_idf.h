@@ -0,0 +1,34 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulated ESP-IDF environment for running LMIC and the HAL on the host.
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Sets the simulated time of esp_timer_get_time().
+ *
+ * The time advances by 1 µs with each call of esp_timer_get_time() (busy
+ * waiting) and jumps to the expiry time of the timer when the task waits
+ * for a notification.
+ */
+void host_set_time(int64_t time_us);
+
+/**
+ * @brief Sets the maximum latency of a timer wake-up (random, in µs).
+ */
+void host_set_wakeup_jitter(uint32_t jitter_us);
+
+/**
+ * @brief Returns the number of timer wake-ups since the start.
+ */
+uint32_t host_get_wakeups(void);
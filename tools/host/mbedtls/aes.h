@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+
+// AES-128 encryption only (see host_idf.c)
+typedef struct {
+    uint8_t round_keys[176];
+} mbedtls_aes_context;
+
+#define MBEDTLS_AES_ENCRYPT 1
+
+void mbedtls_aes_init(mbedtls_aes_context *ctx);
+void mbedtls_aes_free(mbedtls_aes_context *ctx);
+int mbedtls_aes_setkey_enc(mbedtls_aes_context *ctx, const unsigned char *key, unsigned int keybits);
+int mbedtls_aes_crypt_ecb(mbedtls_aes_context *ctx, int mode, const unsigned char input[16], unsigned char output[16]);
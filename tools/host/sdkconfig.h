@@ -0,0 +1,22 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * SDK configuration for the host tests. The region
+ * (CONFIG_TTN_LORA_FREQ_xxx) is passed on the command line.
+ *******************************************************************************/
+
+#pragma once
+
+#define CONFIG_TTN_RADIO_SX1276_77_78_79 1
+#define CONFIG_TTN_CLASS_B 1
+#define CONFIG_TTN_PRECISE_WAIT_US 500
+#define CONFIG_TTN_SPI_FREQ 2000000
+#define CONFIG_TTN_BG_TASK_PRIO 10
+#define CONFIG_TTN_PROVISION_UART_NONE 1
+#define CONFIG_LOG_DEFAULT_LEVEL 0
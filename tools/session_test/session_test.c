@@ -0,0 +1,209 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Host test of the session serialization: the duty cycle state must survive
+ * a save and restore, and the time the device was in deep sleep or powered
+ * off must count towards the duty cycle.
+ *******************************************************************************/
+
+#include "lmic/lmic.h"
+#include "lmic/lmic_bandplan.h"
+#include "hal/hal_esp32.h"
+#include "host_idf.h"
+#include "ttn_session.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(CFG_eu868)
+#define REGION_NAME "EU868"
+#elif defined(CFG_us915)
+#define REGION_NAME "US915"
+#else
+#error "Region not supported by the session host test"
+#endif
+
+// time of the save (µs of the local clock)
+#define SAVE_TIME_US 5000000000LL
+// remaining duty cycle wait at the time of the save
+#define WAIT_SEC 100
+// allowed deviation of a restored wait (the clock advances with each call)
+#define TOLERANCE_osticks ms2osticks(10)
+
+#define TAG_TIME_REF 2
+#define WIRE_VARINT 0
+
+static int checks;
+static int failures;
+
+#define CHECK(cond, ...)                                           \
+    do                                                             \
+    {                                                              \
+        checks++;                                                  \
+        if (!(cond))                                               \
+        {                                                          \
+            failures++;                                            \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);            \
+            printf(__VA_ARGS__);                                   \
+            printf("\n");                                          \
+        }                                                          \
+    } while (0)
+
+
+// -----------------------------------------------------------------------------
+// Helpers
+
+// Sets up a session with a pending duty cycle wait and saves it
+static size_t save_session(uint8_t *buf, size_t size)
+{
+    hal_esp32_set_time(0);
+    host_set_time(SAVE_TIME_US);
+
+    LMIC_reset();
+    LMIC.devaddr = 0x260b1234;
+    LMIC.seqnoUp = 4711;
+    LMIC.globalDutyRate = 7;
+    LMIC.globalDutyAvail = os_getTime() + sec2osticks(WAIT_SEC);
+#if CFG_LMIC_EU_like
+    LMIC.bands[BAND_CENTI].avail = os_getTime() + sec2osticks(WAIT_SEC);
+#endif
+
+    size_t length = ttn_session_encode(buf, size);
+    CHECK(length > 0, "session encoded");
+    return length;
+}
+
+static bool restore_session(const uint8_t *buf, size_t length)
+{
+    LMIC_resetState();
+    bool result = ttn_session_decode(buf, length);
+    CHECK(result, "session decoded");
+    CHECK(LMIC.devaddr == 0x260b1234 && LMIC.seqnoUp == 4711, "session restored");
+    return result;
+}
+
+// Checks the remaining duty cycle wait (in LMIC ticks)
+static void check_wait(ostime_t expected, const char *scenario)
+{
+    ostime_t now = os_getTime();
+    ostime_t global_wait = LMIC.globalDutyAvail - now;
+    CHECK(global_wait <= expected && global_wait >= expected - TOLERANCE_osticks,
+          "%s: global duty cycle wait %d ms, expected %d ms", scenario,
+          (int)osticks2ms(global_wait), (int)osticks2ms(expected));
+#if CFG_LMIC_EU_like
+    ostime_t band_wait = LMIC.bands[BAND_CENTI].avail - now;
+    CHECK(band_wait <= expected && band_wait >= expected - TOLERANCE_osticks,
+          "%s: band wait %d ms, expected %d ms", scenario,
+          (int)osticks2ms(band_wait), (int)osticks2ms(expected));
+#endif
+}
+
+static size_t get_varint(const uint8_t *buf, size_t *pos)
+{
+    size_t value = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        uint8_t b = buf[(*pos)++];
+        value |= (size_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return value;
+    }
+}
+
+// Removes the time reference from a record (as written by earlier versions)
+static size_t remove_time_ref(uint8_t *buf, size_t length)
+{
+    uint8_t out[TTN_SESSION_MAX_SIZE];
+    size_t pos = 0;
+    get_varint(buf, &pos); // version
+    memcpy(out, buf, pos);
+    size_t out_len = pos;
+
+    while (pos < length - 2)
+    {
+        size_t start = pos;
+        size_t key = get_varint(buf, &pos);
+        size_t value = get_varint(buf, &pos);
+        if ((key & 7) != WIRE_VARINT)
+            pos += value;
+        if (key != (TAG_TIME_REF << 3 | WIRE_VARINT))
+        {
+            memcpy(out + out_len, buf + start, pos - start);
+            out_len += pos - start;
+        }
+    }
+
+    os_wlsbf2(out + out_len, os_crc16(out, out_len));
+    out_len += 2;
+    memcpy(buf, out, out_len);
+    return out_len;
+}
+
+
+// -----------------------------------------------------------------------------
+// Tests
+
+// The local time continues during deep sleep
+static void test_deep_sleep(void)
+{
+    uint8_t buf[TTN_SESSION_MAX_SIZE];
+    size_t length = save_session(buf, sizeof(buf));
+
+    host_set_time(SAVE_TIME_US + 2 * WAIT_SEC * 1000000LL);
+    if (restore_session(buf, length))
+        check_wait(0, "deep sleep longer than wait");
+
+    host_set_time(SAVE_TIME_US + 30 * 1000000LL);
+    if (restore_session(buf, length))
+        check_wait(sec2osticks(WAIT_SEC - 30), "deep sleep shorter than wait");
+}
+
+// After a power-off, the clock is advanced by the off duration (see ttn_nvs_restore())
+static void test_power_off(void)
+{
+    uint8_t buf[TTN_SESSION_MAX_SIZE];
+    size_t length = save_session(buf, sizeof(buf));
+    uint32_t save_time = (uint32_t)(SAVE_TIME_US / 1000000);
+
+    host_set_time(200000);
+    hal_esp32_set_time(save_time + 2 * WAIT_SEC);
+    if (restore_session(buf, length))
+        check_wait(0, "power-off longer than wait");
+
+    // without the off duration, the clock restarts at 0 and the time in between counts as zero
+    host_set_time(200000);
+    hal_esp32_set_time(0);
+    if (restore_session(buf, length))
+        check_wait(sec2osticks(WAIT_SEC), "power-off without duration");
+}
+
+// Records without a time reference are restored relative to the time of the restore
+static void test_without_time_ref(void)
+{
+    uint8_t buf[TTN_SESSION_MAX_SIZE];
+    size_t length = save_session(buf, sizeof(buf));
+    length = remove_time_ref(buf, length);
+
+    host_set_time(SAVE_TIME_US + 2 * WAIT_SEC * 1000000LL);
+    if (restore_session(buf, length))
+        check_wait(sec2osticks(WAIT_SEC), "record without time reference");
+}
+
+int main(void)
+{
+    printf("Session host test (%s)\n", REGION_NAME);
+
+    test_deep_sleep();
+    test_power_off();
+    test_without_time_ref();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
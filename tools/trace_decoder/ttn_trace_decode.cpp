@@ -0,0 +1,508 @@
+/*******************************************************************************
+ *
+ * ttn-esp32 - The Things Network device library for ESP-IDF / SX127x
+ *
+ * Copyright (c) 2018-2021 Manuel Bleichenbacher
+ *
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Host tool decoding the binary LMIC event trace (see src/ttn_logging.h).
+ *
+ * Build:  c++ -std=c++17 -O2 -o ttn_trace_decode ttn_trace_decode.cpp
+ * Usage:  ttn_trace_decode [--json] [-o output] [trace]
+ *******************************************************************************/
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+constexpr uint8_t KIND_STRING = 0x00;
+constexpr uint8_t KIND_MAX_EVENT = 0x3f;
+constexpr uint8_t KIND_MESSAGE = 0xf0;
+constexpr uint8_t KIND_MESSAGE_DATUM = 0xf1;
+constexpr uint8_t KIND_FATAL = 0xf2;
+constexpr uint8_t KIND_END = 0xff;
+constexpr int TRACE_VERSION = 1;
+constexpr int NUM_FIELDS = 13;
+
+// field names in bit order
+const char *const FIELD_NAMES[NUM_FIELDS] = {"value",   "freq",   "txend",  "avail",    "opmode",    "fcntUp",      "fcntDn",
+                                             "rxsyms",  "rps",    "txChnl", "datarate", "txrxFlags", "saveIrqFlags"};
+enum Field
+{
+    FIELD_DATUM,
+    FIELD_FREQ,
+    FIELD_TXEND,
+    FIELD_GLOBAL_DUTY_AVAIL,
+    FIELD_OPMODE,
+    FIELD_FCNT_UP,
+    FIELD_FCNT_DN,
+    FIELD_RXSYMS,
+    FIELD_RPS,
+    FIELD_TX_CHNL,
+    FIELD_DATARATE,
+    FIELD_TXRX_FLAGS,
+    FIELD_SAVE_IRQ_FLAGS,
+};
+
+const char *const SF_NAMES[] = {"FSK", "SF7", "SF8", "SF9", "SF10", "SF11", "SF12", "SFrfu"};
+const char *const BW_NAMES[] = {"BW125", "BW250", "BW500", "BWrfu"};
+
+struct Record
+{
+    int trace;        // index of the trace (a new one starts after each header)
+    uint8_t kind;
+    double time_us;   // since the start of the LMIC time base
+    std::string message;
+    uint32_t fields;
+    int64_t values[NUM_FIELDS]; // times (txend, avail) are absolute, in µs
+
+    bool has(Field field) const
+    {
+        return (fields & (1u << field)) != 0;
+    }
+};
+
+class Decoder
+{
+  public:
+    explicit Decoder(const std::vector<uint8_t> &data) : data_(data)
+    {
+    }
+
+    bool decode(std::vector<Record> &records)
+    {
+        while (pos_ < data_.size())
+        {
+            uint8_t kind = data_[pos_];
+            if (kind == 'T')
+            {
+                if (!readHeader())
+                    return false;
+                continue;
+            }
+            if (kind == KIND_END)
+                break;
+            if (trace_ < 0)
+                return error("trace does not start with a header");
+
+            pos_++;
+            if (kind == KIND_STRING)
+            {
+                if (!readString())
+                    return false;
+            }
+            else if (kind <= KIND_MAX_EVENT || kind == KIND_MESSAGE || kind == KIND_MESSAGE_DATUM || kind == KIND_FATAL)
+            {
+                Record record;
+                if (!readRecord(kind, record))
+                    return false;
+                records.push_back(record);
+            }
+            else
+            {
+                return error("unknown record kind");
+            }
+        }
+        return true;
+    }
+
+    const std::string &errorMessage() const
+    {
+        return error_;
+    }
+
+  private:
+    bool readHeader()
+    {
+        if (data_.size() - pos_ < 5 || std::memcmp(&data_[pos_], "TTNT", 4) != 0)
+            return error("invalid header");
+        pos_ += 4;
+        if (data_[pos_++] != TRACE_VERSION)
+            return error("unsupported trace version");
+        uint32_t us_per_tick;
+        if (!readVarint(us_per_tick) || us_per_tick == 0)
+            return error("invalid header");
+
+        us_per_tick_ = us_per_tick;
+        trace_++;
+        time_ = 0;
+        strings_.clear();
+        return true;
+    }
+
+    bool readString()
+    {
+        uint32_t id, len;
+        if (!readVarint(id) || !readVarint(len) || data_.size() - pos_ < len)
+            return error("truncated string");
+        strings_[id] = std::string(reinterpret_cast<const char *>(&data_[pos_]), len);
+        pos_ += len;
+        return true;
+    }
+
+    bool readRecord(uint8_t kind, Record &record)
+    {
+        uint32_t delta, id, fields;
+        if (!readVarint(delta) || !readVarint(id) || !readVarint(fields))
+            return error("truncated record");
+
+        // ticks are 32 bit and wrap around; the deltas are signed
+        time_ += unzigzag(delta);
+        auto it = strings_.find(id);
+        if (it == strings_.end())
+            return error("undefined string");
+
+        record.trace = trace_;
+        record.kind = kind;
+        record.time_us = static_cast<double>(time_) * us_per_tick_;
+        record.message = it->second;
+        record.fields = fields;
+        for (int i = 0; i < NUM_FIELDS; i++)
+        {
+            uint32_t value = 0;
+            if ((fields & (1u << i)) != 0 && !readVarint(value))
+                return error("truncated record");
+            record.values[i] = value;
+        }
+        record.values[FIELD_TXEND] = (time_ + unzigzag(record.values[FIELD_TXEND])) * us_per_tick_;
+        record.values[FIELD_GLOBAL_DUTY_AVAIL] =
+            (time_ + unzigzag(record.values[FIELD_GLOBAL_DUTY_AVAIL])) * us_per_tick_;
+        return true;
+    }
+
+    bool readVarint(uint32_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 35; shift += 7)
+        {
+            if (pos_ >= data_.size())
+                return false;
+            uint8_t b = data_[pos_++];
+            value |= static_cast<uint32_t>(b & 0x7f) << shift;
+            if ((b & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    static int32_t unzigzag(uint32_t value)
+    {
+        return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+    }
+
+    bool error(const char *message)
+    {
+        std::ostringstream os;
+        os << message << " at offset " << pos_;
+        error_ = os.str();
+        return false;
+    }
+
+    const std::vector<uint8_t> &data_;
+    size_t pos_ = 0;
+    int trace_ = -1;
+    int64_t time_ = 0;
+    int64_t us_per_tick_ = 16;
+    std::map<uint32_t, std::string> strings_;
+    std::string error_;
+};
+
+std::string formatRps(uint32_t rps)
+{
+    std::ostringstream os;
+    os << SF_NAMES[rps & 0x7] << ", " << BW_NAMES[(rps >> 3) & 0x3];
+    return os.str();
+}
+
+// duration of a LoRa symbol (in µs), or 0 for FSK
+double symbolTimeUs(uint32_t rps)
+{
+    int sf = rps & 0x7;
+    int bw = (rps >> 3) & 0x3;
+    if (sf == 0 || sf == 7 || bw == 3)
+        return 0;
+    return static_cast<double>(1 << (sf + 6)) * 1000.0 / (125 << bw);
+}
+
+std::string fieldValue(const Record &record, int field)
+{
+    std::ostringstream os;
+    int64_t value = record.values[field];
+    switch (field)
+    {
+    case FIELD_TXEND:
+    case FIELD_GLOBAL_DUTY_AVAIL:
+        os << (value - static_cast<int64_t>(record.time_us)) / 1000.0 << " ms";
+        break;
+    case FIELD_DATUM:
+    case FIELD_OPMODE:
+    case FIELD_TXRX_FLAGS:
+    case FIELD_SAVE_IRQ_FLAGS:
+        os << "0x" << std::hex << value;
+        break;
+    case FIELD_RPS:
+        os << formatRps(static_cast<uint32_t>(value));
+        break;
+    default:
+        os << value;
+        break;
+    }
+    return os.str();
+}
+
+void writeText(std::ostream &out, const std::vector<Record> &records)
+{
+    int trace = -1;
+    char time_buf[32];
+    for (const Record &record : records)
+    {
+        if (record.trace != trace)
+        {
+            trace = record.trace;
+            out << "--- trace " << trace << '\n';
+        }
+
+        std::snprintf(time_buf, sizeof(time_buf), "%12.3f", record.time_us / 1000.0);
+        out << time_buf << " ms  ";
+        if (record.kind == KIND_FATAL)
+            out << "FATAL ";
+        out << record.message;
+        for (int i = 0; i < NUM_FIELDS; i++)
+        {
+            if (record.has(static_cast<Field>(i)))
+                out << "  " << FIELD_NAMES[i] << '=' << fieldValue(record, i);
+        }
+        out << '\n';
+    }
+}
+
+std::string jsonString(const std::string &str)
+{
+    std::string result = "\"";
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            result += '\\';
+            result += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            result += buf;
+        }
+        else
+        {
+            result += c;
+        }
+    }
+    return result + '"';
+}
+
+// threads of the Chrome trace
+constexpr int TID_EVENTS = 1;
+constexpr int TID_RADIO = 2;
+constexpr int TID_MAC = 3;
+
+class JsonWriter
+{
+  public:
+    explicit JsonWriter(std::ostream &out) : out_(out)
+    {
+        // timestamps in µs with ns resolution
+        out_ << std::fixed << std::setprecision(3);
+        out_ << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    }
+
+    ~JsonWriter()
+    {
+        out_ << "\n]}\n";
+    }
+
+    void metadata(int pid, int tid, const char *name, const std::string &value)
+    {
+        begin();
+        out_ << "{\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << tid << ",\"name\":\"" << name
+             << "\",\"args\":{\"name\":" << jsonString(value) << "}}";
+    }
+
+    void instant(const Record &record)
+    {
+        begin();
+        out_ << "{\"ph\":\"i\",\"s\":\"t\",\"pid\":" << record.trace << ",\"tid\":" << TID_EVENTS
+             << ",\"ts\":" << record.time_us << ",\"name\":" << jsonString(record.message) << ",\"args\":{";
+        bool is_first = true;
+        for (int i = 0; i < NUM_FIELDS; i++)
+        {
+            if (!record.has(static_cast<Field>(i)))
+                continue;
+            out_ << (is_first ? "" : ",") << '"' << FIELD_NAMES[i] << "\":" << jsonString(fieldValue(record, i));
+            is_first = false;
+        }
+        out_ << "}}";
+    }
+
+    void span(int pid, int tid, const std::string &name, double start_us, double end_us, const std::string &detail)
+    {
+        if (end_us < start_us)
+            return;
+        begin();
+        out_ << "{\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << tid << ",\"ts\":" << start_us
+             << ",\"dur\":" << end_us - start_us << ",\"name\":" << jsonString(name)
+             << ",\"args\":{\"detail\":" << jsonString(detail) << "}}";
+    }
+
+  private:
+    void begin()
+    {
+        out_ << (is_first_ ? "\n" : ",\n");
+        is_first_ = false;
+    }
+
+    std::ostream &out_;
+    bool is_first_ = true;
+};
+
+// Export as Chrome trace event format (chrome://tracing, https://ui.perfetto.dev)
+void writeJson(std::ostream &out, const std::vector<Record> &records)
+{
+    JsonWriter json(out);
+
+    int trace = -1;
+    const Record *uplink = nullptr;
+    for (const Record &record : records)
+    {
+        if (record.trace != trace)
+        {
+            trace = record.trace;
+            uplink = nullptr;
+            json.metadata(trace, 0, "process_name", "LMIC trace " + std::to_string(trace));
+            json.metadata(trace, TID_EVENTS, "thread_name", "events");
+            json.metadata(trace, TID_RADIO, "thread_name", "radio");
+            json.metadata(trace, TID_MAC, "thread_name", "uplinks");
+        }
+
+        json.instant(record);
+
+        const std::string &name = record.message;
+        if (name == "EV_TXSTART")
+        {
+            uplink = &record;
+        }
+        else if (name == "EV_RXSTART" && record.has(FIELD_RXSYMS) && record.has(FIELD_RPS))
+        {
+            // RX window: the radio waits for the preamble during rxsyms symbols
+            double duration_us = record.values[FIELD_RXSYMS] * symbolTimeUs(static_cast<uint32_t>(record.values[FIELD_RPS]));
+            json.span(trace, TID_RADIO, "RX", record.time_us, record.time_us + duration_us,
+                      formatRps(static_cast<uint32_t>(record.values[FIELD_RPS])));
+        }
+        else if (uplink != nullptr && (name == "EV_TXCOMPLETE" || name == "EV_JOIN_TXCOMPLETE" ||
+                                       name == "EV_JOINED" || name == "EV_JOIN_FAILED" || name == "EV_TXCANCELED"))
+        {
+            std::string detail = uplink->has(FIELD_RPS) ? formatRps(static_cast<uint32_t>(uplink->values[FIELD_RPS])) : "";
+            if (record.has(FIELD_TXEND))
+                json.span(trace, TID_RADIO, "TX", uplink->time_us, static_cast<double>(record.values[FIELD_TXEND]), detail);
+            json.span(trace, TID_MAC, name == "EV_TXCOMPLETE" ? "uplink" : "join", uplink->time_us, record.time_us, detail);
+            uplink = nullptr;
+        }
+    }
+}
+
+void usage()
+{
+    std::cerr << "Usage: ttn_trace_decode [--json] [-o output] [trace]\n"
+                 "Decodes a binary LMIC event trace written by ttn-esp32 (stdin if no file is given).\n"
+                 "  --json     export in Chrome/Perfetto trace format instead of text\n"
+                 "  -o output  write to the given file instead of stdout\n";
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    bool is_json = false;
+    const char *input_path = nullptr;
+    const char *output_path = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--json") == 0)
+        {
+            is_json = true;
+        }
+        else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            output_path = argv[++i];
+        }
+        else if (argv[i][0] != '-' && input_path == nullptr)
+        {
+            input_path = argv[i];
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    std::vector<uint8_t> data;
+    if (input_path != nullptr)
+    {
+        std::ifstream in(input_path, std::ios::binary);
+        if (!in)
+        {
+            std::cerr << "Cannot open " << input_path << '\n';
+            return 1;
+        }
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    else
+    {
+        std::cin >> std::noskipws;
+        data.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    }
+
+    std::vector<Record> records;
+    Decoder decoder(data);
+    bool is_complete = decoder.decode(records);
+
+    std::ofstream file;
+    if (output_path != nullptr)
+    {
+        file.open(output_path);
+        if (!file)
+        {
+            std::cerr << "Cannot create " << output_path << '\n';
+            return 1;
+        }
+    }
+    std::ostream &out = output_path != nullptr ? file : std::cout;
+
+    if (is_json)
+        writeJson(out, records);
+    else
+        writeText(out, records);
+
+    // a truncated trace (e.g. a full partition) is decoded up to the error
+    if (!is_complete)
+    {
+        std::cerr << "Warning: " << decoder.errorMessage() << '\n';
+        return 1;
+    }
+    return 0;
+}